@@ -19,6 +19,7 @@
 #include <cstdint>
 #include "expose.h"
 #include "model_adapter.cpp"
+#include "otherarch/utils.h"
 
 extern "C"
 {
@@ -195,7 +196,60 @@ extern "C"
 
     generation_outputs generate(const generation_inputs inputs)
     {
-        return gpttype_generate(inputs);
+        generation_outputs output = gpttype_generate(inputs);
+        gpttype_token_stream_close(); //wake up any sse reader, nothing more will come
+        return output;
+    }
+
+    //push based streaming. open before generating, then wait and pop from another thread
+    void token_stream_open() {
+        gpttype_token_stream_open();
+    }
+    void token_stream_close() {
+        gpttype_token_stream_close();
+    }
+    int token_stream_wait(int timeout_ms) {
+        return gpttype_token_stream_wait(timeout_ms);
+    }
+    static token_stream_record popped_stream_token;
+    token_stream_outputs token_stream_pop() {
+        token_stream_outputs output;
+        if(gpttype_token_stream_pop(popped_stream_token))
+        {
+            output.status = 1;
+            output.id = popped_stream_token.id;
+            output.logprob = popped_stream_token.logprob;
+            output.timestamp_us = popped_stream_token.timestamp_us;
+            output.text = popped_stream_token.text.c_str();
+        }
+        return output;
+    }
+
+    //per request streaming api, used when batch slots are enabled
+    generation_outputs batch_generate(const generation_inputs inputs, int stream_id, bool force_legacy)
+    {
+        return gpttype_batch_generate(inputs, stream_id, force_legacy);
+    }
+    const char * batch_new_token(int stream_id, int idx) {
+        return gpttype_batch_new_token(stream_id, idx);
+    }
+    int batch_get_stream_count(int stream_id) {
+        return gpttype_batch_get_stream_count(stream_id);
+    }
+    bool batch_has_finished(int stream_id) {
+        return gpttype_batch_has_finished(stream_id);
+    }
+    int batch_get_stop_reason(int stream_id) {
+        return gpttype_batch_get_stop_reason(stream_id);
+    }
+    const char* batch_get_pending_output(int stream_id) {
+       return gpttype_batch_get_pending_output(stream_id).c_str();
+    }
+    bool batch_abort_generate(int stream_id) {
+        return gpttype_batch_abort(stream_id);
+    }
+    int batch_wait_tokens(int stream_id, int have_count, int timeout_ms) {
+        return gpttype_batch_wait_tokens(stream_id, have_count, timeout_ms);
     }
 
     bool sd_load_model(const sd_load_model_inputs inputs)
@@ -230,7 +284,46 @@ extern "C"
     }
     tts_generation_outputs tts_generate(const tts_generation_inputs inputs)
     {
-        return ttstype_generate(inputs);
+        tts_generation_outputs output;
+        try
+        {
+            output = ttstype_generate(inputs);
+        }
+        catch (const std::exception & e)
+        {
+            printf("\nTTS generation failed: %s\n", e.what());
+            output.data = "";
+            output.status = 0;
+        }
+        ttstype_stream_close(); //always wake up any audio stream reader, even when generation failed
+        return output;
+    }
+    bool tts_abort() {
+        ttstype_abort();
+        return true;
+    }
+
+    //streamed tts audio, each record holds base64 16 bit mono pcm for one sentence
+    void tts_stream_open() {
+        ttstype_stream_open();
+    }
+    int tts_stream_wait(int timeout_ms) {
+        return ttstype_stream_wait(timeout_ms);
+    }
+    static token_stream_record popped_tts_chunk;
+    token_stream_outputs tts_stream_pop() {
+        token_stream_outputs output;
+        if(ttstype_stream_pop(popped_tts_chunk))
+        {
+            output.status = 1;
+            output.id = popped_tts_chunk.id;
+            output.timestamp_us = popped_tts_chunk.timestamp_us;
+            output.text = popped_tts_chunk.text.c_str();
+        }
+        return output;
+    }
+    int tts_stream_sample_rate() {
+        return ttstype_stream_sample_rate();
     }
 
     bool embeddings_load_model(const embeddings_load_model_inputs inputs)
@@ -241,6 +334,10 @@ extern "C"
     {
         return embeddingstype_generate(inputs);
     }
+    embeddings_batch_outputs embeddings_generate_batch(const embeddings_batch_inputs inputs)
+    {
+        return embeddingstype_generate_batch(inputs);
+    }
 
     const char * new_token(int idx) {
         if (generated_tokens.size() <= idx || idx < 0) return nullptr;
@@ -264,30 +361,38 @@ extern "C"
         return vision_multimodal_supported;
     }
     float get_last_eval_time() {
+        std::lock_guard<std::mutex> lock(last_stats_mtx);
         return last_eval_time;
     }
     float get_last_process_time() {
+        std::lock_guard<std::mutex> lock(last_stats_mtx);
         return last_process_time;
     }
     int get_last_token_count() {
+        std::lock_guard<std::mutex> lock(last_stats_mtx);
         return last_token_count;
     }
     int get_last_input_count() {
+        std::lock_guard<std::mutex> lock(last_stats_mtx);
         return last_input_count;
     }
     int get_last_seed()
     {
+        std::lock_guard<std::mutex> lock(last_stats_mtx);
         return last_seed;
     }
     int get_last_draft_success()
     {
+        std::lock_guard<std::mutex> lock(last_stats_mtx);
         return last_draft_success;
     }
      int get_last_draft_failed()
     {
+        std::lock_guard<std::mutex> lock(last_stats_mtx);
         return last_draft_failed;
     }
     int get_total_gens() {
+        std::lock_guard<std::mutex> lock(last_stats_mtx);
         return total_gens;
     }
     int get_total_img_gens()
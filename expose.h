@@ -1,5 +1,6 @@
 #pragma once
 #include <cstdint>
+#include <mutex>
 
 const int tensor_split_max = 16;
 const int images_max = 8;
@@ -47,9 +48,11 @@ struct load_model_inputs
     const int draft_amount = 8;
     const int draft_gpulayers = 999;
     const float draft_gpusplit[tensor_split_max] = {};
+    const bool ngram_draft = false;
     const char * mmproj_filename = nullptr;
     const bool mmproj_cpu = false;
     const int visionmaxres = 2048;
+    const int media_cache_mb = 0;
     const bool use_mmap = false;
     const bool use_mlock = false;
     const bool use_smartcontext = false;
@@ -74,12 +77,19 @@ struct load_model_inputs
     const float tensor_split[tensor_split_max] = {};
     const int quant_k = 0;
     const int quant_v = 0;
+    const int kv_recent = 0;
+    const bool kv_paged = false;
+    const char * kv_spill_dir = nullptr;
+    const int kv_resident_mb = 0;
     const bool check_slowness = false;
     const bool highpriority = false;
     const bool swa_support = false;
     const bool smartcache = false;
     const int smartcacheslots = 0;
+    const int smartcache_ram_mb = 0;
+    const char * smartcache_dir = nullptr;
     const bool pipelineparallel = false;
+    const int batch_slots = 0;
     const float lora_multiplier = 1.0f;
     const char * devices_override = nullptr;
     const bool quiet = false;
@@ -149,6 +159,14 @@ struct generation_outputs
     int completion_tokens = 0;
     const char * text; //response will now be stored in c++ allocated memory
 };
+struct token_stream_outputs
+{
+    int status = 0; //1 if a token was returned
+    int32_t id = -1;
+    float logprob = 0.0f;
+    int64_t timestamp_us = 0;
+    const char * text = nullptr;
+};
 struct token_count_outputs
 {
     int count = 0;
@@ -197,6 +215,7 @@ struct sd_load_model_inputs
     const int img_hard_limit = 0;
     const int img_soft_limit = 0;
     const char * devices_override = nullptr;
+    const int step_cache_mode = 0; //0=off, 1=auto, 2=easycache, 3=ucache, 4=cache-dit
     const bool quiet = false;
     const int debugmode = 0;
 };
@@ -226,6 +245,12 @@ struct sd_generation_inputs
     const bool circular_x = false;
     const bool circular_y = false;
     const bool upscale = false;
+    const int batch_count = 1;
+    const int step_cache_mode = -1; //-1 uses the mode picked at load
+    const float step_cache_threshold = 0.0f; //0 uses the default threshold for the model family
+    const int output_format = 0; //0=png, 1=jpeg
+    const int output_quality = 0; //jpeg quality, 0 uses the default
+    const int png_compression = -1; //deflate level 0 to 9, -1 uses the default
 };
 struct sd_generation_outputs
 {
@@ -233,6 +258,11 @@ struct sd_generation_outputs
     int animated = 0;
     const char * data = "";
     const char * data_extra = "";
+    int images_count = 0; //all images of a batch, data holds the first one
+    const char ** images = nullptr;
+    int data_length = 0; //read the base64 buffers by length
+    int data_extra_length = 0;
+    const int * images_length = nullptr;
 };
 struct sd_upscale_inputs
 {
@@ -254,6 +284,7 @@ struct whisper_load_model_inputs
     const char * devices_override = nullptr;
     const bool quiet = false;
     const int debugmode = 0;
+    const int threads = 4;
 };
 struct whisper_generation_inputs
 {
@@ -261,11 +292,13 @@ struct whisper_generation_inputs
     const char * audio_data = nullptr;
     const bool suppress_non_speech = false;
     const char * langcode = nullptr;
+    const bool long_form = false; //cut at silence and transcribe the pieces concurrently
 };
 struct whisper_generation_outputs
 {
     int status = -1;
     const char * text = "";
+    const char * segments = ""; //long form only, json array of start, end (seconds) and text
 };
 
 struct tts_load_model_inputs
@@ -291,6 +324,7 @@ struct tts_generation_inputs
     const char * custom_speaker_voice = "";
     const char * custom_speaker_text = "";
     const char * custom_speaker_data = "";
+    const bool stream = false; //split into sentences and push pcm chunks as each one is vocoded
 };
 struct tts_generation_outputs
 {
@@ -324,6 +358,28 @@ struct embeddings_generation_outputs
     int count = 0;
     const char * data = "";
 };
+enum embeddings_output_format
+{
+    EMBD_FORMAT_FLOAT = 0,
+    EMBD_FORMAT_INT8 = 1,
+    EMBD_FORMAT_BINARY = 2,
+};
+struct embeddings_batch_inputs
+{
+    const int prompts_count = 0;
+    const char ** prompts = nullptr;
+    const bool truncate = true;
+    const int output_format = EMBD_FORMAT_FLOAT;
+};
+struct embeddings_batch_outputs
+{
+    int status = -1;
+    int count = 0; //tokens processed
+    int rows = 0;
+    int n_embd = 0;
+    int row_bytes = 0;
+    const uint8_t * data = nullptr; //rows * row_bytes, valid until the next batch call
+};
 
 extern std::string executable_path;
 extern std::string lora_filename;
@@ -344,4 +400,5 @@ extern int total_tts_gens;
 extern int total_transcribe_gens;
 extern int last_draft_success;
 extern int last_draft_failed;
+extern std::mutex last_stats_mtx;
 extern stop_reason last_stop_reason;
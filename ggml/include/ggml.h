@@ -2362,6 +2362,23 @@ extern "C" {
             struct ggml_tensor * a,
             struct ggml_tensor * sinks);
 
+    // kcpp: same as ggml_flash_attn_ext, but each result row has one more element after the values,
+    // the log-sum-exp of its scaled and masked scores (-inf if every key is masked)
+    // res: [n_embd_v + 1, n_head, n_batch, ne3]
+    // only the CPU backend implements it
+    GGML_API struct ggml_tensor * ggml_flash_attn_ext_lse(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * q,
+            struct ggml_tensor  * k,
+            struct ggml_tensor  * v,
+            struct ggml_tensor  * mask,
+            float                 scale,
+            float                 max_bias,
+            float                 logit_softcap);
+
+    GGML_API bool ggml_flash_attn_ext_has_lse(
+            const struct ggml_tensor * a);
+
     // TODO: needs to be adapted to ggml_flash_attn_ext
     GGML_API struct ggml_tensor * ggml_flash_attn_back(
            struct ggml_context * ctx,
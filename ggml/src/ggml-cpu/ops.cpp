@@ -8106,6 +8106,14 @@ void ggml_compute_forward_top_k(
     }
 }
 
+//kcpp: writes one normalized output row. ggml_flash_attn_ext_lse rows carry the log-sum-exp of the scores after the values
+static inline void ggml_flash_attn_ext_store_row(char * dst_row, const float * VKQ, int64_t DV, bool with_lse, float M, float S) {
+    memcpy(dst_row, VKQ, DV*sizeof(float));
+    if (with_lse) {
+        ((float *) dst_row)[DV] = S == 0.0f ? -INFINITY : M + logf(S);
+    }
+}
+
 static void ggml_compute_forward_flash_attn_ext_f16_one_chunk(
         const ggml_compute_params * params,
         ggml_tensor * dst,
@@ -8114,6 +8122,7 @@ static void ggml_compute_forward_flash_attn_ext_f16_one_chunk(
         float * partials, int64_t partial_stride) {
 
     const bool write_partials = (partials != nullptr);
+    const bool with_lse       = ggml_get_op_params_i32(dst, 4) != 0;
     const ggml_tensor * q     = dst->src[0];
     const ggml_tensor * k     = dst->src[1];
     const ggml_tensor * v     = dst->src[2];
@@ -8133,7 +8142,7 @@ static void ggml_compute_forward_flash_attn_ext_f16_one_chunk(
     const int64_t DV = nev0;
     const int64_t N  = neq1;
 
-    GGML_ASSERT(ne0 == DV);
+    GGML_ASSERT(ne0 == DV + (ggml_get_op_params_i32(dst, 4) != 0 ? 1 : 0));
     GGML_ASSERT(ne2 == N);
 
     // input tensor rows must be contiguous
@@ -8339,7 +8348,7 @@ static void ggml_compute_forward_flash_attn_ext_f16_one_chunk(
             const int i3 = iq3;
 
             // permute(0, 2, 1, 3)
-            memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32, nb1);
+            ggml_flash_attn_ext_store_row((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32, DV, with_lse, M, S);
         }
     }
 }
@@ -8348,6 +8357,7 @@ static void ggml_compute_forward_flash_attn_ext_tiled(
         const ggml_compute_params * params,
         ggml_tensor * dst,
         int ir0, int ir1) {
+    const bool with_lse       = ggml_get_op_params_i32(dst, 4) != 0;
     const ggml_tensor * q     = dst->src[0];
     const ggml_tensor * k     = dst->src[1];
     const ggml_tensor * v     = dst->src[2];
@@ -8367,7 +8377,7 @@ static void ggml_compute_forward_flash_attn_ext_tiled(
     const int64_t DV = nev0;
     const int64_t N  = neq1;
 
-    GGML_ASSERT(ne0 == DV);
+    GGML_ASSERT(ne0 == DV + (ggml_get_op_params_i32(dst, 4) != 0 ? 1 : 0));
     GGML_ASSERT(ne2 == N);
 
     // input tensor rows must be contiguous
@@ -8605,6 +8615,7 @@ static void ggml_compute_forward_flash_attn_ext_tiled(
 
                 if (s > M[tq]) {
                     ms = expf(M[tq] - s);
+                    M[tq] = s;
                     ggml_vec_scale_f32(DV, VKQ32 + tq * DV, ms);
                 } else {
                     vs = expf(s - M[tq]);
@@ -8625,7 +8636,7 @@ static void ggml_compute_forward_flash_attn_ext_tiled(
             const int i3 = iq3;
 
             // permute(0, 2, 1, 3)
-            memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32 + tq * DV, nb1);
+            ggml_flash_attn_ext_store_row((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32 + tq * DV, DV, with_lse, M[tq], S[tq]);
         }
 
         ir += tile_rows;
@@ -8700,7 +8711,7 @@ static void ggml_flash_attn_ext_reduce_partials(
             ggml_vec_scale_f32(DV, VKQ_final, S_inv);
         }
         // iq1=0, iq3=0 for decode
-        memcpy((char *) dst->data + (0*ne2*ne1 + q_head + 0*ne1)*nb1, VKQ_final, nb1);
+        ggml_flash_attn_ext_store_row((char *) dst->data + (0*ne2*ne1 + q_head + 0*ne1)*nb1, VKQ_final, DV, ggml_get_op_params_i32(dst, 4) != 0, M_final, S_final);
     }
 }
 
@@ -8726,7 +8737,7 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     const int64_t N  = neq1;
 
 
-    GGML_ASSERT(ne0 == DV);
+    GGML_ASSERT(ne0 == DV + (ggml_get_op_params_i32(dst, 4) != 0 ? 1 : 0));
     GGML_ASSERT(ne2 == N);
 
     // input tensor rows must be contiguous
@@ -14794,6 +14794,9 @@ static bool ggml_backend_vk_device_supports_op(ggml_backend_dev_t dev, const ggm
                 bool coopmat2 = device->coopmat2;
                 uint32_t HSK = op->src[1]->ne[0];
                 uint32_t HSV = op->src[2]->ne[0];
+                if (ggml_flash_attn_ext_has_lse(op)) {
+                    return false; //kcpp: the log-sum-exp output is cpu only
+                }
                 if ((HSK % 8) != 0 || (HSV % 8) != 0) {
                     return false;
                 }
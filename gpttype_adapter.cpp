@@ -22,8 +22,14 @@
 #include <cctype>
 #include <locale>
 #include <chrono>
+#include <thread>
+#include <deque>
+#include <atomic>
 
 #include "utils.h"
+#include "sampler_workspace.h"
+#include "tokenize_cache.h"
+#include "context_match.h"
 
 //for easier compilation
 //concat source files into one file for compilation purposes
@@ -45,6 +51,34 @@
 #include "tools/mtmd/llava.h"
 #include "tools/mtmd/mtmd-audio.h"
 #include "common/common.h"
+//common/log.h, pulled in by ngram-cache, defines the same LOG_ macros as clip-impl.h. it gets its own and the clip ones come back after
+#pragma push_macro("LOG_DBG")
+#pragma push_macro("LOG_INF")
+#pragma push_macro("LOG_WRN")
+#pragma push_macro("LOG_ERR")
+#pragma push_macro("LOG_CNT")
+#undef LOG_DBG
+#undef LOG_INF
+#undef LOG_WRN
+#undef LOG_ERR
+#undef LOG_CNT
+#include "common/ngram-cache.cpp"
+#undef LOG_DBG
+#undef LOG_INF
+#undef LOG_WRN
+#undef LOG_ERR
+#undef LOG_CNT
+#pragma pop_macro("LOG_DBG")
+#pragma pop_macro("LOG_INF")
+#pragma pop_macro("LOG_WRN")
+#pragma pop_macro("LOG_ERR")
+#pragma pop_macro("LOG_CNT")
+#include "grammar_mask.h"
+
+//savestate deflate uses the miniz built once in zip.o, so only the declarations come in here
+#define MINIZ_HEADER_FILE_ONLY
+#define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
+#include "otherarch/sdcpp/thirdparty/miniz.h"
 
 #if defined(GGML_USE_HIP)
 // for rocblas_initialize()
@@ -53,8 +87,8 @@
 
 //const
 const int extra_context_handle_fragmentation = 128;
-const int MEDIA_TOKEN_IDENTIFIER_A = -998; //alternate between both, changing when image changes
-const int MEDIA_TOKEN_IDENTIFIER_B = -999;
+const int MEDIA_TOKEN_IDENTIFIER_MAX = -998; //media placeholder tokens are this or lower, each object gets its own id from its content
+const int MEDIA_TOKEN_IDENTIFIER_RANGE = 1000000;
 
 //shared
 std::string executable_path = "";
@@ -62,6 +96,9 @@ std::string lora_filename = "";
 std::string mmproj_filename = "";
 std::string draftmodel_filename = "";
 int speculative_chunk_amt = 8; //do it in chunks of this many tokens
+static float speculative_accept_rate = 0.6f; //moving average of per token draft acceptance, sets the draft length
+static thread_local const std::vector<std::pair<int32_t,float>> * speculative_verify_probs = nullptr; //set while sampling a drafted position
+static thread_local int speculative_verify_id = -1;
 bool generation_finished;
 bool audio_multimodal_supported = false;
 bool vision_multimodal_supported = false;
@@ -73,6 +110,7 @@ int last_seed = -1;
 int total_gens = 0;
 int last_draft_success = 0;
 int last_draft_failed = 0;
+std::mutex last_stats_mtx; //guards the last_* counters and total_gens, the batch engine thread writes them too
 stop_reason last_stop_reason = stop_reason::INVALID;
 std::vector<std::string> generated_tokens;
 
@@ -107,6 +145,12 @@ static llama_v2_context * llama_ctx_v2 = nullptr;
 static llama_v3_context * llama_ctx_v3 = nullptr;
 static llama_context * llama_ctx_v4 = nullptr;
 static llama_context * draft_ctx = nullptr; //will remain null if speculative is unused
+static bool ngram_drafting = false; //prompt lookup drafting from the context, used instead of a draft model
+static common_ngram_cache ngram_cache_context; //ngrams of current_context_tokens
+static common_ngram_cache ngram_cache_dynamic; //ngrams of previous generations, kept between requests
+static common_ngram_cache ngram_cache_static; //always empty, no corpus cache is loaded
+static std::vector<int> ngram_cache_tokens; //tokens already counted into ngram_cache_context
+const size_t ngram_cache_dynamic_limit = 1000000; //forget older generations past this many ngrams
 static llama_context * guidance_ctx = nullptr; //for classifier free guidance, will be null if unused
 
 static clip_ctx * clp_ctx_v = nullptr; //for llava
@@ -116,7 +160,10 @@ static std::unique_ptr<mtmd_audio_preprocessor> audio_preproc; //for audio proce
 static std::vector<media_object> media_objects;
 static std::vector<int> last_media_mem; //for storing dummy tokens that will be consumed by llava
 static std::string media_composite_image_signature = ""; //for identifying when the llava images change, we need to invalidate the cache
-static int current_media_identifier = MEDIA_TOKEN_IDENTIFIER_A;
+static uint64_t media_identifier_salt = 0; //changed on forced invalidation so no old media kv is ever matched
+static std::vector<media_embd_cache_entry> media_embd_cache; //lru of clip embeddings, so unchanged media is never encoded twice
+static size_t media_embd_cache_budget = 0; //bytes, entries used by the current request are never evicted
+static uint64_t media_embd_cache_clock = 0;
 static int vision_max_res = 2048;
 static bool use_mrope = false;
 
@@ -142,6 +189,10 @@ static std::unordered_multimap<gpt_vocab::id, std::vector<gpt_vocab::id>> dry_se
 static std::vector<int> dry_repeat_count; // Indexed as last_n_tokens
 static std::unordered_map<gpt_vocab::id, int> dry_max_token_repeat;
 static std::vector<TopPicksData> top_picks_history;
+static thread_local kcpp_sampler_workspace sampler_ws; //per thread, the batch engine samples on its own thread
+static kcpp_grammar_masker grammar_masker; //allowed token masks per grammar state, built from the vocab on first use
+static kcpp_tokenize_cache prompt_tokenize_cache; //previous prompts with their tokens, so a grown prompt only tokenizes the new part
+static std::vector<float> adaptive_original_logits; //reused across tokens for adaptive p
 static int remaining_tokens = 0;
 static bool early_abort = false;
 static std::mutex concat_output_mtx;
@@ -157,10 +208,41 @@ static bool highpriority = false;
 
 static int delayed_generated_tokens_limit = 0;
 std::deque<std::string> delayed_generated_tokens; //for use with antislop sampling
+static std::deque<token_stream_record> delayed_stream_records; //kept in step with delayed_generated_tokens
+static std::deque<int> delayed_banned_states; //banned phrase matcher state before each delayed token, for rewinds
+static multi_pattern_matcher stop_sequence_matcher;
+static multi_pattern_matcher banned_phrase_matcher;
+static int stop_sequence_hit = -1;
+static token_stream_ring token_stream; //push channel for sse readers, fed together with generated_tokens
 static std::map<int,std::vector<int>> antislop_banned_token_ids; //first is the npast position, second is the array of banned ids at that index
 
 static int savestate_limit = 0;
 static std::vector<savestate_data> savestates;
+static token_prefix_tree savestate_tree; //indexes savestate_context_tokens of every slot for prefix lookups
+static size_t savestate_ram_budget = 0; //bytes of snapshots allowed in ram, 0 means no limit
+static std::string savestate_spill_dir = ""; //cold snapshots are written here, empty disables the disk tier
+static std::string savestate_spill_tag = "";
+static uint64_t savestate_serial_counter = 0;
+static const int savestate_max_delta_chain = 4; //deeper chains are saved as a full snapshot instead
+static const int savestate_min_delta_parent = 256; //parents shorter than this are not worth a chain
+
+//continuous batching, only for gguf. slots use seq ids 1 to N, seq 0 stays with the regular gpttype_generate path
+static int batch_slot_count = 0; //0 or 1 means batching is disabled
+static std::vector<batch_slot> batch_slots;
+static std::deque<batch_slot> batch_pending; //requests waiting for a free slot
+static std::map<int,std::shared_ptr<batch_stream_record>> batch_streams;
+static std::mutex batch_queue_mtx; //guards batch_pending and batch_streams
+static std::condition_variable batch_queue_cv;
+static std::mutex batch_ctx_mtx; //held whenever llama_ctx_v4 is in use
+static std::mutex batch_legacy_mtx; //non batchable requests still go through gpttype_generate one at a time
+static std::atomic<int> batch_legacy_stream_id{0}; //stream currently being served by gpttype_generate
+static std::shared_ptr<batch_stream_record> batch_legacy_rec; //its record, gets a copy of each released token. generation thread only
+static std::atomic<int> batch_legacy_waiting{0}; //batch engine backs off while this is nonzero, changed under batch_queue_mtx
+static llama_batch batch_engine_batch = {};
+static std::thread batch_engine_thread;
+static bool batch_engine_stopping = false; //asks the engine thread to exit, guarded by batch_queue_mtx
+static int64_t batch_use_counter = 0;
+const int batch_stream_history_max = 64; //finished stream records kept around for late readers
 
 inline int kcpp_cpu_has_blas(void) {
 #if defined(GGML_USE_BLAS) || defined(GGML_USE_CUDA) || defined(GGML_USE_VULKAN) || defined(GGML_USE_SYCL)
@@ -280,6 +362,33 @@ static void TokenizeString(const std::string & str_to_tokenize, std::vector<int>
         output_tokens = ::gpt_tokenize(vocab, str_to_tokenize);
     }
 }
+//same result as TokenizeString, but long prompts that share a prefix with a recent one reuse its tokens.
+//only for gguf bpe vocabs, where merges never cross pretokenizer chunks and a suffix tokenizes on its own
+static void TokenizeStringCached(const std::string & str_to_tokenize, std::vector<int> & output_tokens, FileFormat file_format, bool add_bos)
+{
+    if (file_format != FileFormat::GGUF_GENERIC || str_to_tokenize.size() < prompt_tokenize_cache.min_reuse)
+    {
+        TokenizeString(str_to_tokenize, output_tokens, file_format, add_bos);
+        return;
+    }
+    const llama_vocab * tmpvocab = llama_model_get_vocab(llama_get_model(llama_ctx_v4));
+    if (llama_vocab_type(tmpvocab) != LLAMA_VOCAB_TYPE_BPE || llama_vocab_get_add_eos(tmpvocab) || llama_vocab_get_add_sep(tmpvocab))
+    {
+        TokenizeString(str_to_tokenize, output_tokens, file_format, add_bos);
+        return;
+    }
+    output_tokens = prompt_tokenize_cache.tokenize(str_to_tokenize,
+        [](const std::string & s) { return ::common_tokenize(llama_ctx_v4, s, false, true); },
+        [file_format](int id) { return FileFormatTokenizeID(id, file_format, true); });
+    if (add_bos)
+    {
+        llama_token bostoadd = llama_vocab_bos(tmpvocab);
+        if (bostoadd != LLAMA_TOKEN_NULL && (llama_vocab_get_add_bos(tmpvocab) || output_tokens.empty() || output_tokens[0] != bostoadd))
+        {
+            output_tokens.insert(output_tokens.begin(), 1, bostoadd);
+        }
+    }
+}
 static int GetEosID(FileFormat file_format, int32_t n_vocab)
 {
     unsigned int eosID = 0;
@@ -642,6 +751,85 @@ const char * kcpp_print_system_info(void) {
     return s.c_str();
 }
 
+static bool is_media_token(int tok)
+{
+    return tok <= MEDIA_TOKEN_IDENTIFIER_MAX;
+}
+
+static uint64_t media_content_hash(const std::vector<uint8_t> & data)
+{
+    uint64_t h = 1469598103934665603ULL; //fnv-1a
+    for(size_t i=0;i<data.size();++i)
+    {
+        h ^= data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static void media_embd_cache_free(media_embd_cache_entry & entry)
+{
+    for(int j=0;j<entry.mediachunks.size();++j)
+    {
+        if(entry.mediachunks[j].clp_img_embd!=nullptr)
+        {
+            free(entry.mediachunks[j].clp_img_embd);
+            entry.mediachunks[j].clp_img_embd = nullptr;
+        }
+    }
+    entry.mediachunks.clear();
+}
+
+static void media_embd_cache_clear()
+{
+    for(int i=0;i<media_embd_cache.size();++i)
+    {
+        media_embd_cache_free(media_embd_cache[i]);
+    }
+    media_embd_cache.clear();
+}
+
+static int media_embd_cache_find(uint64_t hash, bool is_audio)
+{
+    for(int i=0;i<media_embd_cache.size();++i)
+    {
+        if(media_embd_cache[i].hash==hash && media_embd_cache[i].is_audio==is_audio)
+        {
+            media_embd_cache[i].last_used = media_embd_cache_clock;
+            return i;
+        }
+    }
+    return -1;
+}
+
+//evicts least recently used embeddings until the budget fits, skipping anything the current request uses
+static void media_embd_cache_trim()
+{
+    size_t total = 0;
+    for(int i=0;i<media_embd_cache.size();++i)
+    {
+        total += media_embd_cache[i].bytes;
+    }
+    while(total > media_embd_cache_budget)
+    {
+        int victim = -1;
+        for(int i=0;i<media_embd_cache.size();++i)
+        {
+            if(media_embd_cache[i].last_used!=media_embd_cache_clock && (victim<0 || media_embd_cache[i].last_used<media_embd_cache[victim].last_used))
+            {
+                victim = i;
+            }
+        }
+        if(victim<0)
+        {
+            break;
+        }
+        total -= media_embd_cache[victim].bytes;
+        media_embd_cache_free(media_embd_cache[victim]);
+        media_embd_cache.erase(media_embd_cache.begin() + victim);
+    }
+}
+
 //loads a model for speculative decoding.
 static void speculative_decoding_setup(std::string spec_model_filename, const llama_model_params & base_model_params, const llama_context_params & base_ctx_params, int base_n_vocab, const float * draft_gpusplit, int draft_gpulayers)
 {
@@ -723,7 +911,60 @@ static void speculative_decoding_setup(std::string spec_model_filename, const ll
     }
 }
 
-static speculative_draft_result speculative_decoding_eval_chunk(llama_context * draft_ctx, llama_context * main_ctx, const llama_tokens & embd, const int n_vocab, const int & n_past)
+//evaluates the drafted tokens on the main model in one batch. drafted_ids starts with the last accepted token,
+//and the logits at each position are kept so every drafted token can be checked against the real sample
+static speculative_draft_result speculative_verify_chunk(llama_context * main_ctx, const std::vector<int> & drafted_ids, const std::vector<std::vector<std::pair<int32_t,float>>> & draft_probs, const int & n_past)
+{
+    speculative_draft_result results;
+    results.draft_success = false;
+    results.draft_probs = draft_probs;
+    std::vector<int> real_embd = drafted_ids;
+    real_embd.pop_back();
+
+    kcpp_embd_batch batch2 = kcpp_embd_batch(real_embd, n_past, use_mrope, true);
+    auto draftok = (llama_decode(main_ctx, batch2.batch)==0); //actual eval for big model
+    if(!draftok)
+    {
+        printf("\nERROR: Speculative draft model 2 failed!\n");
+        return results;
+    }
+    results.drafted_amount = 0;
+    for(int i=0;i<drafted_ids.size()-1;++i)
+    {
+         results.drafted_amount += 1;
+        float * fulllogits = llama_get_logits_ith(main_ctx,i);
+        results.draftids.push_back(drafted_ids[i+1]);
+        results.actual_logits.push_back(fulllogits);
+    }
+    results.draft_success = true;
+    return results;
+}
+
+//the draft length that keeps the chance of the last drafted token being accepted above 10%
+static int speculative_draft_length()
+{
+    if(speculative_accept_rate >= 0.99f)
+    {
+        return speculative_chunk_amt;
+    }
+    if(speculative_accept_rate <= 0.01f)
+    {
+        return 1;
+    }
+    int len = (int)ceilf(logf(0.1f) / logf(speculative_accept_rate));
+    return std::max(1, std::min(len, speculative_chunk_amt));
+}
+
+static void speculative_update_accept_rate(int accepted, bool rejected)
+{
+    int total = accepted + (rejected ? 1 : 0);
+    if(total > 0)
+    {
+        speculative_accept_rate = 0.8f * speculative_accept_rate + 0.2f * ((float)accepted / total);
+    }
+}
+
+static speculative_draft_result speculative_decoding_eval_chunk(llama_context * draft_ctx, llama_context * main_ctx, const llama_tokens & embd, const int n_vocab, const int & n_past, const int draft_len, const float temp, std::mt19937 & rng)
 {
     speculative_draft_result results;
     results.draft_success = false;
@@ -741,9 +982,10 @@ static speculative_draft_result speculative_decoding_eval_chunk(llama_context *
     int actual_npast = n_past;
     std::vector<int> temp_embd;
     std::vector<int> drafted_ids;
+    std::vector<std::vector<std::pair<int32_t,float>>> draft_probs;
     temp_embd.push_back(embd[0]);
     drafted_ids.push_back(embd[0]);
-    for(int i=0;i<speculative_chunk_amt;++i)
+    for(int i=0;i<draft_len;++i)
     {
         kcpp_embd_batch batch1 = kcpp_embd_batch(temp_embd, draft_npast, false, false);
         auto draftok = (llama_decode(draft_ctx, batch1.batch)==0);
@@ -753,35 +995,78 @@ static speculative_draft_result speculative_decoding_eval_chunk(llama_context *
             return results;
         }
         float * draftlogits = llama_get_logits(draft_ctx);
-        //greedy sample the draft model
-        int topid = std::max_element(draftlogits, draftlogits + n_vocab) - draftlogits;
+        int topid = 0;
+        std::vector<std::pair<int32_t,float>> q;
+        if(temp <= 0.0f)
+        {
+            //greedy sample the draft model
+            topid = std::max_element(draftlogits, draftlogits + n_vocab) - draftlogits;
+            q.push_back({topid, 1.0f});
+        }
+        else
+        {
+            //sample the draft model from its top 40 at the main temperature, and remember q for verification
+            sampler_ws.load(draftlogits, n_vocab);
+            llama_token_data_array cands = sampler_ws.top_k(40);
+            std::vector<float> probs(cands.size);
+            float sum = 0.0f;
+            for(size_t j=0;j<cands.size;++j)
+            {
+                probs[j] = expf((cands.data[j].logit - cands.data[0].logit) / temp);
+                sum += probs[j];
+            }
+            std::discrete_distribution<> dist(probs.begin(), probs.end());
+            topid = cands.data[dist(rng)].id;
+            for(size_t j=0;j<cands.size;++j)
+            {
+                q.push_back({cands.data[j].id, probs[j] / sum});
+            }
+        }
+        draft_probs.push_back(std::move(q));
         drafted_ids.push_back(topid);
         temp_embd.clear();
         temp_embd.push_back(topid);
         ++draft_npast;
     }
     //now that we have our drafted tokens, we form a batch and PP it
+    return speculative_verify_chunk(main_ctx, drafted_ids, draft_probs, actual_npast);
+}
 
-    std::vector<int> real_embd = drafted_ids;
-    real_embd.pop_back();
-
-    kcpp_embd_batch batch2 = kcpp_embd_batch(real_embd, actual_npast, use_mrope, true);
-    auto draftok = (llama_decode(main_ctx, batch2.batch)==0); //actual eval for big model
-    if(!draftok)
+//keeps ngram_cache_context in step with the context, only appended tokens are counted unless the context changed
+static void ngram_cache_sync(std::vector<int> & context_tokens)
+{
+    const size_t have = ngram_cache_tokens.size();
+    bool appended = (have <= context_tokens.size() && std::equal(ngram_cache_tokens.begin(), ngram_cache_tokens.end(), context_tokens.begin()));
+    if(!appended)
     {
-        printf("\nERROR: Speculative draft model 2 failed!\n");
-        return results;
+        ngram_cache_context.clear();
+        ngram_cache_tokens.clear();
     }
-    results.drafted_amount = 0;
-    for(int i=0;i<drafted_ids.size()-1;++i)
+    int nnew = context_tokens.size() - ngram_cache_tokens.size();
+    if(nnew > 0)
     {
-         results.drafted_amount += 1;
-        float * fulllogits = llama_get_logits_ith(main_ctx,i);
-        results.draftids.push_back(drafted_ids[i+1]);
-        results.actual_logits.push_back(fulllogits);
+        common_ngram_cache_update(ngram_cache_context, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, context_tokens, nnew, false);
+        ngram_cache_tokens.insert(ngram_cache_tokens.end(), context_tokens.end() - nnew, context_tokens.end());
     }
-    results.draft_success = true;
-    return results;
+}
+
+//drafts up to draft_len tokens by looking up ngrams of the context and of earlier generations.
+//returns the last accepted token followed by the drafted ones, or just the last token if nothing matched
+static std::vector<int> ngram_draft_tokens(std::vector<int> & context_tokens, int last_token, int draft_len)
+{
+    std::vector<int> drafted_ids;
+    drafted_ids.push_back(last_token);
+    ngram_cache_sync(context_tokens);
+    common_ngram_cache_draft(context_tokens, drafted_ids, draft_len, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, ngram_cache_context, ngram_cache_dynamic, ngram_cache_static);
+    for(int i=1;i<drafted_ids.size();++i)
+    {
+        if(drafted_ids[i]<0) //never draft media placeholders
+        {
+            drafted_ids.resize(i);
+            break;
+        }
+    }
+    return drafted_ids;
 }
 
 // KCPP SAMPLING FUNCTIONS
@@ -889,7 +1174,47 @@ void sample_top_k(llama_token_data_array * cur_p, int32_t k) {
     cur_p->size = k;
 }
 
-llama_token sample_token(llama_token_data_array * candidates, std::mt19937 & rng)
+//picks_out receives the logprobs of this step, pass nullptr to skip recording them
+//speculative sampling. the drafted token is kept with probability min(1, p/q), otherwise the pick comes from
+//the residual max(0, p - q). either way the result is distributed exactly as p
+static int speculative_accept_or_resample(llama_token_data_array * candidates, const std::vector<float> & probs, const std::vector<std::pair<int32_t,float>> & q, std::mt19937 & rng)
+{
+    int draft_idx = -1;
+    for (size_t i = 0; i < candidates->size; ++i) {
+        if (candidates->data[i].id == speculative_verify_id) {
+            draft_idx = i;
+            break;
+        }
+    }
+    float q_draft = 0.0f;
+    for (const auto & e : q) {
+        if (e.first == speculative_verify_id) {
+            q_draft = e.second;
+        }
+    }
+    std::uniform_real_distribution<float> unif(0.0f, 1.0f);
+    if (draft_idx >= 0 && q_draft > 0.0f && unif(rng) * q_draft < probs[draft_idx]) {
+        return draft_idx;
+    }
+    std::vector<float> residual(probs);
+    float residual_sum = 0.0f;
+    for (size_t i = 0; i < candidates->size; ++i) {
+        for (const auto & e : q) {
+            if (e.first == candidates->data[i].id) {
+                residual[i] = std::max(0.0f, residual[i] - e.second);
+                break;
+            }
+        }
+        residual_sum += residual[i];
+    }
+    if (residual_sum <= 0.0f) {
+        residual = probs; //p and q agree, fall back to p
+    }
+    std::discrete_distribution<> dist(residual.begin(), residual.end());
+    return dist(rng);
+}
+
+llama_token sample_token(llama_token_data_array * candidates, std::mt19937 & rng, std::vector<TopPicksData> * picks_out = &top_picks_history)
 {
     sample_softmax(candidates);
     std::vector<float> probs;
@@ -900,8 +1225,21 @@ llama_token sample_token(llama_token_data_array * candidates, std::mt19937 & rng
         probs.push_back(candidates->data[i].p);
     }
 
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
-    int idx = dist(rng);
+    int idx = 0;
+    if(speculative_verify_probs!=nullptr)
+    {
+        idx = speculative_accept_or_resample(candidates, probs, *speculative_verify_probs, rng);
+    }
+    else
+    {
+        std::discrete_distribution<> dist(probs.begin(), probs.end());
+        idx = dist(rng);
+    }
+
+    if(picks_out==nullptr)
+    {
+        return candidates->data[idx].id;
+    }
 
     newpick.selected_token = FileFormatTokenizeID(candidates->data[idx].id, file_format, true);
     float rp1 = (candidates->data[idx].p<=0.0001?0.0001f:candidates->data[idx].p);
@@ -923,7 +1261,7 @@ llama_token sample_token(llama_token_data_array * candidates, std::mt19937 & rng
         newpick.tokenid.push_back(candidates->data[i].id);
     }
 
-    top_picks_history.push_back(newpick);
+    picks_out->push_back(newpick);
 
     llama_token result = candidates->data[idx].id;
     return result;
@@ -1072,7 +1410,8 @@ void sample_xtc(llama_token_data_array * candidates, float xtc_threshold, float
 
 }
 
-void sample_dry(int n_ctx, int penalty_range, float penalty_multiplier, float penalty_base, int allowed_length, const std::unordered_multimap<gpt_vocab::id, std::vector<gpt_vocab::id>>& restart_sequences, llama_token_data_array * candidates) {
+//penalizes by token id, so it works on the full vocab logits before any candidates are picked
+void sample_dry(int n_ctx, int penalty_range, float penalty_multiplier, float penalty_base, int allowed_length, const std::unordered_multimap<gpt_vocab::id, std::vector<gpt_vocab::id>>& restart_sequences, float * logits) {
     if (penalty_multiplier <= 0.0f || penalty_base <= 0.0f) {
         return;
     }
@@ -1266,13 +1605,9 @@ void sample_dry(int n_ctx, int penalty_range, float penalty_multiplier, float pe
             ::utreplace(tokenizedstr, "\n", "\\n");
             printf("%s(%s %.02f)", count == 0 ? "" : " ", RemoveBell(tokenizedstr).c_str(), penalty);
         }
-        candidates->data[token].logit -= penalty;
+        logits[token] -= penalty;
         ++count;
     }
-    if(count>0)
-    {
-        candidates->sorted = false;
-    }
     if (debugmode==1 && !is_quiet && !dry_max_token_repeat.empty()) {
         printf("]\n");
     }
@@ -1324,11 +1659,11 @@ inline void adaptive_p_update_history(float selected_token_prob, float & weighte
 }
 
 
-void sample_rep_pen(int n_ctx, int rep_pen_range, float rep_pen, float rep_pen_slope, float presence_penalty, llama_token_data_array * candidates_p)
+void sample_rep_pen(int n_ctx, int rep_pen_range, float rep_pen, float rep_pen_slope, float presence_penalty, llama_token_data_array * candidates_p, const std::vector<gpt_vocab::id> & history = last_n_tokens)
 {
-    auto last_n_repeat = std::min(std::min((int)last_n_tokens.size(), rep_pen_range), n_ctx);
+    auto last_n_repeat = std::min(std::min((int)history.size(), rep_pen_range), n_ctx);
 
-    const llama_token * last_tokens =  last_n_tokens.data() + last_n_tokens.size() - last_n_repeat;
+    const llama_token * last_tokens =  history.data() + history.size() - last_n_repeat;
     size_t last_tokens_size = last_n_repeat;
     llama_token_data_array * candidates = candidates_p;
 
@@ -1338,9 +1673,8 @@ void sample_rep_pen(int n_ctx, int rep_pen_range, float rep_pen, float rep_pen_s
 
     const int64_t t_start_sample_us = ggml_time_us();
 
-    // Create a frequency map to count occurrences of each token in last_tokens
-    std::unordered_set<llama_token> tokens_near(last_tokens + last_n_repeat / 2, last_tokens + last_n_repeat);
-    std::unordered_set<llama_token> tokens_far(last_tokens, last_tokens + last_n_repeat / 2);
+    // Mark which tokens appear in the near and far halves of last_tokens
+    sampler_ws.mark_history(last_tokens, last_n_repeat, last_n_repeat / 2);
 
     float rep_pen_reduced = rep_pen;
     if(rep_pen_reduced>1.0f)
@@ -1348,13 +1682,12 @@ void sample_rep_pen(int n_ctx, int rep_pen_range, float rep_pen, float rep_pen_s
        rep_pen_reduced = 1.0f + ((rep_pen-1.0f)*rep_pen_slope);
     }
     for (size_t i = 0; i < candidates->size; ++i) {
-        const bool token_in_near = tokens_near.find(candidates->data[i].id) != tokens_near.end();
-        const bool token_in_far = tokens_far.find(candidates->data[i].id) != tokens_far.end();
-        if (!token_in_near && !token_in_far) {
+        const int seen = sampler_ws.history_class(candidates->data[i].id);
+        if (seen == 0) {
             continue;
         }
 
-        float penalty = (token_in_near?rep_pen:rep_pen_reduced);
+        float penalty = (seen == 2 ? rep_pen : rep_pen_reduced);
 
         // The academic publication that described this technique actually just only divided, but that would cause tokens with negative logits to become more likely, which is obviously wrong.
         // This is common fix for this problem, which is to multiply by the penalty instead of dividing.
@@ -1747,6 +2080,60 @@ void sample_guidance(struct llama_context * ctx, struct llama_context * guidance
     }
 }
 
+//runs the user specified sampler order over the candidates. rep pen reads from the provided token history
+static void ApplySamplerOrder(llama_token_data_array * candidates, int n_ctx, int rep_pen_range, float rep_pen, float rep_pen_slope, float presence_penalty, float top_k, float top_a, float top_p, float min_p, float typical_p, float tfs, float nsigma, float temp,
+const std::vector<samplers> & sampler_order, float dynatemp_range, float dynatemp_exponent, float smoothing_factor, float smoothing_curve, const std::vector<gpt_vocab::id> & rep_pen_history)
+{
+    for (int i = 0; i < sampler_order.size(); i++)
+    {
+        switch (sampler_order[i])
+        {
+            case KCPP_SAMPLER_TOP_K:
+                sample_top_k(candidates, top_k);
+                break;
+            case KCPP_SAMPLER_TOP_A:
+                sample_top_a(candidates, top_a, 1);
+                break;
+            case KCPP_SAMPLER_TOP_P:
+                sample_top_p(candidates, top_p, 1);
+                sample_min_p(candidates, min_p, 1);
+                break;
+            case KCPP_SAMPLER_TFS:
+                sample_tail_free(candidates, tfs, 1);
+                break;
+            case KCPP_SAMPLER_TYP:
+                sampler_typical(candidates, typical_p, 1);
+                break;
+            case KCPP_SAMPLER_TEMP:
+                if (dynatemp_range!=0)
+                {
+                    float dynatemp_min = temp - dynatemp_range;
+                    float dynatemp_max = temp + dynatemp_range;
+                    //do not allow negative values
+                    dynatemp_min = dynatemp_min<0?0:dynatemp_min;
+                    dynatemp_max = dynatemp_max<0?0:dynatemp_max;
+                    dynatemp_exponent = dynatemp_exponent<0?0:dynatemp_exponent;
+                    sample_entropy(candidates, dynatemp_min, dynatemp_max, dynatemp_exponent, smoothing_factor, smoothing_curve);
+                }
+                else
+                {
+                    sample_temperature(candidates, temp, smoothing_factor, smoothing_curve);
+                }
+                if (nsigma > 0.0f)
+                {
+                    sample_top_n_sigma(candidates, nsigma);
+                }
+                break;
+            case KCPP_SAMPLER_REP_PEN:
+                sample_rep_pen(n_ctx, rep_pen_range, rep_pen, rep_pen_slope, presence_penalty, candidates, rep_pen_history);
+                break;
+            default:
+                printf("\nSampleLogits: Unknown Sampler : %d",sampler_order[i]);
+                break;
+        }
+    }
+}
+
 int SampleLogits(const float * logits, int n_ctx, int n_vocab, int rep_pen_range, float rep_pen, float rep_pen_slope, float presence_penalty, float top_k, float top_a, float top_p, float min_p, float typical_p, float tfs, float nsigma, float temp, std::mt19937 & rng,
 int mirostat, float mirostat_tau, float mirostat_eta, float dry_multiplier, float dry_base, int dry_allowed_length, int dry_penalty_last_n, float xtc_threshold, float xtc_probability,
 const std::vector<samplers> & sampler_order, llama_grammar * grammar, float dynatemp_range, float dynatemp_exponent, float smoothing_factor, float smoothing_curve, float adaptive_target)
@@ -1755,36 +2142,66 @@ const std::vector<samplers> & sampler_order, llama_grammar * grammar, float dyna
     // n_ctx, n_vocab, rep_pen_range, rep_pen, rep_pen_slope, presence_penalty, top_k, top_a, top_p, min_p, typical_p, tfs, nsigma, temp, mirostat, mirostat_tau, mirostat_eta, dry_multiplier, dry_base, dry_allowed_length, dry_penalty_last_n, xtc_threshold, xtc_probability, sampler_order.size(), dynatemp_range, dynatemp_exponent, smoothing_factor);
 
     int id = 0;
-    std::vector<llama_token_data> candidates;
-    candidates.reserve(n_vocab);
-    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
-    }
+    sampler_ws.load(logits, n_vocab);
+    float * ws_logits = sampler_ws.logits.data();
 
     for(int i=0;i<logit_biases.size();++i)
     {
         auto & itm = logit_biases[i];
-        candidates[itm.token_id].logit += itm.bias;
+        ws_logits[itm.token_id] += itm.bias;
     }
 
-    llama_token_data_array candidates_p = { candidates.data(), candidates.size(), false };
+    //dry always first as it indexes the logits by token id
+    sample_dry(n_ctx, dry_penalty_last_n, dry_multiplier, dry_base, dry_allowed_length, dry_sequence_breakers, ws_logits);
 
-    //dry always first as logits cannot be resorted
-    sample_dry(n_ctx, dry_penalty_last_n, dry_multiplier, dry_base, dry_allowed_length, dry_sequence_breakers, &candidates_p);
-
-    //prefilter to top 3k tokens for improved speed
+    //prefilter to top 3k tokens for improved speed, straight from the logits
     bool use_grammar = grammar != nullptr;
-    std::vector<llama_token_data> precache = (use_grammar ? std::vector<llama_token_data>(candidates) : std::vector<llama_token_data>(0));
-
-    sample_top_k(&candidates_p, 3000);
-
+    const kcpp_grammar_masker::mask_entry * grammar_mask = nullptr;
     if (use_grammar) {
+        if (grammar_masker.n_vocab != n_vocab)
+        {
+            std::vector<std::string> pieces(n_vocab);
+            for (int i = 0; i < n_vocab; ++i)
+            {
+                pieces[i] = FileFormatTokenizeID(i, file_format);
+            }
+            grammar_masker.build(pieces, GetEogIDs(file_format, n_vocab));
+        }
+        grammar_mask = grammar_masker.get(grammar);
+    }
+    llama_token_data_array candidates_p;
+    if (grammar_mask) {
+        //masked logits go straight into the prefilter, so no candidate ever needs the grammar matcher
+        const int allowed = kcpp_grammar_masker::apply(*grammar_mask, ws_logits, n_vocab);
+        candidates_p = sampler_ws.top_k(std::min(3000, std::max(allowed, 1)));
+        while (candidates_p.size > 0 && candidates_p.data[candidates_p.size - 1].logit == -INFINITY) {
+            --candidates_p.size;
+        }
+    } else {
+        candidates_p = sampler_ws.top_k(3000);
+    }
+
+    if (use_grammar && !grammar_mask) {
+        sample_grammar(file_format, n_vocab, &candidates_p, grammar);
+    }
+    // if top_k 3000 or the mask left no valid candidate for this grammar, try again pre-cull with the regular matcher
+    if (use_grammar && candidates_p.size <= 0) {
+        if (grammar_mask) {
+            //the mask already wrote -inf into the working copy, start over from the raw logits
+            sampler_ws.load(logits, n_vocab);
+            for (const auto & itm : logit_biases) {
+                ws_logits[itm.token_id] += itm.bias;
+            }
+        }
+        candidates_p = sampler_ws.all();
         sample_grammar(file_format, n_vocab, &candidates_p, grammar);
-        // if top_k 3000 doesn't contain a valid candidate for this grammar, try again pre-cull
+        sample_top_k(&candidates_p, 3000);
+        while (candidates_p.size > 0 && candidates_p.data[candidates_p.size - 1].logit == -INFINITY) {
+            --candidates_p.size;
+        }
         if (candidates_p.size <= 0) {
-            candidates_p = { precache.data(), precache.size(), false };
-            sample_grammar(file_format, n_vocab, &candidates_p, grammar);
-            sample_top_k(&candidates_p, 3000);
+            printf("\nWarning: Grammar rejected every token, sampling without it!\n");
+            candidates_p = sampler_ws.top_k(3000);
         }
     }
 
@@ -1805,54 +2222,8 @@ const std::vector<samplers> & sampler_order, llama_grammar * grammar, float dyna
     }
     else
     {
-        for (int i = 0; i < sampler_order.size(); i++)
-        {
-            switch (sampler_order[i])
-            {
-                case KCPP_SAMPLER_TOP_K:
-                    sample_top_k(&candidates_p, top_k);
-                    break;
-                case KCPP_SAMPLER_TOP_A:
-                    sample_top_a(&candidates_p, top_a, 1);
-                    break;
-                case KCPP_SAMPLER_TOP_P:
-                    sample_top_p(&candidates_p, top_p, 1);
-                    sample_min_p(&candidates_p, min_p, 1);
-                    break;
-                case KCPP_SAMPLER_TFS:
-                    sample_tail_free(&candidates_p, tfs, 1);
-                    break;
-                case KCPP_SAMPLER_TYP:
-                    sampler_typical(&candidates_p, typical_p, 1);
-                    break;
-                case KCPP_SAMPLER_TEMP:
-                    if (dynatemp_range!=0)
-                    {
-                        float dynatemp_min = temp - dynatemp_range;
-                        float dynatemp_max = temp + dynatemp_range;
-                        //do not allow negative values
-                        dynatemp_min = dynatemp_min<0?0:dynatemp_min;
-                        dynatemp_max = dynatemp_max<0?0:dynatemp_max;
-                        dynatemp_exponent = dynatemp_exponent<0?0:dynatemp_exponent;
-                        sample_entropy(&candidates_p, dynatemp_min, dynatemp_max, dynatemp_exponent, smoothing_factor, smoothing_curve);
-                    }
-                    else
-                    {
-                        sample_temperature(&candidates_p, temp, smoothing_factor, smoothing_curve);
-                    }
-                    if (nsigma > 0.0f)
-                    {
-                        sample_top_n_sigma(&candidates_p, nsigma);
-                    }
-                    break;
-                case KCPP_SAMPLER_REP_PEN:
-                    sample_rep_pen(n_ctx, rep_pen_range, rep_pen, rep_pen_slope, presence_penalty, &candidates_p);
-                    break;
-                default:
-                    printf("\nSampleLogits: Unknown Sampler : %d",sampler_order[i]);
-                    break;
-            }
-        }
+        ApplySamplerOrder(&candidates_p, n_ctx, rep_pen_range, rep_pen, rep_pen_slope, presence_penalty, top_k, top_a, top_p, min_p, typical_p, tfs, nsigma, temp,
+        sampler_order, dynatemp_range, dynatemp_exponent, smoothing_factor, smoothing_curve, last_n_tokens);
         //xtc always last
         sample_xtc(&candidates_p, xtc_threshold, xtc_probability, rng);
         //adaptive p must be last, it messes up all probs
@@ -1896,6 +2267,7 @@ static void load_grammar(const std::string & gammarstr)
         llama_grammar_free_impl(grammar);
         grammar = nullptr;
     }
+    grammar_masker.set_grammar(nullptr);
 
     if (!gammarstr.empty()) {
         parsed_grammar = llama_grammar_parser();
@@ -1911,6 +2283,7 @@ static void load_grammar(const std::string & gammarstr)
         }
         std::vector<const llama_grammar_element *> grammar_rules(parsed_grammar.c_rules());
         grammar = llama_grammar_init_impl(nullptr,grammar_rules.data(), grammar_rules.size(), parsed_grammar.symbol_ids.at("root"));
+        grammar_masker.set_grammar(grammar);
     }
 }
 
@@ -1969,19 +2342,19 @@ bool FullyContainedPrefix(std::vector<int> &sequence1, std::vector<int> &sequenc
     return true;
 }
 
-//given an old GGUF context and a new context that has some middle portion removed,
-//find and remove the middle portion from the old context from the KV. Does not fast forward after this destructive action
+//find the parts of the old context that survive in the new one and rebuild the KV from them. Does not fast forward after this destructive action
 //returns true if contextshift is doable, executes it if dryrun is false
 bool DoContextShifting(llama_context * ctx, llama_context * draft_ctx, std::vector<int> &current_context_tokens, std::vector<int> &new_context_tokens, const int genamt, const int nctx, bool dryrun)
 {
     //scan from start old and new ctx, until first mismatch found, save as p0
-    //check remaining old and new ctx for longest common subseq, which needs to be at 256 tokens
-    //test: longest common subseq (LCQ) MUST start within 0 tokens from end of memory, otherwise purge fails
-    //if passed, save beginning of LCQ from old ctx as p1
-    //remove all tokens from old ctx between p0 and p1, updating both arrays and kv, then continue as normal
+    //cover the remaining new ctx with back to back runs of the old one, which together need to reach a threshold
+    //old tokens between runs are removed from the kv and the runs are moved back to their new positions.
+    //only deletions are handled: kv computed after inserted tokens never saw them, so the first insertion ends
+    //the runs and everything from there on is processed as normal
 
     const int ShortfallThreshold = 200 + std::min((nctx/30),140); //dont trigger shifting if the distance between trimstart and currhead < this
     const int SlackAllowance = 60 + std::min((nctx/60),70); //in case the end text is slightly modified, be forgiving
+    const int MinRunLength = 64; //shorter runs are cheaper to reprocess than to keep
 
     int trimstart = 0;
     int new_tokens_len = new_context_tokens.size();
@@ -2015,37 +2388,72 @@ bool DoContextShifting(llama_context * ctx, llama_context * draft_ctx, std::vect
     auto curr_ctx_without_memory = std::vector<int>(current_context_tokens.begin() + trimstart, current_context_tokens.end());
     auto new_ctx_without_memory = std::vector<int>(new_context_tokens.begin() + trimstart, new_context_tokens.end());
 
-    auto shared = LongestCommonSubseq(curr_ctx_without_memory, new_ctx_without_memory);
+    std::vector<context_run> runs = plan_deletion_runs(curr_ctx_without_memory, new_ctx_without_memory, MinRunLength);
+    int retained = 0;
+    for (const context_run & run : runs)
+    {
+        retained += run.len;
+    }
+
+    //printf("\nRuns: %d, Retained: %d, LCSTokThreshold: %d\n",(int)runs.size(),retained,LCSTokThreshold);
+    if (runs.size() == 0 || retained <= LCSTokThreshold)
+    {
+        return false;
+    }
+    if (dryrun)
+    {
+        return true;
+    }
 
-    //printf("\nSharedSize: %d, LCSTokThreshold: %d, ArrPass: %d\n",shared.size(),LCSTokThreshold,ArrStartWith(new_ctx_without_memory, shared));
-    if (shared.size() > LCSTokThreshold && ArrStartWith(new_ctx_without_memory, shared)) // enough tokens in common
+    int erased = 0;
+    llama_context * shift_ctxs[2] = {ctx, draft_ctx};
+    for (int c = 0; c < 2; ++c)
     {
-        int found = ArrFindIndexOf(current_context_tokens,shared);
-        if(found>=0 && found > trimstart)
+        if (shift_ctxs[c] == nullptr)
+        {
+            continue;
+        }
+        auto mem = llama_get_memory(shift_ctxs[c]);
+
+        //drop every old token that is not part of a run
+        int cursor = trimstart;
+        erased = 0;
+        for (int r = 0; r < runs.size(); ++r)
         {
-            if(!dryrun)
+            int run_begin = trimstart + runs[r].old_start;
+            if (run_begin > cursor)
             {
-                //extract the unwanted tokens out from context and KV
-                int diff = found - trimstart;
-                llama_memory_seq_rm(llama_get_memory(ctx), 0, trimstart, trimstart + diff);
-                llama_memory_seq_add(llama_get_memory(ctx), 0, trimstart + diff, -1, -diff);
-                if(draft_ctx)
-                {
-                    llama_memory_seq_rm(llama_get_memory(draft_ctx), 0, trimstart, trimstart + diff);
-                    llama_memory_seq_add(llama_get_memory(draft_ctx), 0, trimstart + diff, -1, -diff);
-                }
-                for (size_t i = trimstart + diff; i < current_context_tokens.size() - 1; i++)
-                {
-                    current_context_tokens[i - diff] = current_context_tokens[i];
-                }
-                printf("\n[Context Shifting: Erased %d tokens at position %d]", diff, trimstart + 1);
-                current_context_tokens.resize(current_context_tokens.size() - diff);
+                llama_memory_seq_rm(mem, 0, cursor, run_begin);
+                erased += run_begin - cursor;
+            }
+            cursor = run_begin + runs[r].len;
+        }
+        erased += (int)current_context_tokens.size() - cursor;
+        llama_memory_seq_rm(mem, 0, cursor, -1);
+
+        //the runs are back to back in the new context, so every run only moves back. going from the front,
+        //a run never lands on positions still held by a run that has not moved yet
+        for (int r = 0; r < runs.size(); ++r)
+        {
+            int delta = runs[r].new_start - runs[r].old_start;
+            if (delta < 0)
+            {
+                llama_memory_seq_add(mem, 0, trimstart + runs[r].old_start, trimstart + runs[r].old_start + runs[r].len, delta);
             }
-            return true;
         }
     }
-    return false;
 
+    const context_run & lastrun = runs[runs.size() - 1];
+    current_context_tokens.assign(new_context_tokens.begin(), new_context_tokens.begin() + trimstart + lastrun.new_start + lastrun.len);
+    if (runs.size() == 1)
+    {
+        printf("\n[Context Shifting: Erased %d tokens at position %d]", erased, trimstart + 1);
+    }
+    else
+    {
+        printf("\n[Context Shifting: Kept %d segments, erased %d tokens]", (int)runs.size(), erased);
+    }
+    return true;
 }
 
 //returns true if context shifting is possible. does not execute the shift
@@ -2055,6 +2463,19 @@ bool CanContextShift(std::vector<int> &current_context_tokens, std::vector<int>
 }
 
 
+//wipes the kv of the regular generation path. when batching, other sequences must survive so only seq 0 is removed
+static void ClearMainSequence(llama_context * ctx)
+{
+    if(batch_slot_count>1)
+    {
+        llama_memory_seq_rm(llama_get_memory(ctx), 0, -1, -1);
+    }
+    else
+    {
+        llama_memory_clear(llama_get_memory(ctx),true);
+    }
+}
+
 static int GetBatchSize(int desiredBlasBatchSize,FileFormat in_file_format)
 {
     //check if approved to use BLAS
@@ -2135,10 +2556,14 @@ void kcpp_init_audio_proj(clip_ctx * ctx_a)
     audio_preproc->initialize();
 }
 
+static void batch_engine_start();
+static void batch_engine_shutdown();
+
 ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in_file_format, FileFormatExtraMeta in_file_format_meta)
 {
     is_quiet = inputs.quiet;
     ggml_time_init();
+    batch_engine_shutdown(); //a reload must not leave the old engine thread running on the globals below
     kcpp_data = new kcpp_params(); //allocate on heap to avoid linux segfault. yes this leaks memory.
 
     file_format = in_file_format;
@@ -2157,9 +2582,17 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
     //prepare savestate slots
     savestate_limit = inputs.smartcacheslots;
     savestates.resize(savestate_limit);
+    savestate_tree.clear();
+    savestate_ram_budget = (inputs.smartcache_ram_mb > 0 ? (size_t)inputs.smartcache_ram_mb * 1024 * 1024 : 0);
+    savestate_spill_dir = (inputs.smartcache_dir ? inputs.smartcache_dir : "");
+    savestate_spill_tag = std::to_string((long long)time(NULL));
     if(kcpp_data->smartcache)
     {
         printf("SmartCache: Prepared %d KV slots\n",savestate_limit);
+        if(savestate_ram_budget>0)
+        {
+            printf("SmartCache: RAM budget of %zu MB, %s\n",savestate_ram_budget/(1024*1024),(savestate_spill_dir==""?"older snapshots are compressed then dropped":"older snapshots are compressed then spilled to disk"));
+        }
     }
     kcpp_pipeline_parallelism = inputs.pipelineparallel;
     if(!kcpp_data->use_fastforward && kcpp_data->smartcache)
@@ -2167,10 +2600,20 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
         kcpp_data->smartcache = false;
         printf("\nSmartCache IS DISABLED!\nSmartCache requires Fast Forwarding!\n");
     }
-    kcpp_data->swa_full = !inputs.swa_support;
-    if (!kcpp_data->swa_full) {
-        if (inputs.use_contextshift) {
-            kcpp_data->swa_full = true;  //cannot use SWA
+    batch_slot_count = ((isGguf && inputs.batch_slots>1)?inputs.batch_slots:0);
+    if(batch_slot_count >= LLAMA_MAX_SEQ)
+    {
+        batch_slot_count = LLAMA_MAX_SEQ - 1; //seq 0 is reserved for the regular path
+    }
+    if(batch_slot_count>1 && kcpp_data->smartcache)
+    {
+        kcpp_data->smartcache = false;
+        printf("\nSmartCache IS DISABLED!\nSmartCache cannot be used with Batch Slots!\n");
+    }
+    kcpp_data->swa_full = !inputs.swa_support;
+    if (!kcpp_data->swa_full) {
+        if (inputs.use_contextshift) {
+            kcpp_data->swa_full = true;  //cannot use SWA
             printf("\nSWA Mode IS DISABLED!\nSWA Mode Cannot be used with Context Shifting!\n");
         } else if (inputs.use_fastforward) {
             printf("\nSWA Mode is ENABLED!\nNote that using SWA Mode cannot be used with Context Shifting, and can lead to degraded recall when combined with Fast Forwarding!\n");
@@ -2180,6 +2623,11 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
     }
     debugmode = inputs.debugmode;
     draft_ctx = nullptr;
+    ngram_drafting = false;
+    speculative_accept_rate = 0.6f;
+    ngram_cache_context.clear();
+    ngram_cache_dynamic.clear();
+    ngram_cache_tokens.clear();
     guidance_ctx = nullptr;
     audio_multimodal_supported = false;
     vision_multimodal_supported = false;
@@ -2212,6 +2660,10 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
     = mpt_ctx_v3.hparams.n_ctx = kcpp_data->n_ctx;
 
     vision_max_res = inputs.visionmaxres;
+    media_embd_cache_clear();
+    grammar_masker.reset();
+    prompt_tokenize_cache.clear();
+    media_embd_cache_budget = (inputs.media_cache_mb > 0 ? (size_t)inputs.media_cache_mb * 1024 * 1024 : 0);
 
     //determine rope scaling params
     float rope_freq_scale = 1.0f;
@@ -2649,6 +3101,40 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
         llama_ctx_params.swa_full = kcpp_data->swa_full;
         llama_ctx_params.type_k = (inputs.quant_k>1?GGML_TYPE_Q4_0:(inputs.quant_k==1?GGML_TYPE_Q8_0:GGML_TYPE_F16));
         llama_ctx_params.type_v = (inputs.quant_v>1?GGML_TYPE_Q4_0:(inputs.quant_v==1?GGML_TYPE_Q8_0:GGML_TYPE_F16));
+        kcpp_kv_paged = inputs.kv_paged;
+        kcpp_kv_spill_dir = (inputs.kv_spill_dir ? inputs.kv_spill_dir : "");
+        kcpp_kv_resident_bytes = (kcpp_kv_spill_dir!="" && inputs.kv_resident_mb>0 ? (size_t)inputs.kv_resident_mb*1024*1024 : 0);
+        if(kcpp_kv_paged)
+        {
+            printf("\nPaged KV Cache: CPU KV memory is committed on demand%s.\n",(kcpp_kv_spill_dir!=""?", spilling to a scratch file":""));
+        }
+        kcpp_kv_recent_window = 0;
+        if(inputs.kv_recent>0)
+        {
+            if(kcpp_data->flash_attn && (inputs.quant_k>0 || inputs.quant_v>0))
+            {
+                kcpp_kv_recent_window = std::min(inputs.kv_recent, kcpp_data->n_ctx);
+                printf("\nHybrid KV Cache: The last %d positions are kept in F16, older positions use the quantized KV type.\n",kcpp_kv_recent_window);
+            }
+            else
+            {
+                printf("\nHybrid KV Cache IS DISABLED!\nIt requires Flash Attention and a quantized KV cache.\n");
+            }
+        }
+
+        if(batch_slot_count>1)
+        {
+            if(use_mrope || llama_model_is_recurrent(llamamodel) || llama_model_is_hybrid(llamamodel))
+            {
+                printf("\nBatch Slots IS DISABLED!\nBatch Slots cannot be used with recurrent or MRope models!\n");
+                batch_slot_count = 0;
+            }
+            else
+            {
+                llama_ctx_params.n_seq_max = batch_slot_count + 1;
+                printf("\nBatch Slots: %d concurrent sequences will share the %d token context\n",batch_slot_count,(int)llama_ctx_params.n_ctx);
+            }
+        }
 
         llama_ctx_v4 = llama_init_from_model(llamamodel, llama_ctx_params);
         if(load_guidance)
@@ -2786,6 +3272,19 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
                 speculative_decoding_setup(draftmodel_filename, model_params, llama_ctx_params, n_vocab, inputs.draft_gpusplit, inputs.draft_gpulayers);
             }
         }
+        if(inputs.ngram_draft && draft_ctx==nullptr && file_format==FileFormat::GGUF_GENERIC)
+        {
+            if(llama_model_is_recurrent(llamamodel) || llama_model_is_hybrid(llamamodel))
+            {
+                printf("Error: N-Gram drafting cannot be used with Recurrent models!\n");
+            }
+            else
+            {
+                printf("\nN-Gram drafting enabled, up to %d tokens will be drafted from the context without a draft model.\n",inputs.draft_amount);
+                speculative_chunk_amt = inputs.draft_amount;
+                ngram_drafting = true;
+            }
+        }
 
         //we cannot really trust the add bos in vocab. old models don't set it.
         // instead, we EXPLICITY need to find the add_bos_token key==false to automatically set it off.
@@ -2821,6 +3320,11 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
         {
             printf("\nModel Warmup Failed! (code:%d)\n",er);
         }
+        if(batch_slot_count>1)
+        {
+            llama_memory_clear(llama_get_memory(llama_ctx_v4),true);
+            batch_engine_start();
+        }
         return ModelLoadResult::SUCCESS;
     }
     else if (file_format == FileFormat::RWKV_1 || file_format==FileFormat::RWKV_2)
@@ -3278,6 +3782,23 @@ const std::string & gpttype_get_pending_output()
     return concat_output_reader_copy_poll;
 }
 
+void gpttype_token_stream_open()
+{
+    token_stream.open();
+}
+void gpttype_token_stream_close()
+{
+    token_stream.close();
+}
+int gpttype_token_stream_wait(int timeout_ms)
+{
+    return token_stream.wait(timeout_ms);
+}
+bool gpttype_token_stream_pop(token_stream_record & out)
+{
+    return token_stream.pop(out);
+}
+
 const std::vector<TopPicksData> gpttype_get_top_picks_data()
 {
     return top_picks_history;
@@ -3308,7 +3829,39 @@ int GetThreadsToUse(bool blasmode)
     return kcpp_data->n_threads;
 }
 
+//releases the oldest held back token to the pollers and the sse stream
+static void FlushDelayedToken()
+{
+    generated_tokens.push_back(delayed_generated_tokens[0]);
+    if(batch_legacy_rec)
+    {
+        //stream readers never touch generated_tokens, they read this copy under the record lock
+        std::lock_guard<std::mutex> lock(batch_legacy_rec->mtx);
+        batch_legacy_rec->tokens.push_back(generated_tokens.back());
+        batch_legacy_rec->cv.notify_all();
+    }
+    concat_output_mtx.lock();
+    concat_output += delayed_generated_tokens[0];
+    concat_output_mtx.unlock();
+    if(stop_sequence_hit<0)
+    {
+        //stop sequences are only checked against released text, same as concat_output
+        stop_sequence_hit = stop_sequence_matcher.feed(delayed_generated_tokens[0]);
+    }
+    delayed_generated_tokens.pop_front();
+    if(delayed_stream_records.size()>0)
+    {
+        token_stream.push(std::move(delayed_stream_records[0]));
+        delayed_stream_records.pop_front();
+    }
+    if(delayed_banned_states.size()>0)
+    {
+        delayed_banned_states.pop_front();
+    }
+}
+
 //this function prepares the clip embds for llava. it's only needed when images change
+//embeddings come from the media embd cache when the same media was seen before
 static void PrepareMediaEmbds(const int nctx, const std::vector<int> & media_intro)
 {
     bool vision_on = (clp_ctx_v != nullptr && clp_img_data != nullptr);
@@ -3316,56 +3869,70 @@ static void PrepareMediaEmbds(const int nctx, const std::vector<int> & media_int
     if (vision_on || audio_on)
     {
         int introsize = media_intro.size();
+        const size_t embd_row_bytes = llama_model_n_embd_inp(llama_get_model(llama_ctx_v4)) * sizeof(float);
         last_media_mem.clear();
+        ++media_embd_cache_clock;
 
         for(int i=0;i<media_objects.size();++i)
         {
             std::string media_obj = media_objects[i].b64data;
             const std::vector<uint8_t> media_data_buffer = kcpp_base64_decode(media_obj);
-            if(!media_objects[i].is_audio && vision_on)
+            media_objects[i].hash = media_content_hash(media_data_buffer);
+            media_objects[i].token_id = MEDIA_TOKEN_IDENTIFIER_MAX - 1 - (int)((media_objects[i].hash + media_identifier_salt * 0x9E3779B97F4A7C15ULL) % MEDIA_TOKEN_IDENTIFIER_RANGE);
+            media_objects[i].token_count = 0;
+            media_objects[i].mediachunks.clear();
+            const bool is_audio = media_objects[i].is_audio;
+            if((!is_audio && !vision_on) || (is_audio && !audio_on))
+            {
+                printf("\nUnhandled media object, something went wrong.\n");
+                continue;
+            }
+
+            int cached = media_embd_cache_find(media_objects[i].hash, is_audio);
+            if(cached>=0)
+            {
+                if(debugmode==1 && !is_quiet)
+                {
+                    printf("\nReusing cached %s embed for media %d",(is_audio?"audio":"vision"),i);
+                }
+            }
+            else if(!is_audio)
             {
                 //images
+                media_embd_cache_entry entry;
+                entry.hash = media_objects[i].hash;
+                entry.is_audio = false;
+                entry.last_used = media_embd_cache_clock;
                 if (!clip_image_load_from_bytes(media_data_buffer.data(), media_data_buffer.size(), clp_img_data, vision_max_res))
                 {
                     //failed to load image
                     printf("\nError: Clip image %d failed to load!",i);
+                    continue;
                 }
-                else
+                if(debugmode==1 && !is_quiet)
                 {
-                    if(debugmode==1 && !is_quiet)
-                    {
-                        printf("\nCreating clip image embed...");
-                    }
-                    media_chunk chunk;
-                    if (!llava_image_embed_make_with_clip_img(clp_ctx_v, kcpp_data->n_threads, clp_img_data, &chunk.clp_img_embd, &chunk.clp_image_tokens, &chunk.nx, &chunk.ny)) {
-                        printf("\nError: Clip image %d failed to create embd!",i);
-                    }
-                    if(debugmode==1 && !is_quiet)
-                    {
-                        printf("\nVision Clip Embed %i used Tokens: %d",i,chunk.clp_image_tokens);
-                    }
-                    int cliptokensneeded = chunk.clp_image_tokens;
-                    if(cliptokensneeded>0 && cliptokensneeded < nctx)
-                    {
-                        int tokcnt = (chunk.clp_image_tokens + media_objects[i].chunk_start_seq.size() + media_objects[i].chunk_end_seq.size());
-                        if(i==0)
-                        {
-                            tokcnt += introsize;
-                        }
-                        for(int n=0;n<tokcnt;++n)
-                        {
-                            last_media_mem.push_back(current_media_identifier);
-                        }
-                    }
-                    else
-                    {
-                        media_composite_image_signature = ""; //force invalidate
-                        printf("\nWarning: Vision Image excluded - Context size too low or not enough clip tokens! (needed %d)\nImage will be IGNORED! You probably want to relaunch with a larger context size!\n",cliptokensneeded);
-                    }
-                    media_objects[i].mediachunks.push_back(chunk);
+                    printf("\nCreating clip image embed...");
                 }
-            } else if(media_objects[i].is_audio && audio_on) {
+                media_chunk chunk;
+                if (!llava_image_embed_make_with_clip_img(clp_ctx_v, kcpp_data->n_threads, clp_img_data, &chunk.clp_img_embd, &chunk.clp_image_tokens, &chunk.nx, &chunk.ny)) {
+                    printf("\nError: Clip image %d failed to create embd!",i);
+                    media_composite_image_signature = ""; //force invalidate
+                    continue;
+                }
+                if(debugmode==1 && !is_quiet)
+                {
+                    printf("\nVision Clip Embed %i used Tokens: %d",i,chunk.clp_image_tokens);
+                }
+                entry.bytes = chunk.clp_image_tokens * embd_row_bytes;
+                entry.mediachunks.push_back(chunk);
+                media_embd_cache.push_back(entry);
+                cached = media_embd_cache.size()-1;
+            } else {
                 //  audio
+                media_embd_cache_entry entry;
+                entry.hash = media_objects[i].hash;
+                entry.is_audio = true;
+                entry.last_used = media_embd_cache_clock;
                 std::vector<float> pcmf32;
                 int samplerate = clip_get_hparams(clp_ctx_a)->audio_sample_rate;
                 bool ok = kcpp_decode_audio_from_buf(media_data_buffer.data(), media_data_buffer.size(), samplerate, pcmf32);
@@ -3381,7 +3948,6 @@ static void PrepareMediaEmbds(const int nctx, const std::vector<int> & media_int
                 }
 
                 // consider each mel_spec as a separate audio chunk
-                int total_chunk_tokens = 0;
                 for (auto & mel_spec : mel_spec_chunks) {
                     media_chunk chunk;
                     bool ok = audio_embd_make_with_clip_img(clp_ctx_a, kcpp_data->n_threads, mel_spec, &chunk.clp_img_embd, &chunk.clp_image_tokens);
@@ -3392,33 +3958,41 @@ static void PrepareMediaEmbds(const int nctx, const std::vector<int> & media_int
                         {
                             printf("\nAudio Clip %i Embed Chunk used Tokens: %d",i,chunk.clp_image_tokens);
                         }
-                        total_chunk_tokens += chunk.clp_image_tokens;
-                        media_objects[i].mediachunks.push_back(chunk);
+                        entry.bytes += chunk.clp_image_tokens * embd_row_bytes;
+                        entry.mediachunks.push_back(chunk);
                     }
                 }
-                int cliptokensneeded = total_chunk_tokens;
-                if(cliptokensneeded>0 && cliptokensneeded < nctx)
+                media_embd_cache.push_back(entry);
+                cached = media_embd_cache.size()-1;
+            }
+
+            //borrow the cached embeddings, then reserve one placeholder per context position
+            media_objects[i].mediachunks = media_embd_cache[cached].mediachunks;
+            int cliptokensneeded = 0;
+            for(int j=0;j<media_objects[i].mediachunks.size();++j)
+            {
+                cliptokensneeded += media_objects[i].mediachunks[j].clp_image_tokens;
+            }
+            if(cliptokensneeded>0 && cliptokensneeded < nctx)
+            {
+                int tokcnt = (cliptokensneeded + media_objects[i].chunk_start_seq.size() + media_objects[i].chunk_end_seq.size());
+                if(i==0)
                 {
-                    int tokcnt = (cliptokensneeded + media_objects[i].chunk_start_seq.size() + media_objects[i].chunk_end_seq.size());
-                    if(i==0)
-                    {
-                        tokcnt += introsize;
-                    }
-                    for(int n=0;n<tokcnt;++n)
-                    {
-                        last_media_mem.push_back(current_media_identifier);
-                    }
+                    tokcnt += introsize;
                 }
-                else
+                for(int n=0;n<tokcnt;++n)
                 {
-                    media_composite_image_signature = ""; //force invalidate
-                    printf("\nWarning: Audio Embd excluded - Context size too low or not enough clip tokens! (needed %d)\nAudio will be IGNORED! You probably want to relaunch with a larger context size!\n",cliptokensneeded);
+                    last_media_mem.push_back(media_objects[i].token_id);
                 }
-
-            }else{
-                printf("\nUnhandled media object, something went wrong.\n");
+                media_objects[i].token_count = tokcnt;
+            }
+            else
+            {
+                media_composite_image_signature = ""; //force invalidate
+                printf("\nWarning: %s excluded - Context size too low or not enough clip tokens! (needed %d)\n%s will be IGNORED! You probably want to relaunch with a larger context size!\n",(is_audio?"Audio Embd":"Vision Image"),cliptokensneeded,(is_audio?"Audio":"Image"));
             }
         }
+        media_embd_cache_trim();
     }
 }
 
@@ -3438,6 +4012,22 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
         return output;
     }
 
+    //batch slots share the same llama context, so wait for the current batch step and hold them off until done
+    std::unique_lock<std::mutex> batch_ctx_lock(batch_ctx_mtx, std::defer_lock);
+    if(batch_slot_count>1)
+    {
+        {
+            std::lock_guard<std::mutex> lock(batch_queue_mtx);
+            ++batch_legacy_waiting;
+        }
+        batch_ctx_lock.lock();
+        {
+            std::lock_guard<std::mutex> lock(batch_queue_mtx);
+            --batch_legacy_waiting;
+        }
+        batch_queue_cv.notify_all();
+    }
+
     if(debugmode==1 && file_format == FileFormat::GGUF_GENERIC)
     {
         llama_perf_context_reset(llama_ctx_v4);
@@ -3447,6 +4037,9 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
     generation_finished = false; // Set current generation status
     generated_tokens.clear(); // New Generation, new tokens
     delayed_generated_tokens.clear();
+    delayed_stream_records.clear();
+    delayed_banned_states.clear();
+    stop_sequence_hit = -1;
 
     concat_output_mtx.lock();
     concat_output = "";
@@ -3489,6 +4082,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
             }
         }
     }
+    stop_sequence_matcher.build(stop_sequence, false);
 
     //handle custom token bans and antislop phrase banning
     banned_phrases.clear();
@@ -3560,6 +4154,8 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
         }
     }
 
+    banned_phrase_matcher.build(banned_phrases, true);
+
     if(debugmode==1 && !is_quiet && banned_phrases.size()>0)
     {
         printf("\nBanned a total of %zu phrases, with max token count of %d.\n",banned_phrases.size(),delayed_generated_tokens_limit);
@@ -3579,22 +4175,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
     std::string addedmemory = inputs.memory;
     std::string negative_prompt = inputs.negative_prompt;
 
-    //clear previous run llava embd memory, just-in-time free
-    for(int i=0;i<media_objects.size();++i)
-    {
-        if(media_objects[i].b64data!="")
-        {
-            for(int j=0;j<media_objects[i].mediachunks.size();++j)
-            {
-                 if(media_objects[i].mediachunks[j].clp_img_embd!=nullptr)
-                 {
-                    free(media_objects[i].mediachunks[j].clp_img_embd);
-                    media_objects[i].mediachunks[j].clp_img_embd = nullptr;
-                 }
-            }
-            media_objects[i].mediachunks.clear();
-        }
-    }
+    //clear previous run media list, the embeddings themselves stay in the media embd cache
     media_objects.clear();
     std::string new_media_composite = "";
     for(int x=0;x<images_max;++x)
@@ -3660,8 +4241,11 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
     }
     if(media_composite_image_signature!=new_media_composite)
     {
-        //images have changed. swap identifiers to force reprocessing
-        current_media_identifier = (current_media_identifier==MEDIA_TOKEN_IDENTIFIER_A?MEDIA_TOKEN_IDENTIFIER_B:MEDIA_TOKEN_IDENTIFIER_A);
+        //media has changed. placeholders are per object, so kv stays valid up to the first changed object
+        if(media_composite_image_signature=="")
+        {
+            ++media_identifier_salt; //nothing from before can be trusted after a forced invalidate
+        }
         media_composite_image_signature = new_media_composite;
         if(debugmode==1 && !is_quiet)
         {
@@ -3865,7 +4449,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
 
     int32_t nctx = kcpp_data->n_ctx;
 
-    TokenizeString(kcpp_data->prompt, embd_inp, file_format, add_bos_token);
+    TokenizeStringCached(kcpp_data->prompt, embd_inp, file_format, add_bos_token);
     TokenizeString("\nAttached Media:\n", media_intro, file_format, false);
 
     if(media_composite_image_signature=="")
@@ -3880,7 +4464,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
 
     if(addedmemory!="")
     {
-        TokenizeString(addedmemory, embd_inp_mem, file_format, add_bos_token);
+        TokenizeStringCached(addedmemory, embd_inp_mem, file_format, add_bos_token);
     }
 
     //truncate to front of the prompt if its too long
@@ -3941,7 +4525,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
         //prepare negative prompt
         if(negative_prompt!="" && inputs.guidance_scale!=1.0f)
         {
-            TokenizeString(negative_prompt+"\n", negprompt_tokens, file_format, add_bos_token);
+            TokenizeStringCached(negative_prompt+"\n", negprompt_tokens, file_format, add_bos_token);
         }
     }
 
@@ -4060,14 +4644,16 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                 int bestslot = -1;
                 int bestlen = 0;
                 int identical_slot = get_identical_existing_slot(); //see if the slot already exists
+                std::vector<int> slot_lcp(savestate_limit);
+                savestate_tree.match(embd_inp, slot_lcp);
                 for(int i=0;i<savestate_limit;++i)
                 {
-                    bool target_usable = FullyContainedPrefix(savestates[i].savestate_context_tokens,embd_inp);
+                    int target_len = savestates[i].savestate_context_tokens.size();
+                    bool target_usable = (target_len>0 && slot_lcp[i]==target_len); //slot is fully contained in the prompt
                     if(savestates[i].media_signature!=media_composite_image_signature)
                     {
                         target_usable = false;
                     }
-                    int target_len = savestates[i].savestate_context_tokens.size();
                     if(target_usable && target_len>bestlen)
                     {
                         bestlen = target_len;
@@ -4130,9 +4716,12 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                 // Slot loading and saving completely reuses gpttype_load_state_kv and gpttype_save_state_kv, nothing else is needed.
                 bool foundswap = false;
                 int identical_slot = get_identical_existing_slot(); //see if a slot already exists with identical data to current
+                std::vector<int> slot_lcp(savestate_limit);
+                savestate_tree.match(embd_inp, slot_lcp); //one walk of the prompt gives the prefix match of every slot
                 for(int i=0;i<savestate_limit;++i)
                 {
-                    float similaritybeat = ComputePrefixMatchPercent(savestates[i].savestate_context_tokens,embd_inp);
+                    size_t min_length = std::min(savestates[i].savestate_context_tokens.size(), embd_inp.size());
+                    float similaritybeat = (min_length==0 ? 0.0f : (float)slot_lcp[i] / (float)min_length);
                     if(savestates[i].media_signature!=media_composite_image_signature)
                     {
                         continue;
@@ -4257,7 +4846,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
         {
             if(n_past==0) //force full clear
             {
-                llama_memory_clear(llama_get_memory(llama_ctx_v4),true);
+                ClearMainSequence(llama_ctx_v4);
             }
             else
             {
@@ -4403,7 +4992,12 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                     }
                     guidance_n_past += 1;
                 }
-                if(embd.size()!=1 || draft_ctx==nullptr || remaining_tokens<=speculative_chunk_amt || grammar!=nullptr || startedsampling==false) //for large batch, or if no draft model, PP/TG as usual
+                std::vector<int> ngram_drafted; //only filled if ngram drafting found a continuation
+                if(ngram_drafting && embd.size()==1 && remaining_tokens>speculative_chunk_amt && grammar==nullptr && startedsampling)
+                {
+                    ngram_drafted = ngram_draft_tokens(current_context_tokens, embd[0], speculative_draft_length());
+                }
+                if(embd.size()!=1 || (draft_ctx==nullptr && ngram_drafted.size()<=1) || remaining_tokens<=speculative_chunk_amt || grammar!=nullptr || startedsampling==false) //for large batch, or if nothing drafted, PP/TG as usual
                 {
                     draft_used = false;
                     kcpp_embd_batch batch = kcpp_embd_batch(embd, n_past, use_mrope, false);
@@ -4438,12 +5032,25 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                     }
                 } else { //individual tokens AND speculative is used (generation)
                     draft_used = true;
-                    draft_results = speculative_decoding_eval_chunk(draft_ctx, llama_ctx_v4, embd, n_vocab, n_past);
+                    if(draft_ctx)
+                    {
+                        draft_results = speculative_decoding_eval_chunk(draft_ctx, llama_ctx_v4, embd, n_vocab, n_past, speculative_draft_length(), kcpp_data->temp, rng);
+                    }
+                    else
+                    {
+                        //lookups are deterministic, so each drafted token was proposed with certainty
+                        std::vector<std::vector<std::pair<int32_t,float>>> ngram_probs;
+                        for(int i=1;i<ngram_drafted.size();++i)
+                        {
+                            ngram_probs.push_back({{ngram_drafted[i], 1.0f}});
+                        }
+                        draft_results = speculative_verify_chunk(llama_ctx_v4, ngram_drafted, ngram_probs, n_past);
+                    }
                     evalres = draft_results.draft_success;
                     if(debugmode==1 && !is_quiet)
                     {
                         std::string draftedtoks = get_tok_vec_str(draft_results.draftids);
-                        printf("\nDrafted %d Tokens: [%s]\n",speculative_chunk_amt,draftedtoks.c_str());
+                        printf("\nDrafted %d Tokens: [%s]\n",draft_results.drafted_amount,draftedtoks.c_str());
                     }
                 }
             }
@@ -4585,6 +5192,8 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
             int logits_to_sample = 1;
             int logits_sampled = 0;
             bool abort_draft = false;
+            const int chunk_successes_before = draft_successes;
+            const int chunk_failures_before = draft_failures;
             if(draft_used)
             {
                 logits_to_sample = draft_results.drafted_amount;
@@ -4625,16 +5234,17 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                     lowestLogit = LowestLogit(logits);
                 }
 
-                //if adaptive p sampling is used, we need to cache the original probabilities
-                std::vector<llama_token_data> original_candidates;
+                //if adaptive p sampling is used, we need the original probability of whatever gets picked.
+                //keep the raw logits and the softmax normalizer instead of a softmaxed candidate list
+                float adaptive_max_logit = 0.0f;
+                float adaptive_sum_exp = 0.0f;
                 if(adaptive_target > 0.0f)
                 {
-                    original_candidates.reserve(n_vocab);
-                    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-                        original_candidates.emplace_back(llama_token_data{token_id, logitsPtr[token_id], 0.0f});
+                    adaptive_original_logits.assign(logitsPtr, logitsPtr + n_vocab);
+                    adaptive_max_logit = *std::max_element(logitsPtr, logitsPtr + n_vocab);
+                    for (int i = 0; i < n_vocab; ++i) {
+                        adaptive_sum_exp += expf(logitsPtr[i] - adaptive_max_logit);
                     }
-                    llama_token_data_array original_candidates_p = { original_candidates.data(), original_candidates.size(), false };
-                    sample_softmax(&original_candidates_p,false);
                 }
 
                 if(file_format == FileFormat::GGUF_GENERIC && guidance_ctx && negprompt_tokens.size()>0 && inputs.guidance_scale!=1.0f)
@@ -4676,15 +5286,23 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                     }
                 }
 
+                if(draft_used)
+                {
+                    //verify by rejection sampling against the draft distribution instead of requiring an exact match
+                    speculative_verify_probs = &draft_results.draft_probs[logits_sampled];
+                    speculative_verify_id = draft_results.draftids[logits_sampled];
+                }
                 id = SampleLogits(logitsPtr, nctx, n_vocab, last_n_size, repeat_penalty, kcpp_data->rep_pen_slope, presence_penalty,
                 top_k, top_a, top_p, min_p, typical_p, tfs_z, nsigma, temp, rng,
                 kcpp_data->mirostat, kcpp_data->mirostat_tau, kcpp_data->mirostat_eta,
                 kcpp_data->dry_multiplier, kcpp_data->dry_base,
                 kcpp_data->dry_allowed_length, kcpp_data->dry_penalty_last_n, kcpp_data->xtc_threshold, kcpp_data->xtc_probability,
                 sampler_order, grammar, dynatemp_range, dynatemp_exponent, smoothing_factor, smoothing_curve, adaptive_target);
+                speculative_verify_probs = nullptr;
+                speculative_verify_id = -1;
 
                 if (adaptive_target > 0.0f) {
-                    float original_prob = original_candidates[id].p;
+                    float original_prob = (adaptive_sum_exp > 0.0f ? expf(adaptive_original_logits[id] - adaptive_max_logit) / adaptive_sum_exp : 0.0f);
                     adaptive_p_update_history(original_prob, adaptive_p_weighted_sum, adaptive_p_total_weight, adaptive_decay);
                 }
 
@@ -4733,14 +5351,17 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                         tokenizedstr = ""; //prevent render
                     }
 
+                    token_stream_record streamrec;
+                    streamrec.text = tokenizedstr;
+                    streamrec.id = eid;
+                    streamrec.logprob = (top_picks_history.size()>0?top_picks_history[top_picks_history.size()-1].selected_logprob:0.0f);
+                    streamrec.timestamp_us = ggml_time_us();
                     delayed_generated_tokens.push_back(tokenizedstr);
+                    delayed_stream_records.push_back(std::move(streamrec));
+                    delayed_banned_states.push_back(banned_phrase_matcher.get_state());
                     while(delayed_generated_tokens.size() > delayed_generated_tokens_limit && delayed_generated_tokens.size() > 0)
                     {
-                        generated_tokens.push_back(delayed_generated_tokens[0]);
-                        concat_output_mtx.lock();
-                        concat_output += delayed_generated_tokens[0];
-                        concat_output_mtx.unlock();
-                        delayed_generated_tokens.pop_front();
+                        FlushDelayedToken();
                     }
                 }
 
@@ -4771,57 +5392,51 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                     printf("]\n");
                 }
 
-                //anti slop detection
-                if (banned_phrases.size() > 0)
+                //anti slop detection, only the newest token is fed to the matcher
+                if (banned_phrases.size() > 0 && delayed_generated_tokens.size() > 0)
                 {
-                    std::string scanstr = "";
-                    for (int i = 0; i < delayed_generated_tokens.size(); ++i)
-                    {
-                        scanstr += delayed_generated_tokens[i];
-                    }
-                    scanstr = toLowerCase(scanstr);
-                    for (const auto &matched : banned_phrases)
+                    size_t match_end = 0;
+                    int hit = banned_phrase_matcher.feed(delayed_generated_tokens.back(), &match_end);
+                    if (hit >= 0)
                     {
-                        std::string matched_lower = toLowerCase(matched);
-                        if (scanstr.find(matched_lower) != std::string::npos)
+                        const std::string &matched = banned_phrases[hit];
+                        //find how many held back tokens are needed to cover the whole phrase
+                        int rewind_amt = 1;
+                        int remaining = (int)matched.size() - (int)match_end;
+                        for (int i = (int)delayed_generated_tokens.size() - 2; i >= 0 && remaining > 0; --i)
                         {
-                            //find the position in the string that contains all necessary tokens
-                            std::string checkstr = "";
-                            int rewind_amt = 0;
-                            for (int i = delayed_generated_tokens.size() - 1; i >= 0; --i)
-                            {
-                                checkstr = delayed_generated_tokens[i] + checkstr;
-                                ++rewind_amt;
-                                if (toLowerCase(checkstr).find(matched_lower) != std::string::npos)
-                                {
-                                    break;
-                                }
+                            remaining -= delayed_generated_tokens[i].size();
+                            ++rewind_amt;
+                        }
+                        if (remaining > 0) //phrase began in text that was already released, cannot rewind that far
+                        {
+                            rewind_amt = 0;
+                        }
+                        if (rewind_amt > 0 && (current_context_tokens.size() - rewind_amt) > 0)
+                        {
+                            int last_tok = current_context_tokens[current_context_tokens.size() - rewind_amt];
+                            banned_phrase_matcher.set_state(delayed_banned_states[delayed_banned_states.size() - rewind_amt]);
+                            delayed_generated_tokens.resize(delayed_generated_tokens.size() - rewind_amt);
+                            delayed_stream_records.resize(delayed_generated_tokens.size());
+                            delayed_banned_states.resize(delayed_generated_tokens.size());
+                            ContextRewind(embd, current_context_tokens, n_past, last_n_tokens, rewind_amt);
+
+                            //immediately terminate drafting if used
+                            abort_draft = true;
+
+                            // Check if the key exists
+                            int banindex = n_past+1;
+                            if (antislop_banned_token_ids.find(banindex) == antislop_banned_token_ids.end()) {
+                                antislop_banned_token_ids[banindex] = std::vector<int>();
                             }
-                            if (rewind_amt > 0 && (current_context_tokens.size() - rewind_amt) > 0)
-                            {
-                                int last_tok = current_context_tokens[current_context_tokens.size() - rewind_amt];
-                                delayed_generated_tokens.resize(delayed_generated_tokens.size() - rewind_amt);
-                                ContextRewind(embd, current_context_tokens, n_past, last_n_tokens, rewind_amt);
-
-                                //immediately terminate drafting if used
-                                abort_draft = true;
-
-                                // Check if the key exists
-                                int banindex = n_past+1;
-                                if (antislop_banned_token_ids.find(banindex) == antislop_banned_token_ids.end()) {
-                                    antislop_banned_token_ids[banindex] = std::vector<int>();
-                                }
-                                std::vector<int>& current_ids = antislop_banned_token_ids[banindex];
-                                current_ids.push_back(last_tok);
-
-                                if (allow_regular_prints && debugmode == 1)
-                                {
-                                    auto match_clean = matched;
-                                    replace_all(match_clean, "\n", "\\n");
-                                    printf("\n(Banned Phrase Detected: %s - Add ID %d to banlist at index %d, and rewinding %d tokens)\n", match_clean.c_str(), last_tok, banindex, rewind_amt);
-                                }
+                            std::vector<int>& current_ids = antislop_banned_token_ids[banindex];
+                            current_ids.push_back(last_tok);
 
-                                break;
+                            if (allow_regular_prints && debugmode == 1)
+                            {
+                                auto match_clean = matched;
+                                replace_all(match_clean, "\n", "\\n");
+                                printf("\n(Banned Phrase Detected: %s - Add ID %d to banlist at index %d, and rewinding %d tokens)\n", match_clean.c_str(), last_tok, banindex, rewind_amt);
                             }
                         }
                     }
@@ -4858,23 +5473,16 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                     }
                 }
 
-                if(!early_abort)
+                if(!early_abort && stop_sequence_hit >= 0)
                 {
-                    for (const auto &matched : stop_sequence)
+                    early_abort = true;
+                    if(allow_regular_prints)
                     {
-                        if (concat_output.find(matched) != std::string::npos)
-                        {
-                            early_abort = true;
-                            if(allow_regular_prints)
-                            {
-                                auto match_clean = matched;
-                                replace_all(match_clean, "\n", "\\n");
-                                printf("\n(Stop sequence triggered: %s)", match_clean.c_str());
-                            }
-                            last_stop_reason = stop_reason::CUSTOM_STOPPER;
-                            break;
-                        }
+                        auto match_clean = stop_sequence[stop_sequence_hit];
+                        replace_all(match_clean, "\n", "\\n");
+                        printf("\n(Stop sequence triggered: %s)", match_clean.c_str());
                     }
+                    last_stop_reason = stop_reason::CUSTOM_STOPPER;
                 }
 
                 logits_sampled += 1;
@@ -4883,6 +5491,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
             //if we have somehow skipped ahead (e.g drafting), ensure that all tokens after npast are purged
             if (file_format == FileFormat::GGUF_GENERIC && draft_used)
             {
+                speculative_update_accept_rate(draft_successes - chunk_successes_before, draft_failures > chunk_failures_before);
                 llama_memory_seq_rm(llama_get_memory(llama_ctx_v4), 0, n_past, -1);
                 if (draft_ctx) {
                     llama_memory_seq_rm(llama_get_memory(draft_ctx), 0, n_past, -1);
@@ -4897,7 +5506,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
             while ((int)embd_inp.size() > input_consumed)
             {
                 int currtoken = embd_inp[input_consumed];
-                if(currtoken==MEDIA_TOKEN_IDENTIFIER_A || currtoken==MEDIA_TOKEN_IDENTIFIER_B) //special llava token hit
+                if(is_media_token(currtoken)) //special llava token hit
                 {
                     if(!media_embds_built) //this should never happen! however, handle it anyway
                     {
@@ -4917,19 +5526,49 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                         int llavatokenscounted = 0;
                         int llavatokensevaled = 0;
                         int introsize = media_intro.size();
-                        while(input_consumed < embd_inp.size() && (embd_inp[input_consumed]==MEDIA_TOKEN_IDENTIFIER_A || embd_inp[input_consumed]==MEDIA_TOKEN_IDENTIFIER_B))
+
+                        //fast forward may have kept the leading media objects, resume at the first one missing from the kv
+                        int media_in_kv = 0;
+                        for(int k=(int)current_context_tokens.size()-1;k>=0 && is_media_token(current_context_tokens[k]);--k)
+                        {
+                            ++media_in_kv;
+                        }
+                        int first_media = 0;
+                        int media_kept = 0;
+                        while(first_media < media_objects.size() && media_kept + media_objects[first_media].token_count <= media_in_kv)
+                        {
+                            media_kept += media_objects[first_media].token_count;
+                            ++first_media;
+                        }
+                        if(media_in_kv > media_kept) //stopped partway into an object, redo all of it
+                        {
+                            int redo = media_in_kv - media_kept;
+                            n_past -= redo;
+                            llama_memory_seq_rm(llama_get_memory(llama_ctx_v4), 0, n_past, -1);
+                            llavatokenscounted += redo;
+                        }
+                        if(first_media > 0 && debugmode==1 && !is_quiet)
+                        {
+                            printf("\nReusing KV of %d unchanged media objects (%d tokens)",first_media,media_kept);
+                        }
+
+                        while(input_consumed < embd_inp.size() && is_media_token(embd_inp[input_consumed]))
                         {
                             if (!last_n_tokens.empty())
                             {
                                 last_n_tokens.erase(last_n_tokens.begin());
                             }
-                            last_n_tokens.push_back(currtoken);
-                            current_context_tokens.push_back(currtoken);
+                            last_n_tokens.push_back(embd_inp[input_consumed]);
+                            current_context_tokens.push_back(embd_inp[input_consumed]);
                             ++input_consumed;
                             ++llavatokenscounted;
                         }
-                        for(int i=0;i<media_objects.size();++i)
+                        for(int i=first_media;i<media_objects.size();++i)
                         {
+                            if(media_objects[i].token_count==0)
+                            {
+                                continue; //excluded, has no placeholders in the context
+                            }
                             //note: no handling for draft_ctx as we don't support vision for it
                             if(introsize>0 && i==0)
                             {
@@ -5043,11 +5682,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
     //flush any remaining delayed tokens
     while(delayed_generated_tokens.size() > 0)
     {
-        generated_tokens.push_back(delayed_generated_tokens[0]);
-        concat_output_mtx.lock();
-        concat_output += delayed_generated_tokens[0];
-        concat_output_mtx.unlock();
-        delayed_generated_tokens.pop_front();
+        FlushDelayedToken();
     }
 
     //if running rnn model in smartcache mode, save progress after each gen
@@ -5104,14 +5739,25 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
     output.prompt_tokens = (finaltokcount<0?0:finaltokcount);
     output.completion_tokens = realnpredict;
     output.stopreason = last_stop_reason;
-    last_eval_time = pt2;
-    last_process_time = pt1;
-    last_token_count = realnpredict;
-    last_input_count = (finaltokcount<0?0:finaltokcount);
-    last_seed = kcpp_data->seed;
-    last_draft_failed = draft_failures;
-    last_draft_success = draft_successes;
-    total_gens += 1;
+    {
+        std::lock_guard<std::mutex> lock(last_stats_mtx);
+        last_eval_time = pt2;
+        last_process_time = pt1;
+        last_token_count = realnpredict;
+        last_input_count = (finaltokcount<0?0:finaltokcount);
+        last_seed = kcpp_data->seed;
+        last_draft_failed = draft_failures;
+        last_draft_success = draft_successes;
+        total_gens += 1;
+    }
+    if(ngram_drafting && realnpredict>0 && realnpredict<=current_context_tokens.size())
+    {
+        if(ngram_cache_dynamic.size() > ngram_cache_dynamic_limit)
+        {
+            ngram_cache_dynamic.clear();
+        }
+        common_ngram_cache_update(ngram_cache_dynamic, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, current_context_tokens, realnpredict, false);
+    }
     concat_output_mtx.lock();
     concat_output_reader_copy_res = concat_output;
     concat_output_mtx.unlock();
@@ -5150,56 +5796,439 @@ size_t gpttype_calc_new_state_tokencount()
 {
     return current_context_tokens.size();
 }
-size_t gpttype_save_state_kv(int slot)
+//==========================================
+// SmartCache snapshot tiers: raw in ram (hot), deflated in ram (warm), spilled to disk (cold)
+//==========================================
+
+static const size_t savestate_pack_chunk = 64 * 1024 * 1024; //keeps each deflate call within 32 bit lengths
+
+static size_t savestate_ram_usage(const savestate_data & ss)
 {
-    if(kcpp_data==nullptr)
-    {
-        return 0;
+    return ss.current_savestate_buffer.capacity() + ss.current_draft_savestate_buffer.capacity() + ss.packed_buffer.capacity();
+}
+
+//appends src to out as a sequence of [raw_len][stored_len][bytes] chunks, stored raw if deflate does not help
+static bool savestate_pack(const uint8_t * src, size_t len, bool compress, std::vector<uint8_t> & out)
+{
+    for(size_t off=0;off<len;off+=savestate_pack_chunk)
+    {
+        uint64_t raw_len = std::min(savestate_pack_chunk, len - off);
+        size_t headpos = out.size();
+        out.resize(headpos + 16);
+        uint64_t stored_len = raw_len;
+        if(compress)
+        {
+            unsigned long bound = mz_compressBound((unsigned long)raw_len);
+            out.resize(headpos + 16 + bound);
+            unsigned long clen = bound;
+            if(mz_compress2(out.data() + headpos + 16, &clen, src + off, (unsigned long)raw_len, 1)==0 && clen < raw_len)
+            {
+                stored_len = clen;
+            }
+        }
+        if(stored_len==raw_len)
+        {
+            out.resize(headpos + 16 + raw_len);
+            memcpy(out.data() + headpos + 16, src + off, raw_len);
+        }
+        out.resize(headpos + 16 + stored_len);
+        memcpy(out.data() + headpos, &raw_len, 8);
+        memcpy(out.data() + headpos + 8, &stored_len, 8);
     }
-    if(file_format == FileFormat::GGUF_GENERIC)
+    return true;
+}
+
+//reads len bytes worth of chunks starting at pos, advancing pos
+static bool savestate_unpack(const uint8_t * src, size_t srclen, size_t & pos, size_t len, std::vector<uint8_t> & out)
+{
+    out.resize(len + 512);
+    size_t written = 0;
+    while(written < len)
     {
-        size_t totalbytes = 0;
-        if (!savestates[slot].current_savestate_buffer.empty()) {  //JIT free
-            savestates[slot].current_savestate_buffer.clear();
-            savestates[slot].current_draft_savestate_buffer.clear();
-            savestates[slot].savestate_context_tokens.clear();
-            savestates[slot].current_savestate_size = 0;
-            savestates[slot].current_draft_savestate_size = 0;
-            savestates[slot].media_signature = "";
+        if(pos + 16 > srclen)
+        {
+            return false;
         }
-        size_t newsize = llama_state_get_size(llama_ctx_v4);
-        try {
-            if (savestates[slot].current_savestate_buffer.capacity() < newsize + 512) {
-                savestates[slot].current_savestate_buffer = std::vector<uint8_t>(newsize + 512); // add some padding. May throw std::bad_alloc
-            } else {
-                savestates[slot].current_savestate_buffer.resize(newsize + 512);
-            }
-        } catch (const std::bad_alloc&) {
-            fprintf(stderr, "KV Save State: Failed to allocate %zu bytes.\n", newsize + 512);
-            return 0;
+        uint64_t raw_len = 0, stored_len = 0;
+        memcpy(&raw_len, src + pos, 8);
+        memcpy(&stored_len, src + pos + 8, 8);
+        pos += 16;
+        if(pos + stored_len > srclen || written + raw_len > len)
+        {
+            return false;
         }
-        auto res = llama_state_get_data(llama_ctx_v4, savestates[slot].current_savestate_buffer.data(), newsize);
-        if (res > 0) {
-            totalbytes += res;
-            savestates[slot].current_savestate_size   = newsize;
-            savestates[slot].savestate_context_tokens = current_context_tokens;
-            savestates[slot].media_signature = media_composite_image_signature;
-            int maxedpos = llama_memory_seq_pos_max(llama_get_memory(llama_ctx_v4),0);
-            if(maxedpos > 0 && savestates[slot].savestate_context_tokens.size() > maxedpos && savestates[slot].savestate_context_tokens.size()-maxedpos<=2)
+        if(stored_len==raw_len)
+        {
+            memcpy(out.data() + written, src + pos, raw_len);
+        }
+        else
+        {
+            unsigned long dlen = (unsigned long)raw_len;
+            if(mz_uncompress(out.data() + written, &dlen, src + pos, (unsigned long)stored_len)!=0 || dlen!=raw_len)
             {
-                //dirty hack for the memory actually being off by 1 or 2, correct the state
-                while(savestates[slot].savestate_context_tokens.size() > maxedpos)
-                {
-                    savestates[slot].savestate_context_tokens.pop_back();
-                }
+                return false;
             }
-            touch_slot(slot);
-            printf("\nKV Save State %d: Created SaveState of %zu tokens, costing %zu MB.\n",slot,current_context_tokens.size(),savestates[slot].current_savestate_size/(1024*1024));
         }
+        pos += stored_len;
+        written += raw_len;
+    }
+    return true;
+}
 
-        if(draft_ctx)
-        {
-            size_t newsize2 = llama_state_get_size(draft_ctx);
+static std::string savestate_spill_path(int slot)
+{
+    return savestate_spill_dir + "/kcpp_smartcache_" + savestate_spill_tag + "_" + std::to_string(slot) + ".bin";
+}
+
+//drops any warm or cold copy of the slot, the raw buffers are left alone
+static void savestate_release_tiers(savestate_data & ss)
+{
+    ss.packed_buffer.clear();
+    ss.packed_buffer.shrink_to_fit();
+    if(ss.spill_path!="")
+    {
+        std::remove(ss.spill_path.c_str());
+        ss.spill_path = "";
+    }
+    ss.tier = 0;
+}
+
+//moves a slot one tier down. returns false if it could not be moved and was dropped instead
+static bool savestate_demote(int slot)
+{
+    savestate_data & ss = savestates[slot];
+    if(ss.tier==0)
+    {
+        //try deflate first, fall straight through to disk if the kv does not compress
+        std::vector<uint8_t> packed;
+        bool compress = true;
+        try {
+            savestate_pack(ss.current_savestate_buffer.data(), ss.current_savestate_size, compress, packed);
+            savestate_pack(ss.current_draft_savestate_buffer.data(), ss.current_draft_savestate_size, compress, packed);
+        } catch (const std::bad_alloc&) {
+            packed.clear();
+        }
+        size_t rawsize = ss.current_savestate_size + ss.current_draft_savestate_size;
+        bool worthwhile = (packed.size()>0 && packed.size() < rawsize - rawsize/10);
+        if(worthwhile || savestate_spill_dir=="")
+        {
+            if(packed.size()==0)
+            {
+                return false;
+            }
+            ss.packed_buffer.swap(packed);
+            ss.packed_buffer.shrink_to_fit();
+            ss.current_savestate_buffer = std::vector<uint8_t>();
+            ss.current_draft_savestate_buffer = std::vector<uint8_t>();
+            ss.tier = 1;
+            printf("\n[SmartCache: Compressed slot %d from %zu MB to %zu MB]\n",slot,rawsize/(1024*1024),ss.packed_buffer.size()/(1024*1024));
+            return true;
+        }
+        //not compressible enough, spill the raw chunks
+        packed.clear();
+        try {
+            savestate_pack(ss.current_savestate_buffer.data(), ss.current_savestate_size, false, packed);
+            savestate_pack(ss.current_draft_savestate_buffer.data(), ss.current_draft_savestate_size, false, packed);
+        } catch (const std::bad_alloc&) {
+            return false;
+        }
+        ss.packed_buffer.swap(packed);
+        ss.current_savestate_buffer = std::vector<uint8_t>();
+        ss.current_draft_savestate_buffer = std::vector<uint8_t>();
+        ss.tier = 1;
+    }
+    if(ss.tier==1 && savestate_spill_dir!="")
+    {
+        std::string path = savestate_spill_path(slot);
+        try {
+            llama_file f(path.c_str(), "wb");
+            f.write_raw(ss.packed_buffer.data(), ss.packed_buffer.size());
+        } catch (const std::exception & e) {
+            printf("\n[SmartCache: Could not spill slot %d to %s: %s]\n",slot,path.c_str(),e.what());
+            std::remove(path.c_str());
+            return false;
+        }
+        printf("\n[SmartCache: Spilled slot %d to disk, %zu MB]\n",slot,ss.packed_buffer.size()/(1024*1024));
+        ss.spill_path = path;
+        ss.packed_buffer = std::vector<uint8_t>();
+        ss.tier = 2;
+        return true;
+    }
+    return false;
+}
+
+//brings a warm or cold slot back into raw ram buffers
+static bool savestate_promote(int slot)
+{
+    savestate_data & ss = savestates[slot];
+    if(ss.tier==0)
+    {
+        return true;
+    }
+    bool ok = false;
+    try {
+        if(ss.tier==1)
+        {
+            size_t pos = 0;
+            ok = savestate_unpack(ss.packed_buffer.data(), ss.packed_buffer.size(), pos, ss.current_savestate_size, ss.current_savestate_buffer);
+            ok = ok && savestate_unpack(ss.packed_buffer.data(), ss.packed_buffer.size(), pos, ss.current_draft_savestate_size, ss.current_draft_savestate_buffer);
+        }
+        else
+        {
+            llama_file f(ss.spill_path.c_str(), "rb");
+            size_t pos = 0;
+            if(llama_mmap::SUPPORTED)
+            {
+                llama_mmap mapping(&f, 0);
+                const uint8_t * src = (const uint8_t *)mapping.addr();
+                ok = savestate_unpack(src, mapping.size(), pos, ss.current_savestate_size, ss.current_savestate_buffer);
+                ok = ok && savestate_unpack(src, mapping.size(), pos, ss.current_draft_savestate_size, ss.current_draft_savestate_buffer);
+            }
+            else
+            {
+                std::vector<uint8_t> filedata(f.size());
+                f.read_raw(filedata.data(), filedata.size());
+                ok = savestate_unpack(filedata.data(), filedata.size(), pos, ss.current_savestate_size, ss.current_savestate_buffer);
+                ok = ok && savestate_unpack(filedata.data(), filedata.size(), pos, ss.current_draft_savestate_size, ss.current_draft_savestate_buffer);
+            }
+        }
+    } catch (const std::exception & e) {
+        printf("\n[SmartCache: Could not restore slot %d: %s]\n",slot,e.what());
+        ok = false;
+    }
+    if(!ok)
+    {
+        return false;
+    }
+    savestate_release_tiers(ss);
+    return true;
+}
+
+static void savestate_drop_children(int slot);
+
+//demotes least recently used snapshots until ram usage fits the budget
+static void savestate_enforce_budget(int keep_slot)
+{
+    if(savestate_ram_budget==0)
+    {
+        return;
+    }
+    while(true)
+    {
+        size_t total = 0;
+        int victim = -1;
+        for(int i=0;i<savestate_limit;++i)
+        {
+            total += savestate_ram_usage(savestates[i]);
+            if(i!=keep_slot && savestates[i].current_savestate_size>0 && savestates[i].tier<2)
+            {
+                //prefer the oldest, and among equals the hottest so it gets compressed first
+                if(victim<0 || savestates[i].last_used < savestates[victim].last_used
+                || (savestates[i].last_used==savestates[victim].last_used && savestates[i].tier < savestates[victim].tier))
+                {
+                    victim = i;
+                }
+            }
+        }
+        if(total <= savestate_ram_budget || victim<0)
+        {
+            return;
+        }
+        if(!savestate_demote(victim))
+        {
+            printf("\n[SmartCache: RAM budget exceeded, dropping slot %d]\n",victim);
+            savestate_drop_children(victim);
+            savestate_release_tiers(savestates[victim]);
+            savestate_tree.remove(victim);
+            savestates[victim] = savestate_data();
+        }
+    }
+}
+
+//==========================================
+// SmartCache delta snapshots: a slot that extends another slot only stores the kv cells past the parent
+//==========================================
+
+static bool savestate_delta_supported()
+{
+    if(file_format!=FileFormat::GGUF_GENERIC || llama_ctx_v4==nullptr || draft_ctx!=nullptr || !kcpp_data->swa_full)
+    {
+        return false;
+    }
+    const llama_model * mdl = llama_get_model(llama_ctx_v4);
+    if(llama_model_is_recurrent(mdl) || llama_model_is_hybrid(mdl) || file_format_meta.model_architecture==GGUFArch::ARCH_MAMBALIKE || file_format_meta.model_architecture==GGUFArch::ARCH_RWKV)
+    {
+        return false;
+    }
+    return true;
+}
+
+static bool savestate_parent_valid(int slot)
+{
+    const savestate_data & ss = savestates[slot];
+    if(ss.parent_slot<0)
+    {
+        return true;
+    }
+    const savestate_data & par = savestates[ss.parent_slot];
+    return (par.current_savestate_size>0 && par.serial==ss.parent_serial);
+}
+
+//slots in restore order, the full snapshot first. returns false if any link is stale
+static bool savestate_collect_chain(int slot, std::vector<int> & chain)
+{
+    chain.clear();
+    int cur = slot;
+    while(cur>=0)
+    {
+        if((int)chain.size()>savestate_max_delta_chain || !savestate_parent_valid(cur))
+        {
+            return false;
+        }
+        chain.push_back(cur);
+        cur = savestates[cur].parent_slot;
+    }
+    std::reverse(chain.begin(), chain.end());
+    return true;
+}
+
+static bool savestate_has_children(int slot)
+{
+    for(int i=0;i<savestate_limit;++i)
+    {
+        if(i!=slot && savestates[i].parent_slot==slot && savestates[i].current_savestate_size>0 && savestate_parent_valid(i))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+//deltas are useless without their parent, drop them before the parent changes
+static void savestate_drop_children(int slot)
+{
+    for(int i=0;i<savestate_limit;++i)
+    {
+        if(i!=slot && savestates[i].parent_slot==slot && savestates[i].current_savestate_size>0)
+        {
+            savestate_drop_children(i);
+            printf("\n[SmartCache: Dropping slot %d, it was a delta of slot %d]\n",i,slot);
+            savestate_release_tiers(savestates[i]);
+            savestate_tree.remove(i);
+            savestates[i] = savestate_data();
+        }
+    }
+}
+
+//longest existing slot whose whole context is a prefix of the current one, or -1
+static int savestate_pick_parent(int slot)
+{
+    if(!savestate_delta_supported())
+    {
+        return -1;
+    }
+    std::vector<int> slot_lcp(savestate_limit);
+    savestate_tree.match(current_context_tokens, slot_lcp);
+    int best = -1;
+    int bestlen = savestate_min_delta_parent - 1;
+    std::vector<int> chain;
+    for(int i=0;i<savestate_limit;++i)
+    {
+        const int plen = savestates[i].savestate_context_tokens.size();
+        if(i==slot || plen<=bestlen || plen>=(int)current_context_tokens.size() || slot_lcp[i]!=plen)
+        {
+            continue;
+        }
+        if(savestates[i].current_savestate_size==0 || savestates[i].media_signature!=media_composite_image_signature)
+        {
+            continue;
+        }
+        if(!savestate_collect_chain(i, chain) || (int)chain.size()>=savestate_max_delta_chain)
+        {
+            continue;
+        }
+        best = i;
+        bestlen = plen;
+    }
+    return best;
+}
+
+size_t gpttype_save_state_kv(int slot)
+{
+    if(kcpp_data==nullptr)
+    {
+        return 0;
+    }
+    if(batch_slot_count>1)
+    {
+        printf("\nKV state snapshots are not available with Batch Slots!\n");
+        return 0;
+    }
+    if(file_format == FileFormat::GGUF_GENERIC)
+    {
+        size_t totalbytes = 0;
+        savestate_drop_children(slot);
+        savestate_release_tiers(savestates[slot]);
+        savestate_tree.remove(slot);
+        savestates[slot].parent_slot = -1;
+        if (!savestates[slot].current_savestate_buffer.empty()) {  //JIT free
+            savestates[slot].current_savestate_buffer.clear();
+            savestates[slot].current_draft_savestate_buffer.clear();
+            savestates[slot].savestate_context_tokens.clear();
+            savestates[slot].current_savestate_size = 0;
+            savestates[slot].current_draft_savestate_size = 0;
+            savestates[slot].media_signature = "";
+        }
+        //a context that extends another slot is stored as a delta on top of it
+        const int parent = savestate_pick_parent(slot);
+        const int delta_from = (parent>=0 ? (int)savestates[parent].savestate_context_tokens.size() : 0);
+        size_t newsize = (parent>=0 ? llama_state_seq_get_size_range(llama_ctx_v4, 0, delta_from, -1) : llama_state_get_size(llama_ctx_v4));
+        try {
+            if (savestates[slot].current_savestate_buffer.capacity() < newsize + 512) {
+                savestates[slot].current_savestate_buffer = std::vector<uint8_t>(newsize + 512); // add some padding. May throw std::bad_alloc
+            } else {
+                savestates[slot].current_savestate_buffer.resize(newsize + 512);
+            }
+        } catch (const std::bad_alloc&) {
+            fprintf(stderr, "KV Save State: Failed to allocate %zu bytes.\n", newsize + 512);
+            return 0;
+        }
+        auto res = (parent>=0 ? llama_state_seq_get_data_range(llama_ctx_v4, savestates[slot].current_savestate_buffer.data(), newsize, 0, delta_from, -1)
+                   : llama_state_get_data(llama_ctx_v4, savestates[slot].current_savestate_buffer.data(), newsize));
+        if (res > 0) {
+            totalbytes += res;
+            savestates[slot].current_savestate_size   = newsize;
+            savestates[slot].serial = ++savestate_serial_counter;
+            savestates[slot].parent_slot = parent;
+            savestates[slot].parent_serial = (parent>=0 ? savestates[parent].serial : 0);
+            savestates[slot].delta_from = delta_from;
+            savestates[slot].savestate_context_tokens = current_context_tokens;
+            savestates[slot].media_signature = media_composite_image_signature;
+            int maxedpos = llama_memory_seq_pos_max(llama_get_memory(llama_ctx_v4),0);
+            if(maxedpos > 0 && savestates[slot].savestate_context_tokens.size() > maxedpos && savestates[slot].savestate_context_tokens.size()-maxedpos<=2)
+            {
+                //dirty hack for the memory actually being off by 1 or 2, correct the state
+                while(savestates[slot].savestate_context_tokens.size() > maxedpos)
+                {
+                    savestates[slot].savestate_context_tokens.pop_back();
+                }
+            }
+            savestate_tree.insert(slot, savestates[slot].savestate_context_tokens);
+            touch_slot(slot);
+            if(parent>=0)
+            {
+                touch_slot(parent);
+                printf("\nKV Save State %d: Created SaveState of %zu tokens as a delta of %d tokens on slot %d, costing %zu MB.\n",slot,current_context_tokens.size(),(int)current_context_tokens.size()-delta_from,parent,savestates[slot].current_savestate_size/(1024*1024));
+            }
+            else
+            {
+                printf("\nKV Save State %d: Created SaveState of %zu tokens, costing %zu MB.\n",slot,current_context_tokens.size(),savestates[slot].current_savestate_size/(1024*1024));
+            }
+        }
+
+        if(draft_ctx)
+        {
+            size_t newsize2 = llama_state_get_size(draft_ctx);
             try {
                 if (savestates[slot].current_draft_savestate_buffer.capacity() < newsize2 + 512) {
                     savestates[slot].current_draft_savestate_buffer = std::vector<uint8_t>(newsize2 + 512);
@@ -5217,6 +6246,7 @@ size_t gpttype_save_state_kv(int slot)
                 printf("\nKV Save State %d: Created DraftSaveState of %zu tokens, costing %zu MB.\n",slot,current_context_tokens.size(),savestates[slot].current_draft_savestate_size/(1024*1024));
             }
         }
+        savestate_enforce_budget(slot);
         return totalbytes;
     }
     return 0;
@@ -5227,23 +6257,65 @@ bool gpttype_load_state_kv(int slot)
     {
         return false;
     }
+    if(batch_slot_count>1)
+    {
+        printf("\nKV state snapshots are not available with Batch Slots!\n");
+        return false;
+    }
     if(file_format == FileFormat::GGUF_GENERIC)
     {
-        if (savestates[slot].current_savestate_buffer.empty()) {
+        if (savestates[slot].current_savestate_size==0) {
+            return false;
+        }
+        std::vector<int> chain;
+        if (!savestate_collect_chain(slot, chain)) {
+            printf("\nKV Load SaveState %d: Parent snapshot is gone, cannot restore.\n",slot);
             return false;
         }
-        auto res = llama_state_set_data(llama_ctx_v4, savestates[slot].current_savestate_buffer.data(), savestates[slot].current_savestate_size);
+        for (int c : chain) {
+            if (savestates[c].tier!=0) {
+                int oldtier = savestates[c].tier;
+                if(!savestate_promote(c)) {
+                    return false;
+                }
+                printf("\n[SmartCache: Promoted slot %d from %s]\n",c,(oldtier==1?"compressed RAM":"disk"));
+            }
+            if (savestates[c].current_savestate_buffer.empty()) {
+                return false;
+            }
+        }
+        const int root = chain[0];
+        auto res = llama_state_set_data(llama_ctx_v4, savestates[root].current_savestate_buffer.data(), savestates[root].current_savestate_size);
+        for (size_t ci = 1; ci < chain.size() && res > 0; ++ci) {
+            const savestate_data & ss = savestates[chain[ci]];
+            res = llama_state_seq_set_data_range(llama_ctx_v4, ss.current_savestate_buffer.data(), ss.current_savestate_size, 0, ss.delta_from);
+        }
+        if(res == 0 && chain.size() > 1)
+        {
+            //half applied chain, leave a clean context behind
+            llama_memory_clear(llama_get_memory(llama_ctx_v4),true);
+            current_context_tokens.clear();
+        }
         if(res > 0)
         {
             current_context_tokens = savestates[slot].savestate_context_tokens;
-            printf("\nKV Load SaveState %d: Restored KV with %zu tokens.\n", slot,current_context_tokens.size());
+            if(chain.size() > 1 && current_context_tokens.size() > 0)
+            {
+                //the saved logits belong to the full snapshot, so let the last token be evaluated again
+                llama_memory_seq_rm(llama_get_memory(llama_ctx_v4), 0, current_context_tokens.size() - 1, -1);
+                current_context_tokens.pop_back();
+            }
+            printf("\nKV Load SaveState %d: Restored KV with %zu tokens%s.\n", slot,current_context_tokens.size(),(chain.size()>1?" from a delta chain":""));
             if(draft_ctx && savestates[slot].current_draft_savestate_size>0)
             {
                 llama_memory_clear(llama_get_memory(draft_ctx),true);
                 auto res2 = llama_state_set_data(draft_ctx, savestates[slot].current_draft_savestate_buffer.data(), savestates[slot].current_draft_savestate_size);
                 printf("\nKV Load DraftSaveState %d: Restored KV with %zu tokens.\n", slot,current_context_tokens.size());
             }
-            touch_slot(slot);
+            for (int c : chain) {
+                touch_slot(c);
+            }
+            savestate_enforce_budget(slot);
         }
         return (res > 0);
     }
@@ -5257,9 +6329,11 @@ bool gpttype_clear_state_kv(bool shrink)
     }
     if(file_format == FileFormat::GGUF_GENERIC)
     {
+        savestate_tree.clear();
         for(int slot=0;slot<savestate_limit;++slot)
         {
-            if (!savestates[slot].current_savestate_buffer.empty()) {
+            savestate_release_tiers(savestates[slot]);
+            if (!savestates[slot].current_savestate_buffer.empty() || savestates[slot].current_savestate_size>0) {
                 printf("\nKV Clear SaveState %d: Freed %zu MB.\n",slot, savestates[slot].current_savestate_size / (1024 * 1024));
                 savestates[slot].current_savestate_buffer.clear();
                 if(shrink)
@@ -5279,6 +6353,7 @@ bool gpttype_clear_state_kv(bool shrink)
                     savestates[slot].current_draft_savestate_size = 0;
                 }
                 savestates[slot].last_used = 0;
+                savestates[slot].parent_slot = -1;
             }
         }
         return true;
@@ -5324,7 +6399,22 @@ int get_identical_existing_slot() //returns slot number of slot containing exact
 int get_oldest_slot(int excludeSlotId)
 {
     int64_t slotage = INT64_MAX; // Initialize with maximum possible value
-    int slotid = 0;
+    int slotid = -1;
+    for(int i=0;i<savestate_limit;++i)
+    {
+        //slots that other slots are deltas of are only evicted when nothing else is left
+        if(savestates[i].last_used <= slotage && i!=excludeSlotId && !savestate_has_children(i))
+        {
+            slotage = savestates[i].last_used;
+            slotid = i;
+        }
+    }
+    if(slotid>=0)
+    {
+        return slotid;
+    }
+    slotage = INT64_MAX;
+    slotid = 0;
     for(int i=0;i<savestate_limit;++i)
     {
         if(savestates[i].last_used <= slotage && i!=excludeSlotId)
@@ -5334,4 +6424,815 @@ int get_oldest_slot(int excludeSlotId)
         }
     }
     return slotid;
-}
\ No newline at end of file
+}
+//==========================================
+// KCPP BATCHED MULTI-SLOT GENERATION
+//==========================================
+
+//only plain text requests can share the context, everything else still goes through gpttype_generate
+static bool batch_request_supported(const generation_inputs & inputs)
+{
+    if(batch_slot_count<=1 || kcpp_data==nullptr || file_format!=FileFormat::GGUF_GENERIC || llama_ctx_v4==nullptr)
+    {
+        return false;
+    }
+    if (file_format_meta.model_architecture == GGUFArch::ARCH_GLM4 || file_format_meta.model_architecture == GGUFArch::ARCH_DEEPSEEK2)
+    {
+        return false; //needs the gmask prompt fixups
+    }
+    for(int x=0;x<images_max;++x)
+    {
+        if(inputs.images[x]!=nullptr && std::string(inputs.images[x])!="")
+        {
+            return false;
+        }
+    }
+    for(int x=0;x<audio_max;++x)
+    {
+        if(inputs.audio[x]!=nullptr && std::string(inputs.audio[x])!="")
+        {
+            return false;
+        }
+    }
+    std::string negative_prompt = (inputs.negative_prompt?inputs.negative_prompt:"");
+    std::string grammarstr = (inputs.grammar?inputs.grammar:"");
+    if((guidance_ctx && negative_prompt!="" && inputs.guidance_scale!=1.0f) || grammarstr!="" || inputs.grammar_retain_state)
+    {
+        return false;
+    }
+    if(inputs.mirostat!=0 || inputs.dry_multiplier>0.0f || inputs.adaptive_target>0.0f || inputs.banned_tokens_len>0 || inputs.tool_call_fix)
+    {
+        return false;
+    }
+    return true;
+}
+
+//memory + prompt tokenization, truncated from the front to fit, same rules as gpttype_generate
+static std::vector<int> batch_build_prompt(const std::string & prompt, const std::string & memory, const int nctx, const int n_predict)
+{
+    std::vector<int> embd_inp;
+    std::vector<int> embd_inp_mem;
+    std::vector<int> bos;
+    TokenizeString(prompt, embd_inp, file_format, add_bos_token);
+    TokenizeString("", bos, file_format, add_bos_token);
+
+    if(memory=="")
+    {
+        if (embd_inp.size() + n_predict > nctx)
+        {
+            int offset = embd_inp.size() - nctx + n_predict;
+            embd_inp = std::vector<int>(embd_inp.begin() + offset, embd_inp.end());
+            if(bos.size()>0 && embd_inp.size()>0)
+            {
+                embd_inp[0] = bos[0];
+            }
+        }
+        return embd_inp;
+    }
+
+    TokenizeString(memory, embd_inp_mem, file_format, add_bos_token);
+    if (bos.size()>0 && !embd_inp.empty() && bos[0]==embd_inp[0]) {
+        embd_inp.erase(embd_inp.begin());
+    }
+    if (embd_inp_mem.size() + n_predict + 4 > nctx)
+    {
+        int offset = embd_inp_mem.size() - nctx + n_predict + 4;
+        embd_inp_mem = std::vector<int>(embd_inp_mem.begin() + offset, embd_inp_mem.end());
+        if(bos.size()>0 && embd_inp_mem.size()>0)
+        {
+            embd_inp_mem[0] = bos[0];
+        }
+    }
+    int totalsize = (embd_inp_mem.size() + 1 + embd_inp.size() + n_predict);
+    if(totalsize > nctx)
+    {
+        int excess = totalsize - nctx;
+        if (embd_inp.size() >= excess) {
+            embd_inp.erase(embd_inp.begin(), embd_inp.begin() + excess);
+        } else {
+            embd_inp.clear();
+        }
+    }
+    embd_inp.insert(embd_inp.begin(), embd_inp_mem.begin(), embd_inp_mem.end());
+    if(add_bos_token && embd_inp.size()>0 && bos.size()>0 && bos[0]!=embd_inp[0])
+    {
+        embd_inp.insert(embd_inp.begin(), bos[0]);
+    }
+    return embd_inp;
+}
+
+static std::shared_ptr<batch_stream_record> batch_find_stream(int stream_id)
+{
+    std::lock_guard<std::mutex> lock(batch_queue_mtx);
+    auto it = batch_streams.find(stream_id);
+    if(it==batch_streams.end())
+    {
+        return nullptr;
+    }
+    return it->second;
+}
+
+static void batch_register_stream(const std::shared_ptr<batch_stream_record> & rec)
+{
+    std::lock_guard<std::mutex> lock(batch_queue_mtx);
+    batch_streams[rec->stream_id] = rec;
+    //drop the oldest finished records, ids are handed out in increasing order
+    int excess = (int)batch_streams.size() - batch_stream_history_max;
+    for(auto it = batch_streams.begin(); it != batch_streams.end() && excess > 0;)
+    {
+        bool done = false;
+        {
+            std::lock_guard<std::mutex> reclock(it->second->mtx);
+            done = it->second->finished;
+        }
+        if(done)
+        {
+            it = batch_streams.erase(it);
+            --excess;
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+static void batch_finish_slot(batch_slot & slot, stop_reason reason)
+{
+    int generated = slot.params.n_predict - slot.remaining_tokens;
+    {
+        std::lock_guard<std::mutex> lock(slot.stream->mtx);
+        slot.stream->finished = true;
+        slot.stream->stopreason = reason;
+        slot.stream->prompt_tokens = slot.prompt_tokens.size();
+        slot.stream->completion_tokens = generated;
+    }
+    slot.stream->cv.notify_all();
+
+    float elapsed = (ggml_time_ms() - slot.start_time_ms) / 1000.0f;
+    if(!is_quiet && debugmode!=-1)
+    {
+        printf("\n[%s] Batch Slot %d: CtxLimit:%d/%d, Amt:%d/%d, Total:%.2fs (%.2fT/s)",get_timestamp_str().c_str(),slot.seq_id,(int)slot.context_tokens.size()+1,slot.params.n_ctx,generated,slot.params.n_predict,elapsed,(elapsed>0?generated/elapsed:0));
+        fflush(stdout);
+    }
+    {
+        std::lock_guard<std::mutex> lock(last_stats_mtx);
+        last_token_count = generated;
+        last_input_count = slot.prompt_tokens.size();
+        last_seed = slot.params.seed;
+        total_gens += 1;
+    }
+
+    slot.state = BATCH_SLOT_IDLE;
+    slot.stream = nullptr;
+    slot.pending_token = -1;
+    slot.logits_idx = -1;
+    slot.last_used = ++batch_use_counter;
+}
+
+static void batch_evict_slot_kv(batch_slot & slot)
+{
+    llama_memory_seq_rm(llama_get_memory(llama_ctx_v4), slot.seq_id, -1, -1);
+    slot.context_tokens.clear();
+}
+
+//move waiting requests into idle slots, preferring the slot whose cached kv shares the longest prefix
+static void batch_admit_pending()
+{
+    const int total_cells = llama_n_ctx(llama_ctx_v4);
+    while(true)
+    {
+        batch_slot incoming;
+        {
+            std::lock_guard<std::mutex> lock(batch_queue_mtx);
+            if(batch_pending.empty())
+            {
+                return;
+            }
+            int best = batch_pick_slot(batch_slots, batch_pending.front().prompt_tokens);
+            if(best==-1)
+            {
+                return; //all slots busy
+            }
+
+            //make sure the whole request fits beside everyone else, evicting idle kv if needed
+            const batch_slot & front = batch_pending.front();
+            int needed = front.prompt_tokens.size() + front.params.n_predict;
+            while(batch_reserved_cells(batch_slots, best, current_context_tokens.size()) + needed > total_cells)
+            {
+                int victim = batch_pick_victim(batch_slots, best);
+                if(victim!=-1)
+                {
+                    batch_evict_slot_kv(batch_slots[victim]);
+                }
+                else if(current_context_tokens.size()>0)
+                {
+                    llama_memory_seq_rm(llama_get_memory(llama_ctx_v4), 0, -1, -1);
+                    current_context_tokens.clear();
+                    n_past = 0;
+                }
+                else
+                {
+                    break;
+                }
+            }
+            if(batch_reserved_cells(batch_slots, best, current_context_tokens.size()) + needed > total_cells)
+            {
+                return; //wait for an active slot to finish
+            }
+
+            incoming = std::move(batch_pending.front());
+            batch_pending.pop_front();
+            batch_slot & slot = batch_slots[best];
+            incoming.seq_id = slot.seq_id;
+            incoming.context_tokens = std::move(slot.context_tokens);
+            incoming.last_used = slot.last_used;
+            slot = std::move(incoming);
+        }
+
+        //find the slot we just filled and reuse its matching prefix
+        for(int i=0;i<batch_slots.size();++i)
+        {
+            batch_slot & slot = batch_slots[i];
+            if(slot.state!=BATCH_SLOT_IDLE || slot.stream==nullptr)
+            {
+                continue;
+            }
+            int reuse = batch_reusable_prefix(slot.context_tokens, slot.prompt_tokens);
+            llama_memory_seq_rm(llama_get_memory(llama_ctx_v4), slot.seq_id, reuse, -1);
+            slot.context_tokens.resize(reuse);
+            slot.n_past = reuse;
+            slot.input_consumed = reuse;
+            slot.state = BATCH_SLOT_PROMPT;
+            slot.start_time_ms = ggml_time_ms();
+            if(debugmode==1 && !is_quiet)
+            {
+                printf("\n[Batch Slot %d: Prompt %zu tokens, reused %d]\n",slot.seq_id,slot.prompt_tokens.size(),reuse);
+            }
+        }
+    }
+}
+
+static llama_token batch_sample_slot(batch_slot & slot, float * logitsPtr)
+{
+    const std::vector<llama_token> eog_tokens = GetEogIDs(file_format,n_vocab);
+    if (!slot.allow_eos_token && !slot.bypass_eos_token)
+    {
+        float lowestLogit = LowestLogit(logitsPtr,n_vocab);
+        for(int i=0;i<eog_tokens.size();++i)
+        {
+            logitsPtr[eog_tokens[i]] = lowestLogit;
+        }
+    }
+
+    sampler_ws.load(logitsPtr, n_vocab);
+    for(int i=0;i<slot.logit_biases.size();++i)
+    {
+        auto & itm = slot.logit_biases[i];
+        sampler_ws.logits[itm.token_id] += itm.bias;
+    }
+    llama_token_data_array candidates_p = sampler_ws.top_k(3000);
+
+    const kcpp_params & p = slot.params;
+    ApplySamplerOrder(&candidates_p, p.n_ctx, p.repeat_last_n, p.repeat_penalty, p.rep_pen_slope, p.presence_penalty, p.top_k, slot.top_a, p.top_p, p.min_p, p.typical_p, p.tfs_z, p.nsigma, p.temp,
+    slot.sampler_order, p.dynatemp_range, p.dynatemp_exponent, p.smoothing_factor, p.smoothing_curve, slot.last_n_tokens);
+    sample_xtc(&candidates_p, p.xtc_threshold, p.xtc_probability, slot.rng);
+    return sample_token(&candidates_p, slot.rng, nullptr);
+}
+
+//returns true if the slot should stop after this token
+static bool batch_accept_token(batch_slot & slot, llama_token id)
+{
+    if (!slot.last_n_tokens.empty())
+    {
+        slot.last_n_tokens.erase(slot.last_n_tokens.begin());
+    }
+    slot.last_n_tokens.push_back(id);
+    --slot.remaining_tokens;
+
+    const std::vector<llama_token> eog_tokens = GetEogIDs(file_format,n_vocab);
+    bool found_eog = std::find(eog_tokens.begin(), eog_tokens.end(), id) != eog_tokens.end();
+    bool found_special = VecContainsIntVal(slot.special_stop_sequence,id);
+    std::string tokenizedstr = FileFormatTokenizeID(id, file_format, slot.render_special);
+    if(!slot.render_special && (found_eog || found_special))
+    {
+        tokenizedstr = "";
+    }
+
+    bool hit_stopper = false;
+    bool aborted = false;
+    {
+        std::lock_guard<std::mutex> lock(slot.stream->mtx);
+        slot.stream->tokens.push_back(tokenizedstr);
+        slot.stream->output += tokenizedstr;
+        hit_stopper = (slot.stop_matcher.feed(tokenizedstr) >= 0);
+        aborted = slot.stream->abort_requested;
+    }
+    slot.stream->cv.notify_all();
+
+    if(!slot.bypass_eos_token && slot.allow_eos_token && found_eog)
+    {
+        batch_finish_slot(slot, stop_reason::EOS_TOKEN_HIT);
+        return true;
+    }
+    if(found_special)
+    {
+        batch_finish_slot(slot, stop_reason::EOS_TOKEN_HIT);
+        return true;
+    }
+    if(hit_stopper)
+    {
+        batch_finish_slot(slot, stop_reason::CUSTOM_STOPPER);
+        return true;
+    }
+    if(aborted || slot.remaining_tokens<=0)
+    {
+        batch_finish_slot(slot, stop_reason::OUT_OF_TOKENS);
+        return true;
+    }
+    slot.pending_token = id;
+    slot.state = BATCH_SLOT_GENERATING;
+    return false;
+}
+
+//one decode over every active slot: a single new token for generating slots, then prompt chunks fill the rest of the batch
+static void batch_engine_step()
+{
+    batch_admit_pending();
+
+    llama_batch & batch = batch_engine_batch;
+    common_batch_clear(batch);
+    std::vector<int> contributors;
+
+    for(int i=0;i<batch_slots.size();++i)
+    {
+        batch_slot & slot = batch_slots[i];
+        slot.logits_idx = -1;
+        if(slot.state==BATCH_SLOT_IDLE)
+        {
+            continue;
+        }
+        bool aborted = false;
+        {
+            std::lock_guard<std::mutex> lock(slot.stream->mtx);
+            aborted = slot.stream->abort_requested;
+        }
+        if(aborted)
+        {
+            batch_finish_slot(slot, stop_reason::OUT_OF_TOKENS);
+            continue;
+        }
+        if(slot.state==BATCH_SLOT_GENERATING)
+        {
+            slot.logits_idx = batch.n_tokens;
+            common_batch_add(batch, slot.pending_token, slot.n_past, { slot.seq_id }, true);
+            slot.context_tokens.push_back(slot.pending_token);
+            ++slot.n_past;
+            contributors.push_back(i);
+        }
+    }
+
+    for(int i=0;i<batch_slots.size() && batch.n_tokens < kcpp_data->n_batch;++i)
+    {
+        batch_slot & slot = batch_slots[i];
+        if(slot.state!=BATCH_SLOT_PROMPT)
+        {
+            continue;
+        }
+        contributors.push_back(i);
+        while(slot.input_consumed < slot.prompt_tokens.size() && batch.n_tokens < kcpp_data->n_batch)
+        {
+            int tok = slot.prompt_tokens[slot.input_consumed];
+            ++slot.input_consumed;
+            bool is_last = (slot.input_consumed == slot.prompt_tokens.size());
+            if(is_last)
+            {
+                slot.logits_idx = batch.n_tokens;
+            }
+            common_batch_add(batch, tok, slot.n_past, { slot.seq_id }, is_last);
+            slot.context_tokens.push_back(tok);
+            ++slot.n_past;
+        }
+    }
+
+    if(batch.n_tokens==0)
+    {
+        return;
+    }
+
+    int32_t decode_status = llama_decode(llama_ctx_v4, batch);
+    if(decode_status!=0)
+    {
+        printf("\nBatch decode failed! (code:%d, %d tokens)\n",decode_status,batch.n_tokens);
+        for(int i : contributors)
+        {
+            if(batch_slots[i].state!=BATCH_SLOT_IDLE)
+            {
+                batch_evict_slot_kv(batch_slots[i]);
+                batch_finish_slot(batch_slots[i], stop_reason::ERROR_ENCOUNTERED);
+            }
+        }
+        return;
+    }
+
+    for(int i : contributors)
+    {
+        batch_slot & slot = batch_slots[i];
+        if(slot.state==BATCH_SLOT_IDLE || slot.logits_idx<0)
+        {
+            continue; //prompt still has chunks left
+        }
+        float * logitsPtr = llama_get_logits_ith(llama_ctx_v4, slot.logits_idx);
+        llama_token id = batch_sample_slot(slot, logitsPtr);
+        batch_accept_token(slot, id);
+    }
+}
+
+static bool batch_engine_has_work()
+{
+    if(!batch_pending.empty())
+    {
+        return true;
+    }
+    for(int i=0;i<batch_slots.size();++i)
+    {
+        if(batch_slots[i].state!=BATCH_SLOT_IDLE)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void batch_engine_loop()
+{
+    while(true)
+    {
+        {
+            //a waiting regular request gets the context first, it signals once it holds it
+            std::unique_lock<std::mutex> lock(batch_queue_mtx);
+            batch_queue_cv.wait(lock, []{ return batch_engine_stopping || (batch_legacy_waiting==0 && batch_engine_has_work()); });
+            if(batch_engine_stopping)
+            {
+                return;
+            }
+        }
+        std::lock_guard<std::mutex> ctxlock(batch_ctx_mtx);
+        batch_engine_step();
+    }
+}
+
+static void batch_engine_start()
+{
+    batch_slots.clear();
+    batch_slots.resize(batch_slot_count);
+    for(int i=0;i<batch_slot_count;++i)
+    {
+        batch_slots[i].seq_id = i + 1;
+    }
+    batch_engine_batch = llama_batch_init(kcpp_data->n_batch, 0, 1);
+    batch_engine_thread = std::thread(batch_engine_loop);
+}
+
+//stops and joins the engine thread, then fails whatever it was still serving so no caller waits forever
+static void batch_engine_shutdown()
+{
+    if(!batch_engine_thread.joinable())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(batch_queue_mtx);
+        batch_engine_stopping = true;
+    }
+    batch_queue_cv.notify_all();
+    batch_engine_thread.join();
+
+    for(int i=0;i<batch_slots.size();++i)
+    {
+        if(batch_slots[i].state!=BATCH_SLOT_IDLE)
+        {
+            batch_finish_slot(batch_slots[i], stop_reason::ERROR_ENCOUNTERED);
+        }
+    }
+    std::deque<batch_slot> abandoned;
+    {
+        std::lock_guard<std::mutex> lock(batch_queue_mtx);
+        batch_engine_stopping = false;
+        abandoned.swap(batch_pending);
+    }
+    for(auto & req : abandoned)
+    {
+        {
+            std::lock_guard<std::mutex> reclock(req.stream->mtx);
+            req.stream->finished = true;
+            req.stream->stopreason = stop_reason::ERROR_ENCOUNTERED;
+        }
+        req.stream->cv.notify_all();
+    }
+    batch_slots.clear();
+    llama_batch_free(batch_engine_batch);
+    batch_engine_batch = {};
+}
+
+//queues a request into the shared batch and blocks until it is done. falls back to gpttype_generate if not batchable
+generation_outputs gpttype_batch_generate(const generation_inputs inputs, int stream_id, bool force_legacy)
+{
+    static thread_local std::string batch_output_copy;
+    generation_outputs output;
+    auto rec = std::make_shared<batch_stream_record>();
+    rec->stream_id = stream_id;
+    rec->legacy = (force_legacy || !batch_request_supported(inputs));
+    batch_register_stream(rec);
+
+    if(rec->legacy)
+    {
+        std::lock_guard<std::mutex> lock(batch_legacy_mtx);
+        bool aborted = false;
+        {
+            std::lock_guard<std::mutex> reclock(rec->mtx);
+            aborted = rec->abort_requested;
+        }
+        if(aborted) //cancelled while waiting for its turn
+        {
+            std::lock_guard<std::mutex> reclock(rec->mtx);
+            rec->finished = true;
+            rec->stopreason = stop_reason::OUT_OF_TOKENS;
+            rec->cv.notify_all();
+            output.status = 1;
+            output.stopreason = rec->stopreason;
+            output.prompt_tokens = output.completion_tokens = 0;
+            batch_output_copy = "";
+            output.text = batch_output_copy.c_str();
+            return output;
+        }
+        batch_legacy_stream_id = stream_id;
+        batch_legacy_rec = rec;
+        output = gpttype_generate(inputs);
+        batch_legacy_rec = nullptr;
+        batch_output_copy = (output.text?output.text:"");
+        {
+            std::lock_guard<std::mutex> reclock(rec->mtx);
+            rec->output = batch_output_copy;
+            rec->finished = true;
+            rec->stopreason = (stop_reason)output.stopreason;
+            rec->prompt_tokens = output.prompt_tokens;
+            rec->completion_tokens = output.completion_tokens;
+        }
+        batch_legacy_stream_id = 0;
+        rec->cv.notify_all();
+        output.text = (output.text?batch_output_copy.c_str():nullptr);
+        return output;
+    }
+
+    batch_slot req;
+    req.stream = rec;
+    req.params.prompt = inputs.prompt;
+    req.params.seed = inputs.seed;
+    req.params.n_predict = inputs.max_length;
+    req.params.top_k = inputs.top_k;
+    req.params.top_p = inputs.top_p;
+    req.params.min_p = inputs.min_p;
+    req.params.typical_p = inputs.typical_p;
+    req.params.tfs_z = inputs.tfs;
+    req.params.nsigma = inputs.nsigma;
+    req.params.temp = inputs.temperature;
+    req.params.repeat_last_n = inputs.rep_pen_range;
+    req.params.rep_pen_slope = inputs.rep_pen_slope;
+    req.params.repeat_penalty = inputs.rep_pen;
+    req.params.presence_penalty = inputs.presence_penalty;
+    req.params.xtc_threshold = inputs.xtc_threshold;
+    req.params.xtc_probability = inputs.xtc_probability;
+    req.params.dynatemp_range = inputs.dynatemp_range;
+    req.params.dynatemp_exponent = inputs.dynatemp_exponent;
+    req.params.smoothing_factor = inputs.smoothing_factor;
+    req.params.smoothing_curve = inputs.smoothing_curve;
+    req.params.n_ctx = std::min(inputs.max_context_length, (int)llama_n_ctx(llama_ctx_v4));
+    req.top_a = inputs.top_a;
+    req.allow_eos_token = inputs.allow_eos_token;
+    req.bypass_eos_token = inputs.bypass_eos_token;
+    req.render_special = inputs.render_special;
+
+    if (req.params.repeat_last_n < 1)
+    {
+        req.params.repeat_last_n = 1;
+    }
+    if (req.params.rep_pen_slope > 1 || req.params.rep_pen_slope<=0)
+    {
+        req.params.rep_pen_slope = 1;
+    }
+    if (req.params.top_k < 1)
+    {
+        req.params.top_k = n_vocab;
+    }
+    if (req.params.seed <= 0 || req.params.seed==0xFFFFFFFF)
+    {
+        req.params.seed = (((uint32_t)time(NULL)) % 1000000u) + stream_id;
+    }
+    if (req.params.n_predict > req.params.n_ctx - 1)
+    {
+        req.params.n_predict = req.params.n_ctx - 1;
+    }
+    req.rng = std::mt19937(req.params.seed);
+
+    for(int x=0;x<inputs.stop_sequence_len;++x)
+    {
+        std::string stopper = inputs.stop_sequence[x];
+        if(stopper!="")
+        {
+            req.stop_sequence.push_back(stopper);
+            std::vector<int> tmp;
+            TokenizeString(stopper, tmp, file_format, false);
+            if(tmp.size()==1 && FileFormatTokenizeID(tmp[0], file_format)=="")
+            {
+                req.special_stop_sequence.push_back(tmp[0]);
+            }
+        }
+    }
+    req.stop_matcher.build(req.stop_sequence, false);
+    for(int x=0;x<inputs.logit_biases_len;++x)
+    {
+        int32_t t_id = inputs.logit_biases[x].token_id;
+        if(t_id >= 0 && t_id < n_vocab && inputs.logit_biases[x].bias!=0)
+        {
+           req.logit_biases.push_back(inputs.logit_biases[x]);
+        }
+    }
+    if(inputs.sampler_len<=0)
+    {
+        req.sampler_order = {KCPP_SAMPLER_REP_PEN, KCPP_SAMPLER_TOP_K, KCPP_SAMPLER_TOP_A, KCPP_SAMPLER_TFS, KCPP_SAMPLER_TYP, KCPP_SAMPLER_TOP_P, KCPP_SAMPLER_TEMP};
+    }
+    else
+    {
+        for(int i=0;i<inputs.sampler_len;++i)
+        {
+            req.sampler_order.push_back(inputs.sampler_order[i]);
+        }
+    }
+
+    req.prompt_tokens = batch_build_prompt(req.params.prompt, (inputs.memory?inputs.memory:""), req.params.n_ctx, req.params.n_predict);
+    if(req.prompt_tokens.empty())
+    {
+        std::vector<int> bos;
+        TokenizeString("", bos, file_format, true);
+        req.prompt_tokens = (bos.empty() ? std::vector<int>{0} : bos); //need something to decode
+    }
+    req.last_n_tokens.resize(req.params.repeat_last_n, 0);
+    for(int i=0;i<req.prompt_tokens.size();++i)
+    {
+        req.last_n_tokens.erase(req.last_n_tokens.begin());
+        req.last_n_tokens.push_back(req.prompt_tokens[i]);
+    }
+    req.remaining_tokens = req.params.n_predict;
+
+    if(req.remaining_tokens<=0)
+    {
+        std::lock_guard<std::mutex> reclock(rec->mtx);
+        rec->finished = true;
+        rec->stopreason = stop_reason::OUT_OF_TOKENS;
+        rec->prompt_tokens = req.prompt_tokens.size();
+    }
+    else
+    {
+        std::lock_guard<std::mutex> lock(batch_queue_mtx);
+        batch_pending.push_back(std::move(req));
+    }
+    batch_queue_cv.notify_all();
+
+    {
+        std::unique_lock<std::mutex> reclock(rec->mtx);
+        rec->cv.wait(reclock, [&]{ return rec->finished; });
+        batch_output_copy = rec->output;
+        output.status = (rec->stopreason==stop_reason::ERROR_ENCOUNTERED?0:1);
+        output.stopreason = rec->stopreason;
+        output.prompt_tokens = rec->prompt_tokens;
+        output.completion_tokens = rec->completion_tokens;
+    }
+    output.text = batch_output_copy.c_str();
+    return output;
+}
+
+const char * gpttype_batch_new_token(int stream_id, int idx)
+{
+    static thread_local std::string batch_token_copy;
+    auto rec = batch_find_stream(stream_id);
+    if(rec==nullptr || idx<0)
+    {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(rec->mtx);
+    if(rec->tokens.size() <= idx)
+    {
+        return nullptr;
+    }
+    batch_token_copy = rec->tokens[idx];
+    return batch_token_copy.c_str();
+}
+
+int gpttype_batch_get_stream_count(int stream_id)
+{
+    auto rec = batch_find_stream(stream_id);
+    if(rec==nullptr)
+    {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(rec->mtx);
+    return rec->tokens.size();
+}
+
+//blocks until the stream has more than have_count tokens. returns the count, or -1 once finished and fully read
+int gpttype_batch_wait_tokens(int stream_id, int have_count, int timeout_ms)
+{
+    auto rec = batch_find_stream(stream_id);
+    if(rec==nullptr)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(std::min(timeout_ms,20))); //not queued yet
+        return 0;
+    }
+    std::unique_lock<std::mutex> lock(rec->mtx);
+    rec->cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), [&]{ return rec->finished || rec->tokens.size() > have_count; });
+    if(rec->finished && rec->tokens.size() <= have_count)
+    {
+        return -1;
+    }
+    return rec->tokens.size();
+}
+
+bool gpttype_batch_has_finished(int stream_id)
+{
+    auto rec = batch_find_stream(stream_id);
+    if(rec==nullptr)
+    {
+        return false; //not registered yet
+    }
+    std::lock_guard<std::mutex> lock(rec->mtx);
+    return rec->finished;
+}
+
+int gpttype_batch_get_stop_reason(int stream_id)
+{
+    auto rec = batch_find_stream(stream_id);
+    if(rec==nullptr)
+    {
+        return (int)stop_reason::INVALID;
+    }
+    std::lock_guard<std::mutex> lock(rec->mtx);
+    return (int)rec->stopreason;
+}
+
+const std::string & gpttype_batch_get_pending_output(int stream_id)
+{
+    static thread_local std::string batch_pending_copy;
+    batch_pending_copy = "";
+    auto rec = batch_find_stream(stream_id);
+    if(rec!=nullptr)
+    {
+        std::lock_guard<std::mutex> lock(rec->mtx);
+        if(rec->legacy && !rec->finished)
+        {
+            if(batch_legacy_stream_id==stream_id)
+            {
+                batch_pending_copy = gpttype_get_pending_output();
+            }
+        }
+        else
+        {
+            batch_pending_copy = rec->output;
+        }
+    }
+    return batch_pending_copy;
+}
+
+bool gpttype_batch_abort(int stream_id)
+{
+    auto rec = batch_find_stream(stream_id);
+    if(rec==nullptr)
+    {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(rec->mtx);
+        rec->abort_requested = true;
+        if(rec->legacy && batch_legacy_stream_id==stream_id)
+        {
+            early_abort = true;
+        }
+    }
+    //if still waiting in the queue, finish it right away
+    {
+        std::lock_guard<std::mutex> lock(batch_queue_mtx);
+        for(auto it = batch_pending.begin(); it != batch_pending.end(); ++it)
+        {
+            if(it->stream==rec)
+            {
+                batch_pending.erase(it);
+                std::lock_guard<std::mutex> reclock(rec->mtx);
+                rec->finished = true;
+                rec->stopreason = stop_reason::OUT_OF_TOKENS;
+                break;
+            }
+        }
+    }
+    rec->cv.notify_all();
+    return true;
+}
@@ -879,6 +879,30 @@ extern "C" {
                     llama_seq_id   dest_seq_id,
            llama_state_seq_flags   flags);
 
+    //kcpp: sequence state limited to the kv cells at positions [p0, p1), p1 < 0 means to the end.
+    //restoring keeps the cells of the sequence below p0 and replaces everything from p0 onwards,
+    //so a range can be stacked on top of a previously restored prefix. plain kv caches only, not recurrent.
+    LLAMA_API size_t llama_state_seq_get_size_range(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+                       llama_pos   p0,
+                       llama_pos   p1);
+
+    LLAMA_API size_t llama_state_seq_get_data_range(
+            struct llama_context * ctx,
+                         uint8_t * dst,
+                          size_t   size,
+                    llama_seq_id   seq_id,
+                       llama_pos   p0,
+                       llama_pos   p1);
+
+    LLAMA_API size_t llama_state_seq_set_data_range(
+            struct llama_context * ctx,
+                   const uint8_t * src,
+                          size_t   size,
+                    llama_seq_id   dest_seq_id,
+                       llama_pos   p0);
+
     //
     // Decoding
     //
@@ -91,6 +91,10 @@ maxhordectx = 0 #set to whatever maxctx is if 0
 maxhordelen = 1024
 modelbusy = threading.Lock()
 requestsinqueue = 0
+batchgenslots = None #when batch slots are enabled, text gens take this semaphore instead of modelbusy so they can run together
+batchstream_lock = threading.Lock()
+batchstream_counter = 0
+batchstream_genkeys = {} #maps a genkey to its stream id, so batched gens can be polled and aborted individually
 ratelimitlookup = {}
 defaultport = 5001
 showsamplerwarning = True
@@ -162,6 +166,13 @@ class logit_bias(ctypes.Structure):
     _fields_ = [("token_id", ctypes.c_int32),
                 ("bias", ctypes.c_float)]
 
+class token_stream_outputs(ctypes.Structure):
+    _fields_ = [("status", ctypes.c_int),
+                ("id", ctypes.c_int32),
+                ("logprob", ctypes.c_float),
+                ("timestamp_us", ctypes.c_int64),
+                ("text", ctypes.c_char_p)]
+
 class token_count_outputs(ctypes.Structure):
     _fields_ = [("count", ctypes.c_int),
                 ("ids", ctypes.POINTER(ctypes.c_int))]
@@ -193,9 +204,11 @@ class load_model_inputs(ctypes.Structure):
                 ("draft_amount", ctypes.c_int),
                 ("draft_gpulayers", ctypes.c_int),
                 ("draft_gpusplit", ctypes.c_float * tensor_split_max),
+                ("ngram_draft", ctypes.c_bool),
                 ("mmproj_filename", ctypes.c_char_p),
                 ("mmproj_cpu", ctypes.c_bool),
                 ("visionmaxres", ctypes.c_int),
+                ("media_cache_mb", ctypes.c_int),
                 ("use_mmap", ctypes.c_bool),
                 ("use_mlock", ctypes.c_bool),
                 ("use_smartcontext", ctypes.c_bool),
@@ -220,12 +233,19 @@ class load_model_inputs(ctypes.Structure):
                 ("tensor_split", ctypes.c_float * tensor_split_max),
                 ("quant_k", ctypes.c_int),
                 ("quant_v", ctypes.c_int),
+                ("kv_recent", ctypes.c_int),
+                ("kv_paged", ctypes.c_bool),
+                ("kv_spill_dir", ctypes.c_char_p),
+                ("kv_resident_mb", ctypes.c_int),
                 ("check_slowness", ctypes.c_bool),
                 ("highpriority", ctypes.c_bool),
                 ("swa_support", ctypes.c_bool),
                 ("smartcache", ctypes.c_bool),
                 ("smartcacheslots", ctypes.c_int),
+                ("smartcache_ram_mb", ctypes.c_int),
+                ("smartcache_dir", ctypes.c_char_p),
                 ("pipelineparallel", ctypes.c_bool),
+                ("batch_slots", ctypes.c_int),
                 ("lora_multiplier", ctypes.c_float),
                 ("devices_override", ctypes.c_char_p),
                 ("quiet", ctypes.c_bool),
@@ -320,6 +340,7 @@ class sd_load_model_inputs(ctypes.Structure):
                 ("img_hard_limit", ctypes.c_int),
                 ("img_soft_limit", ctypes.c_int),
                 ("devices_override", ctypes.c_char_p),
+                ("step_cache_mode", ctypes.c_int),
                 ("quiet", ctypes.c_bool),
                 ("debugmode", ctypes.c_int)]
 
@@ -347,13 +368,24 @@ class sd_generation_inputs(ctypes.Structure):
                 ("remove_limits", ctypes.c_bool),
                 ("circular_x", ctypes.c_bool),
                 ("circular_y", ctypes.c_bool),
-                ("upscale", ctypes.c_bool)]
+                ("upscale", ctypes.c_bool),
+                ("batch_count", ctypes.c_int),
+                ("step_cache_mode", ctypes.c_int),
+                ("step_cache_threshold", ctypes.c_float),
+                ("output_format", ctypes.c_int),
+                ("output_quality", ctypes.c_int),
+                ("png_compression", ctypes.c_int)]
 
 class sd_generation_outputs(ctypes.Structure):
     _fields_ = [("status", ctypes.c_int),
                 ("animated", ctypes.c_int),
-                ("data", ctypes.c_char_p),
-                ("data_extra", ctypes.c_char_p)]
+                ("data", ctypes.c_void_p),
+                ("data_extra", ctypes.c_void_p),
+                ("images_count", ctypes.c_int),
+                ("images", ctypes.POINTER(ctypes.c_void_p)),
+                ("data_length", ctypes.c_int),
+                ("data_extra_length", ctypes.c_int),
+                ("images_length", ctypes.POINTER(ctypes.c_int))]
 
 class sd_upscale_inputs(ctypes.Structure):
     _fields_ = [("init_images", ctypes.c_char_p),
@@ -370,17 +402,20 @@ class whisper_load_model_inputs(ctypes.Structure):
                 ("vulkan_info", ctypes.c_char_p),
                 ("devices_override", ctypes.c_char_p),
                 ("quiet", ctypes.c_bool),
-                ("debugmode", ctypes.c_int)]
+                ("debugmode", ctypes.c_int),
+                ("threads", ctypes.c_int)]
 
 class whisper_generation_inputs(ctypes.Structure):
     _fields_ = [("prompt", ctypes.c_char_p),
                 ("audio_data", ctypes.c_char_p),
                 ("suppress_non_speech", ctypes.c_bool),
-                ("langcode", ctypes.c_char_p)]
+                ("langcode", ctypes.c_char_p),
+                ("long_form", ctypes.c_bool)]
 
 class whisper_generation_outputs(ctypes.Structure):
     _fields_ = [("status", ctypes.c_int),
-                ("data", ctypes.c_char_p)]
+                ("data", ctypes.c_char_p),
+                ("segments", ctypes.c_char_p)]
 
 class tts_load_model_inputs(ctypes.Structure):
     _fields_ = [("threads", ctypes.c_int),
@@ -402,7 +437,8 @@ class tts_generation_inputs(ctypes.Structure):
                 ("audio_seed", ctypes.c_int),
                 ("custom_speaker_voice", ctypes.c_char_p),
                 ("custom_speaker_text", ctypes.c_char_p),
-                ("custom_speaker_data", ctypes.c_char_p)]
+                ("custom_speaker_data", ctypes.c_char_p),
+                ("stream", ctypes.c_bool)]
 
 class tts_generation_outputs(ctypes.Structure):
     _fields_ = [("status", ctypes.c_int),
@@ -431,6 +467,20 @@ class embeddings_generation_outputs(ctypes.Structure):
                 ("count", ctypes.c_int),
                 ("data", ctypes.c_char_p)]
 
+class embeddings_batch_inputs(ctypes.Structure):
+    _fields_ = [("prompts_count", ctypes.c_int),
+                ("prompts", ctypes.POINTER(ctypes.c_char_p)),
+                ("truncate", ctypes.c_bool),
+                ("output_format", ctypes.c_int)]
+
+class embeddings_batch_outputs(ctypes.Structure):
+    _fields_ = [("status", ctypes.c_int),
+                ("count", ctypes.c_int),
+                ("rows", ctypes.c_int),
+                ("n_embd", ctypes.c_int),
+                ("row_bytes", ctypes.c_int),
+                ("data", ctypes.c_void_p)]
+
 class StdoutRedirector:
     def __init__(self, writer):
         self.writer = writer
@@ -742,6 +792,25 @@ def init_library():
     handle.generate.restype = generation_outputs
     handle.new_token.restype = ctypes.c_char_p
     handle.new_token.argtypes = [ctypes.c_int]
+    handle.batch_generate.argtypes = [generation_inputs, ctypes.c_int, ctypes.c_bool]
+    handle.batch_generate.restype = generation_outputs
+    handle.batch_new_token.restype = ctypes.c_char_p
+    handle.batch_new_token.argtypes = [ctypes.c_int, ctypes.c_int]
+    handle.batch_get_stream_count.argtypes = [ctypes.c_int]
+    handle.batch_get_stream_count.restype = ctypes.c_int
+    handle.batch_has_finished.argtypes = [ctypes.c_int]
+    handle.batch_has_finished.restype = ctypes.c_bool
+    handle.batch_get_stop_reason.argtypes = [ctypes.c_int]
+    handle.batch_get_stop_reason.restype = ctypes.c_int
+    handle.batch_get_pending_output.argtypes = [ctypes.c_int]
+    handle.batch_get_pending_output.restype = ctypes.c_char_p
+    handle.batch_abort_generate.argtypes = [ctypes.c_int]
+    handle.batch_abort_generate.restype = ctypes.c_bool
+    handle.batch_wait_tokens.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_int]
+    handle.batch_wait_tokens.restype = ctypes.c_int
+    handle.token_stream_wait.argtypes = [ctypes.c_int]
+    handle.token_stream_wait.restype = ctypes.c_int
+    handle.token_stream_pop.restype = token_stream_outputs
     handle.get_stream_count.restype = ctypes.c_int
     handle.has_finished.restype = ctypes.c_bool
     handle.has_audio_support.restype = ctypes.c_bool
@@ -789,10 +858,17 @@ def init_library():
     handle.tts_load_model.restype = ctypes.c_bool
     handle.tts_generate.argtypes = [tts_generation_inputs]
     handle.tts_generate.restype = tts_generation_outputs
+    handle.tts_stream_wait.argtypes = [ctypes.c_int]
+    handle.tts_stream_wait.restype = ctypes.c_int
+    handle.tts_stream_pop.restype = token_stream_outputs
+    handle.tts_stream_sample_rate.restype = ctypes.c_int
+    handle.tts_abort.restype = ctypes.c_bool
     handle.embeddings_load_model.argtypes = [embeddings_load_model_inputs]
     handle.embeddings_load_model.restype = ctypes.c_bool
     handle.embeddings_generate.argtypes = [embeddings_generation_inputs]
     handle.embeddings_generate.restype = embeddings_generation_outputs
+    handle.embeddings_generate_batch.argtypes = [embeddings_batch_inputs]
+    handle.embeddings_generate_batch.restype = embeddings_batch_outputs
     handle.last_logprobs.restype = last_logprobs_outputs
     handle.detokenize.argtypes = [token_count_outputs]
     handle.detokenize.restype = ctypes.c_char_p
@@ -1592,9 +1668,11 @@ def load_model(model_filename):
             inputs.draft_gpusplit[n] = float(args.draftgpusplit[n])
         else:
             inputs.draft_gpusplit[n] = 0
+    inputs.ngram_draft = (True if args.ngramdraft and not args.draftmodel else False)
     inputs.mmproj_filename = args.mmproj.encode("UTF-8") if args.mmproj else "".encode("UTF-8")
     inputs.mmproj_cpu = (True if args.mmprojcpu else False)
     inputs.visionmaxres = (512 if args.visionmaxres < 512 else (2048 if args.visionmaxres > 2048 else args.visionmaxres))
+    inputs.media_cache_mb = (args.mediacache if args.mediacache > 0 else 0)
     inputs.use_smartcontext = args.smartcontext
     inputs.use_contextshift = (0 if args.noshift else 1)
     inputs.use_fastforward = (0 if args.nofastforward else 1)
@@ -1608,6 +1686,10 @@ def load_model(model_filename):
             inputs.quant_k = inputs.quant_v = args.quantkv
     else:
         inputs.quant_k = inputs.quant_v = 0
+    inputs.kv_recent = (args.kvrecent if (args.kvrecent > 0 and args.quantkv > 0 and not args.noflashattention) else 0)
+    inputs.kv_paged = (True if (args.kvpaged or args.kvspilldir) else False)
+    inputs.kv_spill_dir = (os.path.abspath(args.kvspilldir).encode("UTF-8") if args.kvspilldir else "".encode("UTF-8"))
+    inputs.kv_resident_mb = (args.kvresident if args.kvresident > 0 else 0)
     inputs.batchsize = args.batchsize
     inputs.autofit = args.autofit
     inputs.autofit_tax_mb = int(args.autofitpadding) + int(calulated_gpu_overhead/(1024*1024))
@@ -1654,7 +1736,10 @@ def load_model(model_filename):
     sclimit = (savestate_limit_default if scint<=1 else scint)
     savestate_limit = sclimit
     inputs.smartcacheslots = sclimit
+    inputs.smartcache_ram_mb = (args.smartcacheram if args.smartcacheram > 0 else 0)
+    inputs.smartcache_dir = (os.path.abspath(args.smartcachedir).encode("UTF-8") if args.smartcachedir else "".encode("UTF-8"))
     inputs.pipelineparallel = (not args.nopipelineparallel)
+    inputs.batch_slots = args.batchslots
     inputs = set_backend_props(inputs)
     ret = handle.load_model(inputs)
     return ret
@@ -1883,7 +1968,16 @@ def generate(genparams, stream_flag=False):
         pendingabortkey = ""
         return {"text":"","status":-1,"stopreason":-1, "prompt_tokens":0, "completion_tokens": 0, "total_tokens": 0}
     else:
-        ret = handle.generate(inputs)
+        batch_stream_id = genparams.get('batch_stream_id', 0)
+        if batch_stream_id > 0:
+            if genkey!="":
+                batchstream_genkeys[genkey] = batch_stream_id
+            wantlogprobs = True if ("logprobs" in genparams and genparams["logprobs"]) else False #logprobs are only recorded on the regular path
+            ret = handle.batch_generate(inputs, batch_stream_id, wantlogprobs)
+            if genkey!="":
+                batchstream_genkeys.pop(genkey, None)
+        else:
+            ret = handle.generate(inputs)
         outstr = ""
         if ret.status==1:
             outstr = ret.text.decode("UTF-8","ignore")
@@ -1910,6 +2004,8 @@ def sd_get_available_schedulers():
     return info.get('available_schedulers', [])
 
 sd_convdirect_choices = ['off', 'vaeonly', 'full']
+sd_stepcache_choices = ['off', 'auto', 'easycache', 'ucache', 'cache-dit']
+sd_outputformat_choices = ['png', 'jpeg']
 
 def sd_convdirect_option(value):
     if not value:
@@ -1970,6 +2066,7 @@ def sd_load_model(model_filename,vae_filename,lora_filenames,t5xxl_filename,clip
     inputs.img_hard_limit = args.sdclamped
     inputs.img_soft_limit = args.sdclampedsoft
     inputs.lora_apply_mode = 0 #auto for now
+    inputs.step_cache_mode = sd_stepcache_choices.index(args.sdstepcache) if args.sdstepcache in sd_stepcache_choices else 0
     inputs = set_backend_props(inputs)
     ret = handle.sd_load_model(inputs)
     return ret
@@ -2068,9 +2165,14 @@ def sd_upscale(genparams):
     ret = handle.sd_upscale(inputs)
     data_main = ""
     if ret.status==1:
-        data_main = ret.data.decode("UTF-8","ignore")
+        data_main = sd_read_b64(ret.data, ret.data_length)
     return data_main
 
+def sd_read_b64(ptr, length): # image outputs are base64 buffers with a length, read them in one copy
+    if not ptr or length <= 0:
+        return ""
+    return ctypes.string_at(ptr, length).decode("ascii")
+
 def sd_generate(genparams):
     global maxctx, args, currentusergenkey, totalgens, pendingabortkey, chatcompl_adapter
 
@@ -2164,26 +2266,42 @@ def sd_generate(genparams):
     inputs.circular_x = tryparseint(adapter_obj.get("circular_x", genparams.get("circular_x",0)),0)
     inputs.circular_y = tryparseint(adapter_obj.get("circular_y", genparams.get("circular_y",0)),0)
     inputs.upscale = (True if tryparseint(genparams.get("enable_hr", 0),0) else False)
+    batch_count = tryparseint(genparams.get("batch_size", genparams.get("n", 1)),1)
+    inputs.batch_count = (1 if batch_count < 1 else (8 if batch_count > 8 else batch_count))
+    step_cache = str(adapter_obj.get("step_cache", genparams.get("step_cache", ""))).lower()
+    inputs.step_cache_mode = sd_stepcache_choices.index(step_cache) if step_cache in sd_stepcache_choices else -1
+    inputs.step_cache_threshold = tryparsefloat(adapter_obj.get("step_cache_threshold", genparams.get("step_cache_threshold", 0)),0)
+    output_format = str(genparams.get("output_format", "png")).lower()
+    output_format = "jpeg" if output_format=="jpg" else output_format
+    output_format = output_format if output_format in sd_outputformat_choices else "png" # webp falls back to png
+    inputs.output_format = sd_outputformat_choices.index(output_format)
+    inputs.output_quality = tryparseint(genparams.get("output_quality", genparams.get("output_compression", 0)),0)
+    inputs.png_compression = tryparseint(genparams.get("png_compression", -1),-1)
     ret = handle.sd_generate(inputs)
     data_main = ""
     data_extra = ""
+    data_all = []
     animated = False
     if ret.status==1:
-        data_main = ret.data.decode("UTF-8","ignore")
-        data_extra = ret.data_extra.decode("UTF-8","ignore")
+        data_main = sd_read_b64(ret.data, ret.data_length)
+        data_extra = sd_read_b64(ret.data_extra, ret.data_extra_length)
         animated = True if ret.animated else False
-    return {"animated": animated, "data":data_main, "data_extra":data_extra}
+        data_all = [sd_read_b64(ret.images[i], ret.images_length[i]) for i in range(ret.images_count)]
+    if not data_all and data_main:
+        data_all = [data_main]
+    return {"animated": animated, "data":data_main, "data_extra":data_extra, "images":data_all, "format":output_format}
 
 
 def whisper_load_model(model_filename):
     global args
     inputs = whisper_load_model_inputs()
     inputs.model_filename = model_filename.encode("UTF-8")
+    inputs.threads = args.threads
     inputs = set_backend_props(inputs)
     ret = handle.whisper_load_model(inputs)
     return ret
 
-def whisper_generate(genparams):
+def whisper_generate(genparams, segments_out=None):
     global args
     prompt = genparams.get("prompt", "")
     audio_data = genparams.get("audio_data", "")
@@ -2196,10 +2314,16 @@ def whisper_generate(genparams):
     lc = lc.strip().lower() if (lc and lc.strip().lower()!="") else "auto"
     inputs.langcode = lc.encode("UTF-8")
     inputs.suppress_non_speech = genparams.get("suppress_non_speech", False)
+    inputs.long_form = genparams.get("long_form", False)
     ret = handle.whisper_generate(inputs)
     outstr = ""
     if ret.status==1:
         outstr = ret.data.decode("UTF-8","ignore")
+        if segments_out is not None and ret.segments:
+            try:
+                segments_out.extend(json.loads(ret.segments.decode("UTF-8","ignore")))
+            except Exception:
+                pass
     return outstr
 
 def tts_load_model(ttc_model_filename,cts_model_filename):
@@ -2242,7 +2366,7 @@ def tts_prepare_voice_json(jsonstr):
     except Exception:
         return None
 
-def tts_generate(genparams):
+def tts_generate(genparams, stream=False):
     global args
     prompt = genparams.get("input", genparams.get("text", ""))
     prompt = prompt.strip()
@@ -2277,6 +2401,7 @@ def tts_generate(genparams):
     else:
         inputs.custom_speaker_text = "".encode("UTF-8")
         inputs.custom_speaker_data = "".encode("UTF-8")
+    inputs.stream = stream
     ret = handle.tts_generate(inputs)
     outstr = ""
     if ret.status==1:
@@ -2306,27 +2431,29 @@ def embeddings_generate(genparams):
         if prompt:
             prompts.append(prompt)
 
-    tokarrs = []
+    # all inputs go down in one call and come back as packed rows, float32, int8 or sign bits
+    embtype = genparams.get("embedding_type", "float")
+    outfmt = 1 if embtype=="int8" else (2 if embtype=="binary" else 0)
+    rows = []
     tokcnt = 0
-    for prompt in prompts:
-        tokarr = []
-        tmpcnt = 0
-        try:
-            inputs = embeddings_generation_inputs()
-            inputs.prompt = prompt.encode("UTF-8")
-            inputs.truncate = genparams.get('truncate', True)
-            ret = handle.embeddings_generate(inputs)
-            if ret.status==1:
-                outstr = ret.data.decode("UTF-8","ignore")
-                tokarr = json.loads(outstr) if outstr else []
-                tmpcnt = ret.count
-        except Exception as e:
-            tokarr = []
-            tmpcnt = 0
-            print(f"Error: {e}")
-        tokarrs.append(tokarr)
-        tokcnt += tmpcnt
-    return {"count":tokcnt, "data":tokarrs}
+    try:
+        inputs = embeddings_batch_inputs()
+        inputs.prompts_count = len(prompts)
+        inputs.prompts = (ctypes.c_char_p * len(prompts))()
+        for n, prompt in enumerate(prompts):
+            inputs.prompts[n] = prompt.encode("UTF-8")
+        inputs.truncate = genparams.get('truncate', True)
+        inputs.output_format = outfmt
+        ret = handle.embeddings_generate_batch(inputs)
+        if ret.status==1 and ret.rows > 0:
+            raw = ctypes.string_at(ret.data, ret.rows * ret.row_bytes)
+            rows = [raw[i*ret.row_bytes:(i+1)*ret.row_bytes] for i in range(ret.rows)]
+            tokcnt = ret.count
+    except Exception as e:
+        rows = []
+        tokcnt = 0
+        print(f"Error: {e}")
+    return {"count":tokcnt, "format":outfmt, "data":rows}
 
 def tokenize_ids(countprompt,tcaddspecial):
     rawcountdata = handle.token_count(countprompt.encode("UTF-8"),tcaddspecial)
@@ -3397,7 +3524,11 @@ class KcppServerRequestHandler(http.server.SimpleHTTPRequestHandler):
                 global last_non_horde_req_time
                 last_non_horde_req_time = time.time()
 
-            return generate(genparams=genparams,stream_flag=stream_flag)
+            try:
+                return generate(genparams=genparams,stream_flag=stream_flag)
+            finally:
+                if stream_flag and genparams.get('batch_stream_id', 0) <= 0:
+                    handle.token_stream_close() #covers early exits that never reached the c++ generate
 
         genout = {"text": "", "status": -1, "stopreason": -1, "prompt_tokens":0, "completion_tokens": 0, "total_tokens": 0}
         if stream_flag:
@@ -3482,6 +3613,8 @@ class KcppServerRequestHandler(http.server.SimpleHTTPRequestHandler):
 
     async def handle_sse_stream(self, genparams, api_format):
         global friendlymodelname, currfinishreason
+        batch_stream_id = genparams.get('batch_stream_id', 0)
+        finishreason = None
         using_openai_tools = genparams.get('using_openai_tools', False)
         self.send_response(200)
         self.send_header("X-Accel-Buffering", "no")
@@ -3498,25 +3631,40 @@ class KcppServerRequestHandler(http.server.SimpleHTTPRequestHandler):
         current_token = 0
         incomplete_token_buffer = bytearray()
         async_sleep_short = 0.02
-        await asyncio.sleep(0.35) #anti race condition, prevent check from overtaking generate
+        stream_wait_ms = 100 #the c++ side wakes us as soon as a token lands, this is only the idle timeout
+        loop = asyncio.get_event_loop()
+
+        def wait_for_tokens(): #blocks in a worker thread, returns (list of new token bytes, finished)
+            nonlocal current_token
+            newtoks = []
+            if batch_stream_id > 0:
+                avail = handle.batch_wait_tokens(batch_stream_id, current_token, stream_wait_ms)
+                while current_token < avail:
+                    token = handle.batch_new_token(batch_stream_id, current_token)
+                    if token is None: # Token isnt ready yet, received nullpointer
+                        break
+                    current_token += 1
+                    newtoks.append(ctypes.string_at(token))
+            else:
+                avail = handle.token_stream_wait(stream_wait_ms)
+                while avail > 0:
+                    rec = handle.token_stream_pop()
+                    if rec.status != 1:
+                        break
+                    current_token += 1
+                    newtoks.append(ctypes.string_at(rec.text))
+            return newtoks, (avail < 0)
 
         try:
             tokenReserve = "" #keeps fully formed tokens that we cannot send out yet
             while True:
-                streamDone = handle.has_finished() #exit next loop on done
+                newtoks, streamDone = await loop.run_in_executor(None, wait_for_tokens) #exit next loop on done
                 if streamDone:
-                    sr = handle.get_last_stop_reason()
-                    currfinishreason = "error" if sr==-2 else ("length" if (sr!=1) else "stop")
+                    sr = (handle.batch_get_stop_reason(batch_stream_id) if batch_stream_id > 0 else handle.get_last_stop_reason())
+                    finishreason = "error" if sr==-2 else ("length" if (sr!=1) else "stop")
+                    currfinishreason = finishreason
                 tokenStr = ""
-                streamcount = handle.get_stream_count()
-                while current_token < streamcount:
-                    token = handle.new_token(current_token)
-
-                    if token is None: # Token isnt ready yet, received nullpointer
-                        break
-
-                    current_token += 1
-                    newbyte = ctypes.string_at(token)
+                for newbyte in newtoks:
                     incomplete_token_buffer += bytearray(newbyte)
                     tokenSeg = incomplete_token_buffer.decode("UTF-8","ignore")
                     incseq = is_incomplete_utf8_sequence(incomplete_token_buffer)
@@ -3529,8 +3677,7 @@ class KcppServerRequestHandler(http.server.SimpleHTTPRequestHandler):
                     sseq = genparams.get('stop_sequence', [])
                     trimstop = genparams.get('trim_stop', True)
                     if trimstop and not streamDone and string_contains_or_overlaps_sequence_substring(tokenStr,sseq):
-                        tokenReserve += tokenStr
-                        await asyncio.sleep(async_sleep_short) #if a stop sequence could trigger soon, do not send output
+                        tokenReserve += tokenStr #if a stop sequence could trigger soon, do not send output
                     else:
                         if tokenStr!="" or tokenReserve!="":
                             tokenStr = tokenReserve + tokenStr
@@ -3544,7 +3691,7 @@ class KcppServerRequestHandler(http.server.SimpleHTTPRequestHandler):
                                         tokenStr = tokenStr[:sindex]
 
                         if tokenStr!="" or streamDone:
-                            need_split_final_msg = True if (currfinishreason is not None and streamDone and tokenStr!="") else False
+                            need_split_final_msg = True if (finishreason is not None and streamDone and tokenStr!="") else False
 
                             # hack for lcppui reasoning_content for thinking models
                             delta = {'role':'assistant','content':tokenStr}
@@ -3590,7 +3737,7 @@ class KcppServerRequestHandler(http.server.SimpleHTTPRequestHandler):
                                     logprobsdict = parse_last_logprobs(lastlogprobs)
                                     addonstr = json.dumps({"id":"koboldcpp","object":"chat.completion.chunk","created":int(time.time()),"model":friendlymodelname,"choices":[{"index":0,"finish_reason":None,"delta":{'role':'assistant','content':''},"logprobs":logprobsdict}]})
                                     await self.send_oai_sse_event(addonstr)
-                                event_str = json.dumps({"id":"koboldcpp","object":"chat.completion.chunk","created":int(time.time()),"model":friendlymodelname,"choices":[{"index":0,"finish_reason":currfinishreason,"delta":delta}]})
+                                event_str = json.dumps({"id":"koboldcpp","object":"chat.completion.chunk","created":int(time.time()),"model":friendlymodelname,"choices":[{"index":0,"finish_reason":finishreason,"delta":delta}]})
                                 await self.send_oai_sse_event(event_str)
                             elif api_format == 3:  # non chat completions
                                 if streamDone and ("logprobs" in genparams and genparams["logprobs"]): # this is a hack that sends an extra message containing ALL the logprobs
@@ -3598,16 +3745,12 @@ class KcppServerRequestHandler(http.server.SimpleHTTPRequestHandler):
                                     logprobsdict = parse_last_logprobs(lastlogprobs)
                                     addonstr = json.dumps({"id":"koboldcpp","object":"text_completion","created":int(time.time()),"model":friendlymodelname,"choices":[{"index":0,"finish_reason":None,"text":"","logprobs":logprobsdict}]})
                                     await self.send_oai_sse_event(addonstr)
-                                event_str = json.dumps({"id":"koboldcpp","object":"text_completion","created":int(time.time()),"model":friendlymodelname,"choices":[{"index":0,"finish_reason":currfinishreason,"text":tokenStr}]})
+                                event_str = json.dumps({"id":"koboldcpp","object":"text_completion","created":int(time.time()),"model":friendlymodelname,"choices":[{"index":0,"finish_reason":finishreason,"text":tokenStr}]})
                                 await self.send_oai_sse_event(event_str)
                             else:
-                                event_str = json.dumps({"token": tokenStr, "finish_reason":currfinishreason})
+                                event_str = json.dumps({"token": tokenStr, "finish_reason":finishreason})
                                 await self.send_kai_sse_event(event_str)
                             tokenStr = ""
-                        else:
-                            await asyncio.sleep(async_sleep_short)
-                else:
-                    await asyncio.sleep(async_sleep_short) #this should keep things responsive
 
                 if streamDone:
                     if api_format == 4 or api_format == 3:  # if oai chat, send last [DONE] message consistent with openai format
@@ -3617,7 +3760,10 @@ class KcppServerRequestHandler(http.server.SimpleHTTPRequestHandler):
         except Exception as ex:
             print("Token streaming was interrupted or aborted!")
             print(ex)
-            handle.abort_generate()
+            if batch_stream_id > 0:
+                handle.batch_abort_generate(batch_stream_id)
+            else:
+                handle.abort_generate()
             time.sleep(0.2) #short delay
 
         # flush buffers, sleep a bit to make sure all data sent, and then force close the connection
@@ -3628,7 +3774,14 @@ class KcppServerRequestHandler(http.server.SimpleHTTPRequestHandler):
 
 
     async def handle_request(self, genparams, api_format, stream_flag):
+        global batchstream_counter
         tasks = []
+        if batchgenslots is not None:
+            with batchstream_lock:
+                batchstream_counter += 1
+                genparams["batch_stream_id"] = batchstream_counter
+        elif stream_flag and not (api_format == 4 and genparams.get('using_openai_tools', False)):
+            handle.token_stream_open() #armed before generate starts, so the reader can never see the previous close
 
         try:
             if stream_flag:
@@ -3643,7 +3796,10 @@ class KcppServerRequestHandler(http.server.SimpleHTTPRequestHandler):
         except (BrokenPipeError, ConnectionAbortedError) as cae: # attempt to abort if connection lost
             print("An ongoing connection was aborted or interrupted!")
             print(cae)
-            handle.abort_generate()
+            if genparams.get('batch_stream_id', 0) > 0:
+                handle.batch_abort_generate(genparams['batch_stream_id'])
+            else:
+                handle.abort_generate()
             time.sleep(0.2) #short delay
         except Exception as e:
             print(e)
@@ -4287,7 +4443,11 @@ Change Mode<br>
             except Exception:
                 multiuserkey = ""
                 pass
-            if (multiuserkey=="" and requestsinqueue==0) or (multiuserkey!="" and multiuserkey==currentusergenkey):
+            if multiuserkey!="" and multiuserkey in batchstream_genkeys:
+                ag = handle.batch_abort_generate(batchstream_genkeys[multiuserkey])
+                response_body = (json.dumps({"success": ("true" if ag else "false"), "done":"true"}).encode())
+                print("\nGeneration Aborted")
+            elif (multiuserkey=="" and requestsinqueue==0) or (multiuserkey!="" and multiuserkey==currentusergenkey):
                 ag = handle.abort_generate()
                 time.sleep(0.1) #short delay before replying
                 response_body = (json.dumps({"success": ("true" if ag else "false"), "done":"true"}).encode())
@@ -4310,7 +4470,10 @@ Change Mode<br>
             except Exception:
                 multiuserkey = ""
 
-            if totalgens>0:
+            if totalgens>0 and multiuserkey!="" and multiuserkey in batchstream_genkeys:
+                pendtxt = handle.batch_get_pending_output(batchstream_genkeys[multiuserkey])
+                pendtxtStr = ctypes.string_at(pendtxt).decode("UTF-8","ignore")
+            elif totalgens>0:
                 if (multiuserkey=="" and multiuserkey==currentusergenkey and requestsinqueue==0) or (multiuserkey!="" and multiuserkey==currentusergenkey): #avoid leaking prompts in multiuser
                     pendtxt = handle.get_pending_output()
                     pendtxtStr = ctypes.string_at(pendtxt).decode("UTF-8","ignore")
@@ -4637,7 +4800,10 @@ Change Mode<br>
         if muint > 0 and requestsinqueue < multiuserlimit:
             reqblocking = True
             requestsinqueue += 1
-        if not modelbusy.acquire(blocking=reqblocking):
+        # with batch slots, text gens share the model and only wait for a free slot
+        textgen_paths = ('/request', '/api/v1/generate', '/api/latest/generate', '/api/extra/generate/stream', '/v1/completions', '/v1/completion', '/v1/chat/completions')
+        reqgate = batchgenslots if (batchgenslots is not None and (self.path.endswith(textgen_paths) or self.path in ('/completions', '/chat/completions'))) else modelbusy
+        if not reqgate.acquire(blocking=reqblocking):
             self.send_response(503)
             self.end_headers(content_type='application/json')
             self.wfile.write(json.dumps({"detail": {
@@ -4981,9 +5147,9 @@ Change Mode<br>
                                 lastgeneratedcomfyimg = b''
                             genresp = (json.dumps({"prompt_id": "12345678-0000-0000-0000-000000000001","number": 0,"node_errors":{}}).encode())
                         elif is_oai_imggen:
-                            genresp = (json.dumps({"created":int(time.time()),"data":[{"b64_json":gendat}],"background":"opaque","output_format":"png","size":"1024x1024","quality":"medium"}).encode())
+                            genresp = (json.dumps({"created":int(time.time()),"data":[{"b64_json":img} for img in (gen["images"] or [gendat])],"background":"opaque","output_format":gen["format"],"size":"1024x1024","quality":"medium"}).encode())
                         else:
-                            genresp = (json.dumps({"images":[gendat],"parameters":{},"info":"","animated":genanim,"extra_data":gendatextra}).encode())
+                            genresp = (json.dumps({"images":(gen["images"] or [gendat]),"parameters":{},"info":"","animated":genanim,"extra_data":gendatextra}).encode())
                         self.send_response(200)
                         self.send_header('content-length', str(len(genresp)))
                         self.end_headers(content_type='application/json')
@@ -4997,6 +5163,7 @@ Change Mode<br>
                     try:
                         global fullwhispermodelpath, has_audio_support
                         gendat = None
+                        transegs = []
                         if genparams.get("audio_data","") and fullwhispermodelpath=="" and has_audio_support: #if we have no whisper model but an audio-capable projector, use that instead
                             adapter_obj = {} if chatcompl_adapter is None else chatcompl_adapter
                             user_message_start = adapter_obj.get("user_start", "### Instruction:")
@@ -5016,8 +5183,11 @@ Change Mode<br>
                             temp_poll_result = generate(genparams=temp_poll)
                             gendat = temp_poll_result['text']
                         else:
-                            gendat = whisper_generate(genparams)
-                        genresp = (json.dumps({"text":gendat}).encode())
+                            gendat = whisper_generate(genparams, transegs)
+                        genresp = {"text":gendat}
+                        if genparams.get("long_form", False):
+                            genresp["segments"] = transegs #start and end in seconds
+                        genresp = (json.dumps(genresp).encode())
                         self.send_response(200)
                         self.send_header('content-length', str(len(genresp)))
                         self.end_headers(content_type='application/json')
@@ -5027,6 +5197,45 @@ Change Mode<br>
                         print("Transcribe: The response could not be sent, maybe connection was terminated?")
                         time.sleep(0.2) #short delay
                     return
+                elif is_tts and (genparams.get("stream", False) or genparams.get("stream_format", "")=="audio"):
+                    #sentences are sent as raw pcm as soon as each one is vocoded, behind a wav header of unknown length
+                    ttsthread = None
+                    stream_done = False
+                    try:
+                        handle.tts_stream_open()
+                        ttsthread = threading.Thread(target=tts_generate, args=(genparams, True))
+                        ttsthread.start()
+                        self.send_response(200)
+                        self.send_header('Content-Disposition', 'attachment; filename="output.wav"')
+                        self.end_headers(content_type='audio/wav')
+                        sent_header = False
+                        while True:
+                            alive = ttsthread.is_alive() # checked before waiting, so chunks pushed before it exited are still drained
+                            avail = handle.tts_stream_wait(100)
+                            if avail < 0 or (avail == 0 and not alive):
+                                break
+                            while avail > 0:
+                                rec = handle.tts_stream_pop()
+                                if rec.status != 1:
+                                    break
+                                avail -= 1
+                                pcm = base64.b64decode(ctypes.string_at(rec.text))
+                                if not sent_header:
+                                    rate = handle.tts_stream_sample_rate()
+                                    self.wfile.write(b'RIFF' + struct.pack('<I', 0xFFFFFFFF) + b'WAVEfmt ' + struct.pack('<IHHIIHH', 16, 1, 1, rate, rate * 2, 2, 16) + b'data' + struct.pack('<I', 0xFFFFFFFF))
+                                    sent_header = True
+                                self.wfile.write(pcm)
+                                self.wfile.flush()
+                        stream_done = True
+                    except Exception as ex:
+                        utfprint(ex,1)
+                        print("TTS: The stream could not be sent, maybe connection was terminated?")
+                    if ttsthread:
+                        if not stream_done:
+                            handle.tts_abort() # the client is gone, stop at the next token instead of finishing every sentence
+                        ttsthread.join() #never let the next request start while this one still runs
+                    self.close_connection = True
+                    return
                 elif is_tts:
                     try:
                         gendat = tts_generate(genparams)
@@ -5049,12 +5258,15 @@ Change Mode<br>
                         outdatas = []
                         odidx = 0
                         for od in gendat["data"]:
-                            if genparams.get("encoding_format", "")=="base64":
-                                binary_data = struct.pack('<' + 'f' * len(od), *od)
-                                b64_string = base64.b64encode(binary_data).decode('utf-8')
+                            if genparams.get("encoding_format", "")=="base64": #rows are already little endian packed
+                                b64_string = base64.b64encode(od).decode('utf-8')
                                 outdatas.append({"object":"embedding","index":odidx,"embedding":b64_string})
+                            elif gendat["format"]==1:
+                                outdatas.append({"object":"embedding","index":odidx,"embedding":list(struct.unpack('<' + 'b' * len(od), od))})
+                            elif gendat["format"]==2:
+                                outdatas.append({"object":"embedding","index":odidx,"embedding":list(od)})
                             else:
-                                outdatas.append({"object":"embedding","index":odidx,"embedding":od})
+                                outdatas.append({"object":"embedding","index":odidx,"embedding":list(struct.unpack('<' + 'f' * (len(od)//4), od))})
                             odidx += 1
                         genresp = (json.dumps({"object":"list","data":outdatas,"model":friendlyembeddingsmodelname,"usage":{"prompt_tokens":gendat["count"],"total_tokens":gendat["count"]}}).encode())
                         self.send_response(200)
@@ -5069,7 +5281,7 @@ Change Mode<br>
 
         finally:
             time.sleep(0.05)
-            modelbusy.release()
+            reqgate.release()
 
         self.send_response(404)
         self.end_headers(content_type='text/html')
@@ -8124,7 +8336,7 @@ def main(launch_args, default_args):
 
 def kcpp_main_process(launch_args, g_memory=None, gui_launcher=False):
     global embedded_kailite, embedded_kcpp_docs, embedded_kcpp_sdui, embedded_kailite_gz, embedded_kcpp_docs_gz, embedded_kcpp_sdui_gz, embedded_lcpp_ui_gz, start_time, exitcounter, global_memory, using_gui_launcher
-    global libname, args, friendlymodelname, friendlysdmodelname, fullsdmodelpath, password, fullwhispermodelpath, ttsmodelpath, embeddingsmodelpath, friendlyembeddingsmodelname, has_audio_support, has_vision_support, cached_chat_template
+    global libname, args, friendlymodelname, friendlysdmodelname, fullsdmodelpath, password, fullwhispermodelpath, ttsmodelpath, embeddingsmodelpath, friendlyembeddingsmodelname, has_audio_support, has_vision_support, cached_chat_template, batchgenslots
 
     start_server = True
 
@@ -8500,6 +8712,8 @@ def kcpp_main_process(launch_args, g_memory=None, gui_launcher=False):
             print("WARNING: Selected Text Model does not seem to be a GGUF file! Are you sure you picked the right file?")
         loadok = load_model(modelname)
         print("Load Text Model OK: " + str(loadok))
+        if loadok and args.batchslots > 1:
+            batchgenslots = threading.BoundedSemaphore(args.batchslots)
         if args.mmproj and args.mmproj!="": # multimodal vision and audio support is only known at runtime
             has_audio_support = handle.has_audio_support()
             has_vision_support = handle.has_vision_support()
@@ -8955,6 +9169,8 @@ if __name__ == '__main__':
     advparser.add_argument("--nofastforward", help="If set, do not attempt to fast forward GGUF context (always reprocess). Will also enable noshift", action='store_true')
     advparser.add_argument("--useswa", help="If set, allows Sliding Window Attention (SWA) KV Cache, which saves memory but cannot be used with context shifting.", action='store_true')
     advparser.add_argument("--smartcache", help="Enables intelligent context switching by saving KV cache snapshots to RAM. Requires fast forwarding.", metavar=('limit'), nargs='?', const=1, type=int, default=0)
+    advparser.add_argument("--smartcacheram", help="RAM budget in MB for SmartCache snapshots. Older snapshots are compressed, then spilled to --smartcachedir or dropped, once the budget is exceeded. 0 means no limit.", metavar=('[MB]'), type=int, default=0)
+    advparser.add_argument("--smartcachedir", help="Directory where SmartCache snapshots that no longer fit in --smartcacheram are spilled to disk.", metavar=('[directory]'), type=str, default="")
     advparser.add_argument("--ropeconfig", help="If set, uses customized RoPE scaling from configured frequency scale and frequency base (e.g. --ropeconfig 0.25 10000). Otherwise, uses NTK-Aware scaling set automatically based on context size. For linear rope, simply set the freq-scale and ignore the freq-base",metavar=('[rope-freq-scale]', '[rope-freq-base]'), default=[0.0, 10000.0], type=float, nargs='+')
     advparser.add_argument("--overridenativecontext", help="Overrides the native trained context of the loaded model with a custom value to be used for Rope scaling.",metavar=('[trained context]'), type=int, default=0)
     compatgroup3 = advparser.add_mutually_exclusive_group()
@@ -8969,6 +9185,7 @@ if __name__ == '__main__':
     advparser.add_argument("--cli", help="Does not launch KoboldCpp HTTP server. Instead, enables KoboldCpp from the command line, accepting interactive console input and displaying responses to the terminal.", action='store_true')
     advparser.add_argument("--genlimit","--promptlimit", help="Sets the maximum number of generated tokens, it will restrict all generations to this or lower. Also usable with --prompt or --benchmark.",metavar=('[token limit]'), type=int, default=0)
     advparser.add_argument("--multiuser", help="Runs in multiuser mode, which queues incoming requests instead of blocking them.", metavar=('limit'), nargs='?', const=1, type=int, default=1)
+    advparser.add_argument("--batchslots", help="GGUF text models only. Generates up to this many concurrent requests together in one shared context, splitting the KV cache between them. Requires multiuser. Set 0 or 1 to disable.", metavar=('[slots]'), type=int, default=0)
     advparser.add_argument("--multiplayer", help="Hosts a shared multiplayer session that others can join.", action='store_true')
     advparser.add_argument("--websearch", help="Enable the local search engine proxy so Web Searches can be done.", action='store_true')
     advparser.add_argument("--remotetunnel", help="Uses Cloudflare to create a remote tunnel, allowing you to access koboldcpp remotely over the internet even behind a firewall.", action='store_true')
@@ -8982,8 +9199,10 @@ if __name__ == '__main__':
     advparser.add_argument("--mmproj", metavar=('[filename]'), help="Select a multimodal projector file for vision models like LLaVA.", default="")
     advparser.add_argument("--mmprojcpu","--no-mmproj-offload", help="Force CLIP for Vision mmproj always on CPU.", action='store_true')
     advparser.add_argument("--visionmaxres", metavar=('[max px]'), help="Clamp MMProj vision maximum allowed resolution. Allowed values are between 512 to 2048 px (default 1024).", type=int, default=default_visionmaxres)
+    advparser.add_argument("--mediacache", metavar=('[MB]'), help="Memory budget in MB for cached vision and audio embeddings, so media that was already sent is not encoded again. 0 keeps only the current request's media.", type=int, default=512)
     advparser.add_argument("--draftmodel","--model-draft","-md", metavar=('[filename]'), help="Load a small draft model for speculative decoding. It will be fully offloaded. Vocab must match the main model.", default="")
     advparser.add_argument("--draftamount","--draft-max","--draft-n", metavar=('[tokens]'), help="How many tokens to draft per chunk before verifying results", type=int, default=default_draft_amount)
+    advparser.add_argument("--ngramdraft", help="Speculative decoding without a draft model. Drafts up to --draftamount tokens by looking up repeated n-grams in the context and earlier generations. Ignored if --draftmodel is set.", action='store_true')
     advparser.add_argument("--draftgpulayers","--gpu-layers-draft","--n-gpu-layers-draft","-ngld", metavar=('[layers]'), help="How many layers to offload to GPU for the draft model (default=full offload)", type=int, default=999)
     advparser.add_argument("--draftgpusplit", help="GPU layer distribution ratio for draft model (default=same as main). Only works if multi-GPUs selected for MAIN model and tensor_split is set!", metavar=('[Ratios]'), type=float, nargs='+')
     advparser.add_argument("--password", metavar=('[API key]'), help="Enter a password required to use this instance. This key will be required for all text endpoints. Image endpoints are not secured.", default=None)
@@ -8995,6 +9214,10 @@ if __name__ == '__main__':
     advparser.add_argument("--noflashattention","--no-flash-attn","-nofa", help="Disables flash attention.", action='store_true')
     advparser.add_argument("--lowvram","-nkvo","--no-kv-offload", help="If supported by the backend, do not offload KV to GPU (lowvram mode). Not recommended, will be slow.", action='store_true')
     advparser.add_argument("--quantkv", help="Sets the KV cache data type quantization, 0=f16, 1=q8, 2=q4. Requires Flash Attention for full effect, otherwise only K cache is quantized.",metavar=('[quantization level 0/1/2]'), type=int, choices=[0,1,2], default=0)
+    advparser.add_argument("--kvpaged", help="Maps the CPU side KV cache on demand, so memory is only committed for the context actually used instead of the full --contextsize.", action='store_true')
+    advparser.add_argument("--kvspilldir", help="Backs the paged CPU KV cache with a scratch file in this directory, so cold pages can be written out when RAM runs short. Implies --kvpaged.", metavar=('[directory]'), type=str, default="")
+    advparser.add_argument("--kvresident", help="With --kvspilldir, the newest KV cache in MB that is preferred to stay in memory. Older tokens beyond it, except the first few, are the first the OS pages out under memory pressure, it is not a hard limit. 0 leaves it to the OS.", metavar=('[MB]'), type=int, default=0)
+    advparser.add_argument("--kvrecent", metavar=('[tokens]'), help="With --quantkv, keeps the most recent N positions of the KV cache in f16 while older positions stay quantized. Requires Flash Attention. The KV cache then stays in system RAM. 0 disables.", type=int, default=0)
     advparser.add_argument("--smartcontext", help="Reserving a portion of context to try processing less frequently. Outdated. Not recommended.", action='store_true')
     advparser.add_argument("--unpack", help="Extracts the file contents of the KoboldCpp binary into a target directory.", metavar=('destination'), type=str, default="")
     advparser.add_argument("--exportconfig", help="Exports the current selected arguments as a .kcpps settings file", metavar=('[filename]'), type=str, default="")
@@ -9049,6 +9272,7 @@ if __name__ == '__main__':
     sdparsergrouplora.add_argument("--sdquant",  metavar=('[quantization level 0/1/2]'), help="If specified, loads the model quantized to save memory. 0=off, 1=q8, 2=q4", type=int, choices=[0,1,2], nargs="?", const=2, default=0)
     sdparsergrouplora.add_argument("--sdlora", metavar=('[filename]'), help="Specify image generation LoRAs safetensors models to be applied. Multiple LoRAs are accepted.", nargs='+')
     sdparsergroup.add_argument("--sdloramult", metavar=('[amount]'), help="Multiplier for the image LoRA model to be applied.", type=float, default=1.0)
+    sdparsergroup.add_argument("--sdstepcache", help="Reuses diffusion model outputs on denoising steps that barely change the image, skipping them. 'auto' picks a method and threshold for the loaded model, or choose 'easycache' (DiT), 'ucache' (UNet) or 'cache-dit' (DiT). Requests can override it with step_cache.", choices=sd_stepcache_choices, default=sd_stepcache_choices[0])
     sdparsergroup.add_argument("--sdtiledvae", metavar=('[maxres]'), help="Adjust the automatic VAE tiling trigger for images above this size. 0 disables vae tiling.", type=int, default=default_vae_tile_threshold)
     whisperparsergroup = parser.add_argument_group('Whisper Transcription Commands')
     whisperparsergroup.add_argument("--whispermodel", metavar=('[filename]'), help="Specify a Whisper .bin model to enable Speech-To-Text transcription.", default="")
@@ -13,6 +13,7 @@
 #include "ggml.h"
 #include "ggml-cpu.h"
 #include "gguf.h"
+#include "otherarch/context_match.h"
 
 #include <chrono>
 #include <filesystem>
@@ -428,7 +429,7 @@ std::string gguf_get_model_arch(const std::string & gguf_filename)
     return fileformat;
  }
 
- bool ArrStartWith(const std::vector<int> targetArray, const std::vector<int> searchSeq)
+ bool ArrStartWith(const std::vector<int> & targetArray, const std::vector<int> & searchSeq)
  {
      int ss = searchSeq.size();
      if(targetArray.size()<ss)
@@ -445,7 +446,8 @@ std::string gguf_get_model_arch(const std::string & gguf_filename)
      return true;
  }
 
- int ArrFindIndexOf(const std::vector<int> targetArray, const std::vector<int> searchSeq)
+ //knuth-morris-pratt, linear in both lengths
+ int ArrFindIndexOf(const std::vector<int> & targetArray, const std::vector<int> & searchSeq)
  {
      int ss = searchSeq.size();
      int tas = targetArray.size();
@@ -453,66 +455,47 @@ std::string gguf_get_model_arch(const std::string & gguf_filename)
      {
          return -1;
      }
-     for(int i=0;i<tas;++i)
+     if(ss==0)
      {
-         int srch = 0;
-         bool fail = false;
-         for(int srch=0;srch<ss;++srch)
+         return 0;
+     }
+     std::vector<int> fail(ss, 0);
+     for(int i=1, k=0;i<ss;++i)
+     {
+         while(k>0 && searchSeq[i]!=searchSeq[k])
          {
-             if ((i + srch) >= tas || targetArray[i + srch] != searchSeq[srch])
-             {
-                 fail = true;
-                 break;
-             }
+             k = fail[k-1];
          }
-         if(!fail)
+         if(searchSeq[i]==searchSeq[k])
          {
-             return i;
+             ++k;
          }
+         fail[i] = k;
      }
-     return -1;
- }
-
- std::vector<int> LongestCommonSubseq(const std::vector<int> x, const std::vector<int> y)
- {
-     int m = x.size(), n = y.size();
-
-     //int LCSuff[m+1][n+1];
-     std::vector<std::vector<int>> LCSuff(m+1, std::vector<int>(n+1));
-
-     for (int j = 0; j <= n; j++)
-         LCSuff[0][j] = 0;
-     for (int i = 0; i <= m; i++)
-         LCSuff[i][0] = 0;
-
-     for (int i = 1; i <= m; i++)
+     for(int i=0, k=0;i<tas;++i)
      {
-         for (int j = 1; j <= n; j++)
+         while(k>0 && targetArray[i]!=searchSeq[k])
          {
-             if (x[i - 1] == y[j - 1])
-                 LCSuff[i][j] = LCSuff[i - 1][j - 1] + 1;
-             else
-                 LCSuff[i][j] = 0;
+             k = fail[k-1];
          }
-     }
-
-     std::vector<int> longest;
-     for (int i = 1; i <= m; i++)
-     {
-         for (int j = 1; j <= n; j++)
+         if(targetArray[i]==searchSeq[k])
+         {
+             ++k;
+         }
+         if(k==ss)
          {
-             if (LCSuff[i][j] > longest.size())
-             {
-                 auto off1 = ((i - LCSuff[i][j] + 1) - 1);
-                 auto off2 = off1 + LCSuff[i][j];
-                 longest.clear();
-                //  std::vector<int>().swap(longest);
-                 longest = std::vector<int>(x.begin() + off1, x.begin() + off2);
-                // x.substr((i - LCSuff[i][j] + 1) - 1, LCSuff[i][j]);
-             }
+             return i - ss + 1;
          }
      }
-     return longest;
+     return -1;
+ }
+
+ //longest common contiguous run of tokens, found with a suffix automaton instead of an m*n table
+ std::vector<int> LongestCommonSubseq(const std::vector<int> & x, const std::vector<int> & y)
+ {
+     int start = 0;
+     int len = longest_common_token_run(x, y, &start);
+     return std::vector<int>(x.begin() + start, x.begin() + start + len);
  }
 
  void ContextFastForward(std::vector<int> &current_context_tokens, std::vector<int> &embd_inp,
@@ -96,6 +96,8 @@ enum ModelLoadResult
     RETRY_LOAD = 2, //used if it's suspected that the model is an older format
 };
 
+struct token_stream_record;
+
 ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in_file_format, FileFormatExtraMeta file_format_meta);
 generation_outputs gpttype_generate(const generation_inputs inputs);
 bool gpttype_generate_abort();
@@ -105,6 +107,19 @@ const std::string & gpttype_get_pending_output();
 std::vector<int> gpttype_get_token_arr(const std::string & input, bool addbos);
 std::string gpttype_detokenize(const std::vector<int> & input, bool render_special);
 const std::vector<TopPicksData> gpttype_get_top_picks_data();
+void gpttype_token_stream_open();
+void gpttype_token_stream_close();
+int gpttype_token_stream_wait(int timeout_ms);
+bool gpttype_token_stream_pop(token_stream_record & out);
+
+generation_outputs gpttype_batch_generate(const generation_inputs inputs, int stream_id, bool force_legacy);
+const char * gpttype_batch_new_token(int stream_id, int idx);
+int gpttype_batch_get_stream_count(int stream_id);
+bool gpttype_batch_has_finished(int stream_id);
+int gpttype_batch_get_stop_reason(int stream_id);
+const std::string & gpttype_batch_get_pending_output(int stream_id);
+bool gpttype_batch_abort(int stream_id);
+int gpttype_batch_wait_tokens(int stream_id, int have_count, int timeout_ms);
 
 bool sdtype_load_model(const sd_load_model_inputs inputs);
 sd_generation_outputs sdtype_generate(const sd_generation_inputs inputs);
@@ -116,18 +131,25 @@ whisper_generation_outputs whispertype_generate(const whisper_generation_inputs
 
 bool ttstype_load_model(const tts_load_model_inputs inputs);
 tts_generation_outputs ttstype_generate(const tts_generation_inputs inputs);
+void ttstype_stream_open();
+void ttstype_stream_close();
+void ttstype_abort();
+int ttstype_stream_wait(int timeout_ms);
+bool ttstype_stream_pop(token_stream_record & rec);
+int ttstype_stream_sample_rate();
 
 bool embeddingstype_load_model(const embeddings_load_model_inputs inputs);
 embeddings_generation_outputs embeddingstype_generate(const embeddings_generation_inputs inputs);
+embeddings_batch_outputs embeddingstype_generate_batch(const embeddings_batch_inputs inputs);
 
 void timer_start();
 double timer_check();
 void print_tok_vec(std::vector<int> &embd);
 void print_tok_vec(std::vector<float> &embd);
 void print_vec(std::vector<std::string> &embd);
-std::vector<int> LongestCommonSubseq(const std::vector<int> x, const std::vector<int> y);
-bool ArrStartWith(const std::vector<int> targetArray, const std::vector<int> searchSeq);
-int ArrFindIndexOf(const std::vector<int> targetArray, const std::vector<int> searchSeq);
+std::vector<int> LongestCommonSubseq(const std::vector<int> & x, const std::vector<int> & y);
+bool ArrStartWith(const std::vector<int> & targetArray, const std::vector<int> & searchSeq);
+int ArrFindIndexOf(const std::vector<int> & targetArray, const std::vector<int> & searchSeq);
 
 FileFormat check_file_format(const std::string & fname, FileFormatExtraMeta * fileformatmeta);
 void ContextFastForward(std::vector<int> &current_context_tokens, std::vector<int> &embd_inp,
@@ -0,0 +1,352 @@
+// Mixed radix FFT shared by whisper, mtmd audio and the TTS vocoders
+// Plans hold the factorization and per stage twiddles, built once per size and direction and shared between threads.
+// Transforms run out of place into a caller owned work buffer, so nothing is allocated per call.
+// Butterflies are radix 4, 2 and 3 with a generic one for other factors, written so the inner loops over the
+// stage stay contiguous and can be vectorized.
+
+#pragma once
+
+#include <vector>
+#include <map>
+#include <mutex>
+#include <memory>
+#include <cmath>
+#include <cstddef>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+struct kcpp_cpx
+{
+    float r;
+    float i;
+};
+
+static inline kcpp_cpx kcpp_cmul(kcpp_cpx a, kcpp_cpx b)
+{
+    return { a.r * b.r - a.i * b.i, a.r * b.i + a.i * b.r };
+}
+
+struct kcpp_fft_plan
+{
+    int n = 0;
+    bool inverse = false;
+    std::vector<int> factors; //radix and remaining length per stage
+    std::vector<kcpp_cpx> stage_tw; //per stage, (p-1)*m leg twiddles followed by the p roots of unity
+    std::vector<size_t> stage_off;
+
+    void init(int len, bool inv)
+    {
+        n = len;
+        inverse = inv;
+        factors.clear();
+        int rem = n;
+        int p = 4;
+        while (rem > 1)
+        {
+            while (rem % p)
+            {
+                p = (p == 4 ? 2 : (p == 2 ? 3 : p + 2));
+                if (p * p > rem)
+                {
+                    p = rem;
+                }
+            }
+            rem /= p;
+            factors.push_back(p);
+            factors.push_back(rem);
+        }
+        if (factors.empty())
+        {
+            factors.push_back(1);
+            factors.push_back(1);
+        }
+
+        const double sign = inverse ? 1.0 : -1.0;
+        stage_tw.clear();
+        stage_off.clear();
+        size_t fstride = 1;
+        for (size_t s = 0; s < factors.size(); s += 2)
+        {
+            const int fp = factors[s];
+            const int m = factors[s + 1];
+            stage_off.push_back(stage_tw.size());
+            for (int q = 1; q < fp; ++q)
+            {
+                for (int k = 0; k < m; ++k)
+                {
+                    const double a = sign * 2.0 * M_PI * (double)((size_t)q * k * fstride % n) / n;
+                    stage_tw.push_back({ (float)cos(a), (float)sin(a) });
+                }
+            }
+            for (int q = 0; q < fp; ++q)
+            {
+                const double a = sign * 2.0 * M_PI * q / fp;
+                stage_tw.push_back({ (float)cos(a), (float)sin(a) });
+            }
+            fstride *= fp;
+        }
+    }
+
+    //out must not alias in. unscaled in both directions
+    void execute(const kcpp_cpx * in, kcpp_cpx * out) const
+    {
+        if (n == 1)
+        {
+            out[0] = in[0];
+            return;
+        }
+        work(out, in, 1, 0);
+    }
+
+    //decimation in time, the sub transforms of every p-th input land in consecutive blocks of m
+    void work(kcpp_cpx * out, const kcpp_cpx * f, size_t fstride, int stage) const
+    {
+        const int p = factors[2 * stage];
+        const int m = factors[2 * stage + 1];
+        kcpp_cpx * const beg = out;
+        kcpp_cpx * const end = out + p * m;
+        if (m == 1)
+        {
+            do
+            {
+                *out = *f;
+                f += fstride;
+            } while (++out != end);
+        }
+        else
+        {
+            do
+            {
+                work(out, f, fstride * p, stage + 1);
+                f += fstride;
+            } while ((out += m) != end);
+        }
+
+        const kcpp_cpx * tw = stage_tw.data() + stage_off[stage];
+        switch (p)
+        {
+            case 2: bfly2(beg, tw, m); break;
+            case 3: bfly3(beg, tw, m); break;
+            case 4: bfly4(beg, tw, m); break;
+            default: bfly_generic(beg, tw, m, p); break;
+        }
+    }
+
+    static void bfly2(kcpp_cpx * out, const kcpp_cpx * tw, int m)
+    {
+        kcpp_cpx * o1 = out + m;
+        for (int k = 0; k < m; ++k)
+        {
+            const kcpp_cpx t = kcpp_cmul(o1[k], tw[k]);
+            o1[k] = { out[k].r - t.r, out[k].i - t.i };
+            out[k] = { out[k].r + t.r, out[k].i + t.i };
+        }
+    }
+
+    void bfly3(kcpp_cpx * out, const kcpp_cpx * tw, int m) const
+    {
+        const kcpp_cpx * tw1 = tw;
+        const kcpp_cpx * tw2 = tw + m;
+        const float c = (inverse ? 1.0f : -1.0f) * 0.86602540378443864676f; //sin of the 120 degree root
+        kcpp_cpx * o1 = out + m;
+        kcpp_cpx * o2 = out + 2 * m;
+        for (int k = 0; k < m; ++k)
+        {
+            const kcpp_cpx a1 = kcpp_cmul(o1[k], tw1[k]);
+            const kcpp_cpx a2 = kcpp_cmul(o2[k], tw2[k]);
+            const kcpp_cpx s = { a1.r + a2.r, a1.i + a2.i };
+            const kcpp_cpx d = { a1.r - a2.r, a1.i - a2.i };
+            const kcpp_cpx h = { out[k].r - 0.5f * s.r, out[k].i - 0.5f * s.i };
+            out[k] = { out[k].r + s.r, out[k].i + s.i };
+            o1[k] = { h.r - c * d.i, h.i + c * d.r };
+            o2[k] = { h.r + c * d.i, h.i - c * d.r };
+        }
+    }
+
+    void bfly4(kcpp_cpx * out, const kcpp_cpx * tw, int m) const
+    {
+        const kcpp_cpx * tw1 = tw;
+        const kcpp_cpx * tw2 = tw + m;
+        const kcpp_cpx * tw3 = tw + 2 * m;
+        kcpp_cpx * o1 = out + m;
+        kcpp_cpx * o2 = out + 2 * m;
+        kcpp_cpx * o3 = out + 3 * m;
+        const float sg = inverse ? -1.0f : 1.0f;
+        for (int k = 0; k < m; ++k)
+        {
+            const kcpp_cpx a0 = out[k];
+            const kcpp_cpx a1 = kcpp_cmul(o1[k], tw1[k]);
+            const kcpp_cpx a2 = kcpp_cmul(o2[k], tw2[k]);
+            const kcpp_cpx a3 = kcpp_cmul(o3[k], tw3[k]);
+            const kcpp_cpx t0 = { a0.r + a2.r, a0.i + a2.i };
+            const kcpp_cpx t1 = { a0.r - a2.r, a0.i - a2.i };
+            const kcpp_cpx t2 = { a1.r + a3.r, a1.i + a3.i };
+            const kcpp_cpx t3 = { sg * (a1.r - a3.r), sg * (a1.i - a3.i) };
+            out[k] = { t0.r + t2.r, t0.i + t2.i };
+            o2[k] = { t0.r - t2.r, t0.i - t2.i };
+            o1[k] = { t1.r + t3.i, t1.i - t3.r };
+            o3[k] = { t1.r - t3.i, t1.i + t3.r };
+        }
+    }
+
+    static void bfly_generic(kcpp_cpx * out, const kcpp_cpx * tw, int m, int p)
+    {
+        const kcpp_cpx * roots = tw + (size_t)(p - 1) * m;
+        kcpp_cpx local[32];
+        thread_local std::vector<kcpp_cpx> big;
+        kcpp_cpx * y = local;
+        if (p > 32)
+        {
+            big.resize(p);
+            y = big.data();
+        }
+        for (int k = 0; k < m; ++k)
+        {
+            y[0] = out[k];
+            for (int q = 1; q < p; ++q)
+            {
+                y[q] = kcpp_cmul(out[k + q * m], tw[(size_t)(q - 1) * m + k]);
+            }
+            for (int q1 = 0; q1 < p; ++q1)
+            {
+                kcpp_cpx acc = y[0];
+                int idx = 0;
+                for (int q = 1; q < p; ++q)
+                {
+                    idx += q1;
+                    idx = (idx >= p ? idx - p : idx);
+                    const kcpp_cpx t = kcpp_cmul(y[q], roots[idx]);
+                    acc.r += t.r;
+                    acc.i += t.i;
+                }
+                out[k + q1 * m] = acc;
+            }
+        }
+    }
+};
+
+//real transforms of even length go through a complex one of half the length
+struct kcpp_rfft_plan
+{
+    int n = 0;
+    bool inverse = false;
+    kcpp_fft_plan cplx;
+    std::vector<kcpp_cpx> super_tw;
+
+    void init(int len, bool inv)
+    {
+        n = len;
+        inverse = inv;
+        if (n % 2)
+        {
+            cplx.init(n, inv);
+            return;
+        }
+        const int half = n / 2;
+        cplx.init(half, inv);
+        super_tw.resize(half / 2 + 1);
+        for (int i = 0; i < (int)super_tw.size(); ++i)
+        {
+            double a = -M_PI * ((double)(i + 1) / half + 0.5);
+            if (inverse)
+            {
+                a = -a;
+            }
+            super_tw[i] = { (float)cos(a), (float)sin(a) };
+        }
+    }
+
+    //complex values needed in the work buffer
+    size_t work_size() const
+    {
+        return (size_t)2 * n;
+    }
+
+    //n real samples to the n/2+1 bins from 0 to nyquist, interleaved re/im
+    void forward(const float * in, float * out, kcpp_cpx * work) const
+    {
+        kcpp_cpx * res = (kcpp_cpx *)out;
+        if (n % 2)
+        {
+            for (int i = 0; i < n; ++i)
+            {
+                work[i] = { in[i], 0.0f };
+            }
+            cplx.execute(work, work + n);
+            for (int i = 0; i <= n / 2; ++i)
+            {
+                res[i] = work[n + i];
+            }
+            return;
+        }
+        const int half = n / 2;
+        kcpp_cpx * z = work + half;
+        cplx.execute((const kcpp_cpx *)in, z);
+        const kcpp_cpx dc = z[0];
+        res[0] = { dc.r + dc.i, 0.0f };
+        res[half] = { dc.r - dc.i, 0.0f };
+        for (int k = 1; k <= half / 2; ++k)
+        {
+            const kcpp_cpx fpk = z[k];
+            const kcpp_cpx fpnk = { z[half - k].r, -z[half - k].i };
+            const kcpp_cpx f1k = { fpk.r + fpnk.r, fpk.i + fpnk.i };
+            const kcpp_cpx f2k = { fpk.r - fpnk.r, fpk.i - fpnk.i };
+            const kcpp_cpx t = kcpp_cmul(f2k, super_tw[k - 1]);
+            res[k] = { 0.5f * (f1k.r + t.r), 0.5f * (f1k.i + t.i) };
+            res[half - k] = { 0.5f * (f1k.r - t.r), 0.5f * (t.i - f1k.i) };
+        }
+    }
+
+    //n/2+1 bins back to n real samples, unscaled so a round trip multiplies by n
+    void backward(const float * in, float * out, kcpp_cpx * work) const
+    {
+        const kcpp_cpx * bins = (const kcpp_cpx *)in;
+        if (n % 2)
+        {
+            for (int i = 0; i <= n / 2; ++i)
+            {
+                work[i] = bins[i];
+            }
+            for (int i = n / 2 + 1; i < n; ++i)
+            {
+                work[i] = { bins[n - i].r, -bins[n - i].i };
+            }
+            cplx.execute(work, work + n);
+            for (int i = 0; i < n; ++i)
+            {
+                out[i] = work[n + i].r;
+            }
+            return;
+        }
+        const int half = n / 2;
+        work[0] = { bins[0].r + bins[half].r, bins[0].r - bins[half].r };
+        for (int k = 1; k <= half / 2; ++k)
+        {
+            const kcpp_cpx fk = bins[k];
+            const kcpp_cpx fnkc = { bins[half - k].r, -bins[half - k].i };
+            const kcpp_cpx fek = { fk.r + fnkc.r, fk.i + fnkc.i };
+            const kcpp_cpx tmp = { fk.r - fnkc.r, fk.i - fnkc.i };
+            const kcpp_cpx fok = kcpp_cmul(tmp, super_tw[k - 1]);
+            work[k] = { fek.r + fok.r, fek.i + fok.i };
+            work[half - k] = { fek.r - fok.r, fok.i - fek.i };
+        }
+        cplx.execute(work, (kcpp_cpx *)out);
+    }
+};
+
+//shared plans, built on first use
+static inline const kcpp_rfft_plan & kcpp_rfft_get_plan(int n, bool inverse)
+{
+    static std::mutex mtx;
+    static std::map<std::pair<int, bool>, std::unique_ptr<kcpp_rfft_plan>> plans;
+    std::lock_guard<std::mutex> lock(mtx);
+    auto & p = plans[{ n, inverse }];
+    if (!p)
+    {
+        p.reset(new kcpp_rfft_plan());
+        p->init(n, inverse);
+    }
+    return *p;
+}
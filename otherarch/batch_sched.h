@@ -0,0 +1,97 @@
+// Slot scheduling policy for continuous batching.
+// Kept free of llama state so the choices can be tested on their own, the engine in gpttype_adapter applies them.
+
+#pragma once
+
+#include <vector>
+
+enum batch_slot_state
+{
+    BATCH_SLOT_IDLE = 0, //free, but may still hold reusable kv from its previous request
+    BATCH_SLOT_PROMPT = 1, //ingesting prompt tokens in chunks
+    BATCH_SLOT_GENERATING = 2,
+};
+
+//tokens at the start of cached that equal the prompt
+static inline int batch_common_prefix(const std::vector<int> & cached, const std::vector<int> & prompt)
+{
+    int match = 0;
+    while(match<cached.size() && match<prompt.size() && cached[match]==prompt[match])
+    {
+        ++match;
+    }
+    return match;
+}
+
+//prompt tokens that can be kept from the cached kv. at least one token is always evaluated to get logits
+static inline int batch_reusable_prefix(const std::vector<int> & cached, const std::vector<int> & prompt)
+{
+    int reuse = batch_common_prefix(cached, prompt);
+    if(reuse >= (int)prompt.size())
+    {
+        reuse = prompt.size() - 1;
+    }
+    return (reuse<0?0:reuse);
+}
+
+//idle slot whose cached kv shares the longest prefix with the prompt, least recently used on ties. -1 if all are busy
+template<typename Slot>
+int batch_pick_slot(const std::vector<Slot> & slots, const std::vector<int> & prompt)
+{
+    int best = -1;
+    int best_match = -1;
+    for(int i=0;i<slots.size();++i)
+    {
+        if(slots[i].state!=BATCH_SLOT_IDLE)
+        {
+            continue;
+        }
+        int match = batch_common_prefix(slots[i].context_tokens, prompt);
+        if(match>best_match || (match==best_match && slots[i].last_used < slots[best].last_used))
+        {
+            best = i;
+            best_match = match;
+        }
+    }
+    return best;
+}
+
+//kv cells that active slots may still grow into, plus cells held by idle slots and by the regular path (main_cells)
+template<typename Slot>
+int batch_reserved_cells(const std::vector<Slot> & slots, int exclude_idx, int main_cells)
+{
+    int reserved = main_cells;
+    for(int i=0;i<slots.size();++i)
+    {
+        if(i==exclude_idx)
+        {
+            continue;
+        }
+        const Slot & s = slots[i];
+        if(s.state==BATCH_SLOT_IDLE)
+        {
+            reserved += s.context_tokens.size();
+        }
+        else
+        {
+            reserved += s.prompt_tokens.size() + s.params.n_predict;
+        }
+    }
+    return reserved;
+}
+
+//least recently used idle slot other than keep that still holds kv, evicted first when a request does not fit. -1 if none
+template<typename Slot>
+int batch_pick_victim(const std::vector<Slot> & slots, int keep)
+{
+    int victim = -1;
+    for(int i=0;i<slots.size();++i)
+    {
+        if(i!=keep && slots[i].state==BATCH_SLOT_IDLE && slots[i].context_tokens.size()>0
+        && (victim==-1 || slots[i].last_used < slots[victim].last_used))
+        {
+            victim = i;
+        }
+    }
+    return victim;
+}
@@ -0,0 +1,205 @@
+// Token run matching between two contexts, used by context shifting and smart context.
+// A suffix automaton of the old context is matched against the new one in linear time,
+// with a couple of states per token instead of a quadratic table.
+
+#pragma once
+
+#include <vector>
+#include <map>
+#include <cstdint>
+#include <algorithm>
+
+struct token_suffix_automaton
+{
+    struct state
+    {
+        int len = 0;
+        int link = -1;
+        int firstpos = -1; //end index of the first occurrence in the source
+        int lastpos = -1; //end index of the last occurrence in the source
+        std::map<int, int> next;
+    };
+    std::vector<state> st;
+    int last = 0;
+
+    void build(const std::vector<int> & src)
+    {
+        st.clear();
+        st.reserve(src.size() * 2 + 1);
+        st.emplace_back();
+        last = 0;
+        for (int i = 0; i < (int)src.size(); ++i)
+        {
+            extend(src[i], i);
+        }
+        //every end position of a state is also one of its suffix link, push the last ones up from the longest states
+        std::vector<int> order(st.size());
+        for (int i = 0; i < (int)st.size(); ++i)
+        {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [this](int a, int b) { return st[a].len > st[b].len; });
+        for (int v : order)
+        {
+            if (st[v].link >= 0)
+            {
+                st[st[v].link].lastpos = std::max(st[st[v].link].lastpos, st[v].lastpos);
+            }
+        }
+    }
+
+    void extend(int tok, int pos)
+    {
+        int cur = st.size();
+        st.emplace_back();
+        st[cur].len = st[last].len + 1;
+        st[cur].firstpos = pos;
+        st[cur].lastpos = pos;
+        int p = last;
+        while (p != -1 && st[p].next.find(tok) == st[p].next.end())
+        {
+            st[p].next[tok] = cur;
+            p = st[p].link;
+        }
+        if (p == -1)
+        {
+            st[cur].link = 0;
+        }
+        else
+        {
+            int q = st[p].next[tok];
+            if (st[p].len + 1 == st[q].len)
+            {
+                st[cur].link = q;
+            }
+            else
+            {
+                int clone = st.size();
+                st.push_back(st[q]);
+                st[clone].len = st[p].len + 1;
+                while (p != -1)
+                {
+                    auto it = st[p].next.find(tok);
+                    if (it == st[p].next.end() || it->second != q)
+                    {
+                        break;
+                    }
+                    it->second = clone;
+                    p = st[p].link;
+                }
+                st[q].link = clone;
+                st[cur].link = clone;
+            }
+        }
+        last = cur;
+    }
+};
+
+//finds the longest run of tokens present in both x and y. ties go to the run ending earliest in x,
+//the same answer the old dynamic programming table gave. returns the length, start in x via x_start
+inline int longest_common_token_run(const std::vector<int> & x, const std::vector<int> & y, int * x_start)
+{
+    *x_start = 0;
+    if (x.empty() || y.empty())
+    {
+        return 0;
+    }
+    token_suffix_automaton sam;
+    sam.build(x);
+    int v = 0;
+    int l = 0;
+    int best = 0;
+    int best_end = -1;
+    for (int j = 0; j < (int)y.size(); ++j)
+    {
+        const int tok = y[j];
+        while (v != 0 && sam.st[v].next.find(tok) == sam.st[v].next.end())
+        {
+            v = sam.st[v].link;
+            l = sam.st[v].len;
+        }
+        auto it = sam.st[v].next.find(tok);
+        if (it != sam.st[v].next.end())
+        {
+            v = it->second;
+            ++l;
+        }
+        else
+        {
+            v = 0;
+            l = 0;
+        }
+        if (l > 0 && (l > best || (l == best && sam.st[v].firstpos < best_end)))
+        {
+            best = l;
+            best_end = sam.st[v].firstpos;
+        }
+    }
+    if (best > 0)
+    {
+        *x_start = best_end - best + 1;
+    }
+    return best;
+}
+
+//a run kept from the old context, x[old_start, old_start+len) lands at y[new_start, new_start+len)
+struct context_run
+{
+    int old_start = 0;
+    int new_start = 0;
+    int len = 0;
+};
+
+//covers the front of y with back to back runs that appear in order in x, which is what remains after spans are deleted
+//from x. each run is the longest prefix of the rest of y that occurs after the previous run in x, taken at its earliest
+//place there. stops at the first run shorter than min_run, the rest of y is new and has to be processed
+inline std::vector<context_run> plan_deletion_runs(const std::vector<int> & x, const std::vector<int> & y, int min_run)
+{
+    std::vector<context_run> runs;
+    if (x.empty() || y.empty())
+    {
+        return runs;
+    }
+    token_suffix_automaton sam;
+    sam.build(x);
+    int xi = 0;
+    int yi = 0;
+    while (yi < (int)y.size() && xi < (int)x.size())
+    {
+        //extend while some occurrence of y[yi, yi+len] still starts at or after xi
+        int v = 0;
+        int len = 0;
+        while (yi + len < (int)y.size())
+        {
+            auto it = sam.st[v].next.find(y[yi + len]);
+            if (it == sam.st[v].next.end() || sam.st[it->second].lastpos - len < xi)
+            {
+                break;
+            }
+            v = it->second;
+            ++len;
+        }
+        if (len < min_run || len == 0)
+        {
+            break;
+        }
+        //the first occurrence usually qualifies, otherwise look forward from xi for the earliest one that does
+        int start = sam.st[v].firstpos - len + 1;
+        if (start < xi)
+        {
+            start = xi;
+            while (!std::equal(y.begin() + yi, y.begin() + yi + len, x.begin() + start))
+            {
+                ++start;
+            }
+        }
+        context_run run;
+        run.old_start = start;
+        run.new_start = yi;
+        run.len = len;
+        runs.push_back(run);
+        xi = start + len;
+        yi += len;
+    }
+    return runs;
+}
@@ -7,6 +7,7 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstring>
 #include <cstdio>
 #include <fstream>
 #include <map>
@@ -26,6 +27,8 @@ static std::string ttsvulkandeviceenv;
 bool embeddings_debug = false;
 static int max_batchsize = 512;
 static std::string last_output = "";
+static std::vector<uint8_t> last_batch_output; //packed rows of the last batched request
+static int max_seqs = 64; //sequences sharing one decode
 
 static void batch_add_seq(llama_batch & batch, const std::vector<int32_t> & tokens, llama_seq_id seq_id) {
     size_t n_tokens = tokens.size();
@@ -141,6 +144,7 @@ bool embeddingstype_load_model(const embeddings_load_model_inputs inputs)
     ctx_params.n_threads_batch = nthreads;
     ctx_params.flash_attn_type = (inputs.flash_attention?LLAMA_FLASH_ATTN_TYPE_ENABLED:LLAMA_FLASH_ATTN_TYPE_DISABLED);
     ctx_params.kv_unified = true;
+    ctx_params.n_seq_max = max_seqs; //lets many short inputs share one decode
 
     embeddings_ctx = llama_init_from_model(embeddingsmodel, ctx_params);
 
@@ -175,33 +179,13 @@ bool embeddingstype_load_model(const embeddings_load_model_inputs inputs)
     return true;
 }
 
-embeddings_generation_outputs embeddingstype_generate(const embeddings_generation_inputs inputs)
+//tokenizes and truncates one input, false if it is too long and truncation is off
+static bool prepare_embedding_input(const std::string & prompt, bool truncate, std::vector<int32_t> & inp)
 {
-    embeddings_generation_outputs output;
-
-    if(embeddings_ctx==nullptr)
-    {
-        printf("\nWarning: KCPP Embeddings Model not initialized!\n");
-        output.data = "";
-        output.status = 0;
-        output.count = 0;
-        return output;
-    }
-
-    double timetaken = 0;
-    timer_start();
-
-    llama_memory_clear(llama_get_memory(embeddings_ctx),true);
-    std::string prompt = inputs.prompt;
-
-    // max batch size
     const uint64_t n_batch = max_batchsize;
-
-    // tokenize the prompts and trim
-    std::vector<std::vector<int32_t>> prompt_inputs;
-    auto inp = common_tokenize(embeddings_ctx, prompt, true, true);
+    inp = common_tokenize(embeddings_ctx, prompt, true, true);
     if (inp.size() > n_batch) {
-        if (inputs.truncate) {
+        if (truncate) {
             int oldsize = inp.size();
             //get bos token
             std::vector<int> bos;
@@ -220,52 +204,43 @@ embeddings_generation_outputs embeddingstype_generate(const embeddings_generatio
         } else {
             printf("\n%s: number of tokens in an input (%lld) exceeds embedding size limit for this model (%lld), lower token amount!\n",
                 __func__, (long long int) inp.size(), (long long int) n_batch);
-            output.data   = "";
-            output.status = 0;
-            output.count  = 0;
-            return output;
+            return false;
         }
     }
-    prompt_inputs.push_back(inp);
-
-    if(embeddings_debug)
-    {
-        print_tok_vec(inp);
-    }
-    printf("\nGenerating Embeddings for %d tokens...",inp.size());
+    return true;
+}
 
-    // initialize batch
-    const int n_prompts = 1;
+//embeds all inputs, packing as many sequences into each decode as fit. one normalized row per input,
+//taken from the first token when the model has no pooling
+static bool embed_inputs(const std::vector<std::vector<int32_t>> & prompt_inputs, std::vector<float> & rows, int & n_embd)
+{
+    const uint64_t n_batch = max_batchsize;
+    const int n_prompts = prompt_inputs.size();
     const enum llama_pooling_type pooling_type = llama_pooling_type(embeddings_ctx);
-    struct llama_batch batch = llama_batch_init(n_batch, 0, 1);
+    const llama_model * embeddingsmodel = llama_get_model(embeddings_ctx);
+    n_embd = llama_model_n_embd(embeddingsmodel);
+    const int embd_normalize = 2; //euclidean
 
     // count number of embeddings
+    std::vector<int> first_row(n_prompts, 0);
     int n_embd_count = 0;
-    if (pooling_type == LLAMA_POOLING_TYPE_NONE) {
-        for (int k = 0; k < n_prompts; k++) {
-            n_embd_count += prompt_inputs[k].size();
-        }
-    } else {
-        n_embd_count = n_prompts;
+    for (int k = 0; k < n_prompts; k++) {
+        first_row[k] = n_embd_count;
+        n_embd_count += (pooling_type == LLAMA_POOLING_TYPE_NONE ? prompt_inputs[k].size() : 1);
     }
-
-    // allocate output
-    const llama_model * embeddingsmodel = llama_get_model(embeddings_ctx);
-    const int n_embd = llama_model_n_embd(embeddingsmodel);
-    std::vector<float> embeddings(n_embd_count * n_embd, 0);
+    std::vector<float> embeddings((size_t)n_embd_count * n_embd, 0);
     float * emb = embeddings.data();
-    int embd_normalize = 2; //euclidean
+    struct llama_batch batch = llama_batch_init(n_batch, 0, 1);
 
     // break into batches
     int e = 0; // number of embeddings already stored
     int s = 0; // number of prompts in current batch
     for (int k = 0; k < n_prompts; k++) {
-        // clamp to n_batch tokens
         auto & inp = prompt_inputs[k];
         const uint64_t n_toks = inp.size();
         // encode if at capacity
-        if (batch.n_tokens + n_toks > n_batch) {
-            float * out = emb + e * n_embd;
+        if (batch.n_tokens + n_toks > n_batch || s >= max_seqs) {
+            float * out = emb + (size_t)e * n_embd;
             batch_decode(embeddings_ctx, batch, out, s, n_embd, embd_normalize);
             e += pooling_type == LLAMA_POOLING_TYPE_NONE ? batch.n_tokens : s;
             s = 0;
@@ -277,8 +252,57 @@ embeddings_generation_outputs embeddingstype_generate(const embeddings_generatio
     }
 
     // final batch
-    float * out = emb + e * n_embd;
-    batch_decode(embeddings_ctx, batch, out, s, n_embd, embd_normalize);
+    if (s > 0) {
+        float * out = emb + (size_t)e * n_embd;
+        batch_decode(embeddings_ctx, batch, out, s, n_embd, embd_normalize);
+    }
+    llama_batch_free(batch);
+
+    rows.resize((size_t)n_prompts * n_embd);
+    for (int k = 0; k < n_prompts; k++) {
+        std::copy(emb + (size_t)first_row[k] * n_embd, emb + (size_t)(first_row[k] + 1) * n_embd, rows.data() + (size_t)k * n_embd);
+    }
+    return true;
+}
+
+embeddings_generation_outputs embeddingstype_generate(const embeddings_generation_inputs inputs)
+{
+    embeddings_generation_outputs output;
+
+    if(embeddings_ctx==nullptr)
+    {
+        printf("\nWarning: KCPP Embeddings Model not initialized!\n");
+        output.data = "";
+        output.status = 0;
+        output.count = 0;
+        return output;
+    }
+
+    double timetaken = 0;
+    timer_start();
+
+    std::string prompt = inputs.prompt;
+
+    // tokenize the prompts and trim
+    std::vector<std::vector<int32_t>> prompt_inputs(1);
+    std::vector<int32_t> & inp = prompt_inputs[0];
+    if (!prepare_embedding_input(prompt, inputs.truncate, inp)) {
+        output.data   = "";
+        output.status = 0;
+        output.count  = 0;
+        return output;
+    }
+
+    if(embeddings_debug)
+    {
+        print_tok_vec(inp);
+    }
+    printf("\nGenerating Embeddings for %d tokens...",inp.size());
+
+    std::vector<float> rows;
+    int n_embd = 0;
+    embed_inputs(prompt_inputs, rows, n_embd);
+    const float * emb = rows.data();
 
     std::string outputarray = "[";
     for (int i = 0; i < n_embd; i++) {
@@ -291,9 +315,6 @@ embeddings_generation_outputs embeddingstype_generate(const embeddings_generatio
     outputarray += "]";
     last_output = outputarray;
 
-    // clean up
-    llama_batch_free(batch);
-
     timetaken = timer_check();
     printf("\nText Embeddings Generated %d values in %.2fs.\n",(int) n_embd,timetaken);
 
@@ -302,3 +323,72 @@ embeddings_generation_outputs embeddingstype_generate(const embeddings_generatio
     output.count = inp.size();
     return output;
 }
+
+//many inputs in one call, returned as a packed matrix with one row per input instead of text
+embeddings_batch_outputs embeddingstype_generate_batch(const embeddings_batch_inputs inputs)
+{
+    embeddings_batch_outputs output;
+    last_batch_output.clear();
+    output.data = last_batch_output.data();
+
+    if(embeddings_ctx==nullptr)
+    {
+        printf("\nWarning: KCPP Embeddings Model not initialized!\n");
+        output.status = 0;
+        return output;
+    }
+
+    double timetaken = 0;
+    timer_start();
+
+    std::vector<std::vector<int32_t>> prompt_inputs(std::max(0, inputs.prompts_count));
+    int tokcount = 0;
+    for (int i = 0; i < inputs.prompts_count; ++i) {
+        if (!prepare_embedding_input(inputs.prompts[i], inputs.truncate, prompt_inputs[i])) {
+            output.status = 0;
+            return output;
+        }
+        tokcount += prompt_inputs[i].size();
+    }
+    printf("\nGenerating Embeddings for %d inputs (%d tokens)...",inputs.prompts_count,tokcount);
+
+    std::vector<float> rows;
+    int n_embd = 0;
+    embed_inputs(prompt_inputs, rows, n_embd);
+
+    //rows are unit length, so int8 is a plain scale by 127 and binary keeps the sign bits, msb first
+    const int n_rows = prompt_inputs.size();
+    int row_bytes = n_embd * sizeof(float);
+    if (inputs.output_format == EMBD_FORMAT_INT8) {
+        row_bytes = n_embd;
+    } else if (inputs.output_format == EMBD_FORMAT_BINARY) {
+        row_bytes = (n_embd + 7) / 8;
+    }
+    last_batch_output.assign((size_t)n_rows * row_bytes, 0);
+    for (int r = 0; r < n_rows; ++r) {
+        const float * src = rows.data() + (size_t)r * n_embd;
+        uint8_t * dst = last_batch_output.data() + (size_t)r * row_bytes;
+        if (inputs.output_format == EMBD_FORMAT_INT8) {
+            for (int i = 0; i < n_embd; ++i) {
+                dst[i] = (uint8_t)(int8_t)std::clamp((int)std::lround(src[i] * 127.0f), -127, 127);
+            }
+        } else if (inputs.output_format == EMBD_FORMAT_BINARY) {
+            for (int i = 0; i < n_embd; ++i) {
+                dst[i / 8] |= (src[i] > 0.0f ? 1 : 0) << (7 - (i % 8));
+            }
+        } else {
+            memcpy(dst, src, row_bytes);
+        }
+    }
+
+    timetaken = timer_check();
+    printf("\nText Embeddings Generated %d rows of %d values in %.2fs.\n",n_rows,n_embd,timetaken);
+
+    output.status = 1;
+    output.count = tokcount;
+    output.rows = n_rows;
+    output.n_embd = n_embd;
+    output.row_bytes = row_bytes;
+    output.data = last_batch_output.data();
+    return output;
+}
@@ -0,0 +1,265 @@
+// Allowed token masks for grammar sampling
+// The vocab is sorted by its decoded code points, which makes it an implicit prefix trie. One walk over it per grammar
+// state shares the matching work between tokens with a common prefix and skips whole subtrees once a prefix is rejected.
+// The resulting bitmask is cached by stack configuration, so revisiting a state costs one lookup.
+// Uses the grammar internals, include after src/llama.cpp in the unity build.
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+struct kcpp_grammar_masker
+{
+    struct mask_entry
+    {
+        llama_grammar_stacks stacks;
+        std::vector<uint64_t> bits;
+        int allowed = 0;
+    };
+
+    int n_vocab = 0;
+    std::vector<std::vector<uint32_t>> cps; //code points per token, without the terminating 0
+    std::vector<int> order; //tokens in the walk, sorted by code points
+    std::vector<int> irregular; //pieces that end in a partial or invalid utf8 sequence
+    std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> irregular_decoded;
+    std::vector<int> eog;
+    bool grammar_ok = false; //grammars that match token ids directly go through the regular matcher
+    std::unordered_map<size_t, std::vector<mask_entry>> cache;
+    size_t cache_count = 0;
+    size_t cache_limit = 512;
+
+    void build(const std::vector<std::string> & pieces, const std::vector<int> & eog_ids)
+    {
+        n_vocab = pieces.size();
+        cps.assign(n_vocab, {});
+        order.clear();
+        irregular.clear();
+        irregular_decoded.clear();
+        eog = eog_ids;
+        std::vector<uint8_t> is_eog(n_vocab, 0);
+        for (int id : eog)
+        {
+            if (id >= 0 && id < n_vocab)
+            {
+                is_eog[id] = 1;
+            }
+        }
+        for (int i = 0; i < n_vocab; ++i)
+        {
+            const std::string & piece = pieces[i];
+            if (is_eog[i] || piece.empty() || piece[0] == 0)
+            {
+                continue; //eog is decided by the stacks, empty pieces are never allowed
+            }
+            auto decoded = decode_utf8(piece.c_str(), llama_partial_utf8{0, 0});
+            if (decoded.second.n_remain != 0)
+            {
+                irregular.push_back(i);
+                irregular_decoded.push_back(std::move(decoded));
+                continue;
+            }
+            decoded.first.pop_back();
+            cps[i] = std::move(decoded.first);
+            order.push_back(i);
+        }
+        std::sort(order.begin(), order.end(), [this](int a, int b) { return cps[a] < cps[b]; });
+        clear_cache();
+    }
+
+    void reset()
+    {
+        n_vocab = 0;
+        cps.clear();
+        order.clear();
+        irregular.clear();
+        irregular_decoded.clear();
+        eog.clear();
+        clear_cache();
+    }
+
+    void clear_cache()
+    {
+        cache.clear();
+        cache_count = 0;
+    }
+
+    //call whenever a new grammar is loaded, the cached masks point into the old rules
+    void set_grammar(const llama_grammar * grammar)
+    {
+        clear_cache();
+        grammar_ok = (grammar != nullptr);
+        if (grammar_ok)
+        {
+            for (const auto & rule : grammar->rules)
+            {
+                for (const auto & elem : rule)
+                {
+                    if (elem.type == LLAMA_GRETYPE_TOKEN || elem.type == LLAMA_GRETYPE_TOKEN_NOT)
+                    {
+                        grammar_ok = false;
+                    }
+                }
+            }
+        }
+    }
+
+    static size_t hash_stacks(const llama_grammar_stacks & stacks)
+    {
+        size_t h = stacks.size();
+        for (const auto & stack : stacks)
+        {
+            for (const llama_grammar_element * pos : stack)
+            {
+                h ^= std::hash<const void *>{}(pos) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+            }
+            h = h * 31 + stack.size();
+        }
+        return h;
+    }
+
+    //mask for the current grammar state, nullptr when the state has to go through the regular matcher
+    const mask_entry * get(llama_grammar * grammar)
+    {
+        if (!grammar_ok || n_vocab == 0 || grammar->partial_utf8.n_remain > 0)
+        {
+            return nullptr;
+        }
+        const size_t h = hash_stacks(grammar->stacks);
+        auto & bucket = cache[h];
+        for (const auto & e : bucket)
+        {
+            if (e.stacks == grammar->stacks)
+            {
+                return &e;
+            }
+        }
+        if (cache_count >= cache_limit)
+        {
+            clear_cache(); //states rarely repeat across that many steps, just start over
+            return get(grammar);
+        }
+        mask_entry e;
+        e.stacks = grammar->stacks;
+        e.bits.assign((n_vocab + 63) / 64, 0);
+        compute(grammar, e);
+        ++cache_count;
+        bucket.push_back(std::move(e));
+        return &bucket.back();
+    }
+
+    void allow(mask_entry & e, int id)
+    {
+        e.bits[id >> 6] |= (1ULL << (id & 63));
+        ++e.allowed;
+    }
+
+    void compute(llama_grammar * grammar, mask_entry & e)
+    {
+        bool allow_eos = false;
+        for (const auto & stack : e.stacks)
+        {
+            if (stack.empty())
+            {
+                allow_eos = true;
+                break;
+            }
+        }
+        if (allow_eos)
+        {
+            for (int id : eog)
+            {
+                if (id >= 0 && id < n_vocab)
+                {
+                    allow(e, id);
+                }
+            }
+        }
+        if (!order.empty())
+        {
+            walk(grammar, e.stacks, 0, order.size(), 0, e);
+        }
+        if (!irregular.empty())
+        {
+            std::vector<llama_grammar_candidate> cands;
+            cands.reserve(irregular.size());
+            for (size_t i = 0; i < irregular.size(); ++i)
+            {
+                cands.push_back({ i, irregular_decoded[i].first.data(), irregular_decoded[i].second });
+            }
+            std::vector<uint8_t> rejected(irregular.size(), 0);
+            for (const auto & r : llama_grammar_reject_candidates(grammar->rules, e.stacks, cands))
+            {
+                rejected[r.index] = 1;
+            }
+            for (size_t i = 0; i < irregular.size(); ++i)
+            {
+                if (!rejected[i])
+                {
+                    allow(e, irregular[i]);
+                }
+            }
+        }
+    }
+
+    //order[lo..hi) share their first depth code points and the grammar is at stacks after them
+    void walk(llama_grammar * grammar, const llama_grammar_stacks & stacks, int lo, int hi, int depth, mask_entry & e)
+    {
+        llama_grammar_stacks next;
+        int i = lo;
+        while (i < hi)
+        {
+            const uint32_t chr = cps[order[i]][depth];
+            int j = i + 1;
+            while (j < hi && cps[order[j]][depth] == chr)
+            {
+                ++j;
+            }
+            next.clear();
+            for (const auto & stack : stacks)
+            {
+                llama_grammar_accept_chr(*grammar, stack, chr, next);
+            }
+            if (!next.empty())
+            {
+                //shorter sequences sort first, so the tokens ending here lead the group
+                int k = i;
+                while (k < j && (int)cps[order[k]].size() == depth + 1)
+                {
+                    allow(e, order[k]);
+                    ++k;
+                }
+                if (k < j)
+                {
+                    walk(grammar, next, k, j, depth + 1, e);
+                }
+            }
+            i = j;
+        }
+    }
+
+    //disallowed logits become -inf, returns how many tokens are allowed
+    static int apply(const mask_entry & e, float * logits, int n)
+    {
+        const int words = (n + 63) / 64;
+        for (int w = 0; w < words; ++w)
+        {
+            const uint64_t m = e.bits[w];
+            if (m == ~0ULL)
+            {
+                continue;
+            }
+            float * lg = logits + w * 64;
+            const int cnt = std::min(64, n - w * 64);
+            for (int b = 0; b < cnt; ++b)
+            {
+                lg[b] = ((m >> b) & 1) ? lg[b] : -INFINITY;
+            }
+        }
+        return e.allowed;
+    }
+};
@@ -0,0 +1,275 @@
+// Output image encoding for image generation
+// PNG rows are filtered and deflated in horizontal bands on separate threads. Every band is a raw deflate stream ended
+// by a sync flush and written as its own IDAT chunk, so the chunks join into one zlib stream. The adler32 of the bands
+// is combined at the end. JPEG goes through the stb encoder.
+// Uses miniz and the stb_image_write internals, include after both in the unity build.
+
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+
+enum kcpp_image_format
+{
+    KCPP_IMAGE_PNG = 0,
+    KCPP_IMAGE_JPEG = 1,
+};
+
+static inline void kcpp_png_put32(std::vector<uint8_t> & out, uint32_t v)
+{
+    const uint8_t b[4] = { (uint8_t)(v >> 24), (uint8_t)(v >> 16), (uint8_t)(v >> 8), (uint8_t)v };
+    out.insert(out.end(), b, b + 4);
+}
+
+static void kcpp_png_chunk(std::vector<uint8_t> & out, const char * tag, const uint8_t * data, size_t len)
+{
+    kcpp_png_put32(out, (uint32_t)len);
+    const size_t start = out.size();
+    out.insert(out.end(), tag, tag + 4);
+    if (len > 0)
+    {
+        out.insert(out.end(), data, data + len);
+    }
+    kcpp_png_put32(out, (uint32_t)mz_crc32(MZ_CRC32_INIT, out.data() + start, len + 4));
+}
+
+//adler32 of two buffers from the sums of each, same as zlib's adler32_combine
+static uint32_t kcpp_adler32_combine(uint32_t a1, uint32_t a2, size_t len2)
+{
+    const uint32_t base = 65521;
+    const uint32_t rem = (uint32_t)(len2 % base);
+    uint32_t sum1 = a1 & 0xffff;
+    uint32_t sum2 = (uint32_t)(((uint64_t)rem * sum1) % base);
+    sum1 += (a2 & 0xffff) + base - 1;
+    sum2 += (a1 >> 16) + (a2 >> 16) + base - rem;
+    sum1 = (sum1 >= base ? sum1 - base : sum1);
+    sum1 = (sum1 >= base ? sum1 - base : sum1);
+    sum2 = (sum2 >= (base << 1) ? sum2 - (base << 1) : sum2);
+    sum2 = (sum2 >= base ? sum2 - base : sum2);
+    return sum1 | (sum2 << 16);
+}
+
+static inline uint8_t kcpp_paeth(int a, int b, int c)
+{
+    const int p = a + b - c;
+    const int pa = abs(p - a);
+    const int pb = abs(p - b);
+    const int pc = abs(p - c);
+    return (uint8_t)((pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c));
+}
+
+static inline int kcpp_png_cost(const uint8_t * f, int len)
+{
+    int cost = 0;
+    for (int i = 0; i < len; ++i)
+    {
+        cost += abs((int8_t)f[i]);
+    }
+    return cost;
+}
+
+//filter type byte and the filtered row, picking the filter with the smallest sum of signed residuals like stb does
+static void kcpp_png_filter_row(const uint8_t * row, const uint8_t * prev, int len, int bpp, uint8_t * out, uint8_t * scratch)
+{
+    uint8_t * f1 = scratch;
+    uint8_t * f2 = scratch + len;
+    uint8_t * f3 = scratch + 2 * len;
+    uint8_t * f4 = scratch + 3 * len;
+    for (int i = 0; i < bpp; ++i)
+    {
+        f1[i] = row[i];
+        f2[i] = row[i] - prev[i];
+        f3[i] = row[i] - (prev[i] >> 1);
+        f4[i] = row[i] - prev[i];
+    }
+    for (int i = bpp; i < len; ++i)
+    {
+        f1[i] = row[i] - row[i - bpp];
+        f2[i] = row[i] - prev[i];
+        f3[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+        f4[i] = row[i] - kcpp_paeth(row[i - bpp], prev[i], prev[i - bpp]);
+    }
+    const uint8_t * filtered[5] = { row, f1, f2, f3, f4 };
+    int best = 0;
+    int best_cost = kcpp_png_cost(row, len);
+    for (int t = 1; t < 5; ++t)
+    {
+        const int cost = kcpp_png_cost(filtered[t], len);
+        if (cost < best_cost)
+        {
+            best_cost = cost;
+            best = t;
+        }
+    }
+    out[0] = (uint8_t)best;
+    memcpy(out + 1, filtered[best], len);
+}
+
+struct kcpp_png_band
+{
+    std::vector<uint8_t> chunk; //complete IDAT chunk
+    uint32_t adler = 1;
+    size_t raw_len = 0;
+    bool ok = false;
+};
+
+static mz_bool kcpp_png_band_put(const void * buf, int len, void * user)
+{
+    std::vector<uint8_t> * out = (std::vector<uint8_t> *)user;
+    out->insert(out->end(), (const uint8_t *)buf, (const uint8_t *)buf + len);
+    return MZ_TRUE;
+}
+
+static void kcpp_png_encode_band(const uint8_t * pixels, int w, int n, int y0, int y1, int level, bool first, bool last, kcpp_png_band & band)
+{
+    const int len = w * n;
+    std::vector<uint8_t> zero(len, 0);
+    std::vector<uint8_t> scratch((size_t)4 * len);
+    std::vector<uint8_t> line(len + 1);
+    std::vector<uint8_t> data;
+    data.reserve(((size_t)(y1 - y0) * (len + 1)) / 2);
+    if (first)
+    {
+        data.push_back(0x78); //zlib header, 32k window
+        data.push_back(level <= 1 ? 0x01 : (level < 6 ? 0x5e : (level == 6 ? 0x9c : 0xda)));
+    }
+
+    tdefl_compressor * comp = (tdefl_compressor *)malloc(sizeof(tdefl_compressor));
+    const mz_uint flags = tdefl_create_comp_flags_from_zip_params(level, -MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY);
+    if (comp == nullptr || tdefl_init(comp, kcpp_png_band_put, &data, (int)flags) != TDEFL_STATUS_OKAY)
+    {
+        free(comp);
+        return;
+    }
+    uint32_t adler = 1;
+    bool ok = true;
+    for (int y = y0; y < y1 && ok; ++y)
+    {
+        const uint8_t * row = pixels + (size_t)y * len;
+        const uint8_t * prev = (y > 0 ? row - len : zero.data());
+        kcpp_png_filter_row(row, prev, len, n, line.data(), scratch.data());
+        adler = (uint32_t)mz_adler32(adler, line.data(), line.size());
+        ok = (tdefl_compress_buffer(comp, line.data(), line.size(), TDEFL_NO_FLUSH) == TDEFL_STATUS_OKAY);
+    }
+    if (ok)
+    {
+        const tdefl_status st = tdefl_compress_buffer(comp, nullptr, 0, last ? TDEFL_FINISH : TDEFL_SYNC_FLUSH);
+        ok = (st == (last ? TDEFL_STATUS_DONE : TDEFL_STATUS_OKAY));
+    }
+    free(comp);
+    if (ok)
+    {
+        band.chunk.reserve(data.size() + 12);
+        kcpp_png_chunk(band.chunk, "IDAT", data.data(), data.size());
+    }
+    band.adler = adler;
+    band.raw_len = (size_t)(y1 - y0) * (len + 1);
+    band.ok = ok;
+}
+
+//png of 8 bit pixels with n channels, with the generation parameters in a tEXt chunk when given.
+//level is the deflate level from 0 to 9, bands of at least 128KB of pixels are compressed on up to threads threads
+static bool kcpp_png_encode(const uint8_t * pixels, int w, int h, int n, const char * parameters, int level, int threads, std::vector<uint8_t> & out)
+{
+    static const int color_types[5] = { -1, 0, 4, 2, 6 };
+    out.clear();
+    if (pixels == nullptr || w <= 0 || h <= 0 || n < 1 || n > 4)
+    {
+        return false;
+    }
+    level = std::max(0, std::min(level, 9));
+    const size_t row_bytes = (size_t)w * n;
+    const size_t min_band = 128 * 1024;
+    int nb = (int)std::min<size_t>((size_t)std::max(threads, 1), std::max<size_t>(1, (row_bytes * h) / min_band));
+    nb = std::min(nb, h);
+
+    std::vector<kcpp_png_band> bands(nb);
+    std::vector<std::thread> workers;
+    for (int b = 0; b < nb; ++b)
+    {
+        const int y0 = (int)((int64_t)h * b / nb);
+        const int y1 = (int)((int64_t)h * (b + 1) / nb);
+        if (b == nb - 1)
+        {
+            kcpp_png_encode_band(pixels, w, n, y0, y1, level, b == 0, true, bands[b]);
+        }
+        else
+        {
+            workers.emplace_back(kcpp_png_encode_band, pixels, w, n, y0, y1, level, b == 0, false, std::ref(bands[b]));
+        }
+    }
+    for (auto & t : workers)
+    {
+        t.join();
+    }
+
+    uint32_t adler = 1;
+    size_t total = 0;
+    for (const auto & band : bands)
+    {
+        if (!band.ok)
+        {
+            return false;
+        }
+        adler = kcpp_adler32_combine(adler, band.adler, band.raw_len);
+        total += band.chunk.size();
+    }
+
+    const size_t param_len = (parameters ? strlen(parameters) : 0);
+    out.reserve(8 + 25 + (parameters ? param_len + 23 : 0) + total + 16 + 12);
+    const uint8_t sig[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    out.insert(out.end(), sig, sig + 8);
+    uint8_t ihdr[13] = { 0 };
+    for (int i = 0; i < 4; ++i)
+    {
+        ihdr[i] = (uint8_t)(w >> (24 - 8 * i));
+        ihdr[4 + i] = (uint8_t)(h >> (24 - 8 * i));
+    }
+    ihdr[8] = 8;
+    ihdr[9] = (uint8_t)color_types[n];
+    kcpp_png_chunk(out, "IHDR", ihdr, 13);
+    if (parameters)
+    {
+        std::vector<uint8_t> text((const uint8_t *)"parameters", (const uint8_t *)"parameters" + 11); //keyword and its nul separator
+        text.insert(text.end(), (const uint8_t *)parameters, (const uint8_t *)parameters + param_len);
+        kcpp_png_chunk(out, "tEXt", text.data(), text.size());
+    }
+    for (const auto & band : bands)
+    {
+        out.insert(out.end(), band.chunk.begin(), band.chunk.end());
+    }
+    const uint8_t trailer[4] = { (uint8_t)(adler >> 24), (uint8_t)(adler >> 16), (uint8_t)(adler >> 8), (uint8_t)adler };
+    kcpp_png_chunk(out, "IDAT", trailer, 4);
+    kcpp_png_chunk(out, "IEND", nullptr, 0);
+    return true;
+}
+
+static void kcpp_jpg_put(void * context, void * data, int size)
+{
+    std::vector<uint8_t> * out = (std::vector<uint8_t> *)context;
+    out->insert(out->end(), (const uint8_t *)data, (const uint8_t *)data + size);
+}
+
+//baseline jpeg through stb, alpha is dropped. quality from 1 to 100
+static bool kcpp_jpg_encode(const uint8_t * pixels, int w, int h, int n, const char * parameters, int quality, std::vector<uint8_t> & out)
+{
+    out.clear();
+    out.reserve((size_t)w * h / 4);
+    stbi__write_context s = { 0 };
+    stbi__start_write_callbacks(&s, kcpp_jpg_put, &out);
+    return stbi_write_jpg_core(&s, w, h, n, pixels, std::max(1, std::min(quality, 100)), parameters) != 0 && !out.empty();
+}
+
+//encodes a generated image in the requested format
+static bool kcpp_image_encode(const uint8_t * pixels, int w, int h, int n, const char * parameters, int format, int quality, int level, int threads, std::vector<uint8_t> & out)
+{
+    if (format == KCPP_IMAGE_JPEG)
+    {
+        return kcpp_jpg_encode(pixels, w, h, n, parameters, quality, out);
+    }
+    return kcpp_png_encode(pixels, w, h, n, parameters, level, threads, out);
+}
@@ -10,9 +10,14 @@
 #include <map>
 #include <string>
 #include <vector>
+#include <mutex>
+#include <memory>
+#include <condition_variable>
+#include <random>
 
 #include "utils.h"
 #include "model_adapter.h"
+#include "batch_sched.h"
 
 //for sampler params
 struct kcpp_params {
@@ -516,16 +521,28 @@ struct media_chunk
 struct media_object
 {
     std::string b64data = "";
-    std::vector<media_chunk> mediachunks;
+    std::vector<media_chunk> mediachunks; //embeddings are owned by the media embd cache, do not free
     bool is_audio = false; //if true its audio, otherwise its vision
     std::vector<int> chunk_start_seq;
     std::vector<int> chunk_end_seq;
+    uint64_t hash = 0; //hash of the decoded media bytes
+    int token_id = 0; //placeholder token used for every context position of this object
+    int token_count = 0; //context positions taken, including separators. 0 if the object was excluded
+};
+struct media_embd_cache_entry
+{
+    uint64_t hash = 0;
+    bool is_audio = false;
+    std::vector<media_chunk> mediachunks; //owns the embeddings
+    size_t bytes = 0;
+    uint64_t last_used = 0;
 };
 
 struct speculative_draft_result
 {
     std::vector<int32_t> draftids;
     std::vector<float *> actual_logits;
+    std::vector<std::vector<std::pair<int32_t,float>>> draft_probs; //distribution each draft token was sampled from
     bool draft_success = false;
     int drafted_amount = 0;
 };
@@ -539,6 +556,58 @@ struct savestate_data
     std::vector<gpt_vocab::id> savestate_context_tokens; //for context clones
     int64_t last_used = 0; //unix timestamp, updated on save or load
     std::string media_signature = "";
+    int tier = 0; //0 = raw buffers in ram, 1 = packed_buffer in ram, 2 = packed data in spill_path
+    std::vector<uint8_t> packed_buffer; //chunked, possibly deflated main state followed by the draft state
+    std::string spill_path = "";
+    uint64_t serial = 0; //bumped on every save, lets deltas detect a replaced parent
+    int parent_slot = -1; //if set, the buffer only holds kv cells from delta_from onwards on top of this slot
+    uint64_t parent_serial = 0;
+    int delta_from = 0;
+};
+
+//streamed output of one batched request. outlives the slot so late readers can still drain it
+struct batch_stream_record
+{
+    int stream_id = 0;
+    bool legacy = false; //request was not batchable and ran through gpttype_generate instead
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<std::string> tokens;
+    std::string output;
+    bool finished = false;
+    bool abort_requested = false;
+    stop_reason stopreason = stop_reason::INVALID;
+    int prompt_tokens = 0;
+    int completion_tokens = 0;
+};
+
+//one sequence in the shared llama_context, with its own sampler state
+struct batch_slot
+{
+    batch_slot_state state = BATCH_SLOT_IDLE;
+    int seq_id = 1;
+    std::shared_ptr<batch_stream_record> stream;
+    kcpp_params params;
+    float top_a = 0.0f;
+    std::vector<samplers> sampler_order;
+    std::vector<logit_bias> logit_biases;
+    std::vector<std::string> stop_sequence;
+    std::vector<int> special_stop_sequence;
+    multi_pattern_matcher stop_matcher;
+    bool allow_eos_token = true;
+    bool bypass_eos_token = false;
+    bool render_special = false;
+    std::mt19937 rng;
+    std::vector<int> prompt_tokens; //full prompt of the current request
+    std::vector<int> context_tokens; //tokens currently held in this slot's kv sequence
+    std::vector<int> last_n_tokens;
+    int n_past = 0;
+    int input_consumed = 0;
+    int remaining_tokens = 0;
+    int pending_token = -1; //last sampled token, decoded in the next step
+    int logits_idx = -1; //row of the current batch holding this slot's logits, -1 if none
+    int64_t last_used = 0;
+    int64_t start_time_ms = 0;
 };
 
 const float default_norm_eps = 1e-5f;
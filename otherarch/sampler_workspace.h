@@ -0,0 +1,180 @@
+// Reusable buffers for the token sampler
+// A sampling step works on one copy of the logits and never rebuilds vocab sized candidate lists or hash sets.
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <cfloat>
+#include "llama.h"
+
+struct kcpp_sampler_workspace
+{
+    std::vector<float> logits; //working copy, biases and id based penalties are applied in place
+    std::vector<llama_token_data> candidates;
+    std::vector<uint32_t> histo;
+    std::vector<uint32_t> near_stamp; //rep pen membership, a token is marked when its entry equals stamp
+    std::vector<uint32_t> far_stamp;
+    uint32_t stamp = 0;
+
+    void load(const float * src, int n_vocab)
+    {
+        logits.resize(n_vocab);
+        memcpy(logits.data(), src, n_vocab * sizeof(float));
+        if (candidates.capacity() < (size_t)n_vocab)
+        {
+            candidates.reserve(n_vocab);
+        }
+    }
+
+    //the whole vocab as unsorted candidates, only needed for fallbacks
+    llama_token_data_array all()
+    {
+        const int n = logits.size();
+        candidates.resize(n);
+        for (int i = 0; i < n; ++i)
+        {
+            candidates[i] = llama_token_data{i, logits[i], 0.0f};
+        }
+        return { candidates.data(), candidates.size(), -1, false };
+    }
+
+    //the k highest logits, sorted descending. same result as sample_top_k over the full vocab,
+    //but found with a histogram over the raw floats so only about k entries are ever materialized
+    llama_token_data_array top_k(int k)
+    {
+        const int n = logits.size();
+        const float * lg = logits.data();
+        if (k <= 0 || k >= n)
+        {
+            llama_token_data_array res = all();
+            std::sort(candidates.begin(), candidates.end(), [](const llama_token_data & a, const llama_token_data & b) { return a.logit > b.logit; });
+            res.sorted = true;
+            return res;
+        }
+
+        //pass 1, range of the finite logits. banned tokens sit at -inf or at the lowest logit
+        float mx = -FLT_MAX;
+        float mn = FLT_MAX;
+        for (int i = 0; i < n; ++i)
+        {
+            const float v = lg[i];
+            mx = (v > mx ? v : mx);
+            mn = (v < mn && v > -FLT_MAX ? v : mn);
+        }
+
+        if (!std::isfinite(mx))
+        {
+            llama_token_data_array res = all();
+            std::partial_sort(candidates.begin(), candidates.begin() + k, candidates.end(), [](const llama_token_data & a, const llama_token_data & b) { return a.logit > b.logit; });
+            candidates.resize(k);
+            return { candidates.data(), candidates.size(), -1, true };
+        }
+
+        candidates.clear();
+        if (!(mx > mn))
+        {
+            //every finite logit is equal, often a mask that leaves only a few tokens. those come first,
+            //then banned ones to fill k, highest first like the full sort would give
+            for (int i = 0; i < n && (int)candidates.size() < k; ++i)
+            {
+                if (lg[i] == mx)
+                {
+                    candidates.push_back(llama_token_data{i, lg[i], 0.0f});
+                }
+            }
+            const size_t finite = candidates.size();
+            for (int i = 0; i < n && (int)candidates.size() < k; ++i)
+            {
+                if (lg[i] != mx)
+                {
+                    candidates.push_back(llama_token_data{i, lg[i], 0.0f});
+                }
+            }
+            std::stable_sort(candidates.begin() + finite, candidates.end(), [](const llama_token_data & a, const llama_token_data & b) { return a.logit > b.logit; });
+            return { candidates.data(), candidates.size(), -1, true };
+        }
+
+        //pass 2, histogram. bins are fine enough that the boundary bin is small
+        constexpr int nbins = 4096;
+        const float scale = (nbins - 1) / (mx - mn);
+        histo.assign(nbins, 0);
+        auto bin_of = [mn, scale](float v) {
+            float f = (v - mn) * scale;
+            f = (f > 0.0f ? f : 0.0f);
+            return std::min((int)f, nbins - 1);
+        };
+        for (int i = 0; i < n; ++i)
+        {
+            ++histo[bin_of(lg[i])];
+        }
+        int tb = nbins - 1;
+        uint32_t have = 0;
+        for (; tb > 0; --tb)
+        {
+            have += histo[tb];
+            if (have >= (uint32_t)k)
+            {
+                break;
+            }
+        }
+
+        //pass 3, collect everything at or above the threshold bin, then sort only that
+        for (int i = 0; i < n; ++i)
+        {
+            if (bin_of(lg[i]) >= tb)
+            {
+                candidates.push_back(llama_token_data{i, lg[i], 0.0f});
+            }
+        }
+        const size_t keep = std::min((size_t)k, candidates.size());
+        std::partial_sort(candidates.begin(), candidates.begin() + keep, candidates.end(), [](const llama_token_data & a, const llama_token_data & b) { return a.logit > b.logit; });
+        candidates.resize(keep);
+        return { candidates.data(), candidates.size(), -1, true };
+    }
+
+    //marks tokens[near_from..count) as near and tokens[0..near_from) as far for the repetition penalty
+    void mark_history(const int32_t * tokens, int count, int near_from)
+    {
+        if (++stamp == 0) //wrapped, start over
+        {
+            std::fill(near_stamp.begin(), near_stamp.end(), 0);
+            std::fill(far_stamp.begin(), far_stamp.end(), 0);
+            stamp = 1;
+        }
+        for (int i = 0; i < count; ++i)
+        {
+            const int32_t t = tokens[i];
+            if (t < 0)
+            {
+                continue;
+            }
+            if ((size_t)t >= near_stamp.size())
+            {
+                near_stamp.resize(t + 1024, 0);
+                far_stamp.resize(t + 1024, 0);
+            }
+            if (i >= near_from)
+            {
+                near_stamp[t] = stamp;
+            }
+            else
+            {
+                far_stamp[t] = stamp;
+            }
+        }
+    }
+
+    //0 = not in the history, 1 = only in the far half, 2 = in the near half
+    int history_class(int32_t id) const
+    {
+        if (id < 0 || (size_t)id >= near_stamp.size())
+        {
+            return 0;
+        }
+        return (near_stamp[id] == stamp ? 2 : (far_stamp[id] == stamp ? 1 : 0));
+    }
+};
@@ -486,18 +486,32 @@ __STATIC_INLINE__ void sd_image_f32_to_ggml_tensor(sd_image_f32_t image,
 __STATIC_INLINE__ void ggml_ext_tensor_split_2d(struct ggml_tensor* input,
                                                 struct ggml_tensor* output,
                                                 int x,
-                                                int y) {
+                                                int y,
+                                                int64_t output_l = 0) {
     int64_t width    = output->ne[0];
     int64_t height   = output->ne[1];
     int64_t channels = output->ne[2];
-    int64_t ne3      = output->ne[3];
+    int64_t ne3      = input->ne[3];
     GGML_ASSERT(input->type == GGML_TYPE_F32 && output->type == GGML_TYPE_F32);
+    // kcpp: host tensors are copied a row at a time, output_l picks the slot of a batched tile
+    if (input->buffer == nullptr && output->buffer == nullptr && input->nb[0] == sizeof(float) && output->nb[0] == sizeof(float)) {
+        for (int l = 0; l < ne3; l++) {
+            for (int k = 0; k < channels; k++) {
+                for (int iy = 0; iy < height; iy++) {
+                    const char* src = (const char*)input->data + l * input->nb[3] + k * input->nb[2] + (iy + y) * input->nb[1] + x * sizeof(float);
+                    char* dst       = (char*)output->data + (l + output_l) * output->nb[3] + k * output->nb[2] + iy * output->nb[1];
+                    memcpy(dst, src, width * sizeof(float));
+                }
+            }
+        }
+        return;
+    }
     for (int iy = 0; iy < height; iy++) {
         for (int ix = 0; ix < width; ix++) {
             for (int k = 0; k < channels; k++) {
                 for (int l = 0; l < ne3; l++) {
                     float value = ggml_ext_tensor_get_f32(input, ix + x, iy + y, k, l);
-                    ggml_ext_tensor_set_f32(output, value, ix, iy, k, l);
+                    ggml_ext_tensor_set_f32(output, value, ix, iy, k, l + output_l);
                 }
             }
         }
@@ -516,22 +530,61 @@ __STATIC_INLINE__ void ggml_ext_tensor_merge_2d(struct ggml_tensor* input,
                                                 int y,
                                                 int overlap_x,
                                                 int overlap_y,
-                                                int x_skip = 0,
-                                                int y_skip = 0) {
+                                                int x_skip      = 0,
+                                                int y_skip      = 0,
+                                                int64_t input_l = 0) {
     int64_t width    = input->ne[0];
     int64_t height   = input->ne[1];
     int64_t channels = input->ne[2];
-    int64_t ne3      = input->ne[3];
+    int64_t ne3      = output->ne[3];
 
     int64_t img_width  = output->ne[0];
     int64_t img_height = output->ne[1];
 
     GGML_ASSERT(input->type == GGML_TYPE_F32 && output->type == GGML_TYPE_F32);
+    // kcpp: the feathering weight is separable, so it is computed once per column and per row and the
+    // blend becomes a multiply add over contiguous rows. input_l picks the slot of a batched tile
+    if (input->buffer == nullptr && output->buffer == nullptr && input->nb[0] == sizeof(float) && output->nb[0] == sizeof(float)) {
+        const bool blend = overlap_x > 0 || overlap_y > 0;
+        std::vector<float> wx(width, 1.0f);
+        std::vector<float> wy(height, 1.0f);
+        if (blend) {
+            for (int ix = x_skip; ix < width; ix++) {
+                const float x_f_0 = (overlap_x > 0 && x > 0) ? (ix - x_skip) / float(overlap_x) : 1;
+                const float x_f_1 = (overlap_x > 0 && x < (img_width - width)) ? (width - ix) / float(overlap_x) : 1;
+                wx[ix]            = smootherstep_f32(std::min(std::min(x_f_0, x_f_1), 1.f));
+            }
+            for (int iy = y_skip; iy < height; iy++) {
+                const float y_f_0 = (overlap_y > 0 && y > 0) ? (iy - y_skip) / float(overlap_y) : 1;
+                const float y_f_1 = (overlap_y > 0 && y < (img_height - height)) ? (height - iy) / float(overlap_y) : 1;
+                wy[iy]            = smootherstep_f32(std::min(std::min(y_f_0, y_f_1), 1.f));
+            }
+        }
+        const int64_t row_len = width - x_skip;
+        for (int l = 0; l < ne3; l++) {
+            for (int k = 0; k < channels; k++) {
+                for (int iy = y_skip; iy < height; iy++) {
+                    const float* src = (const float*)((const char*)input->data + (l + input_l) * input->nb[3] + k * input->nb[2] + iy * input->nb[1]) + x_skip;
+                    float* dst       = (float*)((char*)output->data + l * output->nb[3] + k * output->nb[2] + (y + iy) * output->nb[1]) + x + x_skip;
+                    if (!blend) {
+                        memcpy(dst, src, row_len * sizeof(float));
+                        continue;
+                    }
+                    const float* w  = wx.data() + x_skip;
+                    const float row = wy[iy];
+                    for (int64_t i = 0; i < row_len; i++) {
+                        dst[i] += src[i] * (row * w[i]);
+                    }
+                }
+            }
+        }
+        return;
+    }
     for (int iy = y_skip; iy < height; iy++) {
         for (int ix = x_skip; ix < width; ix++) {
             for (int k = 0; k < channels; k++) {
                 for (int l = 0; l < ne3; l++) {
-                    float new_value = ggml_ext_tensor_get_f32(input, ix, iy, k, l);
+                    float new_value = ggml_ext_tensor_get_f32(input, ix, iy, k, l + input_l);
                     if (overlap_x > 0 || overlap_y > 0) {  // blend colors in overlapped area
                         float old_value = ggml_ext_tensor_get_f32(output, x + ix, y + iy, k, l);
 
@@ -805,7 +858,10 @@ __STATIC_INLINE__ void sd_tiling_non_square(ggml_tensor* input,
                                             const int p_tile_size_x,
                                             const int p_tile_size_y,
                                             const float tile_overlap_factor,
-                                            on_tile_process on_processing) {
+                                            on_tile_process on_processing,
+                                            int max_batch                            = 1,
+                                            size_t batch_budget                      = 0,
+                                            std::function<size_t()> tile_buffer_size = nullptr) {
     output = ggml_set_f32(output, 0);
 
     int input_width   = (int)input->ne[0];
@@ -860,31 +916,12 @@ __STATIC_INLINE__ void sd_tiling_non_square(ggml_tensor* input,
         input_tile_size_y *= scale;
     }
 
-    struct ggml_init_params params = {};
-    params.mem_size += input_tile_size_x * input_tile_size_y * input->ne[2] * input->ne[3] * sizeof(float);      // input chunk
-    params.mem_size += output_tile_size_x * output_tile_size_y * output->ne[2] * output->ne[3] * sizeof(float);  // output chunk
-    params.mem_size += 3 * ggml_tensor_overhead();
-    params.mem_buffer = nullptr;
-    params.no_alloc   = false;
-
-    LOG_DEBUG("tile work buffer size: %.2f MB", params.mem_size / 1024.f / 1024.f);
-
-    // draft context
-    struct ggml_context* tiles_ctx = ggml_init(params);
-    if (!tiles_ctx) {
-        LOG_ERROR("ggml_init() failed");
-        return;
-    }
-
-    // tiling
-    ggml_tensor* input_tile  = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, input_tile_size_x, input_tile_size_y, input->ne[2], input->ne[3]);
-    ggml_tensor* output_tile = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, output_tile_size_x, output_tile_size_y, output->ne[2], output->ne[3]);
-    int num_tiles            = num_tiles_x * num_tiles_y;
-    LOG_DEBUG("processing %i tiles", num_tiles);
-    pretty_progress(0, num_tiles, 0.0f);
-    int tile_count = 1;
+    // kcpp: collect the tile positions first, so several can go into one graph
+    struct tile_pos {
+        int x_in, y_in, x_out, y_out, dx, dy;
+    };
+    std::vector<tile_pos> tiles;
     bool last_y = false, last_x = false;
-    float last_time = 0.0f;
     for (int y = 0; y < small_height && !last_y; y += non_tile_overlap_y) {
         int dy = 0;
         if (y + tile_size_y >= small_height) {
@@ -908,28 +945,117 @@ __STATIC_INLINE__ void sd_tiling_non_square(ggml_tensor* input,
                 last_x = true;
             }
 
-            int x_in  = decode ? x : scale * x;
-            int y_in  = decode ? y : scale * y;
-            int x_out = decode ? x * scale : x;
-            int y_out = decode ? y * scale : y;
+            tile_pos t;
+            t.x_in  = decode ? x : scale * x;
+            t.y_in  = decode ? y : scale * y;
+            t.x_out = decode ? x * scale : x;
+            t.y_out = decode ? y * scale : y;
+            t.dx    = dx;
+            t.dy    = dy;
+            tiles.push_back(t);
+        }
+        last_x = false;
+    }
 
-            int overlap_x_out = decode ? tile_overlap_x * scale : tile_overlap_x;
-            int overlap_y_out = decode ? tile_overlap_y * scale : tile_overlap_y;
+    int overlap_x_out = decode ? tile_overlap_x * scale : tile_overlap_x;
+    int overlap_y_out = decode ? tile_overlap_y * scale : tile_overlap_y;
 
-            int64_t t1 = ggml_time_ms();
-            ggml_ext_tensor_split_2d(input, input_tile, x_in, y_in);
-            if (on_processing(input_tile, output_tile, false)) {
-                ggml_ext_tensor_merge_2d(output_tile, output, x_out, y_out, overlap_x_out, overlap_y_out, dx, dy);
+    // tiles are packed along ne[3], only possible when the tensors are not batched already
+    const int num_tiles = (int)tiles.size();
+    if (input->ne[3] != 1 || output->ne[3] != 1 || !tile_buffer_size) {
+        max_batch = 1;
+    }
+    max_batch = std::max(1, std::min(max_batch, num_tiles));
 
-                int64_t t2 = ggml_time_ms();
-                last_time  = (t2 - t1) / 1000.0f;
-                pretty_progress(tile_count, num_tiles, last_time);
-            } else {
-                LOG_ERROR("Failed to process patch %d at (%d, %d)", tile_count, x, y);
+    size_t in_tile_bytes  = input_tile_size_x * input_tile_size_y * input->ne[2] * input->ne[3] * sizeof(float);
+    size_t out_tile_bytes = output_tile_size_x * output_tile_size_y * output->ne[2] * output->ne[3] * sizeof(float);
+
+    struct ggml_init_params params = {};
+    params.mem_size += in_tile_bytes;   // input chunk
+    params.mem_size += out_tile_bytes;  // output chunk
+    params.mem_size += 3 * ggml_tensor_overhead();
+    if (max_batch > 1) {
+        // a full batch and a smaller last one
+        params.mem_size += 2 * (size_t)max_batch * (in_tile_bytes + out_tile_bytes) + 6 * ggml_tensor_overhead();
+    }
+    params.mem_buffer = nullptr;
+    params.no_alloc   = false;
+
+    LOG_DEBUG("tile work buffer size: %.2f MB", params.mem_size / 1024.f / 1024.f);
+
+    // draft context
+    struct ggml_context* tiles_ctx = ggml_init(params);
+    if (!tiles_ctx) {
+        LOG_ERROR("ggml_init() failed");
+        return;
+    }
+
+    // tiling
+    ggml_tensor* input_tile  = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, input_tile_size_x, input_tile_size_y, input->ne[2], input->ne[3]);
+    ggml_tensor* output_tile = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, output_tile_size_x, output_tile_size_y, output->ne[2], output->ne[3]);
+    LOG_DEBUG("processing %i tiles", num_tiles);
+    pretty_progress(0, num_tiles, 0.0f);
+    int tile_count  = 1;
+    float last_time = 0.0f;
+
+    auto process_one = [&](const tile_pos& t) {
+        int64_t t1 = ggml_time_ms();
+        ggml_ext_tensor_split_2d(input, input_tile, t.x_in, t.y_in);
+        if (on_processing(input_tile, output_tile, false)) {
+            ggml_ext_tensor_merge_2d(output_tile, output, t.x_out, t.y_out, overlap_x_out, overlap_y_out, t.dx, t.dy);
+
+            int64_t t2 = ggml_time_ms();
+            last_time  = (t2 - t1) / 1000.0f;
+            pretty_progress(tile_count, num_tiles, last_time);
+        } else {
+            LOG_ERROR("Failed to process patch %d at (%d, %d)", tile_count, t.x_out, t.y_out);
+        }
+        tile_count++;
+    };
+
+    int next = 0;
+    if (max_batch > 1) {
+        // the first tile alone gives the compute buffer of one tile, the batch is sized so that
+        // the buffer for all of them stays within the budget
+        process_one(tiles[next++]);
+        size_t one_tile = tile_buffer_size();
+        int batch       = one_tile > 0 ? (int)std::min<size_t>(max_batch, std::max<size_t>(1, batch_budget / one_tile)) : 1;
+        batch           = std::min(batch, num_tiles - next);
+        if (batch > 1) {
+            LOG_DEBUG("batching %d tiles per graph (%.2f MB per tile)", batch, one_tile / 1024.f / 1024.f);
+        }
+        ggml_tensor* batch_in  = nullptr;
+        ggml_tensor* batch_out = nullptr;
+        while (batch > 1 && next < num_tiles) {
+            const int n = std::min(batch, num_tiles - next);
+            if (n < 2) {
+                break;
+            }
+            if (batch_in == nullptr || batch_in->ne[3] != n) {
+                batch_in  = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, input_tile_size_x, input_tile_size_y, input->ne[2], n);
+                batch_out = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, output_tile_size_x, output_tile_size_y, output->ne[2], n);
+            }
+            int64_t t1 = ggml_time_ms();
+            for (int b = 0; b < n; b++) {
+                ggml_ext_tensor_split_2d(input, batch_in, tiles[next + b].x_in, tiles[next + b].y_in, b);
+            }
+            if (!on_processing(batch_in, batch_out, false)) {
+                LOG_WARN("batched tiles failed, processing them one at a time");
+                break;
             }
-            tile_count++;
+            for (int b = 0; b < n; b++) {
+                const tile_pos& t = tiles[next + b];
+                ggml_ext_tensor_merge_2d(batch_out, output, t.x_out, t.y_out, overlap_x_out, overlap_y_out, t.dx, t.dy, b);
+            }
+            int64_t t2 = ggml_time_ms();
+            last_time  = (t2 - t1) / 1000.0f / n;
+            next += n;
+            tile_count += n;
+            pretty_progress(tile_count - 1, num_tiles, last_time);
         }
-        last_x = false;
+    }
+    while (next < num_tiles) {
+        process_one(tiles[next++]);
     }
     if (tile_count < num_tiles) {
         pretty_progress(num_tiles, num_tiles, last_time);
@@ -942,8 +1068,16 @@ __STATIC_INLINE__ void sd_tiling(ggml_tensor* input,
                                  const int scale,
                                  const int tile_size,
                                  const float tile_overlap_factor,
-                                 on_tile_process on_processing) {
-    sd_tiling_non_square(input, output, scale, tile_size, tile_size, tile_overlap_factor, on_processing);
+                                 on_tile_process on_processing,
+                                 int max_batch                            = 1,
+                                 size_t batch_budget                      = 0,
+                                 std::function<size_t()> tile_buffer_size = nullptr) {
+    sd_tiling_non_square(input, output, scale, tile_size, tile_size, tile_overlap_factor, on_processing, max_batch, batch_budget, tile_buffer_size);
+}
+
+// kcpp: compute memory a batch of tiles may take, less on gpus where the tile size was picked to fit small cards
+__STATIC_INLINE__ size_t sd_tile_batch_budget(bool on_cpu) {
+    return (on_cpu ? 1536ull : 512ull) * 1024 * 1024;
 }
 
 __STATIC_INLINE__ struct ggml_tensor* ggml_ext_group_norm_32(struct ggml_context* ctx,
@@ -1973,6 +2107,18 @@ public:
         free_cache_ctx();
     }
 
+    // kcpp
+    size_t get_compute_buffer_size() {
+        if (compute_allocr != nullptr) {
+            return ggml_gallocr_get_buffer_size(compute_allocr, 0);
+        }
+        return 0;
+    }
+
+    bool runtime_backend_is_cpu() {
+        return runtime_backend == nullptr || ggml_backend_is_cpu(runtime_backend);
+    }
+
     void free_compute_buffer() {
         if (compute_allocr != nullptr) {
             ggml_gallocr_free(compute_allocr);
@@ -23,7 +23,10 @@
 #include "upscaler.cpp"
 #include "model.cpp"
 #include "tokenize_util.cpp"
-#include "zip.c"
+//zip.c and its miniz are built once as their own object, shared with the text adapter
+#define MINIZ_HEADER_FILE_ONLY
+#include "miniz.h"
+#include "zip.h"
 
 #include "otherarch/utils.h"
 
@@ -41,6 +44,7 @@
 #include "stb_image_resize.h"
 
 #include "avi_writer.h"
+#include "otherarch/image_encode.h"
 
 static_assert((int)SD_TYPE_COUNT == (int)GGML_TYPE_COUNT,
               "inconsistency between SD_TYPE_COUNT and GGML_TYPE_COUNT");
@@ -93,6 +97,12 @@ static upscaler_ctx_t* upscaler_ctx = nullptr;
 static int sddebugmode = 0;
 static std::string recent_data = "";
 static std::string recent_data2 = ""; //for cases when we have 2 outputs
+static std::vector<std::string> recent_batch; //every image of a batched request
+static std::vector<const char *> recent_batch_ptrs;
+static std::vector<int> recent_batch_lens;
+static const int default_png_compression = 3; //much faster than 6 for about the same size on generated images
+static const int default_jpg_quality = 90;
+static const int max_stacked_batch = 4; //unet images denoised together, more mostly costs compute buffer memory
 static uint8_t * input_image_buffer = NULL;
 static uint8_t * input_mask_buffer = NULL;
 static uint8_t * upscale_src_buffer = NULL;
@@ -109,6 +119,28 @@ static bool photomaker_enabled = false;
 
 static bool is_vid_model = false;
 static bool remove_limits = false;
+static int cfg_step_cache_mode = 0; //0=off, 1=auto, 2=easycache, 3=ucache, 4=cache-dit
+static int last_cache_skipped = 0;
+static int last_cache_total = 0;
+
+//auto step cache settings per model family, the default threshold and step window for each
+struct step_cache_preset
+{
+    const char * family;
+    sd_cache_mode_t mode;
+    float threshold;
+    float start_percent;
+    float end_percent;
+};
+static const step_cache_preset step_cache_presets[] = {
+    {"unet",    SD_CACHE_UCACHE,    1.0f,  0.15f, 0.95f},
+    {"flux",    SD_CACHE_EASYCACHE, 0.2f,  0.15f, 0.95f},
+    {"sd3",     SD_CACHE_EASYCACHE, 0.15f, 0.15f, 0.95f},
+    {"wan",     SD_CACHE_EASYCACHE, 0.1f,  0.2f,  0.95f},
+    {"qwen",    SD_CACHE_EASYCACHE, 0.2f,  0.15f, 0.95f},
+    {"zimage",  SD_CACHE_EASYCACHE, 0.25f, 0.15f, 0.95f},
+};
+static const int step_cache_min_steps = 12; //distilled few step models have nothing to spare
 
 static int get_loaded_sd_version(sd_ctx_t* ctx)
 {
@@ -126,6 +158,74 @@ static bool loaded_model_is_chroma(sd_ctx_t* ctx)
     return false;
 }
 
+static const char * step_cache_mode_name(int mode)
+{
+    switch (mode) {
+        case 1: return "auto";
+        case 2: return "easycache";
+        case 3: return "ucache";
+        case 4: return "cache-dit";
+        default: return "off";
+    }
+}
+
+static const step_cache_preset * get_step_cache_preset(SDVersion ver)
+{
+    const char * family = nullptr;
+    if (sd_version_is_unet(ver)) {
+        family = "unet";
+    } else if (sd_version_is_flux(ver) || sd_version_is_flux2(ver)) {
+        family = "flux";
+    } else if (sd_version_is_sd3(ver)) {
+        family = "sd3";
+    } else if (sd_version_is_wan(ver)) {
+        family = "wan";
+    } else if (sd_version_is_qwen_image(ver)) {
+        family = "qwen";
+    } else if (sd_version_is_z_image(ver)) {
+        family = "zimage";
+    }
+    for (const auto & p : step_cache_presets) {
+        if (family && strcmp(p.family, family) == 0) {
+            return &p;
+        }
+    }
+    return nullptr;
+}
+
+//fills the sdcpp cache params for the requested mode, leaves them disabled when it does not apply
+static void setup_step_cache(sd_cache_params_t & cache, int mode, float threshold, int steps, SDVersion ver)
+{
+    sd_cache_params_init(&cache);
+    const step_cache_preset * preset = get_step_cache_preset(ver);
+    if (mode == 1) {
+        if (preset == nullptr || steps < step_cache_min_steps) {
+            return;
+        }
+        cache.mode = preset->mode;
+        cache.reuse_threshold = preset->threshold;
+        cache.start_percent = preset->start_percent;
+        cache.end_percent = preset->end_percent;
+    } else if (mode == 2) {
+        cache.mode = SD_CACHE_EASYCACHE;
+        cache.reuse_threshold = 0.2f;
+    } else if (mode == 3) {
+        cache.mode = SD_CACHE_UCACHE;
+        cache.reuse_threshold = 1.0f;
+    } else if (mode == 4) {
+        cache.mode = SD_CACHE_CACHE_DIT;
+    } else {
+        return;
+    }
+    if (threshold > 0.0f) {
+        if (cache.mode == SD_CACHE_CACHE_DIT) {
+            cache.residual_diff_threshold = threshold;
+        } else {
+            cache.reuse_threshold = threshold;
+        }
+    }
+}
+
 static std::string read_str_from_disk(std::string filepath)
 {
     std::string output;
@@ -227,6 +327,7 @@ bool sdtype_load_model(const sd_load_model_inputs inputs) {
     cfg_tiled_vae_threshold = (cfg_tiled_vae_threshold <= 0 ? 8192 : cfg_tiled_vae_threshold); //if negative dont tile
     cfg_side_limit = inputs.img_hard_limit;
     cfg_square_limit = inputs.img_soft_limit;
+    cfg_step_cache_mode = std::max(0, std::min(4, inputs.step_cache_mode));
     printf("\nImageGen Init - Load Model: %s\n",inputs.model_filename);
 
     int lora_apply_mode = std::max(0, std::min(2, inputs.lora_apply_mode));
@@ -288,6 +389,10 @@ bool sdtype_load_model(const sd_load_model_inputs inputs) {
     {
         printf("Conv2D Direct for VAE model is enabled\n");
     }
+    if(cfg_step_cache_mode > 0)
+    {
+        printf("Diffusion step cache: %s\n",step_cache_mode_name(cfg_step_cache_mode));
+    }
     if(inputs.quant > 0)
     {
         printf("Note: Loading a pre-quantized model is always faster than using compress weights!\n");
@@ -498,6 +603,19 @@ static std::string get_image_params(const sd_img_gen_params_t & params) {
     return ss.str();
 }
 
+//encodes one output image straight to base64, empty if it failed
+static std::string encode_output_image(const sd_image_t & img, const char * parameters, int format, int quality, int level)
+{
+    std::vector<uint8_t> encoded;
+    const int threads = (sd_params && sd_params->n_threads > 0) ? sd_params->n_threads : sd_get_num_physical_cores();
+    if (!kcpp_image_encode(img.data, img.width, img.height, img.channel, parameters, format, quality, level, threads, encoded))
+    {
+        printf("\nKCPP SD: output image encoding failed!\n");
+        return "";
+    }
+    return kcpp_base64_encode(encoded.data(), encoded.size());
+}
+
 static inline int rounddown_64(int n) {
     return n - n % 64;
 }
@@ -1024,7 +1142,16 @@ sd_generation_outputs sdtype_generate(const sd_generation_inputs inputs)
     params.seed = sd_params->seed;
     params.strength = sd_params->strength;
     params.vae_tiling_params.enabled = dotile;
-    params.batch_count = 1;
+    params.batch_count = (is_vid_model ? 1 : std::max(1, std::min(inputs.batch_count, 8)));
+    params.stacked_batch = max_stacked_batch;
+    int step_cache_mode = (inputs.step_cache_mode < 0 ? cfg_step_cache_mode : std::min(4, inputs.step_cache_mode));
+    setup_step_cache(params.cache, step_cache_mode, inputs.step_cache_threshold, params.sample_params.sample_steps, (SDVersion)loadedsdver);
+    const int cache_skipped_before = sd_ctx->sd->cache_steps_skipped;
+    const int cache_total_before = sd_ctx->sd->cache_steps_total;
+    if(!sd_is_quiet && sddebugmode==1 && params.cache.mode != SD_CACHE_DISABLED)
+    {
+        printf("\nStep cache: %s, mode %d\n",step_cache_mode_name(step_cache_mode),(int)params.cache.mode);
+    }
 
     // needs to be "reapplied" because sdcpp tracks previously applied LoRAs
     // and weights, and apply/unapply the differences at each gen
@@ -1057,6 +1184,7 @@ sd_generation_outputs sdtype_generate(const sd_generation_inputs inputs)
         vid_gen_params.sample_params = params.sample_params;
         vid_gen_params.strength = params.strength;
         vid_gen_params.seed = params.seed;
+        vid_gen_params.cache = params.cache;
         vid_gen_params.video_frames = vid_req_frames;
         if(wan_imgs.size()>0)
         {
@@ -1189,6 +1317,9 @@ sd_generation_outputs sdtype_generate(const sd_generation_inputs inputs)
 
     }
 
+    last_cache_skipped = sd_ctx->sd->cache_steps_skipped - cache_skipped_before;
+    last_cache_total = sd_ctx->sd->cache_steps_total - cache_total_before;
+
     if (results == NULL) {
         printf("\nKCPP SD generate failed!\n");
         output.data = "";
@@ -1201,6 +1332,12 @@ sd_generation_outputs sdtype_generate(const sd_generation_inputs inputs)
     bool wasanim = false;
     sd_image_t upscaled_image;
     upscaled_image.data = nullptr;
+    recent_batch.clear();
+    recent_data = "";
+    recent_data2 = "";
+    const int output_format = (inputs.output_format == KCPP_IMAGE_JPEG ? KCPP_IMAGE_JPEG : KCPP_IMAGE_PNG);
+    const int output_quality = (inputs.output_quality > 0 ? inputs.output_quality : default_jpg_quality);
+    const int png_compression = (inputs.png_compression >= 0 ? inputs.png_compression : default_png_compression);
 
     for (int i = 0; i < params.batch_count; i++) {
         if (results[i].data == NULL) {
@@ -1259,22 +1396,25 @@ sd_generation_outputs sdtype_generate(const sd_generation_inputs inputs)
         }
         else
         {
-            int out_data_len;
-            unsigned char * png = nullptr;
+            sd_img_gen_params_t imgparams = params;
+            imgparams.seed = params.seed + i; //each image of a batch uses the next seed
+            const sd_image_t * outimg = &results[i];
             if(inputs.upscale && upscaler_ctx != nullptr)
             {
                 printf("Upscaling output image...\n");
+                if(upscaled_image.data)
+                {
+                    free(upscaled_image.data);
+                    upscaled_image.data = nullptr;
+                }
                 upscaled_image = upscale(upscaler_ctx, results[i], 2);
-                png = stbi_write_png_to_mem(upscaled_image.data, 0, upscaled_image.width, upscaled_image.height, upscaled_image.channel, &out_data_len, get_image_params(params).c_str());
-            } else {
-                png = stbi_write_png_to_mem(results[i].data, 0, results[i].width, results[i].height, results[i].channel, &out_data_len, get_image_params(params).c_str());
+                outimg = &upscaled_image;
             }
 
-            if (png != NULL)
+            std::string encoded = encode_output_image(*outimg, get_image_params(imgparams).c_str(), output_format, output_quality, png_compression);
+            if (!encoded.empty())
             {
-                recent_data = kcpp_base64_encode(png,out_data_len);
-                recent_data2 = "";
-                free(png);
+                recent_batch.push_back(std::move(encoded));
             }
         }
 
@@ -1289,8 +1429,22 @@ sd_generation_outputs sdtype_generate(const sd_generation_inputs inputs)
     }
 
     free(results);
-    output.data = recent_data.c_str();
+    recent_batch_ptrs.clear();
+    recent_batch_lens.clear();
+    for (const auto & img : recent_batch)
+    {
+        recent_batch_ptrs.push_back(img.c_str());
+        recent_batch_lens.push_back(img.size());
+    }
+    //the first image of a batch is the main output, shared rather than copied
+    const std::string & main_data = (recent_batch.empty() ? recent_data : recent_batch[0]);
+    output.data = main_data.c_str();
+    output.data_length = main_data.size();
     output.data_extra = recent_data2.c_str();
+    output.data_extra_length = recent_data2.size();
+    output.images_count = recent_batch_ptrs.size();
+    output.images = recent_batch_ptrs.data();
+    output.images_length = recent_batch_lens.data();
     output.animated = (wasanim?1:0);
     output.status = 1;
     total_img_gens += 1;
@@ -1334,16 +1488,11 @@ sd_generation_outputs sdtype_upscale(const sd_upscale_inputs inputs)
         source_img.data = upscale_src_buffer;
 
         upscaled_image = upscale(upscaler_ctx, source_img, inputs.upscaling_resize);
-        int out_data_len;
-        unsigned char * png = stbi_write_png_to_mem(upscaled_image.data, 0, upscaled_image.width, upscaled_image.height, upscaled_image.channel, &out_data_len, nullptr);
-        if (png != NULL)
-        {
-            recent_data = kcpp_base64_encode(png,out_data_len);
-            recent_data2 = "";
-            free(png);
-        }
+        recent_data = encode_output_image(upscaled_image, nullptr, KCPP_IMAGE_PNG, default_jpg_quality, default_png_compression);
+        recent_data2 = "";
         free(upscaled_image.data);
         output.data = recent_data.c_str();
+        output.data_length = recent_data.size();
         output.data_extra = recent_data2.c_str();
         output.animated = 0;
         output.status = 1;
@@ -1367,7 +1516,16 @@ sd_info_outputs sdtype_get_info()
     }
     j["available_schedulers"] = available_schedulers;
 
-    static std::string recent_info = j.dump();
+    json step_cache;
+    step_cache["mode"] = step_cache_mode_name(cfg_step_cache_mode);
+    step_cache["last_steps_skipped"] = last_cache_skipped;
+    step_cache["last_steps"] = last_cache_total;
+    step_cache["total_steps_skipped"] = (sd_ctx ? sd_ctx->sd->cache_steps_skipped : 0);
+    step_cache["total_steps"] = (sd_ctx ? sd_ctx->sd->cache_steps_total : 0);
+    j["step_cache"] = step_cache;
+
+    static std::string recent_info;
+    recent_info = j.dump();
     sd_info_outputs output;
     output.status = 0;
     output.data = recent_info.c_str();
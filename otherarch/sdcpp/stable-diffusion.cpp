@@ -135,6 +135,9 @@ public:
     std::string taesd_path;
     bool use_tiny_autoencoder            = false;
     sd_tiling_params_t vae_tiling_params = {false, 0, 0, 0.5f, 0, 0};
+    int stacked_batch                    = 1;  // kcpp
+    int cache_steps_skipped              = 0;  // kcpp: running totals of the step caches, for sd_get_info
+    int cache_steps_total                = 0;  // kcpp
     bool offload_params_to_cpu           = false;
     bool use_pmid                        = false;
 
@@ -146,6 +149,25 @@ public:
     // lora_name => multiplier
     std::unordered_map<std::string, float> curr_lora_state;
 
+    // kcpp: conditioning cache, repeat prompts skip the text encoders entirely
+    struct CondCacheTensor {
+        bool present   = false;
+        ggml_type type = GGML_TYPE_F32;
+        int64_t ne[4]  = {1, 1, 1, 1};
+        std::vector<uint8_t> data;
+    };
+    struct CondCacheEntry {
+        std::string key;
+        std::vector<CondCacheTensor> tensors;  // crossattn, vector, concat, then the extra crossattns
+        size_t bytes       = 0;
+        uint64_t last_used = 0;
+    };
+    std::vector<CondCacheEntry> cond_cache;
+    size_t cond_cache_budget = 256ull * 1024 * 1024;
+    size_t cond_cache_bytes  = 0;
+    uint64_t cond_cache_clock = 0;
+    std::string cond_lora_key;  // sorted lora set from the last apply_loras
+
     std::shared_ptr<Denoiser> denoiser = std::make_shared<CompVisDenoiser>();
 
     StableDiffusionGGML() = default;
@@ -1374,6 +1396,12 @@ public:
             lora_f2m[lora_id] = loras[i].multiplier;
             LOG_DEBUG("lora %s:%.2f", lora_id.c_str(), loras[i].multiplier);
         }
+        // kcpp: the cached conditionings are only valid for the same lora set
+        std::map<std::string, float> sorted_loras(lora_f2m.begin(), lora_f2m.end());
+        cond_lora_key.clear();
+        for (auto& kv : sorted_loras) {
+            cond_lora_key += kv.first + ":" + std::to_string(kv.second) + "|";
+        }
         int64_t t0 = ggml_time_ms();
         if (apply_lora_immediately) {
             apply_loras_immediately(lora_f2m);
@@ -1386,6 +1414,86 @@ public:
         }
     }
 
+    // kcpp: get_learned_condition through the conditioning cache.
+    // photomaker and reference images change what the encoder sees, so those always run it
+    SDCondition get_cached_condition(ggml_context* work_ctx, const ConditionerParams& condition_params) {
+        if (cond_cache_budget == 0 || use_pmid || condition_params.num_input_imgs > 0 || !condition_params.ref_images.empty()) {
+            return cond_stage_model->get_learned_condition(work_ctx, n_threads, condition_params);
+        }
+        std::string key = cond_lora_key + "#" + std::to_string(condition_params.clip_skip) + "," +
+                          std::to_string(condition_params.width) + "," + std::to_string(condition_params.height) + "," +
+                          std::to_string(condition_params.adm_in_channels) + "," +
+                          std::to_string(condition_params.zero_out_masked ? 1 : 0) + "#" + condition_params.text;
+        ++cond_cache_clock;
+
+        auto restore = [&](const CondCacheTensor& ct) -> ggml_tensor* {
+            if (!ct.present) {
+                return nullptr;
+            }
+            ggml_tensor* t = ggml_new_tensor(work_ctx, ct.type, 4, ct.ne);
+            memcpy(t->data, ct.data.data(), ct.data.size());
+            return t;
+        };
+        for (auto& e : cond_cache) {
+            if (e.key == key) {
+                e.last_used = cond_cache_clock;
+                SDCondition cond;
+                cond.c_crossattn = restore(e.tensors[0]);
+                cond.c_vector    = restore(e.tensors[1]);
+                cond.c_concat    = restore(e.tensors[2]);
+                for (size_t i = 3; i < e.tensors.size(); i++) {
+                    cond.extra_c_crossattns.push_back(restore(e.tensors[i]));
+                }
+                LOG_DEBUG("conditioning cache hit");
+                return cond;
+            }
+        }
+
+        SDCondition cond = cond_stage_model->get_learned_condition(work_ctx, n_threads, condition_params);
+
+        CondCacheEntry entry;
+        entry.key       = key;
+        entry.last_used = cond_cache_clock;
+        bool storable   = true;
+        auto store      = [&](ggml_tensor* t) {
+            CondCacheTensor ct;
+            if (t != nullptr) {
+                if (t->data == nullptr || !ggml_is_contiguous(t)) {
+                    storable = false;
+                } else {
+                    ct.present = true;
+                    ct.type    = t->type;
+                    for (int i = 0; i < 4; i++) {
+                        ct.ne[i] = t->ne[i];
+                    }
+                    ct.data.assign((const uint8_t*)t->data, (const uint8_t*)t->data + ggml_nbytes(t));
+                    entry.bytes += ct.data.size();
+                }
+            }
+            entry.tensors.push_back(std::move(ct));
+        };
+        store(cond.c_crossattn);
+        store(cond.c_vector);
+        store(cond.c_concat);
+        for (auto t : cond.extra_c_crossattns) {
+            store(t);
+        }
+        if (!storable || entry.bytes > cond_cache_budget) {
+            return cond;
+        }
+        // evict least recently used entries until the new one fits
+        while (!cond_cache.empty() && cond_cache_bytes + entry.bytes > cond_cache_budget) {
+            auto oldest = std::min_element(cond_cache.begin(), cond_cache.end(), [](const CondCacheEntry& a, const CondCacheEntry& b) {
+                return a.last_used < b.last_used;
+            });
+            cond_cache_bytes -= oldest->bytes;
+            cond_cache.erase(oldest);
+        }
+        cond_cache_bytes += entry.bytes;
+        cond_cache.push_back(std::move(entry));
+        return cond;
+    }
+
     SDCondition get_pmid_conditon(ggml_context* work_ctx,
                                   sd_pm_params_t pm_params,
                                   ConditionerParams& condition_params) {
@@ -2138,7 +2246,11 @@ public:
                 timesteps_vec.assign(1, t);
             }
 
-            timesteps_vec  = process_timesteps(timesteps_vec, init_latent, denoise_mask);
+            timesteps_vec = process_timesteps(timesteps_vec, init_latent, denoise_mask);
+            if (sd_version_is_unet(version) && input->ne[3] > 1) {
+                // kcpp: stacked batch, one timestep per image
+                timesteps_vec.assign(input->ne[3], timesteps_vec[0]);
+            }
             auto timesteps = vector_to_ggml_tensor(work_ctx, timesteps_vec);
             std::vector<float> guidance_vec(1, guidance.distilled_guidance);
             auto guidance_tensor = vector_to_ggml_tensor(work_ctx, guidance_vec);
@@ -2403,6 +2515,14 @@ public:
             }
         }
 
+        // kcpp
+        if (easycache_enabled || ucache_enabled || cachedit_enabled) {
+            cache_steps_total += sigmas.size() > 0 ? (int)sigmas.size() - 1 : 0;
+            cache_steps_skipped += (easycache_enabled ? easycache_state.total_steps_skipped : 0) +
+                                   (ucache_enabled ? ucache_state.total_steps_skipped : 0) +
+                                   (cachedit_enabled ? cachedit_state.total_steps_skipped : 0);
+        }
+
         if (inverse_noise_scaling) {
             x = denoiser->inverse_noise_scaling(sigmas[sigmas.size() - 1], x);
         }
@@ -2620,6 +2740,15 @@ public:
         }
     }
 
+    // kcpp: how many vae tiles may share one graph. only the image autoencoder, the video ones
+    // use the batch dimension for frames or channels
+    int vae_tile_batch() {
+        if (std::dynamic_pointer_cast<AutoEncoderKL>(first_stage_model) == nullptr) {
+            return 1;
+        }
+        return 8;
+    }
+
     void get_tile_sizes(int& tile_size_x,
                         int& tile_size_y,
                         float& tile_overlap,
@@ -2695,7 +2824,9 @@ public:
                 auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
                     return first_stage_model->compute(n_threads, in, false, &out, work_ctx);
                 };
-                sd_tiling_non_square(x, result, vae_scale_factor, tile_size_x, tile_size_y, tile_overlap, on_tiling);
+                sd_tiling_non_square(x, result, vae_scale_factor, tile_size_x, tile_size_y, tile_overlap, on_tiling,
+                                     vae_tile_batch(), sd_tile_batch_budget(first_stage_model->runtime_backend_is_cpu()),
+                                     [&]() { return first_stage_model->get_compute_buffer_size(); });  // kcpp
             } else {
                 first_stage_model->compute(n_threads, x, false, &result, work_ctx);
             }
@@ -2824,7 +2955,9 @@ public:
                 auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
                     return first_stage_model->compute(n_threads, in, true, &out, nullptr);
                 };
-                sd_tiling_non_square(x, result, vae_scale_factor, tile_size_x, tile_size_y, tile_overlap, on_tiling);
+                sd_tiling_non_square(x, result, vae_scale_factor, tile_size_x, tile_size_y, tile_overlap, on_tiling,
+                                     vae_tile_batch(), sd_tile_batch_budget(first_stage_model->runtime_backend_is_cpu()),
+                                     [&]() { return first_stage_model->get_compute_buffer_size(); });  // kcpp
             } else {
                 if (!first_stage_model->compute(n_threads, x, true, &result, work_ctx)) {
                     LOG_ERROR("Failed to decode latetnts");
@@ -3237,6 +3370,7 @@ void sd_img_gen_params_init(sd_img_gen_params_t* sd_img_gen_params) {
     sd_img_gen_params->strength          = 0.75f;
     sd_img_gen_params->seed              = -1;
     sd_img_gen_params->batch_count       = 1;
+    sd_img_gen_params->stacked_batch     = 1;
     sd_img_gen_params->control_strength  = 0.9f;
     sd_img_gen_params->pm_params         = {nullptr, 0, nullptr, 20.f};
     sd_img_gen_params->vae_tiling_params = {false, 0, 0, 0.5f, 0.0f, 0.0f};
@@ -3425,9 +3559,7 @@ sd_image_t* generate_image_internal(sd_ctx_t* sd_ctx,
 
     // Get learned condition
     condition_params.zero_out_masked = false;
-    SDCondition cond                 = sd_ctx->sd->cond_stage_model->get_learned_condition(work_ctx,
-                                                                                           sd_ctx->sd->n_threads,
-                                                                                           condition_params);
+    SDCondition cond                 = sd_ctx->sd->get_cached_condition(work_ctx, condition_params);  // kcpp
 
     SDCondition uncond;
     if (guidance.txt_cfg != 1.0 ||
@@ -3438,9 +3570,7 @@ sd_image_t* generate_image_internal(sd_ctx_t* sd_ctx,
         }
         condition_params.text            = negative_prompt;
         condition_params.zero_out_masked = zero_out_masked;
-        uncond                           = sd_ctx->sd->cond_stage_model->get_learned_condition(work_ctx,
-                                                                                               sd_ctx->sd->n_threads,
-                                                                                               condition_params);
+        uncond                           = sd_ctx->sd->get_cached_condition(work_ctx, condition_params);  // kcpp
     }
     int64_t t1 = ggml_time_ms();
     LOG_INFO("get_learned_condition completed, taking %" PRId64 " ms", t1 - t0);
@@ -3551,7 +3681,78 @@ sd_image_t* generate_image_internal(sd_ctx_t* sd_ctx,
         (sd_version_is_inpaint_or_unet_edit(sd_ctx->sd->version) && guidance.txt_cfg != guidance.img_cfg)) {
         img_cond = SDCondition(uncond.c_crossattn, uncond.c_vector, cond.c_concat);
     }
+    // kcpp: unet models can denoise several images at once, their latents stacked along the batch dimension,
+    // so every step is one graph evaluation. each image keeps the noise of its own seed, ancestral samplers differ
+    std::vector<struct ggml_tensor*> stacked_latents(batch_count, nullptr);
+    const bool can_stack = sd_ctx->sd->stacked_batch > 1 && batch_count > 1 &&
+                           sd_version_is_unet(sd_ctx->sd->version) && image_hint == nullptr &&
+                           !sd_ctx->sd->use_pmid && denoise_mask == nullptr && ref_latents.empty() &&
+                           sd_get_preview_callback() == nullptr &&
+                           (cache_params == nullptr || cache_params->mode == SD_CACHE_DISABLED) &&
+                           init_latent->ne[3] == 1;
+    for (int b0 = 0; can_stack && b0 < batch_count;) {
+        const int n = std::min(sd_ctx->sd->stacked_batch, batch_count - b0);
+        if (n < 2) {
+            break;
+        }
+        int64_t sampling_start = ggml_time_ms();
+        LOG_INFO("generating images %i-%i/%i together - seed %" PRId64, b0 + 1, b0 + n, batch_count, seed + b0);
+        const size_t one = ggml_nbytes(init_latent);
+        struct ggml_tensor* x_t     = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, init_latent->ne[0], init_latent->ne[1], init_latent->ne[2], n);
+        struct ggml_tensor* noise   = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, n);
+        struct ggml_tensor* noise_1 = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, 1);
+        for (int j = 0; j < n; j++) {
+            memcpy((char*)x_t->data + j * one, init_latent->data, one);
+            sd_ctx->sd->rng->manual_seed(seed + b0 + j);
+            ggml_ext_im_set_randn_f32(noise_1, sd_ctx->sd->rng);
+            memcpy((char*)noise->data + j * ggml_nbytes(noise_1), noise_1->data, ggml_nbytes(noise_1));
+        }
+        sd_ctx->sd->sampler_rng->manual_seed(seed + b0);
+
+        struct ggml_tensor* x_0 = sd_ctx->sd->sample(work_ctx,
+                                                     sd_ctx->sd->diffusion_model,
+                                                     true,
+                                                     x_t,
+                                                     noise,
+                                                     cond,
+                                                     uncond,
+                                                     img_cond,
+                                                     image_hint,
+                                                     control_strength,
+                                                     guidance,
+                                                     eta,
+                                                     shifted_timestep,
+                                                     sample_method,
+                                                     sigmas,
+                                                     -1,
+                                                     id_cond,
+                                                     ref_latents,
+                                                     increase_ref_index,
+                                                     denoise_mask,
+                                                     nullptr,
+                                                     1.0f,
+                                                     cache_params);
+        int64_t sampling_end = ggml_time_ms();
+        if (x_0 == nullptr) {
+            // most likely the stacked graph did not fit, the rest goes one image at a time
+            LOG_WARN("stacked sampling failed after %.2fs, falling back to one image at a time", (sampling_end - sampling_start) * 1.0f / 1000);
+            break;
+        }
+        LOG_INFO("sampling completed, taking %.2fs", (sampling_end - sampling_start) * 1.0f / 1000);
+        const size_t lat = ggml_nbytes(x_0) / n;
+        for (int j = 0; j < n; j++) {
+            struct ggml_tensor* x_j = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, x_0->ne[0], x_0->ne[1], x_0->ne[2], 1);
+            memcpy(x_j->data, (char*)x_0->data + j * lat, lat);
+            stacked_latents[b0 + j] = x_j;
+        }
+        b0 += n;
+    }
+
     for (int b = 0; b < batch_count; b++) {
+        if (stacked_latents[b] != nullptr) {
+            final_latents.push_back(stacked_latents[b]);
+            continue;
+        }
         int64_t sampling_start = ggml_time_ms();
         int64_t cur_seed       = seed + b;
         LOG_INFO("generating image: %i/%i - seed %" PRId64, b + 1, batch_count, cur_seed);
@@ -3651,6 +3852,7 @@ sd_image_t* generate_image_internal(sd_ctx_t* sd_ctx,
 
 sd_image_t* generate_image(sd_ctx_t* sd_ctx, const sd_img_gen_params_t* sd_img_gen_params) {
     sd_ctx->sd->vae_tiling_params = sd_img_gen_params->vae_tiling_params;
+    sd_ctx->sd->stacked_batch     = sd_img_gen_params->stacked_batch;
     int width                     = sd_img_gen_params->width;
     int height                    = sd_img_gen_params->height;
 
@@ -4237,17 +4439,13 @@ SD_API sd_image_t* generate_video(sd_ctx_t* sd_ctx, const sd_vid_gen_params_t* s
     condition_params.text            = prompt;
 
     int64_t t1       = ggml_time_ms();
-    SDCondition cond = sd_ctx->sd->cond_stage_model->get_learned_condition(work_ctx,
-                                                                           sd_ctx->sd->n_threads,
-                                                                           condition_params);
+    SDCondition cond = sd_ctx->sd->get_cached_condition(work_ctx, condition_params);  // kcpp
     cond.c_concat    = concat_latent;
     cond.c_vector    = clip_vision_output;
     SDCondition uncond;
     if (sd_vid_gen_params->sample_params.guidance.txt_cfg != 1.0 || sd_vid_gen_params->high_noise_sample_params.guidance.txt_cfg != 1.0) {
         condition_params.text = negative_prompt;
-        uncond                = sd_ctx->sd->cond_stage_model->get_learned_condition(work_ctx,
-                                                                                    sd_ctx->sd->n_threads,
-                                                                                    condition_params);
+        uncond                = sd_ctx->sd->get_cached_condition(work_ctx, condition_params);  // kcpp
         uncond.c_concat       = concat_latent;
         uncond.c_vector       = clip_vision_output;
     }
@@ -302,6 +302,7 @@ typedef struct {
     sd_pm_params_t pm_params;
     sd_tiling_params_t vae_tiling_params;
     sd_cache_params_t cache;
+    int stacked_batch; // kcpp: images denoised together in one graph, unet models only
 } sd_img_gen_params_t;
 
 typedef struct {
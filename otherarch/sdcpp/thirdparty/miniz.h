@@ -1760,6 +1760,9 @@ MINIZ_EXPORT void *mz_zip_extract_archive_file_to_heap_v2(
 #endif
 
 #endif /* MINIZ_NO_ARCHIVE_APIS */
+
+// kcpp: MINIZ_HEADER_FILE_ONLY gives just the declarations, the implementation is compiled once through zip.c into its own object
+#ifndef MINIZ_HEADER_FILE_ONLY
 /**************************************************************************
  *
  * Copyright 2013-2014 RAD Game Tools and Valve Software
@@ -10128,3 +10131,5 @@ mz_bool mz_zip_end(mz_zip_archive *pZip) {
 #endif
 
 #endif /*#ifndef MINIZ_NO_ARCHIVE_APIS*/
+
+#endif // MINIZ_HEADER_FILE_ONLY (kcpp)
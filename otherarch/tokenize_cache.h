@@ -0,0 +1,159 @@
+// Incremental prompt tokenization
+// Chat prompts grow by a turn per request, so most of the text was already tokenized last time. The previous texts are
+// kept with their tokens and byte offsets, and only the part after a safe split point before the first changed byte
+// is tokenized again. A split is safe when it is a pretokenizer chunk boundary in both texts: right after a newline
+// with a non whitespace byte following. Merges never cross chunks, and the retokenized tail is checked against the old tokens.
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+
+struct kcpp_tokenize_cache
+{
+    struct entry
+    {
+        std::string text;
+        std::vector<int> tokens; //without bos
+        std::vector<size_t> offsets; //byte offset where each token starts
+        uint64_t last_used = 0;
+    };
+
+    std::vector<entry> entries;
+    size_t max_entries = 4; //prompt, memory and negative prompt are all tokenized per request
+    size_t min_reuse = 2048; //shorter shared prefixes are cheaper to just tokenize again
+    size_t margin = 64; //bytes kept clear of the first change, lookahead in the pretokenizer can reach back a little
+    uint64_t clock = 0;
+
+    void clear()
+    {
+        entries.clear();
+    }
+
+    static bool is_space(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    //token byte offsets from the pieces, false if the pieces do not spell out the text exactly
+    static bool build_offsets(const std::string & text, const std::vector<int> & tokens, size_t first, size_t start_byte,
+        std::vector<size_t> & offsets, const std::function<std::string(int)> & piece_of)
+    {
+        offsets.resize(tokens.size());
+        size_t pos = start_byte;
+        for (size_t i = first; i < tokens.size(); ++i)
+        {
+            offsets[i] = pos;
+            const std::string piece = piece_of(tokens[i]);
+            if (piece.empty() || text.compare(pos, piece.size(), piece) != 0)
+            {
+                return false;
+            }
+            pos += piece.size();
+        }
+        return pos == text.size();
+    }
+
+    //tokens of text without bos. tokenize_fn tokenizes a whole string without bos, piece_of gives the exact bytes of a token
+    std::vector<int> tokenize(const std::string & text, const std::function<std::vector<int>(const std::string &)> & tokenize_fn,
+        const std::function<std::string(int)> & piece_of)
+    {
+        ++clock;
+        entry * best = nullptr;
+        size_t best_common = 0;
+        for (auto & e : entries)
+        {
+            const size_t lim = std::min(e.text.size(), text.size());
+            size_t common = std::mismatch(e.text.begin(), e.text.begin() + lim, text.begin()).first - e.text.begin();
+            if (common > best_common)
+            {
+                best_common = common;
+                best = &e;
+            }
+        }
+
+        if (best && best->text.size() == text.size() && best_common == text.size())
+        {
+            best->last_used = clock;
+            return best->tokens;
+        }
+
+        entry fresh;
+        fresh.text = text;
+        bool reused = false;
+        if (best && best_common >= min_reuse + margin)
+        {
+            //last token starting at or before the safe limit, then walk back to a newline boundary
+            const size_t limit = best_common - margin;
+            size_t t = std::upper_bound(best->offsets.begin(), best->offsets.end(), limit) - best->offsets.begin();
+            while (t > 0)
+            {
+                --t;
+                const size_t off = best->offsets[t];
+                if (off < min_reuse)
+                {
+                    t = 0;
+                    break;
+                }
+                if (text[off - 1] == '\n' && !is_space(text[off]))
+                {
+                    break;
+                }
+            }
+            if (t > 0)
+            {
+                const size_t split = best->offsets[t];
+                std::vector<int> tail = tokenize_fn(text.substr(split));
+                //the tokens before the change must come out the same, otherwise the split was not a real boundary
+                size_t check = 0;
+                while (t + check + 1 < best->tokens.size() && best->offsets[t + check + 1] <= limit)
+                {
+                    ++check;
+                }
+                check = std::max<size_t>(check, 1);
+                if (tail.size() >= check && best->tokens.size() >= t + check
+                    && std::equal(tail.begin(), tail.begin() + check, best->tokens.begin() + t))
+                {
+                    fresh.tokens.assign(best->tokens.begin(), best->tokens.begin() + t);
+                    fresh.tokens.insert(fresh.tokens.end(), tail.begin(), tail.end());
+                    fresh.offsets.assign(best->offsets.begin(), best->offsets.begin() + t);
+                    reused = build_offsets(text, fresh.tokens, t, split, fresh.offsets, piece_of);
+                    if (!reused)
+                    {
+                        return fresh.tokens; //still correct, just not cacheable
+                    }
+                }
+            }
+        }
+
+        if (!reused)
+        {
+            fresh.tokens = tokenize_fn(text);
+            if (text.size() < min_reuse || !build_offsets(text, fresh.tokens, 0, 0, fresh.offsets, piece_of))
+            {
+                return fresh.tokens;
+            }
+        }
+
+        //replace the entry we grew from, or the least recently used one
+        fresh.last_used = clock;
+        std::vector<int> result = fresh.tokens;
+        if (best && best_common >= min_reuse)
+        {
+            *best = std::move(fresh);
+        }
+        else if (entries.size() < max_entries)
+        {
+            entries.push_back(std::move(fresh));
+        }
+        else
+        {
+            auto oldest = std::min_element(entries.begin(), entries.end(), [](const entry & a, const entry & b) { return a.last_used < b.last_used; });
+            *oldest = std::move(fresh);
+        }
+        return result;
+    }
+};
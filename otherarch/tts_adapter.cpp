@@ -1,5 +1,6 @@
 #include "model_adapter.h"
 #include "otherarch/utils.h"
+#include "otherarch/audio_fft.h"
 
 #include "common.h"
 #include "sampling.h"
@@ -13,6 +14,7 @@
 #include <regex>
 #include <string>
 #include <thread>
+#include <atomic>
 #include <vector>
 
 #include "src/llama-context.h"
@@ -178,42 +180,21 @@ static void fill_hann_window(int length, bool periodic, float * output) {
     }
 }
 
-// very poor-man fft
-static void twiddle(float * real, float * imag, int k, int N) {
-    float angle = 2 * M_PI * k / N;
-    *real = cos(angle);
-    *imag = sin(angle);
-}
-
-static void irfft(int n, const float * inp_cplx, float * out_real) {
-    int N = n / 2 + 1;
-
-    std::vector<float> real_input(N);
-    std::vector<float> imag_input(N);
-    for (int i = 0; i < N; ++i) {
-        real_input[i] = inp_cplx[2 * i];
-        imag_input[i] = inp_cplx[2 * i + 1];
-    }
-
-    std::vector<float> real_output(n);
-    std::vector<float> imag_output(n);
-
-    for (int k = 0; k < n; ++k) {
-        real_output[k] = 0.0f;
-        imag_output[k] = 0.0f;
-        for (int m = 0; m < N; ++m) {
-            float twiddle_real;
-            float twiddle_imag;
-
-            twiddle(&twiddle_real, &twiddle_imag, k * m, n);
-
-            real_output[k] += real_input[m] * twiddle_real - imag_input[m] * twiddle_imag;
-            imag_output[k] += real_input[m] * twiddle_imag + imag_input[m] * twiddle_real;
-        }
-    }
-
+// matches the old direct sum over bins 0..n/2 scaled by 1/(n/2+1): the end bins count twice in a hermitian
+// inverse, so they are doubled and the unscaled result divided by n+2
+static void irfft(int n, const float * inp_cplx, float * out_real, std::vector<float> & bins, std::vector<kcpp_cpx> & work) {
+    const kcpp_rfft_plan & plan = kcpp_rfft_get_plan(n, true);
+    const int N = n / 2 + 1;
+    bins.assign(inp_cplx, inp_cplx + 2 * N);
+    bins[0] *= 2.0f;
+    bins[1] *= 2.0f;
+    bins[2 * (N - 1) + 0] *= 2.0f;
+    bins[2 * (N - 1) + 1] *= 2.0f;
+    work.resize(plan.work_size());
+    plan.backward(bins.data(), out_real, work.data());
+    const float scale = 1.0f / (2 * N);
     for (int i = 0; i < n; ++i) {
-        out_real[i] = real_output[i] / N;
+        out_real[i] *= scale;
     }
 }
 
@@ -299,8 +280,10 @@ static std::vector<float> embd_to_audio(
     std::vector<std::thread> workers(n_thread);
     for (int i = 0; i < n_thread; ++i) {
         workers[i] = std::thread([&, i]() {
+            std::vector<float> bins;
+            std::vector<kcpp_cpx> work;
             for (int l = i; l < n_codes; l += n_thread) {
-                irfft(n_fft, ST.data() + l*n_embd, res.data() + l*n_fft);
+                irfft(n_fft, ST.data() + l*n_embd, res.data() + l*n_fft, bins, work);
                 for (int j = 0; j < n_fft; ++j) {
                     res  [l*n_fft + j] *= hann[j];
                     hann2[l*n_fft + j]  = hann[j] * hann[j];
@@ -612,6 +595,37 @@ static std::string detectedarch = "";
 int total_tts_gens = 0;
 static std::string tts_executable_path = "";
 
+//pcm chunks for streaming readers, one per finished sentence
+static token_stream_ring tts_chunk_stream(256);
+static int tts_stream_rate = 24000;
+static std::atomic<bool> tts_abort_flag{false}; //set when a streaming client goes away
+
+void ttstype_stream_open()
+{
+    tts_abort_flag = false; //cleared here, before the generation thread starts, so an early abort is not lost
+    tts_chunk_stream.open();
+}
+void ttstype_stream_close()
+{
+    tts_chunk_stream.close();
+}
+int ttstype_stream_wait(int timeout_ms)
+{
+    return tts_chunk_stream.wait(timeout_ms);
+}
+bool ttstype_stream_pop(token_stream_record & rec)
+{
+    return tts_chunk_stream.pop(rec);
+}
+void ttstype_abort()
+{
+    tts_abort_flag = true;
+}
+int ttstype_stream_sample_rate()
+{
+    return tts_stream_rate;
+}
+
 bool ttstype_load_model(const tts_load_model_inputs inputs)
 {
     tts_is_quiet = inputs.quiet;
@@ -756,6 +770,231 @@ bool ttstype_load_model(const tts_load_model_inputs inputs)
     return true;
 }
 
+//splits raw prompt text into sentences for streaming, at whitespace after sentence punctuation.
+//short sentences are merged into the next one, since very short parts vocode poorly
+static std::vector<std::string> split_tts_sentences(const std::string & text)
+{
+    const size_t min_words = 4;
+    std::vector<std::string> parts;
+    std::string cur;
+    size_t words = 0;
+    size_t pos = 0;
+    while (pos < text.size())
+    {
+        while (pos < text.size() && isspace((unsigned char)text[pos]))
+        {
+            ++pos;
+        }
+        size_t end = pos;
+        while (end < text.size() && !isspace((unsigned char)text[end]))
+        {
+            ++end;
+        }
+        if (end == pos)
+        {
+            break;
+        }
+        std::string word = text.substr(pos, end - pos);
+        pos = end;
+        cur += (cur.empty() ? "" : " ") + word;
+        ++words;
+        size_t lastpos = word.find_last_not_of("\"')]*");
+        const char last = (lastpos == std::string::npos ? 0 : word[lastpos]);
+        const bool ends = (last == '.' || last == '!' || last == '?' || last == ';' || last == ':');
+        if (ends && words >= min_words)
+        {
+            parts.push_back(cur);
+            cur.clear();
+            words = 0;
+        }
+    }
+    if (!cur.empty())
+    {
+        if (!parts.empty() && words < min_words)
+        {
+            parts.back() += " " + cur;
+        }
+        else
+        {
+            parts.push_back(cur);
+        }
+    }
+    return parts;
+}
+
+static void fade_in_audio(std::vector<float> & audio, int len)
+{
+    len = std::min(len, (int)audio.size());
+    for (int i = 0; i < len; ++i) {
+        audio[i] *= (float)i / len;
+    }
+}
+
+//raw 16 bit mono pcm for one streamed chunk, the reader writes the wav header once
+static std::string save_pcm16_base64(const std::vector<float> & data)
+{
+    std::string pcm(data.size() * sizeof(int16_t), '\0');
+    int16_t * dst = (int16_t *)&pcm[0];
+    for (size_t i = 0; i < data.size(); ++i) {
+        dst[i] = static_cast<int16_t>(std::clamp(data[i] * 32767.0, -32768.0, 32767.0));
+    }
+    return kcpp_base64_encode(pcm);
+}
+
+static void push_tts_chunk(const std::vector<float> & data, int idx)
+{
+    token_stream_record rec;
+    rec.text = save_pcm16_base64(data);
+    rec.id = idx;
+    rec.timestamp_us = ggml_time_us();
+    tts_chunk_stream.push(std::move(rec));
+}
+
+//generates the audio codes for one part of the cleaned prompt, with the cached speaker in front
+static bool outetts_generate_codes(const std::string & part_clean, const std::string & sampletext, int speaker_seed, llama_token newlineid, std::mt19937 & speaker_rng, std::vector<llama_token> & codes)
+{
+    const llama_model * model_ttc = llama_get_model(ttc_ctx);
+    const llama_vocab * ttcvocab = llama_model_get_vocab(model_ttc);
+    const int ttc_n_vocab = llama_vocab_n_tokens(ttcvocab);
+    std::string prompt_clean = part_clean;
+    std::vector<llama_token> prompt_inp;
+    llama_memory_clear(llama_get_memory(ttc_ctx),true);
+    prompt_init(prompt_inp, ttcvocab);
+    bool next_token_uses_guide_token = true;
+    codes.clear();
+
+    std::vector<llama_token> guide_tokens = prepare_guide_tokens(ttcvocab,prompt_clean,ttsver);
+    if(!tts_is_quiet && ttsdebugmode==1)
+    {
+        printf("\nGuide Tokens (%d tokens):\n", guide_tokens.size());
+        const std::string inp_txt = common_detokenize(ttc_ctx, guide_tokens, true);
+        printf("%s", inp_txt.c_str());
+        printf("\n");
+    }
+    if(speaker_seed > 0)
+    {
+        prompt_clean = sampletext + (ttsver==TTS_VER_3?"<|space|>":"<|text_sep|>") + prompt_clean;
+    }
+    prompt_add(prompt_inp, ttcvocab, prompt_clean, false, true);
+
+    if(!tts_is_quiet)
+    {
+        printf("\nTTS Processing (%d input tokens)...\n", prompt_inp.size());
+    }
+
+    prompt_add(prompt_inp, ttcvocab, "<|text_end|>\n<|audio_start|>\n", false, true);
+
+    if(!last_speaker_codes.empty() && speaker_seed > 0) //apply speaker voice output
+    {
+        prompt_add(prompt_inp, last_speaker_codes);
+        prompt_add(prompt_inp, ttcvocab, "\n", false, true);
+    }
+
+    if(!tts_is_quiet && ttsdebugmode==1)
+    {
+        printf("\nDUMP TTS PROMPT (%d tokens):\n", prompt_inp.size());
+        print_tok_vec(prompt_inp);
+        const std::string inp_txt = common_detokenize(ttc_ctx, prompt_inp, true);
+        printf("\n%s\n", inp_txt.c_str());
+    }
+
+    //create batch with tokens for decoding prompt processing
+    kcpp_embd_batch tts_batch = kcpp_embd_batch(prompt_inp, 0, false, false);
+
+    auto evalok = (llama_decode(ttc_ctx, tts_batch.batch)==0);
+    if (!evalok) {
+        printf("\nError: TTS prompt batch processing failed\n");
+        return false;
+    }
+
+    // main loop
+    int n_decode = 0;
+    int n_predict = tts_max_len; //max 4096 tokens
+
+    while (n_decode <= n_predict)
+    {
+        if (tts_abort_flag)
+        {
+            return false;
+        }
+        float * logits = llama_get_logits(ttc_ctx);
+
+        //use predictable settings to generate voice
+        const int topk = 4;
+        const float temp = 0.75f;
+        const float top_p = 1.0f;
+        llama_token new_token_id = kcpp_quick_sample(logits,ttc_n_vocab,std::vector<int32_t>(),1.0,top_p,topk,temp,speaker_rng);
+
+        //guide tokens help prevent hallucinations by forcing the TTS to use the correct word
+        if(next_token_uses_guide_token && !llama_vocab_is_control(ttcvocab, new_token_id) && !llama_vocab_is_eog(ttcvocab, new_token_id))
+        {
+            if(!guide_tokens.empty())
+            {
+                llama_token guide_token = guide_tokens[0];
+                guide_tokens.erase(guide_tokens.begin());
+                new_token_id = guide_token; //ensure correct word fragment is used
+            } else {
+                n_decode = n_predict; //end generation
+            }
+        }
+
+        //this is the token id that always precedes a new word
+        next_token_uses_guide_token = (new_token_id == newlineid);
+        codes.push_back(new_token_id);
+
+        // is it an end of generation? -> mark the stream as finished
+        if (llama_vocab_is_eog(ttcvocab, new_token_id) || n_decode >= n_predict) {
+            break;
+        }
+
+        n_decode += 1;
+        std::vector<llama_token> next = {new_token_id};
+        llama_batch batch = llama_batch_get_one(next.data(), next.size());
+
+        // evaluate the current batch with the transformer model
+        if (llama_decode(ttc_ctx, batch)) {
+            printf("\nError: TTS code generation failed!\n");
+            return false;
+        }
+        if(!tts_is_quiet)
+        {
+            printf("\rTTS Generating (%d outputs)", n_decode);
+        }
+    }
+
+    if(!tts_is_quiet && ttsdebugmode==1)
+    {
+        const std::string inp_txt = common_detokenize(ttc_ctx, codes, true);
+        printf("\nGenerated %d Codes: '%s'\n",codes.size(), inp_txt.c_str());
+    }
+
+    // remove all non-audio tokens (i.e. < 151672 || > 155772)
+    codes.erase(std::remove_if(codes.begin(), codes.end(), [](llama_token t) { return t < cts_offset || t > (cts_offset+4100); }), codes.end());
+
+    for (auto & token : codes) {
+        token -= cts_offset;
+    }
+    return true;
+}
+
+//runs the vocoder over one part's codes
+static bool outetts_vocode(std::vector<llama_token> & codes, std::vector<float> & audio)
+{
+    const llama_model * model_cts = llama_get_model(cts_ctx);
+    llama_memory_clear(llama_get_memory(cts_ctx),true);
+    kcpp_embd_batch codebatch = kcpp_embd_batch(codes,0,false,true);
+    printf("\nRunning Vocoder (%d AudioTokens)", (int)codes.size());
+
+    if (llama_encode(cts_ctx, codebatch.batch) != 0) {
+        return false;
+    }
+    // spectral operations
+    const int n_embd = llama_model_n_embd_out(model_cts);
+    const float * embd = llama_get_embeddings(cts_ctx);
+    audio = embd_to_audio(embd, (int)codes.size(), n_embd, nthreads);
+    return true;
+}
+
 static tts_generation_outputs ttstype_generate_ttscpp(const tts_generation_inputs inputs)
 {
     tts_generation_outputs output;
@@ -815,30 +1054,55 @@ static tts_generation_outputs ttstype_generate_ttscpp(const tts_generation_input
     {
         printf("\nTTS Generating...");
     }
-    tts_response response_data;
-    int errorres = generate(ttscpp_runner, prompt, &response_data, ttscpp_config);
-    if(errorres==0)
+    //these backends vocode inside generate, so streaming just runs one sentence at a time
+    std::vector<std::string> parts;
+    if(inputs.stream)
     {
-        ttstime = timer_check();
-        printf("\nTTS Generated audio in %.2fs.\n",ttstime);
-        std::vector<float> wavdat = std::vector(response_data.data, response_data.data + response_data.n_outputs);
-        //audio_post_clean(wavdat);
-        last_generated_audio = save_wav16_base64(wavdat, ttscpp_runner->sampling_rate);
-        output.data = last_generated_audio.c_str();
-        output.status = 1;
-        last_generation_settings_audio_seed = 0;
-        last_generation_settings_speaker_seed = speaker_seed;
-        last_generation_settings_prompt = std::string(prompt);
-        total_tts_gens += 1;
-        return output;
+        parts = split_tts_sentences(prompt);
     }
     else
     {
-        printf("\nError: TTSCPP generation failed\n");
-        output.data = "";
-        output.status = 0;
-        return output;
+        parts.push_back(prompt);
     }
+    tts_stream_rate = ttscpp_runner->sampling_rate;
+    std::vector<float> wavdat;
+    for (size_t pi = 0; pi < parts.size(); ++pi)
+    {
+        if (tts_abort_flag)
+        {
+            printf("\nTTS generation aborted.\n");
+            output.data = "";
+            output.status = 0;
+            return output;
+        }
+        tts_response response_data;
+        int errorres = generate(ttscpp_runner, parts[pi], &response_data, ttscpp_config);
+        if(errorres!=0)
+        {
+            printf("\nError: TTSCPP generation failed\n");
+            output.data = "";
+            output.status = 0;
+            return output;
+        }
+        std::vector<float> partdat = std::vector(response_data.data, response_data.data + response_data.n_outputs);
+        if(inputs.stream)
+        {
+            push_tts_chunk(partdat, pi);
+        }
+        wavdat.insert(wavdat.end(), partdat.begin(), partdat.end());
+    }
+
+    ttstime = timer_check();
+    printf("\nTTS Generated audio in %.2fs.\n",ttstime);
+    //audio_post_clean(wavdat);
+    last_generated_audio = save_wav16_base64(wavdat, ttscpp_runner->sampling_rate);
+    output.data = last_generated_audio.c_str();
+    output.status = 1;
+    last_generation_settings_audio_seed = 0;
+    last_generation_settings_speaker_seed = speaker_seed;
+    last_generation_settings_prompt = std::string(prompt);
+    total_tts_gens += 1;
+    return output;
 }
 
 static tts_generation_outputs ttstype_generate_outetts(const tts_generation_inputs inputs)
@@ -1071,190 +1335,158 @@ static tts_generation_outputs ttstype_generate_outetts(const tts_generation_inpu
     }
     last_speaker_data = custom_speaker_data;
 
-    //second pass: add the speaker before the actual prompt
-    guide_tokens = prepare_guide_tokens(ttcvocab,prompt_clean,ttsver);
-    if(!tts_is_quiet && ttsdebugmode==1)
-    {
-        printf("\nGuide Tokens (%d tokens):\n", guide_tokens.size());
-        const std::string inp_txt = common_detokenize(ttc_ctx, guide_tokens, true);
-        printf("%s", inp_txt.c_str());
-        printf("\n");
-    }
-    if(speaker_seed > 0)
-    {
-        prompt_clean = sampletext + (ttsver==TTS_VER_3?"<|space|>":"<|text_sep|>") + prompt_clean;
-    }
-    prompt_add(prompt_inp, ttcvocab, prompt_clean, false, true);
-
-    if(!tts_is_quiet)
-    {
-        printf("\nTTS Processing (%d input tokens)...\n", prompt_inp.size());
-    }
-
-    prompt_add(prompt_inp, ttcvocab, "<|text_end|>\n<|audio_start|>\n", false, true);
-
-    if(!last_speaker_codes.empty() && speaker_seed > 0) //apply speaker voice output
+    //second pass: add the speaker before the actual prompt.
+    //when streaming, each sentence is generated on its own and vocoded while the next one is being generated
+    std::vector<std::string> parts;
+    if(inputs.stream)
     {
-        prompt_add(prompt_inp, last_speaker_codes);
-        prompt_add(prompt_inp, ttcvocab, "\n", false, true);
+        //same 300 word limit as the whole prompt, spread over the cleaned sentences
+        const std::string sep = (ttsver==TTS_VER_3?"<|space|>":"<|text_sep|>");
+        size_t words_left = 300;
+        for (const std::string & sentence : split_tts_sentences(prompt))
+        {
+            std::string part = trim_words(process_text(sentence,ttsver),sep,words_left);
+            if (part.empty() || process_text(sentence,TTS_VER_2).empty())
+            {
+                continue;
+            }
+            size_t words = 1;
+            for (size_t at = part.find(sep); at != std::string::npos; at = part.find(sep, at + sep.size()))
+            {
+                ++words;
+            }
+            parts.push_back(part);
+            words_left -= std::min(words, words_left);
+            if (words_left == 0)
+            {
+                break;
+            }
+        }
     }
-
-    if(!tts_is_quiet && ttsdebugmode==1)
+    else
     {
-        printf("\nDUMP TTS PROMPT (%d tokens):\n", prompt_inp.size());
-        print_tok_vec(prompt_inp);
-        const std::string inp_txt = common_detokenize(ttc_ctx, prompt_inp, true);
-        printf("\n%s\n", inp_txt.c_str());
-    }
-
-    //create batch with tokens for decoding prompt processing
-    kcpp_embd_batch tts_batch = kcpp_embd_batch(prompt_inp, 0, false, false);
-
-    auto evalok = (llama_decode(ttc_ctx, tts_batch.batch)==0);
-    if (!evalok) {
-        printf("\nError: TTS prompt batch processing failed\n");
-        output.data = "";
-        output.status = 0;
-        return output;
+        parts.push_back(prompt_clean);
     }
 
-    // main loop
-    n_decode = 0;
-    n_predict = tts_max_len; //max 4096 tokens
+    const int t_sr = 24000; //final target sampling rate
+    tts_stream_rate = t_sr;
+    const int cutout = t_sr/4; // zero out first x seconds depending on whether its seeded
+    std::vector<float> audio;
+    std::vector<float> part_audio;
+    std::thread vocoder;
+    bool vocoded = false;
+    int total_codes = 0;
+    int parts_done = 0;
+
+    //waits for the running vocoder and appends its audio
+    auto finish_part = [&]() -> bool {
+        if (!vocoder.joinable()) {
+            return true;
+        }
+        vocoder.join();
+        if (!vocoded) {
+            return false;
+        }
+        if (part_audio.size() > cutout+16) {
+            if (parts_done == 0) {
+                for (int i = 0; i < cutout; ++i) {
+                    part_audio[i] = 0.0f;
+                }
+            } else {
+                fade_in_audio(part_audio, t_sr/50);
+            }
+            audio.insert(audio.end(), part_audio.begin(), part_audio.end());
+            if (inputs.stream) {
+                push_tts_chunk(part_audio, parts_done);
+            }
+            ++parts_done;
+        }
+        return true;
+    };
 
-    while (n_decode <= n_predict)
+    bool failed = false;
+    for (size_t pi = 0; pi < parts.size() && !failed; ++pi)
     {
-        float * logits = llama_get_logits(ttc_ctx);
-
-        //use predictable settings to generate voice
-        const int topk = 4;
-        const float temp = 0.75f;
-        const float top_p = 1.0f;
-        llama_token new_token_id = kcpp_quick_sample(logits,ttc_n_vocab,std::vector<int32_t>(),1.0,top_p,topk,temp,speaker_rng);
-
-        //guide tokens help prevent hallucinations by forcing the TTS to use the correct word
-        if(next_token_uses_guide_token && !llama_vocab_is_control(ttcvocab, new_token_id) && !llama_vocab_is_eog(ttcvocab, new_token_id))
+        std::vector<llama_token> part_codes;
+        if (!outetts_generate_codes(parts[pi], sampletext, speaker_seed, newlineid, speaker_rng, part_codes))
         {
-            if(!guide_tokens.empty())
+            if (tts_abort_flag)
             {
-                llama_token guide_token = guide_tokens[0];
-                guide_tokens.erase(guide_tokens.begin());
-                new_token_id = guide_token; //ensure correct word fragment is used
-            } else {
-                n_decode = n_predict; //end generation
+                printf("\nTTS generation aborted.\n");
             }
+            failed = true;
         }
-
-        //this is the token id that always precedes a new word
-        next_token_uses_guide_token = (new_token_id == newlineid);
-        codes.push_back(new_token_id);
-
-        // is it an end of generation? -> mark the stream as finished
-        if (llama_vocab_is_eog(ttcvocab, new_token_id) || n_decode >= n_predict) {
-            break;
+        if (!finish_part())
+        {
+            printf("\nError: TTS vocoder generation failed!\n");
+            failed = true;
         }
-
-        n_decode += 1;
-        std::vector<llama_token> next = {new_token_id};
-        llama_batch batch = llama_batch_get_one(next.data(), next.size());
-
-        // evaluate the current batch with the transformer model
-        if (llama_decode(ttc_ctx, batch)) {
-            printf("\nError: TTS code generation failed!\n");
-            output.data = "";
-            output.status = 0;
-            return output;
+        if (failed)
+        {
+            break;
         }
-        if(!tts_is_quiet)
+        if (part_codes.size() <= 1)
         {
-            printf("\rTTS Generating (%d outputs)", n_decode);
+            printf("\nWarning: No Audio Tokens Produced!\n");
+            continue;
         }
+        total_codes += part_codes.size();
+        vocoder = std::thread([&part_audio, &vocoded, part_codes = std::move(part_codes)]() mutable {
+            vocoded = outetts_vocode(part_codes, part_audio);
+        });
     }
-
-    if(!tts_is_quiet && ttsdebugmode==1)
+    if (!failed && !finish_part())
     {
-        const std::string inp_txt = common_detokenize(ttc_ctx, codes, true);
-        printf("\nGenerated %d Codes: '%s'\n",codes.size(), inp_txt.c_str());
+        printf("\nError: TTS vocoder generation failed!\n");
+        failed = true;
     }
-
-    // remove all non-audio tokens (i.e. < 151672 || > 155772)
-    codes.erase(std::remove_if(codes.begin(), codes.end(), [](llama_token t) { return t < cts_offset || t > (cts_offset+4100); }), codes.end());
-
-    for (auto & token : codes) {
-        token -= cts_offset;
+    if (vocoder.joinable())
+    {
+        vocoder.join();
     }
 
-    const int n_codes = codes.size();
-    if(n_codes<=1)
+    if (failed)
+    {
+        output.data = "";
+        output.status = 0;
+        return output;
+    }
+    if (audio.empty())
     {
-        printf("\nWarning: No Audio Tokens Produced!\n");
+        printf("\nWarning: TTS vocoder generated nothing!\n");
         last_generated_audio = "";
         output.data = last_generated_audio.c_str();
         output.status = 1;
         return output;
     }
-    kcpp_embd_batch codebatch = kcpp_embd_batch(codes,0,false,true);
-    printf("\nRunning Vocoder (%d AudioTokens)", codes.size());
 
-    if (llama_encode(cts_ctx, codebatch.batch) != 0) {
-        printf("\nError: TTS vocoder generation failed!\n");
-        output.data = "";
-        output.status = 0;
-        return output;
+    //add some silence at the end
+    for (int i = 0; i < cutout*2; ++i) {
+        audio.push_back(0.0f);
     }
-    else
-    {
-        // spectral operations
-        const int n_embd = llama_model_n_embd_out(model_cts);
-        const float * embd = llama_get_embeddings(cts_ctx);
-        std::vector<float> audio = embd_to_audio(embd, n_codes, n_embd, nthreads);
-
-        const int n_sr = 24000; // original sampling rate
-        const int t_sr = 24000; //final target sampling rate
-
-        // zero out first x seconds depending on whether its seeded
-        const int cutout = t_sr/4;
-
-        //audio = resample_wav(audio,n_sr,t_sr); //resample to 16k
-
-        if(audio.size()>cutout+16)
-        {
-            for (int i = 0; i < cutout; ++i) {
-                audio[i] = 0.0f;
-            }
-            //add some silence at the end
-            for (int i = 0; i < cutout*2; ++i) {
-                audio.push_back(0.0f);
-            }
-        }
-        else
-        {
-            printf("\nWarning: TTS vocoder generated nothing!\n");
-            last_generated_audio = "";
-            output.data = last_generated_audio.c_str();
-            output.status = 1;
-            return output;
-        }
 
-        last_generated_audio = save_wav16_base64(audio, t_sr);
-        ttstime = timer_check();
+    last_generated_audio = save_wav16_base64(audio, t_sr);
+    ttstime = timer_check();
 
-        printf("\nTTS Generated %d audio tokens in %.2fs.\n",(int) codes.size(),ttstime);
+    printf("\nTTS Generated %d audio tokens in %.2fs.\n",total_codes,ttstime);
 
-        output.data = last_generated_audio.c_str();
-        output.status = 1;
+    output.data = last_generated_audio.c_str();
+    output.status = 1;
 
-        last_generation_settings_audio_seed = inputs.audio_seed;
-        last_generation_settings_speaker_seed = inputs.speaker_seed;
-        last_generation_settings_prompt = std::string(prompt);
-        total_tts_gens += 1;
+    last_generation_settings_audio_seed = inputs.audio_seed;
+    last_generation_settings_speaker_seed = inputs.speaker_seed;
+    last_generation_settings_prompt = std::string(prompt);
+    total_tts_gens += 1;
 
-        return output;
-    }
+    return output;
 }
 
 tts_generation_outputs ttstype_generate(const tts_generation_inputs inputs)
 {
+    if (!inputs.stream)
+    {
+        tts_abort_flag = false;
+    }
     if (is_ttscpp_file) {
         return ttstype_generate_ttscpp(inputs);
     } else {
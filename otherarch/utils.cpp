@@ -4,12 +4,18 @@
 
 #include <cmath>
 #include <cstring>
+#include <algorithm>
 #include <fstream>
 #include <regex>
 #include <locale>
 #include <codecvt>
 #include <sstream>
 #include <ctime>
+#include <chrono>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
 
 #define MINIAUDIO_IMPLEMENTATION
 #ifndef MTMD_AUDIO_DEBUG
@@ -303,47 +309,79 @@ std::vector<uint8_t> kcpp_base64_decode(const std::string & encoded_string)
 
     return ret;
 }
-std::string kcpp_base64_encode(const unsigned char* data, unsigned int data_length) {
-    const std::string base64_chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    std::string encoded;
-    encoded.reserve(((data_length + 2) / 3) * 4);
-    for (unsigned int i = 0; i < data_length; i += 3) {
-        unsigned int triple = (data[i] << 16) + (i + 1 < data_length ? data[i + 1] << 8 : 0) + (i + 2 < data_length ? data[i + 2] : 0);
-        encoded.push_back(base64_chars[(triple >> 18) & 0x3F]);
-        encoded.push_back(base64_chars[(triple >> 12) & 0x3F]);
-        if (i + 1 < data_length) {
-            encoded.push_back(base64_chars[(triple >> 6) & 0x3F]);
-        } else {
-            encoded.push_back('=');
-        }
-        if (i + 2 < data_length) {
-            encoded.push_back(base64_chars[triple & 0x3F]);
-        } else {
-            encoded.push_back('=');
+//12 bits of input to two output chars at a time, the vector path handles 12 bytes per step
+static const char kcpp_base64_chars_enc[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static size_t kcpp_base64_encode_scalar(const unsigned char* data, size_t len, char* out)
+{
+    static const std::vector<uint16_t> pairs = []() {
+        std::vector<uint16_t> t(4096);
+        for (int i = 0; i < 4096; ++i)
+        {
+            char c[2] = { kcpp_base64_chars_enc[i >> 6], kcpp_base64_chars_enc[i & 0x3F] };
+            memcpy(&t[i], c, 2);
         }
+        return t;
+    }();
+    char* o = out;
+    size_t i = 0;
+    for (; i + 3 <= len; i += 3)
+    {
+        const uint32_t triple = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+        memcpy(o, &pairs[triple >> 12], 2);
+        memcpy(o + 2, &pairs[triple & 0xFFF], 2);
+        o += 4;
     }
-    return encoded;
-}
-std::string kcpp_base64_encode(const std::string &data) {
-    static const char lookup[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    std::string encoded;
-    int val = 0, valb = -6;
-    for (unsigned char c : data) {
-        val = (val << 8) + c;
-        valb += 8;
-        while (valb >= 0) {
-            encoded.push_back(lookup[(val >> valb) & 0x3F]);
-            valb -= 6;
-        }
+    if (i < len)
+    {
+        const uint32_t triple = (data[i] << 16) | (i + 1 < len ? data[i + 1] << 8 : 0);
+        *o++ = kcpp_base64_chars_enc[(triple >> 18) & 0x3F];
+        *o++ = kcpp_base64_chars_enc[(triple >> 12) & 0x3F];
+        *o++ = (i + 1 < len ? kcpp_base64_chars_enc[(triple >> 6) & 0x3F] : '=');
+        *o++ = '=';
     }
-    if (valb > -6) {
-        encoded.push_back(lookup[((val << 8) >> (valb + 8)) & 0x3F]);
+    return o - out;
+}
+
+#if defined(__SSSE3__)
+static size_t kcpp_base64_encode_ssse3(const unsigned char* data, size_t len, char* out)
+{
+    const __m128i shuf = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    const __m128i shift_lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    size_t i = 0;
+    char* o = out;
+    //loads 16 bytes but only uses 12, so stop while 4 spare bytes remain
+    for (; i + 16 <= len; i += 12)
+    {
+        __m128i in = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + i)), shuf);
+        const __m128i t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+        const __m128i t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+        const __m128i idx = _mm_or_si128(t0, t1);
+        //ranges A-Z, a-z, 0-9, + and / each get their own offset
+        __m128i sel = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+        sel = _mm_or_si128(sel, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx), _mm_set1_epi8(13)));
+        _mm_storeu_si128((__m128i*)o, _mm_add_epi8(_mm_shuffle_epi8(shift_lut, sel), idx));
+        o += 16;
     }
-    while (encoded.size() % 4) {
-        encoded.push_back('=');
+    return (o - out) + kcpp_base64_encode_scalar(data + i, len - i, o);
+}
+#endif
+
+std::string kcpp_base64_encode(const unsigned char* data, unsigned int data_length) {
+    std::string encoded(((size_t)data_length + 2) / 3 * 4, '\0');
+    if (data_length == 0) {
+        return encoded;
     }
+#if defined(__SSSE3__)
+    kcpp_base64_encode_ssse3(data, data_length, &encoded[0]);
+#else
+    kcpp_base64_encode_scalar(data, data_length, &encoded[0]);
+#endif
     return encoded;
 }
+std::string kcpp_base64_encode(const std::string &data) {
+    return kcpp_base64_encode((const unsigned char*)data.data(), (unsigned int)data.size());
+}
 
 std::string get_timestamp_str()
 {
@@ -748,4 +786,298 @@ std::vector<ggml_backend_dev_t> kcpp_parse_device_list(const std::string & value
         devices.push_back(nullptr);
     }
     return devices;
-}
\ No newline at end of file
+}
+
+token_stream_ring::token_stream_ring(size_t capacity) {
+    size_t cap = 1;
+    while (cap < capacity) {
+        cap <<= 1;
+    }
+    slots.resize(cap);
+    mask = cap - 1;
+}
+
+void token_stream_ring::wake() {
+    if (waiters.load() > 0) {
+        std::lock_guard<std::mutex> lock(wait_mtx);
+        wait_cv.notify_all();
+    }
+}
+
+void token_stream_ring::open() {
+    head.store(0);
+    tail.store(0);
+    detached.store(false);
+    closed.store(false);
+}
+
+void token_stream_ring::close() {
+    closed.store(true);
+    wake();
+}
+
+bool token_stream_ring::push(token_stream_record && rec) {
+    if (closed.load() || detached.load()) { //nobody is listening
+        return false;
+    }
+    const size_t h = head.load(std::memory_order_relaxed);
+    //full, give the reader up to a second to catch up before dropping it, never stall generation for good
+    if (h - tail.load(std::memory_order_acquire) > mask) {
+        std::unique_lock<std::mutex> lock(wait_mtx);
+        writer_waiting.store(true); //seq_cst, pairs with the tail store in pop()
+        const bool has_space = space_cv.wait_for(lock, std::chrono::seconds(1), [&]() {
+            return h - tail.load() <= mask;
+        });
+        writer_waiting.store(false);
+        if (!has_space) {
+            printf("\nToken stream reader is not draining, detaching it.\n");
+            detached.store(true);
+            return false;
+        }
+    }
+    slots[h & mask] = std::move(rec);
+    head.store(h + 1); //seq_cst, so wake() cannot miss a reader that just registered
+    wake();
+    return true;
+}
+
+bool token_stream_ring::pop(token_stream_record & out) {
+    const size_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire)) {
+        return false;
+    }
+    out = std::move(slots[t & mask]);
+    tail.store(t + 1); //seq_cst, so a writer that just found the ring full is not missed
+    if (writer_waiting.load()) {
+        std::lock_guard<std::mutex> lock(wait_mtx);
+        space_cv.notify_one();
+    }
+    return true;
+}
+
+int token_stream_ring::wait(int timeout_ms) {
+    auto ready = [this]() {
+        return head.load() != tail.load() || closed.load();
+    };
+    if (!ready() && timeout_ms > 0) {
+        std::unique_lock<std::mutex> lock(wait_mtx);
+        ++waiters;
+        wait_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), ready);
+        --waiters;
+    }
+    const size_t avail = head.load() - tail.load();
+    if (avail == 0 && closed.load()) {
+        return -1;
+    }
+    return (int)avail;
+}
+
+static inline unsigned char fold_ascii(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? (unsigned char)(c + ('a' - 'A')) : c;
+}
+
+void multi_pattern_matcher::clear() {
+    trans.clear();
+    out.clear();
+    pattern_lens.clear();
+    state = 0;
+}
+
+void multi_pattern_matcher::build(const std::vector<std::string> & patterns, bool ignore_case) {
+    clear();
+    fold = ignore_case;
+    trans.assign(256, -1);
+    out.push_back(-1);
+    for (int p = 0; p < (int)patterns.size(); ++p) {
+        const std::string & pat = patterns[p];
+        pattern_lens.push_back(pat.size());
+        if (pat.empty()) {
+            continue; //an empty pattern can never be reported sensibly
+        }
+        int node = 0;
+        for (unsigned char c : pat) {
+            if (fold) {
+                c = fold_ascii(c);
+            }
+            if (trans[node * 256 + c] < 0) {
+                trans[node * 256 + c] = (int32_t)out.size();
+                out.push_back(-1);
+                trans.resize(trans.size() + 256, -1);
+            }
+            node = trans[node * 256 + c];
+        }
+        if (out[node] < 0) {
+            out[node] = p;
+        }
+    }
+
+    //bfs to fill failure transitions, turning the trie into a full dfa
+    std::vector<int32_t> fail(out.size(), 0);
+    std::vector<int32_t> queue;
+    queue.reserve(out.size());
+    for (int c = 0; c < 256; ++c) {
+        int32_t nxt = trans[c];
+        if (nxt < 0) {
+            trans[c] = 0;
+        } else {
+            fail[nxt] = 0;
+            queue.push_back(nxt);
+        }
+    }
+    for (size_t qi = 0; qi < queue.size(); ++qi) {
+        const int32_t node = queue[qi];
+        const int32_t f = fail[node];
+        if (out[f] >= 0 && (out[node] < 0 || out[f] < out[node])) {
+            out[node] = out[f];
+        }
+        for (int c = 0; c < 256; ++c) {
+            int32_t nxt = trans[node * 256 + c];
+            if (nxt < 0) {
+                trans[node * 256 + c] = trans[f * 256 + c];
+            } else {
+                fail[nxt] = trans[f * 256 + c];
+                queue.push_back(nxt);
+            }
+        }
+    }
+}
+
+int multi_pattern_matcher::feed(const std::string & text, size_t * match_end) {
+    int found = -1;
+    if (trans.empty()) {
+        return found;
+    }
+    int32_t s = state;
+    for (size_t i = 0; i < text.size(); ++i) {
+        unsigned char c = (unsigned char)text[i];
+        if (fold) {
+            c = fold_ascii(c);
+        }
+        s = trans[s * 256 + c];
+        const int32_t hit = out[s];
+        if (hit >= 0 && (found < 0 || hit < found)) {
+            found = hit;
+            if (match_end) {
+                *match_end = i + 1;
+            }
+        }
+    }
+    state = s;
+    return found;
+}
+
+void token_prefix_tree::clear() {
+    root.children.clear();
+    root.owners.clear();
+    owned.clear();
+}
+
+void token_prefix_tree::insert(int owner, const std::vector<int> & tokens) {
+    remove(owner);
+    if (tokens.empty()) {
+        return;
+    }
+    node * cur = &root;
+    size_t pos = 0;
+    while (pos < tokens.size()) {
+        auto it = cur->children.find(tokens[pos]);
+        if (it == cur->children.end()) {
+            std::unique_ptr<node> leaf(new node());
+            leaf->edge.assign(tokens.begin() + pos, tokens.end());
+            leaf->owners.push_back(owner);
+            leaf->parent = cur;
+            owned[owner] = owned_end{leaf.get(), tokens.size()};
+            cur->children[tokens[pos]] = std::move(leaf);
+            return;
+        }
+        node * child = it->second.get();
+        size_t k = 0;
+        while (k < child->edge.size() && pos + k < tokens.size() && child->edge[k] == tokens[pos + k]) {
+            ++k;
+        }
+        if (k < child->edge.size()) {
+            //split the edge, the upper half becomes a new node shared by everyone below
+            std::unique_ptr<node> mid(new node());
+            mid->edge.assign(child->edge.begin(), child->edge.begin() + k);
+            mid->owners = child->owners;
+            mid->parent = cur;
+            std::unique_ptr<node> lower = std::move(it->second);
+            lower->edge.erase(lower->edge.begin(), lower->edge.begin() + k);
+            lower->parent = mid.get();
+            mid->children[lower->edge[0]] = std::move(lower);
+            it->second = std::move(mid);
+            child = it->second.get();
+        }
+        child->owners.push_back(owner);
+        cur = child;
+        pos += k;
+    }
+    owned[owner] = owned_end{cur, tokens.size()};
+}
+
+void token_prefix_tree::remove(int owner) {
+    auto found = owned.find(owner);
+    if (found == owned.end()) {
+        return;
+    }
+    node * cur = found->second.last;
+    owned.erase(found);
+
+    //owners only shrink going down, so the nodes left empty are a chain ending at the leaf. drop its top
+    node * emptied = nullptr;
+    for (node * n = cur; n != &root; n = n->parent) {
+        auto & ow = n->owners;
+        ow.erase(std::remove(ow.begin(), ow.end(), owner), ow.end());
+        emptied = (ow.empty() ? n : emptied);
+    }
+    if (emptied) {
+        cur = emptied->parent;
+        cur->children.erase(emptied->edge[0]);
+    }
+
+    //where nobody ends any more and only one path remains, fold it back into a single edge.
+    //the child is kept and takes over the edge, so end nodes held by other owners stay valid
+    while (cur != &root) {
+        node * up = cur->parent;
+        if (cur->children.size() == 1 && cur->owners.size() == cur->children.begin()->second->owners.size()) {
+            std::unique_ptr<node> only = std::move(cur->children.begin()->second);
+            only->edge.insert(only->edge.begin(), cur->edge.begin(), cur->edge.end());
+            only->parent = up;
+            up->children[only->edge[0]] = std::move(only); //frees cur
+        }
+        cur = up;
+    }
+}
+
+int token_prefix_tree::match(const std::vector<int> & tokens, std::vector<int> & lcp_out) const {
+    for (auto & v : lcp_out) {
+        v = 0;
+    }
+    int best = -1;
+    const node * cur = &root;
+    size_t pos = 0;
+    while (pos < tokens.size()) {
+        auto it = cur->children.find(tokens[pos]);
+        if (it == cur->children.end()) {
+            break;
+        }
+        const node * child = it->second.get();
+        size_t k = 0;
+        while (k < child->edge.size() && pos + k < tokens.size() && child->edge[k] == tokens[pos + k]) {
+            ++k;
+        }
+        pos += k;
+        for (int o : child->owners) {
+            if (o >= 0 && o < (int)lcp_out.size()) {
+                //an owner's sequence may end partway into a shared edge only at a node boundary, so depth is exact
+                lcp_out[o] = (int)std::min(pos, owned.at(o).len);
+            }
+        }
+        best = child->owners.empty() ? best : child->owners[0];
+        if (k < child->edge.size()) {
+            break;
+        }
+        cur = child;
+    }
+    return best;
+}
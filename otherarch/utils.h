@@ -4,9 +4,13 @@
 
 #include <string>
 #include <map>
+#include <memory>
 #include <vector>
 #include <random>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include "ggml_v3.h"
 #include "llama.h"
 
@@ -116,3 +120,91 @@ private:
         int img_ny
     );
 };
+
+//one streamed token, as seen by the sse reader
+struct token_stream_record {
+    std::string text;
+    int32_t id = -1;
+    float logprob = 0.0f;
+    int64_t timestamp_us = 0;
+};
+
+//lock-free single producer single consumer ring for streamed tokens.
+//the generation thread pushes, the server pops. locks are only taken while the reader or writer is actually asleep.
+class token_stream_ring {
+public:
+    explicit token_stream_ring(size_t capacity = 4096);
+
+    void open();  //reader side, call before the generation starts so wait() does not see a stale close
+    void close(); //writer side, no more tokens will follow
+    bool push(token_stream_record && rec); //writer side, returns false if the reader stopped draining
+    bool pop(token_stream_record & out); //reader side, returns false if nothing is available
+    int wait(int timeout_ms); //reader side, returns number of tokens ready, or -1 once closed and drained
+
+private:
+    std::vector<token_stream_record> slots;
+    size_t mask = 0;
+    std::atomic<size_t> head{0}; //next slot to write
+    std::atomic<size_t> tail{0}; //next slot to read
+    std::atomic<bool> closed{true};
+    std::atomic<bool> detached{false};
+    std::atomic<int> waiters{0};
+    std::atomic<bool> writer_waiting{false};
+    std::mutex wait_mtx;
+    std::condition_variable wait_cv; //reader sleeps here for tokens
+    std::condition_variable space_cv; //writer sleeps here while the ring is full
+
+    void wake();
+};
+
+//streaming aho-corasick automaton over raw bytes, for stop sequences and banned phrases.
+//built once per request, then fed only the newly emitted text. ignore_case folds ascii only.
+class multi_pattern_matcher {
+public:
+    void build(const std::vector<std::string> & patterns, bool ignore_case);
+    void clear();
+    bool empty() const { return pattern_lens.empty(); }
+
+    int get_state() const { return state; }
+    void set_state(int s) { state = s; } //to roll back after a rewind
+    void reset() { state = 0; }
+
+    //feeds text and returns the lowest pattern index that completed inside it, or -1.
+    //match_end receives how many bytes of text were consumed when that pattern completed.
+    int feed(const std::string & text, size_t * match_end = nullptr);
+    size_t pattern_len(int idx) const { return pattern_lens[idx]; }
+
+private:
+    std::vector<int32_t> trans; //dense goto table, 256 per node
+    std::vector<int32_t> out; //lowest pattern index ending at each node, including suffixes
+    std::vector<size_t> pattern_lens;
+    bool fold = false;
+    int state = 0;
+};
+
+//radix tree over cached token sequences, shared prefixes are stored once.
+//each sequence is tagged with an owner id (e.g. a smartcache slot).
+class token_prefix_tree {
+public:
+    void insert(int owner, const std::vector<int> & tokens); //replaces any sequence the owner already had
+    void remove(int owner);
+    void clear();
+
+    //walks tokens once and writes the common prefix length with every owner's sequence into lcp_out (indexed by owner).
+    //returns the owner with the longest common prefix, or -1 if nothing matches at all
+    int match(const std::vector<int> & tokens, std::vector<int> & lcp_out) const;
+
+private:
+    struct node {
+        std::vector<int> edge; //tokens on the edge leading into this node
+        std::map<int, std::unique_ptr<node>> children; //keyed by the first token of the child edge
+        std::vector<int> owners; //owners whose sequence passes through or ends in this node
+        node * parent = nullptr;
+    };
+    struct owned_end {
+        node * last; //node the owner's sequence ends in, removal walks up from here
+        size_t len;
+    };
+    node root;
+    std::map<int, owned_end> owned;
+};
@@ -13,6 +13,8 @@
 #include <cstring>
 #include <mutex>
 #include <cinttypes>
+#include <atomic>
+#include <algorithm>
 
 #define COMMON_SAMPLE_RATE 16000
 
@@ -24,6 +26,9 @@ static int whisperdebugmode = 0;
 static bool whisper_is_quiet = false;
 static whisper_context * whisper_ctx = nullptr;
 static std::string whisper_output_text = "";
+static std::string whisper_output_segments = ""; //json, long form only
+static int whisper_threads = 4;
+static std::vector<whisper_state *> whisper_worker_states; //long form workers beyond the context's own state, kept for later requests
 
 int total_transcribe_gens = 0;
 
@@ -69,6 +74,224 @@ static std::string output_txt(struct whisper_context * ctx) {
     return outtxt;
 }
 
+//energy based voice activity over 20ms frames, used to cut long audio where nobody is speaking
+struct whisper_audio_segment
+{
+    int start = 0; //in samples
+    int len = 0;
+};
+
+static std::vector<whisper_audio_segment> split_on_silence(const std::vector<float> & pcmf32, int min_len, int max_len)
+{
+    const int frame = COMMON_SAMPLE_RATE / 50;
+    const int n_frames = pcmf32.size() / frame;
+    std::vector<whisper_audio_segment> segments;
+    if (n_frames == 0)
+    {
+        return segments;
+    }
+    std::vector<float> energy(n_frames);
+    for (int f = 0; f < n_frames; ++f)
+    {
+        double acc = 0;
+        for (int i = 0; i < frame; ++i)
+        {
+            const float v = pcmf32[f * frame + i];
+            acc += v * v;
+        }
+        energy[f] = acc / frame;
+    }
+
+    //speech threshold a fixed factor above the noise floor, taken as the 10th percentile frame
+    std::vector<float> sorted = energy;
+    std::nth_element(sorted.begin(), sorted.begin() + n_frames / 10, sorted.end());
+    const float thold = std::max(sorted[n_frames / 10] * 4.0f, 1e-7f);
+
+    const int min_frames = std::max(1, min_len / frame);
+    const int max_frames = std::max(min_frames + 1, max_len / frame);
+    int seg_start = 0;
+    while (seg_start < n_frames)
+    {
+        int seg_end = n_frames;
+        if (n_frames - seg_start > max_frames)
+        {
+            //cut in the middle of the longest quiet run in the search window, or at the quietest frame if there is none
+            const int lo = seg_start + min_frames;
+            const int hi = seg_start + max_frames;
+            int best_run = 0;
+            int best_cut = -1;
+            int run = 0;
+            for (int f = lo; f < hi; ++f)
+            {
+                run = (energy[f] < thold) ? run + 1 : 0;
+                if (run > best_run)
+                {
+                    best_run = run;
+                    best_cut = f - run / 2;
+                }
+            }
+            if (best_cut < 0)
+            {
+                best_cut = std::min_element(energy.begin() + lo, energy.begin() + hi) - energy.begin();
+            }
+            seg_end = best_cut;
+        }
+
+        //segments without any speech are skipped, whisper tends to hallucinate on silence
+        int voiced = 0;
+        for (int f = seg_start; f < seg_end; ++f)
+        {
+            voiced += (energy[f] >= thold) ? 1 : 0;
+        }
+        if (voiced >= 10)
+        {
+            whisper_audio_segment seg;
+            seg.start = seg_start * frame;
+            seg.len = (seg_end == n_frames ? (int)pcmf32.size() : seg_end * frame) - seg.start;
+            segments.push_back(seg);
+        }
+        seg_start = seg_end;
+    }
+    return segments;
+}
+
+struct whisper_timed_text
+{
+    int64_t t0 = 0; //centiseconds from the start of the audio
+    int64_t t1 = 0;
+    std::string text;
+};
+
+static std::string json_escape_text(const std::string & str)
+{
+    std::string out;
+    out.reserve(str.size() + 8);
+    for (unsigned char c : str)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += (char)c;
+        }
+        else if (c < 0x20)
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        }
+        else
+        {
+            out += (char)c;
+        }
+    }
+    return out;
+}
+
+//transcribes the segments concurrently, each worker owns a whisper state over the shared model.
+//results are stitched back in timeline order, outsegs gets their start and end in seconds as a json array
+static bool transcribe_long_form(const std::vector<float> & pcmf32, const whisper_full_params & wparams, std::string & outtxt, std::string & outsegs)
+{
+    outtxt = "";
+    outsegs = "[]";
+    const std::vector<whisper_audio_segment> segments = split_on_silence(pcmf32, COMMON_SAMPLE_RATE * 20, COMMON_SAMPLE_RATE * 60);
+    if (segments.empty())
+    {
+        return true;
+    }
+
+    //a few threads per state keeps the decoder busy, more states mostly cost memory
+    const int n_workers = std::max(1, std::min({ (int)segments.size(), whisper_threads / 4, 8 }));
+    const int threads_per_worker = std::max(1, whisper_threads / n_workers);
+    if (!whisper_is_quiet)
+    {
+        printf("\nWhisper Long Form: %d segments on %d workers (%d threads each)", (int)segments.size(), n_workers, threads_per_worker);
+    }
+
+    //worker states hold their own kv and compute buffers, so they are made on first need and then reused
+    while ((int)whisper_worker_states.size() < n_workers - 1)
+    {
+        whisper_state * st = whisper_init_state(whisper_ctx);
+        if (st == nullptr)
+        {
+            break; //run with the states we got
+        }
+        whisper_worker_states.push_back(st);
+    }
+    std::vector<whisper_state *> states;
+    states.push_back(whisper_ctx->state);
+    for (int i = 1; i < n_workers && i <= (int)whisper_worker_states.size(); ++i)
+    {
+        states.push_back(whisper_worker_states[i - 1]);
+    }
+
+    std::vector<std::vector<whisper_timed_text>> results(segments.size());
+    std::atomic<int> next_seg(0);
+    std::atomic<bool> failed(false);
+    auto worker = [&](whisper_state * state) {
+        whisper_full_params params = wparams;
+        params.n_threads = threads_per_worker;
+        params.no_timestamps = false; //needed for segment times within each piece
+        while (!failed)
+        {
+            const int idx = next_seg++;
+            if (idx >= (int)segments.size())
+            {
+                break;
+            }
+            const whisper_audio_segment & seg = segments[idx];
+            if (whisper_full_with_state(whisper_ctx, state, params, pcmf32.data() + seg.start, seg.len) != 0)
+            {
+                failed = true;
+                break;
+            }
+            const int64_t offset = (int64_t)seg.start * 100 / COMMON_SAMPLE_RATE;
+            const int n = whisper_full_n_segments_from_state(state);
+            for (int i = 0; i < n; ++i)
+            {
+                whisper_timed_text tt;
+                tt.t0 = offset + whisper_full_get_segment_t0_from_state(state, i);
+                tt.t1 = offset + whisper_full_get_segment_t1_from_state(state, i);
+                tt.text = whisper_full_get_segment_text_from_state(state, i);
+                results[idx].push_back(std::move(tt));
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < states.size(); ++i)
+    {
+        threads.emplace_back(worker, states[i]);
+    }
+    worker(states[0]);
+    for (auto & t : threads)
+    {
+        t.join();
+    }
+    if (failed)
+    {
+        return false;
+    }
+
+    outsegs = "[";
+    for (const auto & seg : results)
+    {
+        for (const auto & tt : seg)
+        {
+            if (whisperdebugmode == 1 && !whisper_is_quiet)
+            {
+                printf("\n[%s --> %s] %s", to_timestamp(tt.t0).c_str(), to_timestamp(tt.t1).c_str(), tt.text.c_str());
+            }
+            outtxt += tt.text;
+            char times[64];
+            snprintf(times, sizeof(times), "{\"start\":%.2f,\"end\":%.2f,\"text\":\"", tt.t0 / 100.0, tt.t1 / 100.0);
+            outsegs += (outsegs.size() > 1 ? "," : "");
+            outsegs += times + json_escape_text(tt.text) + "\"}";
+        }
+    }
+    outsegs += "]";
+    return true;
+}
+
 void cb_log_disable(enum ggml_log_level , const char * , void * ) { }
 
 static std::string whispervulkandeviceenv;
@@ -97,6 +320,7 @@ bool whispertype_load_model(const whisper_load_model_inputs inputs)
     printf("\nLoading Whisper Model: %s",modelfile.c_str());
 
     whisperdebugmode = inputs.debugmode;
+    whisper_threads = std::max(1, inputs.threads);
     if (whisperdebugmode!=1) {
         whisper_log_set(cb_log_disable, NULL);
     }
@@ -106,6 +330,11 @@ bool whispertype_load_model(const whisper_load_model_inputs inputs)
     cparams.use_gpu    = true;
     cparams.flash_attn = false;
 
+    for (whisper_state * st : whisper_worker_states)
+    {
+        whisper_free_state(st); //they belong to the previous model
+    }
+    whisper_worker_states.clear();
     whisper_ctx = whisper_init_from_file_with_params(modelfile.c_str(), cparams);
 
     if (whisper_ctx == nullptr) {
@@ -158,7 +387,7 @@ whisper_generation_outputs whispertype_generate(const whisper_generation_inputs
     wparams.translate        = false;
     wparams.language         = langcode.c_str();
     wparams.detect_language  = false;
-    wparams.n_threads        = 4;
+    wparams.n_threads        = whisper_threads;
     wparams.n_max_text_ctx   = wparams.n_max_text_ctx;
     wparams.offset_ms        = 0;
     wparams.duration_ms      = 0;
@@ -181,19 +410,32 @@ whisper_generation_outputs whispertype_generate(const whisper_generation_inputs
     wparams.logprob_thold    = -1.00f;
     wparams.no_timestamps    = true;
 
-    if (whisper_full_parallel(whisper_ctx, wparams, pcmf32.data(), pcmf32.size(), 1) != 0) {
-        printf("\nWhisper: Failed to process audio!\n");
-        output.text = "";
-        output.status = 0;
-        return output;
+    whisper_output_segments = "";
+    if (inputs.long_form)
+    {
+        if (!transcribe_long_form(pcmf32, wparams, whisper_output_text, whisper_output_segments)) {
+            printf("\nWhisper: Failed to process audio!\n");
+            output.text = "";
+            output.status = 0;
+            return output;
+        }
+    }
+    else
+    {
+        if (whisper_full_parallel(whisper_ctx, wparams, pcmf32.data(), pcmf32.size(), 1) != 0) {
+            printf("\nWhisper: Failed to process audio!\n");
+            output.text = "";
+            output.status = 0;
+            return output;
+        }
+        // output text transcription
+        whisper_output_text = output_txt(whisper_ctx);
     }
 
     if (!whisper_is_quiet && whisperdebugmode==1) {
         whisper_print_timings(whisper_ctx);
     }
 
-    // output text transcription
-    whisper_output_text = output_txt(whisper_ctx);
     std::string ts = get_timestamp_str();
     if(!whisper_is_quiet)
     {
@@ -202,6 +444,7 @@ whisper_generation_outputs whispertype_generate(const whisper_generation_inputs
         printf("\n[%s] Whisper Transcribe Done.",ts.c_str());
     }
     output.text = whisper_output_text.c_str();
+    output.segments = whisper_output_segments.c_str();
     output.status = 1;
     total_transcribe_gens += 1;
     return output;
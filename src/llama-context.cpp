@@ -21,6 +21,18 @@
 //kcpp: use a global flag to toggle pipeline parallelism to avoid messing with ctx params
 static bool kcpp_pipeline_parallelism = false;
 
+//kcpp: positions kept in f16 by the hybrid precision kv cache, 0 disables it. read when the memory is created
+static uint32_t kcpp_kv_recent_window = 0;
+
+//kcpp: paged kv, host kv buffers are mapped and committed on demand. read when the memory is created
+static bool kcpp_kv_paged = false;
+static std::string kcpp_kv_spill_dir; //when set, the pages are backed by a scratch file in this directory
+static size_t kcpp_kv_resident_bytes = 0; //with a scratch file, cells beyond this many bytes are hinted as cold. 0 = no budget
+
+//kcpp: position window applied by the kv cache during sequence state io, set only inside the *_range calls
+static llama_pos kcpp_state_range_p0 = -1; //-1 means no window
+static llama_pos kcpp_state_range_p1 = -1; //-1 means up to the end
+
 llama_context::llama_context(
         const llama_model & model,
               llama_context_params params) :
@@ -3396,6 +3408,35 @@ size_t llama_state_seq_set_data_ext(llama_context * ctx, const uint8_t * src, si
     return ctx->state_seq_set_data(seq_id, src, size, flags);
 }
 
+//kcpp: sets the window for one state call and always clears it again
+struct kcpp_state_range_guard {
+    kcpp_state_range_guard(llama_pos p0, llama_pos p1) {
+        kcpp_state_range_p0 = (p0 < 0 ? 0 : p0);
+        kcpp_state_range_p1 = p1;
+    }
+    ~kcpp_state_range_guard() {
+        kcpp_state_range_p0 = -1;
+        kcpp_state_range_p1 = -1;
+    }
+};
+
+size_t llama_state_seq_get_size_range(llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    kcpp_state_range_guard guard(p0, p1);
+    return ctx->state_seq_get_size(seq_id, 0);
+}
+
+size_t llama_state_seq_get_data_range(llama_context * ctx, uint8_t * dst, size_t size, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    ctx->synchronize();
+    kcpp_state_range_guard guard(p0, p1);
+    return ctx->state_seq_get_data(seq_id, dst, size, 0);
+}
+
+size_t llama_state_seq_set_data_range(llama_context * ctx, const uint8_t * src, size_t size, llama_seq_id dest_seq_id, llama_pos p0) {
+    ctx->synchronize();
+    kcpp_state_range_guard guard(p0, -1);
+    return ctx->state_seq_set_data(dest_seq_id, src, size, 0);
+}
+
 size_t llama_state_seq_save_file(llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count) {
     ctx->synchronize();
 
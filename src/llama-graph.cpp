@@ -429,10 +429,29 @@ void llm_graph_input_attn_kv::set_input(const llama_ubatch * ubatch) {
     mctx->set_input_v_idxs(self_v_idxs, ubatch);
 
     mctx->set_input_kq_mask(self_kq_mask, ubatch, cparams.causal_attn);
+
+    if (mctx_recent) {
+        mctx_recent->set_input_k_idxs(self_k_idxs_recent, ubatch);
+        mctx_recent->set_input_v_idxs(self_v_idxs_recent, ubatch);
+
+        mctx_recent->set_input_kq_mask(self_kq_mask_recent, ubatch, cparams.causal_attn);
+    }
+
+    if (self_sink_base) {
+        GGML_ASSERT(ggml_backend_buffer_is_host(self_sink_base->buffer));
+        float * data = (float *) self_sink_base->data;
+        std::fill(data, data + ggml_nelements(self_sink_base), -1e30f);
+    }
 }
 
 bool llm_graph_input_attn_kv::can_reuse(const llm_graph_params & params) {
-    const auto * mctx = static_cast<const llama_kv_cache_context *>(params.mctx);
+    //kcpp: the hybrid precision cache hands out a pair of contexts
+    const auto * mctx_hybrid = dynamic_cast<const llama_kv_cache_iswa_context *>(params.mctx);
+    if ((mctx_hybrid != nullptr) != (mctx_recent != nullptr)) {
+        return false;
+    }
+
+    const auto * mctx = mctx_hybrid ? mctx_hybrid->get_base() : static_cast<const llama_kv_cache_context *>(params.mctx);
 
     this->mctx = mctx;
 
@@ -443,6 +462,14 @@ bool llm_graph_input_attn_kv::can_reuse(const llm_graph_params & params) {
 
     res &= can_reuse_kq_mask(self_kq_mask, mctx, params.ubatch, params.cparams);
 
+    if (mctx_hybrid) {
+        this->mctx_recent = mctx_hybrid->get_swa();
+
+        res &= self_k_idxs_recent->ne[0] == params.ubatch.n_tokens;
+
+        res &= can_reuse_kq_mask(self_kq_mask_recent, mctx_recent, params.ubatch, params.cparams);
+    }
+
     return res;
 }
 
@@ -1935,10 +1962,33 @@ static std::unique_ptr<llm_graph_input_attn_kv> build_attn_inp_kv_impl(
 }
 
 llm_graph_input_attn_kv * llm_graph_context::build_attn_inp_kv() const {
-    const auto * mctx_cur = static_cast<const llama_kv_cache_context *>(mctx);
+    //kcpp: the hybrid precision cache is the only iswa memory a non-SWA model can get
+    const auto * mctx_hybrid = dynamic_cast<const llama_kv_cache_iswa_context *>(mctx);
+
+    const auto * mctx_cur = mctx_hybrid ? mctx_hybrid->get_base() : static_cast<const llama_kv_cache_context *>(mctx);
 
     auto inp = build_attn_inp_kv_impl(ctx0, ubatch, hparams, cparams, mctx_cur);
 
+    if (mctx_hybrid) {
+        GGML_ASSERT(cparams.flash_attn && "hybrid precision KV cache requires flash attention");
+
+        const auto * mctx_recent = mctx_hybrid->get_swa();
+
+        inp->mctx_recent = mctx_recent;
+
+        inp->self_k_idxs_recent = mctx_recent->build_input_k_idxs(ctx0, ubatch);
+        inp->self_v_idxs_recent = mctx_recent->build_input_v_idxs(ctx0, ubatch);
+
+        inp->self_kq_mask_recent = build_kq_mask(ctx0, mctx_recent, ubatch, cparams);
+        ggml_set_input(inp->self_kq_mask_recent);
+
+        inp->self_kq_mask_recent_cnv = ggml_cast(ctx0, inp->self_kq_mask_recent, GGML_TYPE_F16);
+
+        // each store is attended separately, see build_attn
+        inp->self_sink_base = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, hparams.n_head());
+        ggml_set_input(inp->self_sink_base);
+    }
+
     return (llm_graph_input_attn_kv *) res->add_input(std::move(inp));
 }
 
@@ -1972,6 +2022,11 @@ ggml_tensor * llm_graph_context::build_attn(
 
         ggml_build_forward_expand(gf, mctx_cur->cpy_k(ctx0, k_cur, k_idxs, il));
         ggml_build_forward_expand(gf, mctx_cur->cpy_v(ctx0, v_cur, v_idxs, il));
+
+        if (inp->mctx_recent) {
+            ggml_build_forward_expand(gf, inp->mctx_recent->cpy_k(ctx0, k_cur, inp->self_k_idxs_recent, il));
+            ggml_build_forward_expand(gf, inp->mctx_recent->cpy_v(ctx0, v_cur, inp->self_v_idxs_recent, il));
+        }
     }
 
     const auto & kq_mask = inp->get_kq_mask();
@@ -1980,7 +2035,55 @@ ggml_tensor * llm_graph_context::build_attn(
     ggml_tensor * k = mctx_cur->get_k(ctx0, il);
     ggml_tensor * v = mctx_cur->get_v(ctx0, il);
 
-    ggml_tensor * cur = build_attn_mha(q, k, v, kq_b, kq_mask, sinks, v_mla, kq_scale, il);
+    ggml_tensor * cur = nullptr;
+
+    if (inp->mctx_recent) {
+        //kcpp: hybrid precision. each store is attended in its own type and the two outputs are blended by the
+        //share of the softmax mass on each store, which follows from the log-sum-exp the attention pass returns.
+        //the quantized history is never expanded and its scores are computed once
+        GGML_ASSERT(kq_b == nullptr);
+
+        ggml_tensor * k_r = inp->mctx_recent->get_k(ctx0, il);
+        ggml_tensor * v_r = inp->mctx_recent->get_v(ctx0, il);
+
+        const int64_t n_stream = k->ne[3];
+        const float   softcap  = hparams.attn_soft_cap ? hparams.f_attn_logit_softcapping : 0.0f;
+
+        ggml_tensor * qs = ggml_view_4d(ctx0, q, q->ne[0], q->ne[1], q->ne[2]/n_stream, n_stream, q->nb[1], q->nb[2], q->nb[3]/n_stream, 0);
+        qs = ggml_permute(ctx0, qs, 0, 2, 1, 3);
+
+        // model sinks count once, on the base store. without them the very low sink keeps a fully masked row finite
+        ggml_tensor * fa_b = ggml_flash_attn_ext_lse(ctx0, qs, ggml_permute(ctx0, k, 0, 2, 1, 3), ggml_permute(ctx0, v, 0, 2, 1, 3),
+                                                     inp->self_kq_mask_cnv, kq_scale, hparams.f_max_alibi_bias, softcap);
+        ggml_flash_attn_ext_add_sinks(fa_b, sinks ? sinks : inp->self_sink_base);
+        ggml_flash_attn_ext_set_prec (fa_b, GGML_PREC_F32);
+        cb(fa_b, "fattn_base", il);
+
+        // the recent store always holds the current token, so its rows are never fully masked
+        ggml_tensor * fa_r = ggml_flash_attn_ext_lse(ctx0, qs, ggml_permute(ctx0, k_r, 0, 2, 1, 3), ggml_permute(ctx0, v_r, 0, 2, 1, 3),
+                                                     inp->self_kq_mask_recent_cnv, kq_scale, hparams.f_max_alibi_bias, softcap);
+        ggml_flash_attn_ext_set_prec (fa_r, GGML_PREC_F32);
+        cb(fa_r, "fattn_recent", il);
+
+        // rows are [values, lse] for each head and token
+        const int64_t n_embd_v = v->ne[0];
+        auto values = [&](ggml_tensor * fa) {
+            return ggml_view_4d(ctx0, fa, n_embd_v, fa->ne[1], fa->ne[2], fa->ne[3], fa->nb[1], fa->nb[2], fa->nb[3], 0);
+        };
+        auto lse = [&](ggml_tensor * fa) {
+            return ggml_view_4d(ctx0, fa, 1, fa->ne[1], fa->ne[2], fa->ne[3], fa->nb[1], fa->nb[2], fa->nb[3], n_embd_v*ggml_element_size(fa));
+        };
+
+        // base share = exp(lse_b) / (exp(lse_b) + exp(lse_r)) = sigmoid(lse_b - lse_r)
+        ggml_tensor * w_b = ggml_sigmoid(ctx0, ggml_sub(ctx0, lse(fa_b), lse(fa_r)));
+        cb(w_b, "kq_base_share", il);
+
+        ggml_tensor * o_r = values(fa_r);
+        cur = ggml_add(ctx0, o_r, ggml_mul(ctx0, ggml_sub(ctx0, values(fa_b), o_r), w_b));
+        cur = ggml_reshape_2d(ctx0, cur, cur->ne[0]*cur->ne[1], cur->ne[2]*cur->ne[3]);
+    } else {
+        cur = build_attn_mha(q, k, v, kq_b, kq_mask, sinks, v_mla, kq_scale, il);
+    }
     cb(cur, "kqv_out", il);
 
     if (wo) {
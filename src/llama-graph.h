@@ -308,6 +308,13 @@ public:
     ggml_tensor * self_kq_mask     = nullptr; // F32 [n_kv, n_batch/n_stream, 1, n_stream]
     ggml_tensor * self_kq_mask_cnv = nullptr; //     [n_kv, n_batch/n_stream, 1, n_stream]
 
+    //kcpp: hybrid precision, the f16 store of recent positions. self_kq_mask_cnv then covers the base store only
+    ggml_tensor * self_k_idxs_recent      = nullptr; // I64 [n_batch]
+    ggml_tensor * self_v_idxs_recent      = nullptr; // I64 [n_batch]
+    ggml_tensor * self_kq_mask_recent     = nullptr; // F32 [n_kv_recent, n_batch/n_stream, 1, n_stream]
+    ggml_tensor * self_kq_mask_recent_cnv = nullptr; // F16 [n_kv_recent, n_batch/n_stream, 1, n_stream]
+    ggml_tensor * self_sink_base          = nullptr; // F32 [n_head], very low, so a fully masked row gives zeros
+
     // note: these have to be copies because in order to be able to reuse a graph, its inputs
     //       need to carry these parameters with them. otherwise, they can point to freed
     //       llm_graph_params from a previous batch, causing stack-use-after-return
@@ -315,6 +322,7 @@ public:
     const llama_cparams cparams;
 
     const llama_kv_cache_context * mctx;
+    const llama_kv_cache_context * mctx_recent = nullptr;
 };
 
 // V-less input for the KV cache
@@ -24,7 +24,31 @@ llama_kv_cache_iswa::llama_kv_cache_iswa(
                  uint32_t   n_ubatch,
                  uint32_t   n_pad,
     const layer_filter_cb & filter,
-    const  layer_reuse_cb & reuse) : hparams(model.hparams), unified(unified) {
+    const  layer_reuse_cb & reuse,
+                 uint32_t   kcpp_recent_window) : hparams(model.hparams), unified(unified), kcpp_hybrid(kcpp_recent_window > 0) {
+
+    if (kcpp_hybrid) {
+        //kcpp: hybrid precision, every layer lives in both caches
+        uint32_t size_recent = GGML_PAD(std::min(kv_size, kcpp_recent_window*(unified ? n_seq_max : 1) + n_ubatch), 256);
+        size_recent += 128;
+        size_recent = GGML_PAD(size_recent, n_pad);
+
+        LLAMA_LOG_INFO("%s: creating hybrid precision KV cache, %u cells in %s/%s and the last %u positions in f16 (%u cells)\n",
+                __func__, kv_size, ggml_type_name(type_k), ggml_type_name(type_v), kcpp_recent_window, size_recent);
+
+        kv_base = std::make_unique<llama_kv_cache>(
+                model, type_k, type_v,
+                v_trans, offload, unified, kv_size, n_seq_max, n_pad,
+                0, LLAMA_SWA_TYPE_NONE, filter, reuse);
+
+        kv_swa = std::make_unique<llama_kv_cache>(
+                model, GGML_TYPE_F16, GGML_TYPE_F16,
+                v_trans, offload, unified, size_recent, n_seq_max, n_pad,
+                kcpp_recent_window, LLAMA_SWA_TYPE_STANDARD, filter, reuse);
+
+        kv_base->kcpp_set_recent(kv_swa.get(), kcpp_recent_window);
+        return;
+    }
 
     // chain filters
     const layer_filter_cb filter_base = [&](int32_t il) {
@@ -111,6 +135,11 @@ void llama_kv_cache_iswa::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p
 }
 
 llama_pos llama_kv_cache_iswa::seq_pos_min(llama_seq_id seq_id) const {
+    if (kcpp_hybrid) {
+        //kcpp: only the base cache holds the full history
+        return kv_base->seq_pos_min(seq_id);
+    }
+
     // the base cache is a superset of the SWA cache, so we can just check the SWA cache
     return kv_swa->seq_pos_min(seq_id);
 }
@@ -222,6 +251,11 @@ llama_memory_context_ptr llama_kv_cache_iswa::init_update(llama_context * lctx,
 }
 
 bool llama_kv_cache_iswa::get_can_shift() const {
+    if (kcpp_hybrid) {
+        //kcpp: keys the recent cache dropped are still in the base cache, so shifting both stays exact
+        return kv_base->get_can_shift() && kv_swa->get_can_shift();
+    }
+
     return kv_base->get_can_shift() &&
            kv_swa->get_can_shift() &&
            kv_base->get_size() == kv_swa->get_size();
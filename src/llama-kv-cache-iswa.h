@@ -10,6 +10,10 @@
 
 // utilizes two instances of llama_kv_cache
 //   the first instance is for the non-SWA layers of the model and the second instance is for the SWA layers
+//
+// kcpp: with kcpp_recent_window > 0 it is used as a hybrid precision cache for non-SWA models instead
+//   both instances hold every layer. the base instance keeps the full history in the requested (quantized) types
+//   and the SWA instance keeps the last kcpp_recent_window positions in F16. attention reads both
 
 class llama_kv_cache_iswa : public llama_memory_i {
 public:
@@ -26,7 +30,8 @@ public:
                      uint32_t   n_ubatch,
                      uint32_t   n_pad,
         const layer_filter_cb & filter,
-        const  layer_reuse_cb & reuse);
+        const  layer_reuse_cb & reuse,
+                     uint32_t   kcpp_recent_window = 0);
 
     ~llama_kv_cache_iswa() = default;
 
@@ -70,11 +75,15 @@ public:
     llama_kv_cache * get_base() const;
     llama_kv_cache * get_swa () const;
 
+    bool kcpp_is_hybrid() const { return kcpp_hybrid; }
+
 private:
     const llama_hparams & hparams;
 
     const bool unified;
 
+    const bool kcpp_hybrid;
+
     std::unique_ptr<llama_kv_cache> kv_base;
     std::unique_ptr<llama_kv_cache> kv_swa;
 };
@@ -5,6 +5,8 @@
 #include "llama-model.h"
 #include "llama-context.h"
 
+#include "ggml-alloc.h"
+
 #include <algorithm>
 #include <cassert>
 #include <cmath>
@@ -13,6 +15,21 @@
 #include <map>
 #include <stdexcept>
 
+#ifdef __has_include
+    #if __has_include(<unistd.h>)
+        #include <unistd.h>
+        #include <fcntl.h>
+        #if defined(_POSIX_MAPPED_FILES)
+            #include <sys/mman.h>
+        #endif
+    #endif
+#endif
+
+//kcpp: paged kv needs posix mappings
+#if defined(_POSIX_MAPPED_FILES) && !defined(_WIN32)
+#define KCPP_PAGED_KV 1
+#endif
+
 //
 // llama_kv_cache
 //
@@ -187,7 +204,16 @@ llama_kv_cache::llama_kv_cache(
                 t->buffer = buf; // set dummy buffer for KV cache so that the backend scheduler won't try to allocate it
             }
         } else {
-            buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx.get(), buft); // real buffer
+            buf = nullptr;
+            if (kcpp_kv_paged && buft == ggml_backend_cpu_buffer_type()) {
+                buf = kcpp_paged_alloc(ctx.get(), buft); // fresh mappings read as zero, no clear needed
+            }
+            if (!buf) {
+                buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx.get(), buft); // real buffer
+                if (buf) {
+                    ggml_backend_buffer_clear(buf, 0);
+                }
+            }
         }
         if (!buf) {
             throw std::runtime_error("failed to allocate buffer for kv cache");
@@ -195,7 +221,9 @@ llama_kv_cache::llama_kv_cache(
 
         LLAMA_LOG_INFO("%s: %10s KV buffer size = %8.2f MiB\n", __func__, ggml_backend_buffer_name(buf), ggml_backend_buffer_get_size(buf)/1024.0/1024.0);
 
-        ggml_backend_buffer_clear(buf, 0);
+        if (model.hparams.no_alloc) {
+            ggml_backend_buffer_clear(buf, 0);
+        }
         ctxs_bufs.emplace_back(std::move(ctx), buf);
     }
 
@@ -211,21 +239,203 @@ llama_kv_cache::llama_kv_cache(
 
     const char * LLAMA_KV_CACHE_DEBUG = getenv("LLAMA_KV_CACHE_DEBUG");
     debug = LLAMA_KV_CACHE_DEBUG ? atoi(LLAMA_KV_CACHE_DEBUG) : 0;
+
+    kcpp_cold_ranges.resize(n_stream);
+    kcpp_cold_used.resize(n_stream, 0);
+    kcpp_cold_tick.resize(n_stream, 0);
 }
 
 void llama_kv_cache::clear(bool data) {
     for (uint32_t s = 0; s < n_stream; ++s) {
         v_cells[s].reset();
         v_heads[s] = 0;
+        kcpp_cold_ranges[s].clear();
+        kcpp_cold_used[s] = 0;
+        kcpp_cold_tick[s] = 0;
     }
 
     if (data) {
         for (auto & [_, buf] : ctxs_bufs) {
-            ggml_backend_buffer_clear(buf.get(), 0);
+            if (!kcpp_paged_release(buf.get())) {
+                ggml_backend_buffer_clear(buf.get(), 0);
+            }
         }
     }
 }
 
+llama_kv_cache::kcpp_paged_map::~kcpp_paged_map() {
+#ifdef KCPP_PAGED_KV
+    if (addr) {
+        munmap(addr, size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+#endif
+}
+
+ggml_backend_buffer_t llama_kv_cache::kcpp_paged_alloc(ggml_context * ctx, ggml_backend_buffer_type_t buft) {
+#ifdef KCPP_PAGED_KV
+    const size_t align = ggml_backend_buft_get_alignment(buft);
+
+    size_t size = 0;
+    for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != nullptr; t = ggml_get_next_tensor(ctx, t)) {
+        if (t->view_src == nullptr) {
+            size += GGML_PAD(ggml_backend_buft_get_alloc_size(buft, t), align);
+        }
+    }
+    size = GGML_PAD(size, (size_t) sysconf(_SC_PAGESIZE));
+
+    auto map = std::make_unique<kcpp_paged_map>();
+    map->size = size;
+
+    if (!kcpp_kv_spill_dir.empty()) {
+        std::string path = kcpp_kv_spill_dir + "/kcpp_kv_XXXXXX";
+        map->fd = mkstemp(&path[0]);
+        if (map->fd < 0) {
+            LLAMA_LOG_WARN("%s: cannot create KV scratch file in %s, using regular memory\n", __func__, kcpp_kv_spill_dir.c_str());
+            return nullptr;
+        }
+        unlink(path.c_str()); // the file goes away with the process
+        if (ftruncate(map->fd, size) != 0) {
+            LLAMA_LOG_WARN("%s: cannot size KV scratch file to %zu bytes, using regular memory\n", __func__, size);
+            return nullptr;
+        }
+        map->addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, map->fd, 0);
+    } else {
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+        flags |= MAP_NORESERVE;
+#endif
+        map->addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    }
+    if (map->addr == MAP_FAILED) {
+        map->addr = nullptr;
+        LLAMA_LOG_WARN("%s: cannot map %zu bytes for the KV cache, using regular memory\n", __func__, size);
+        return nullptr;
+    }
+
+    ggml_backend_buffer_t buf = ggml_backend_cpu_buffer_from_ptr(map->addr, size);
+    ggml_tallocr talloc = ggml_tallocr_new(buf);
+    for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != nullptr; t = ggml_get_next_tensor(ctx, t)) {
+        if (t->view_src == nullptr && ggml_tallocr_alloc(&talloc, t) != GGML_STATUS_SUCCESS) {
+            ggml_backend_buffer_free(buf);
+            return nullptr;
+        }
+    }
+    for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != nullptr; t = ggml_get_next_tensor(ctx, t)) {
+        if (t->view_src != nullptr && t->buffer == nullptr) {
+            ggml_backend_view_init(t);
+        }
+    }
+
+    LLAMA_LOG_INFO("%s: KV cache pages are committed on demand%s\n", __func__, map->fd >= 0 ? ", backed by a scratch file" : "");
+
+    map->buf = buf;
+    kcpp_paged_maps.push_back(std::move(map));
+    return buf;
+#else
+    GGML_UNUSED(ctx);
+    GGML_UNUSED(buft);
+    return nullptr;
+#endif
+}
+
+bool llama_kv_cache::kcpp_paged_release(ggml_backend_buffer_t buf) {
+#if defined(KCPP_PAGED_KV) && defined(__linux__)
+    for (auto & map : kcpp_paged_maps) {
+        if (map->buf != buf) {
+            continue;
+        }
+        // hand the pages back instead of writing zeros over them, they read as zero afterwards
+        if (map->fd >= 0) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+            return fallocate(map->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, map->size) == 0;
+#else
+            return false;
+#endif
+        }
+        return madvise(map->addr, map->size, MADV_DONTNEED) == 0;
+    }
+#else
+    GGML_UNUSED(buf);
+#endif
+    return false;
+}
+
+void llama_kv_cache::kcpp_paged_hint(uint32_t strm) {
+#if defined(KCPP_PAGED_KV) && defined(MADV_COLD)
+    if (kcpp_kv_resident_bytes == 0 || kcpp_paged_maps.empty()) {
+        return;
+    }
+
+    const auto & cells = v_cells[strm];
+    const uint32_t used = cells.used_max_p1();
+    const size_t per_cell = total_size() / ((size_t) cells.size() * n_stream);
+    if (per_cell == 0 || (size_t) used * per_cell <= kcpp_kv_resident_bytes) {
+        return;
+    }
+
+    const size_t page = sysconf(_SC_PAGESIZE);
+    auto advise = [&](const ggml_tensor * t, uint32_t i0, uint32_t i1, int advice) {
+        // only whole pages inside the rows of these cells
+        uintptr_t p0 = (uintptr_t) t->data + strm*t->nb[2] + i0*t->nb[1];
+        uintptr_t p1 = (uintptr_t) t->data + strm*t->nb[2] + i1*t->nb[1];
+        p0 = GGML_PAD(p0, page);
+        p1 = p1 - p1 % page;
+        if (p1 > p0) {
+            madvise((void *) p0, p1 - p0, advice);
+        }
+    };
+
+    auto & ranges = kcpp_cold_ranges[strm];
+    const bool regrow = (used >= kcpp_cold_used[strm] + 256 || used < kcpp_cold_used[strm]);
+    if (regrow) {
+        // everything except the first tokens (attention sinks) and the newest tokens that fit the budget is cold
+        const llama_pos sink = 64;
+        const uint32_t keep = kcpp_kv_resident_bytes / per_cell;
+        llama_pos pos_max = -1;
+        for (uint32_t i = 0; i < used; ++i) {
+            if (!cells.is_empty(i)) {
+                pos_max = std::max(pos_max, cells.pos_get(i));
+            }
+        }
+        const llama_pos cold_end = pos_max - (llama_pos) (keep > (uint32_t) sink ? keep - sink : 0);
+
+        ranges.clear();
+        for (uint32_t i = 0; i < used; ++i) {
+            const bool cold = cells.is_empty(i) || (cells.pos_get(i) >= sink && cells.pos_get(i) < cold_end);
+            if (!cold) {
+                continue;
+            }
+            if (!ranges.empty() && ranges.back().second == i) {
+                ranges.back().second = i + 1;
+            } else {
+                ranges.emplace_back(i, i + 1);
+            }
+        }
+        kcpp_cold_used[strm] = used;
+    } else if (++kcpp_cold_tick[strm] < 64) {
+        return;
+    }
+
+    // let the kernel write these back to the scratch file first when memory is needed. attention still reads every
+    // cell, which makes the pages active again, so the hint is renewed every few dozen ubatches. nothing is
+    // prefetched, the cold pages fault back in only when read
+    kcpp_cold_tick[strm] = 0;
+    for (const auto & layer : layers) {
+        for (const auto & r : ranges) {
+            advise(layer.k, r.first, r.second, MADV_COLD);
+            if (!v_trans && layer.v) {
+                advise(layer.v, r.first, r.second, MADV_COLD);
+            }
+        }
+    }
+#else
+    GGML_UNUSED(strm);
+#endif
+}
+
 bool llama_kv_cache::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
     GGML_ASSERT(seq_id == -1 || (seq_id >= 0 && (size_t) seq_id < seq_to_stream.size()));
 
@@ -970,6 +1180,8 @@ void llama_kv_cache::apply_ubatch(const slot_info & sinfo, const llama_ubatch &
         auto & head = v_heads[sinfo.strm[s]];
 
         head = sinfo.idxs[s].back() + 1;
+
+        kcpp_paged_hint(sinfo.strm[s]);
     }
 }
 
@@ -1001,6 +1213,11 @@ bool llama_kv_cache::get_has_shift() const {
     return result;
 }
 
+void llama_kv_cache::kcpp_set_recent(const llama_kv_cache * recent, uint32_t n_recent) {
+    kcpp_recent   = recent;
+    kcpp_n_recent = n_recent;
+}
+
 uint32_t llama_kv_cache::get_n_kv(const slot_info & sinfo) const {
     uint32_t result = 0;
 
@@ -1259,6 +1476,10 @@ struct args_set_input_kq_mask {
     uint32_t       n_swa;
     llama_swa_type swa_type;
 
+    //kcpp: sorted positions per sequence held by the recent store, nullptr when not in hybrid mode
+    const std::vector<std::vector<llama_pos>> * recent_pos;
+    uint32_t n_recent;
+
     int64_t n_kv;
     int64_t n_stream;
     int64_t n_tps;
@@ -1275,6 +1496,9 @@ static void set_input_kq_mask_impl(const args_set_input_kq_mask & args, float *
     const uint32_t       n_swa    = args.n_swa;
     const llama_swa_type swa_type = args.swa_type;
 
+    const auto * recent_pos = args.recent_pos;
+    const int32_t n_recent  = args.n_recent;
+
     const int64_t n_kv     = args.n_kv;
     const int64_t n_stream = args.n_stream;
     const int64_t n_tps    = args.n_tps;
@@ -1331,7 +1555,7 @@ static void set_input_kq_mask_impl(const args_set_input_kq_mask & args, float *
                     prev = true;
                 } else {
                     idxs.clear();
-                    idxs.reserve(ubatch->n_tokens + n_swa + 32);
+                    idxs.reserve(ubatch->n_tokens + n_swa + n_recent + 32);
 
                     seq_srct[seq_id] = i;
                 }
@@ -1365,7 +1589,7 @@ static void set_input_kq_mask_impl(const args_set_input_kq_mask & args, float *
                 if (!alibi) {
                     if (!prev) {
                         // record all cells for which: p0 >= seq_pos_min[seq_id] - n_swa - 32
-                        if (p0 + (int32_t) (n_swa + 32) >= seq_pos_min[seq_id]) {
+                        if (p0 + (int32_t) (n_swa + n_recent + 32) >= seq_pos_min[seq_id]) {
                             idxs.push_back(j);
                         }
                     }
@@ -1396,6 +1620,14 @@ static void set_input_kq_mask_impl(const args_set_input_kq_mask & args, float *
                     }
                 }
 
+                //kcpp: hybrid precision, the recent store covers this key
+                if (recent_pos && p1 - p0 < n_recent) {
+                    const auto & rp = (*recent_pos)[seq_id];
+                    if (std::binary_search(rp.begin(), rp.end(), p0)) {
+                        goto skip;
+                    }
+                }
+
                 if (alibi) {
                     data[idst + j] = -std::abs(p0 - p1);
                 } else {
@@ -1456,6 +1688,27 @@ void llama_kv_cache::set_input_kq_mask(ggml_tensor * dst, const llama_ubatch * u
 
     //const int64_t t_start = ggml_time_us();
 
+    //kcpp: collect what the recent store holds, it is small so this is cheap per ubatch
+    std::vector<std::vector<llama_pos>> recent_pos;
+    if (kcpp_recent) {
+        recent_pos.resize(LLAMA_MAX_SEQ);
+        for (const auto & rcells : kcpp_recent->v_cells) {
+            for (uint32_t j = 0; j < rcells.size(); ++j) {
+                if (rcells.is_empty(j)) {
+                    continue;
+                }
+                for (uint32_t seq = 0; seq < n_seq_max; ++seq) {
+                    if (rcells.seq_has(j, seq)) {
+                        recent_pos[seq].push_back(rcells.pos_get(j));
+                    }
+                }
+            }
+        }
+        for (auto & rp : recent_pos) {
+            std::sort(rp.begin(), rp.end());
+        }
+    }
+
     const args_set_input_kq_mask args = {
         /*.hparams          =*/ hparams,
         /*.ubatch           =*/ ubatch,
@@ -1463,6 +1716,8 @@ void llama_kv_cache::set_input_kq_mask(ggml_tensor * dst, const llama_ubatch * u
         /*.seq_to_stream    =*/ seq_to_stream,
         /*.n_swa            =*/ n_swa,
         /*.swa_type         =*/ swa_type,
+        /*.recent_pos       =*/ kcpp_recent ? &recent_pos : nullptr,
+        /*.n_recent         =*/ kcpp_n_recent,
         /*.n_kv             =*/ n_kv,
         /*.n_stream         =*/ n_stream,
         /*.n_tps            =*/ n_tps,
@@ -1662,7 +1917,12 @@ void llama_kv_cache::state_write(llama_io_write_i & io, llama_seq_id seq_id, lla
         uint32_t cell_range_begin = cells.size();
 
         for (uint32_t i = 0; i < cells.size(); ++i) {
-            if (!cells.is_empty(i) && (seq_id == -1 || cells.seq_has(i, seq_id))) {
+            bool in_window = true; //kcpp: optional position window for range snapshots
+            if (kcpp_state_range_p0 >= 0 && !cells.is_empty(i)) {
+                const llama_pos p = cells.pos_get(i);
+                in_window = (p >= kcpp_state_range_p0 && (kcpp_state_range_p1 < 0 || p < kcpp_state_range_p1));
+            }
+            if (!cells.is_empty(i) && in_window && (seq_id == -1 || cells.seq_has(i, seq_id))) {
                 ++cell_count;
                 if (cell_range_begin == cells.size()) {
                     cell_range_begin = i;
@@ -1872,7 +2132,8 @@ bool llama_kv_cache::state_read_meta(llama_io_read_i & io, uint32_t strm, uint32
 
     if (dest_seq_id != -1) {
         // single sequence
-        seq_rm(dest_seq_id, -1, -1);
+        // kcpp: a range restore keeps the prefix below the window
+        seq_rm(dest_seq_id, (kcpp_state_range_p0 >= 0 ? kcpp_state_range_p0 : -1), -1);
 
         llama_batch_allocr balloc(hparams.n_pos_per_embd());
 
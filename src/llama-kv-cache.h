@@ -152,6 +152,10 @@ public:
 
     bool get_has_shift() const;
 
+    //kcpp: hybrid precision, keys within n_recent positions of the query that the recent store
+    //also holds are masked here and read from the recent store instead
+    void kcpp_set_recent(const llama_kv_cache * recent, uint32_t n_recent);
+
     //
     // graph_build API
     //
@@ -229,9 +233,34 @@ private:
     // env: LLAMA_KV_CACHE_DEBUG
     int debug = 0;
 
+    //kcpp: high precision store for the most recent positions, nullptr when not in hybrid mode
+    const llama_kv_cache * kcpp_recent = nullptr;
+    uint32_t kcpp_n_recent = 0;
+
     // this is the SWA type of the cache - not to be confused with the model SWA type
     const llama_swa_type swa_type = LLAMA_SWA_TYPE_NONE;
 
+    //kcpp: paged kv, host buffers mapped on demand instead of allocated and cleared up front.
+    //pages are only committed once written, with a spill dir they are backed by a scratch file
+    struct kcpp_paged_map {
+        ggml_backend_buffer_t buf = nullptr;
+        void * addr = nullptr;
+        size_t size = 0;
+        int    fd   = -1; // unlinked scratch file, -1 for anonymous memory
+
+        ~kcpp_paged_map();
+    };
+    std::vector<std::unique_ptr<kcpp_paged_map>> kcpp_paged_maps;
+
+    // cell ranges [first, second) per stream that are outside the resident budget, refreshed as the cache grows
+    std::vector<std::vector<std::pair<uint32_t, uint32_t>>> kcpp_cold_ranges;
+    std::vector<uint32_t> kcpp_cold_used; // used_max_p1 when the ranges were computed
+    std::vector<uint32_t> kcpp_cold_tick; // ubatches since the cold hint was last applied
+
+    ggml_backend_buffer_t kcpp_paged_alloc(ggml_context * ctx, ggml_backend_buffer_type_t buft);
+    bool kcpp_paged_release(ggml_backend_buffer_t buf);
+    void kcpp_paged_hint(uint32_t strm);
+
     // ggml contexts for the KV cache along with the allocated backend buffers:
     std::vector<std::pair<ggml_context_ptr, ggml_backend_buffer_ptr>> ctxs_bufs;
 
@@ -8445,6 +8445,25 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
                                 1,
                                 nullptr,
                                 reuse);
+                    } else if (kcpp_kv_recent_window > 0 && cparams.flash_attn && !hparams.is_mla() && arch != LLM_ARCH_T5 &&
+                               (ggml_is_quantized(params.type_k) || ggml_is_quantized(params.type_v))) {
+                        //kcpp: hybrid precision, recent positions in f16 and the rest in the quantized types.
+                        //the stores are merged by a cpu only attention op, so they stay in host memory
+                        res = new llama_kv_cache_iswa(
+                                *this,
+                                params.type_k,
+                                params.type_v,
+                                !cparams.flash_attn,
+                                false,
+                                false,
+                                cparams.kv_unified,
+                                cparams.n_ctx_seq,
+                                cparams.n_seq_max,
+                                cparams.n_ubatch,
+                                1,
+                                nullptr,
+                                reuse,
+                                kcpp_kv_recent_window);
                     } else {
                         GGML_ASSERT(!hparams.is_swa_any());
 
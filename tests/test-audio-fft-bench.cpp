@@ -0,0 +1,177 @@
+// Micro-benchmark for the shared audio FFT.
+// Times a mel frame sized forward transform against the recursive whisper FFT, and the OuteTTS sized inverse
+// against the direct sum the vocoder used before, checking that the results agree.
+// Build with: make fft_bench
+
+#include <cstdio>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+
+#include "audio_fft.h"
+
+//copy of the recursive whisper fft, with the direct dft for odd lengths
+static void legacy_dft(const std::vector<float> & in, std::vector<float> & out)
+{
+    int N = in.size();
+    out.resize(N * 2);
+    for (int k = 0; k < N; k++)
+    {
+        float re = 0;
+        float im = 0;
+        for (int n = 0; n < N; n++)
+        {
+            float t = 2 * M_PI * k * n / N;
+            re += in[n] * cosf(t);
+            im -= in[n] * sinf(t);
+        }
+        out[k * 2 + 0] = re;
+        out[k * 2 + 1] = im;
+    }
+}
+
+static void legacy_fft(const std::vector<float> & in, std::vector<float> & out)
+{
+    out.resize(in.size() * 2);
+    int N = in.size();
+    if (N == 1)
+    {
+        out[0] = in[0];
+        out[1] = 0;
+        return;
+    }
+    if (N % 2 == 1)
+    {
+        legacy_dft(in, out);
+        return;
+    }
+    std::vector<float> even;
+    std::vector<float> odd;
+    for (int i = 0; i < N; i++)
+    {
+        (i % 2 == 0 ? even : odd).push_back(in[i]);
+    }
+    std::vector<float> even_fft;
+    std::vector<float> odd_fft;
+    legacy_fft(even, even_fft);
+    legacy_fft(odd, odd_fft);
+    for (int k = 0; k < N / 2; k++)
+    {
+        float t = 2 * M_PI * k / N;
+        float re = cosf(t);
+        float im = -sinf(t);
+        float re_odd = odd_fft[2 * k + 0];
+        float im_odd = odd_fft[2 * k + 1];
+        out[2 * k + 0] = even_fft[2 * k + 0] + re * re_odd - im * im_odd;
+        out[2 * k + 1] = even_fft[2 * k + 1] + re * im_odd + im * re_odd;
+        out[2 * (k + N / 2) + 0] = even_fft[2 * k + 0] - re * re_odd + im * im_odd;
+        out[2 * (k + N / 2) + 1] = even_fft[2 * k + 1] - re * im_odd - im * re_odd;
+    }
+}
+
+//the O(n^2) inverse OuteTTS used, summing bins 0..n/2 and scaling by 1/(n/2+1)
+static void legacy_irfft(int n, const float * inp_cplx, float * out_real)
+{
+    int N = n / 2 + 1;
+    for (int k = 0; k < n; ++k)
+    {
+        float re = 0.0f;
+        for (int m = 0; m < N; ++m)
+        {
+            float angle = 2 * M_PI * k * m / n;
+            re += inp_cplx[2 * m] * cosf(angle) - inp_cplx[2 * m + 1] * sinf(angle);
+        }
+        out_real[k] = re / N;
+    }
+}
+
+int main()
+{
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    const int fwd_sizes[] = {400, 512, 1024};
+    for (int n : fwd_sizes)
+    {
+        const int reps = 2000;
+        std::vector<float> in(n);
+        for (auto & v : in)
+        {
+            v = dist(rng);
+        }
+        std::vector<float> ref;
+        std::vector<float> out(n + 2);
+        const kcpp_rfft_plan & plan = kcpp_rfft_get_plan(n, false);
+        std::vector<kcpp_cpx> work(plan.work_size());
+
+        auto t0 = std::chrono::high_resolution_clock::now();
+        for (int r = 0; r < reps; ++r)
+        {
+            legacy_fft(in, ref);
+        }
+        auto t1 = std::chrono::high_resolution_clock::now();
+        for (int r = 0; r < reps; ++r)
+        {
+            plan.forward(in.data(), out.data(), work.data());
+        }
+        auto t2 = std::chrono::high_resolution_clock::now();
+
+        float err = 0.0f;
+        for (int i = 0; i < n + 2; ++i)
+        {
+            err = std::max(err, std::fabs(out[i] - ref[i]));
+        }
+        printf("forward %5d: legacy %8.2f us, planned %6.2f us, max diff %.2e\n", n,
+            std::chrono::duration<double, std::micro>(t1 - t0).count() / reps,
+            std::chrono::duration<double, std::micro>(t2 - t1).count() / reps, err);
+    }
+
+    const int inv_sizes[] = {1280, 2400};
+    for (int n : inv_sizes)
+    {
+        const int reps = 20;
+        const int nb = n / 2 + 1;
+        std::vector<float> bins(2 * nb);
+        for (auto & v : bins)
+        {
+            v = dist(rng);
+        }
+        std::vector<float> ref(n);
+        std::vector<float> out(n);
+        std::vector<float> tmp(2 * nb);
+        const kcpp_rfft_plan & plan = kcpp_rfft_get_plan(n, true);
+        std::vector<kcpp_cpx> work(plan.work_size());
+
+        auto t0 = std::chrono::high_resolution_clock::now();
+        for (int r = 0; r < reps; ++r)
+        {
+            legacy_irfft(n, bins.data(), ref.data());
+        }
+        auto t1 = std::chrono::high_resolution_clock::now();
+        for (int r = 0; r < reps; ++r)
+        {
+            //same rescaling as the vocoder, the end bins count twice
+            tmp = bins;
+            tmp[0] *= 2.0f;
+            tmp[2 * (nb - 1)] *= 2.0f;
+            plan.backward(tmp.data(), out.data(), work.data());
+            for (int i = 0; i < n; ++i)
+            {
+                out[i] /= 2 * nb;
+            }
+        }
+        auto t2 = std::chrono::high_resolution_clock::now();
+
+        float err = 0.0f;
+        for (int i = 0; i < n; ++i)
+        {
+            err = std::max(err, std::fabs(out[i] - ref[i]));
+        }
+        printf("inverse %5d: legacy %8.2f us, planned %6.2f us, max diff %.2e\n", n,
+            std::chrono::duration<double, std::micro>(t1 - t0).count() / reps,
+            std::chrono::duration<double, std::micro>(t2 - t1).count() / reps, err);
+    }
+    return 0;
+}
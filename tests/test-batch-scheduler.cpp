@@ -0,0 +1,93 @@
+// Checks for the continuous batching slot policy: which idle slot a request lands in, how much kv is reserved,
+// which slot gets evicted and how much of a cached prefix is reused.
+// Build with: make batchsched_test
+
+#include <cstdio>
+#include <vector>
+
+#include "batch_sched.h"
+
+struct test_params
+{
+    int n_predict = 0;
+};
+
+struct test_slot
+{
+    batch_slot_state state = BATCH_SLOT_IDLE;
+    std::vector<int> prompt_tokens;
+    std::vector<int> context_tokens;
+    test_params params;
+    long long last_used = 0;
+};
+
+static int failures = 0;
+
+static void expect(bool ok, const char * what)
+{
+    if(!ok)
+    {
+        printf("FAIL: %s\n", what);
+        ++failures;
+    }
+}
+
+static test_slot make_slot(batch_slot_state state, std::vector<int> cached, long long last_used)
+{
+    test_slot s;
+    s.state = state;
+    s.context_tokens = cached;
+    s.last_used = last_used;
+    return s;
+}
+
+int main()
+{
+    //longest cached prefix wins
+    {
+        std::vector<test_slot> slots = { make_slot(BATCH_SLOT_IDLE, {1,2,9}, 5), make_slot(BATCH_SLOT_IDLE, {1,2,3,4}, 9), make_slot(BATCH_SLOT_IDLE, {}, 1) };
+        expect(batch_pick_slot(slots, {1,2,3,4,5}) == 1, "longest prefix picks slot 1");
+    }
+    //ties go to the least recently used slot
+    {
+        std::vector<test_slot> slots = { make_slot(BATCH_SLOT_IDLE, {7}, 8), make_slot(BATCH_SLOT_IDLE, {8}, 3), make_slot(BATCH_SLOT_IDLE, {9}, 6) };
+        expect(batch_pick_slot(slots, {1,2}) == 1, "tie picks the oldest slot");
+    }
+    //busy slots are never picked, even with a better prefix
+    {
+        std::vector<test_slot> slots = { make_slot(BATCH_SLOT_GENERATING, {1,2,3}, 1), make_slot(BATCH_SLOT_IDLE, {4}, 2) };
+        expect(batch_pick_slot(slots, {1,2,3}) == 1, "busy slot skipped");
+        slots[1].state = BATCH_SLOT_PROMPT;
+        expect(batch_pick_slot(slots, {1,2,3}) == -1, "all busy gives -1");
+    }
+
+    //reserved cells: idle slots hold their cache, active ones their prompt plus what they may still generate
+    {
+        std::vector<test_slot> slots = { make_slot(BATCH_SLOT_IDLE, {1,2,3}, 1), make_slot(BATCH_SLOT_GENERATING, {1,2}, 2), make_slot(BATCH_SLOT_IDLE, {5,6}, 3) };
+        slots[1].prompt_tokens = {1,2,3,4};
+        slots[1].params.n_predict = 10;
+        expect(batch_reserved_cells(slots, -1, 7) == 7 + 3 + 14 + 2, "reserved with nothing excluded");
+        expect(batch_reserved_cells(slots, 0, 7) == 7 + 14 + 2, "reserved excludes the target slot");
+    }
+
+    //eviction takes the oldest idle slot that still has kv, never the target or an active slot
+    {
+        std::vector<test_slot> slots = { make_slot(BATCH_SLOT_IDLE, {1}, 4), make_slot(BATCH_SLOT_IDLE, {}, 1), make_slot(BATCH_SLOT_GENERATING, {2}, 0), make_slot(BATCH_SLOT_IDLE, {3}, 2) };
+        expect(batch_pick_victim(slots, 0) == 3, "victim is the oldest idle slot with kv");
+        expect(batch_pick_victim(slots, 3) == 0, "victim skips the target slot");
+        slots[0].context_tokens.clear();
+        expect(batch_pick_victim(slots, 3) == -1, "no victim when nothing idle holds kv");
+    }
+
+    //prefix reuse always leaves one prompt token to evaluate
+    {
+        expect(batch_reusable_prefix({1,2,3,4}, {1,2,9}) == 2, "partial prefix reused");
+        expect(batch_reusable_prefix({1,2,3,4}, {1,2,3}) == 2, "full match keeps the last token for logits");
+        expect(batch_reusable_prefix({1,2,3}, {1,2,3}) == 2, "identical prompt keeps the last token for logits");
+        expect(batch_reusable_prefix({}, {5}) == 0, "empty cache");
+        expect(batch_reusable_prefix({5}, {}) == 0, "empty prompt");
+    }
+
+    printf("%s, %d failures\n", failures ? "FAILED" : "ok", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,320 @@
+// Micro-benchmark for the context shift matchers.
+// Builds synthetic chat histories (fixed memory block, then turns drawn from a zipf-like vocab with recurring phrases).
+// Longest run: drops the oldest turns the way a full context does, and times the old m*n table against the suffix automaton.
+// Shift planner: drops whole turns (each opening with the same chat template header) from the old context and appends
+// a reply, and times the rolling hash planner against plan_deletion_runs, checking that the runs rebuild everything kept.
+// Slot selection then plans against several saved contexts, as CanContextShift does for each smart cache slot,
+// next to the m*n table those paths ran before the automaton.
+// Build with: make contextshift_bench
+
+#include <cstdio>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <unordered_map>
+
+#include "context_match.h"
+
+//copy of the quadratic LongestCommonSubseq used by model_adapter before the suffix automaton
+static std::vector<int> legacy_lcs(const std::vector<int> & x, const std::vector<int> & y)
+{
+    int m = x.size(), n = y.size();
+    std::vector<std::vector<int>> LCSuff(m+1, std::vector<int>(n+1));
+    for (int i = 1; i <= m; i++)
+    {
+        for (int j = 1; j <= n; j++)
+        {
+            LCSuff[i][j] = (x[i - 1] == y[j - 1] ? LCSuff[i - 1][j - 1] + 1 : 0);
+        }
+    }
+    std::vector<int> longest;
+    for (int i = 1; i <= m; i++)
+    {
+        for (int j = 1; j <= n; j++)
+        {
+            if (LCSuff[i][j] > longest.size())
+            {
+                auto off1 = i - LCSuff[i][j];
+                longest = std::vector<int>(x.begin() + off1, x.begin() + off1 + LCSuff[i][j]);
+            }
+        }
+    }
+    return longest;
+}
+
+//copy of the rolling hash PlanContextRuns used by DoContextShifting before plan_deletion_runs,
+//cut at the first run with new tokens in front of it like the caller did
+static std::vector<context_run> legacy_plan(const std::vector<int> & oldtoks, const std::vector<int> & newtoks, const int min_run)
+{
+    const int anchor = 16;
+    const uint64_t base = 1000003ULL;
+    std::vector<context_run> runs;
+    const int oldlen = oldtoks.size();
+    const int newlen = newtoks.size();
+    if (oldlen < anchor || newlen < anchor)
+    {
+        return runs;
+    }
+    uint64_t base_pow = 1;
+    for (int i = 0; i < anchor; ++i)
+    {
+        base_pow *= base;
+    }
+    std::vector<uint64_t> oldhash(oldlen + 1, 0);
+    std::vector<uint64_t> newhash(newlen + 1, 0);
+    for (int i = 0; i < oldlen; ++i)
+    {
+        oldhash[i+1] = oldhash[i] * base + (uint32_t)oldtoks[i];
+    }
+    for (int i = 0; i < newlen; ++i)
+    {
+        newhash[i+1] = newhash[i] * base + (uint32_t)newtoks[i];
+    }
+    auto window_old = [&](int i) { return oldhash[i + anchor] - oldhash[i] * base_pow; };
+    auto window_new = [&](int i) { return newhash[i + anchor] - newhash[i] * base_pow; };
+    std::unordered_map<uint64_t, std::vector<int>> index;
+    index.reserve(oldlen);
+    for (int i = 0; i + anchor <= oldlen; ++i)
+    {
+        index[window_old(i)].push_back(i);
+    }
+    int oi = 0;
+    int ni = 0;
+    while (ni + anchor <= newlen && oi + anchor <= oldlen)
+    {
+        auto it = index.find(window_new(ni));
+        int best_pos = -1;
+        int best_len = 0;
+        if (it != index.end())
+        {
+            const std::vector<int> & positions = it->second;
+            auto pit = std::lower_bound(positions.begin(), positions.end(), oi);
+            for (int tries = 0; pit != positions.end() && tries < 8; ++pit, ++tries)
+            {
+                int len = 0;
+                while (*pit + len < oldlen && ni + len < newlen && oldtoks[*pit + len] == newtoks[ni + len])
+                {
+                    ++len;
+                }
+                if (len > best_len)
+                {
+                    best_len = len;
+                    best_pos = *pit;
+                }
+            }
+        }
+        if (best_pos >= 0 && best_len >= min_run)
+        {
+            if (ni > (runs.empty() ? 0 : runs.back().new_start + runs.back().len))
+            {
+                break;
+            }
+            context_run run;
+            run.old_start = best_pos;
+            run.new_start = ni;
+            run.len = best_len;
+            runs.push_back(run);
+            oi = best_pos + best_len;
+            ni += best_len;
+        }
+        else
+        {
+            ++ni;
+        }
+    }
+    return runs;
+}
+
+//tokens covered by the runs if they are back to back from the front of y and each one really matches x in order, else -1
+static int checked_coverage(const std::vector<context_run> & runs, const std::vector<int> & x, const std::vector<int> & y)
+{
+    int xi = 0;
+    int yi = 0;
+    for (const context_run & r : runs)
+    {
+        if (r.new_start != yi || r.old_start < xi || !std::equal(y.begin() + r.new_start, y.begin() + r.new_start + r.len, x.begin() + r.old_start))
+        {
+            return -1;
+        }
+        xi = r.old_start + r.len;
+        yi += r.len;
+    }
+    return yi;
+}
+
+static std::vector<int> make_history(int len, std::mt19937 & rng)
+{
+    const int vocab = 32000;
+    std::vector<double> weights(vocab);
+    for (int i = 0; i < vocab; ++i)
+    {
+        weights[i] = 1.0 / (i + 10);
+    }
+    std::discrete_distribution<int> zipf(weights.begin(), weights.end());
+    std::vector<std::vector<int>> phrases(64);
+    for (auto & p : phrases)
+    {
+        p.resize(4 + rng() % 12);
+        for (auto & t : p)
+        {
+            t = zipf(rng);
+        }
+    }
+    std::vector<int> out;
+    while ((int)out.size() < len)
+    {
+        //a turn: an instruct tag, then text that reuses common phrases
+        out.push_back(1);
+        out.push_back(2);
+        int turn = 40 + rng() % 300;
+        for (int i = 0; i < turn; ++i)
+        {
+            if (rng() % 8 == 0)
+            {
+                auto & p = phrases[rng() % phrases.size()];
+                out.insert(out.end(), p.begin(), p.end());
+            }
+            else
+            {
+                out.push_back(zipf(rng));
+            }
+        }
+    }
+    out.resize(len);
+    return out;
+}
+
+int main()
+{
+    const int sizes[] = {8192, 32768, 131072};
+    std::mt19937 rng(42);
+    int failures = 0;
+    printf("longest run (smart context):\n");
+    for (int nctx : sizes)
+    {
+        //memory block, then a history that slid forward by a quarter of the context
+        const int memlen = 512;
+        const int shift = nctx / 4;
+        std::vector<int> memory = make_history(memlen, rng);
+        std::vector<int> history = make_history(nctx + shift, rng);
+        std::vector<int> oldctx(history.begin(), history.begin() + (nctx - memlen));
+        std::vector<int> newctx(history.begin() + shift, history.begin() + shift + (nctx - memlen));
+
+        auto t0 = std::chrono::high_resolution_clock::now();
+        int start = 0;
+        int len = longest_common_token_run(oldctx, newctx, &start);
+        auto t1 = std::chrono::high_resolution_clock::now();
+        double sam_ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+        double table_mb = (double)oldctx.size() * newctx.size() * sizeof(int) / (1024.0 * 1024.0);
+
+        if (table_mb <= 1024.0)
+        {
+            auto t2 = std::chrono::high_resolution_clock::now();
+            std::vector<int> ref = legacy_lcs(oldctx, newctx);
+            auto t3 = std::chrono::high_resolution_clock::now();
+            double legacy_ms = std::chrono::duration<double, std::milli>(t3 - t2).count();
+            bool same = ((int)ref.size() == len && std::equal(ref.begin(), ref.end(), oldctx.begin() + start));
+            printf("ctx %6d: legacy %9.1f ms (%.0f MB table), automaton %7.1f ms, match %d tokens at %d, %s\n",
+                nctx, legacy_ms, table_mb, sam_ms, len, start, (same ? "identical" : "MISMATCH"));
+            failures += (same ? 0 : 1);
+        }
+        else
+        {
+            printf("ctx %6d: legacy skipped (would need a %.0f MB table), automaton %7.1f ms, match %d tokens at %d\n",
+                nctx, table_mb, sam_ms, len, start);
+        }
+    }
+
+    printf("shift planner (context shifting and slot selection):\n");
+    for (int nctx : sizes)
+    {
+        //turns open with the same header, so the text after a deleted span also occurs all over the old context
+        std::vector<int> header = make_history(24, rng);
+        std::vector<std::vector<int>> turns;
+        int total = 0;
+        while (total < nctx)
+        {
+            std::vector<int> turn = header;
+            std::vector<int> body = make_history(40 + rng() % 300, rng);
+            turn.insert(turn.end(), body.begin(), body.end());
+            total += turn.size();
+            turns.push_back(turn);
+        }
+        //a full context loses the oldest quarter of the turns, a stale note in the middle and a swapped example
+        const int nturns = turns.size();
+        std::vector<bool> dropped(nturns, false);
+        for (int t = 0; t < nturns / 4; ++t)
+        {
+            dropped[t] = true;
+        }
+        dropped[nturns / 2] = true;
+        dropped[(nturns * 3) / 4] = true;
+        std::vector<int> oldctx;
+        std::vector<int> newctx;
+        for (int t = 0; t < nturns; ++t)
+        {
+            oldctx.insert(oldctx.end(), turns[t].begin(), turns[t].end());
+            if (!dropped[t])
+            {
+                newctx.insert(newctx.end(), turns[t].begin(), turns[t].end());
+            }
+        }
+        const int kept = newctx.size();
+        std::vector<int> reply = make_history(400, rng);
+        newctx.insert(newctx.end(), header.begin(), header.end());
+        newctx.insert(newctx.end(), reply.begin(), reply.end());
+
+        auto t0 = std::chrono::high_resolution_clock::now();
+        std::vector<context_run> legacy_runs = legacy_plan(oldctx, newctx, 64);
+        auto t1 = std::chrono::high_resolution_clock::now();
+        std::vector<context_run> runs = plan_deletion_runs(oldctx, newctx, 64);
+        auto t2 = std::chrono::high_resolution_clock::now();
+        double legacy_ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+        double sam_ms = std::chrono::duration<double, std::milli>(t2 - t1).count();
+
+        const int legacy_cov = checked_coverage(legacy_runs, oldctx, newctx);
+        const int cov = checked_coverage(runs, oldctx, newctx);
+        const bool ok = (cov >= kept);
+        printf("ctx %6d: rolling hash %7.1f ms keeps %6d, automaton %7.1f ms keeps %6d in %d runs of %d kept tokens, %s\n",
+            nctx, legacy_ms, legacy_cov, sam_ms, cov, (int)runs.size(), kept, (ok ? "ok" : "FAILED"));
+        failures += (ok ? 0 : 1);
+
+        //saved slots: the same chat, the chat before its last turns, an unrelated chat and the chat after a big trim
+        std::vector<std::vector<int>> slots;
+        slots.push_back(oldctx);
+        slots.push_back(std::vector<int>(oldctx.begin(), oldctx.end() - std::min((int)oldctx.size() / 8, 1000)));
+        slots.push_back(make_history(oldctx.size(), rng));
+        slots.push_back(std::vector<int>(oldctx.begin() + oldctx.size() / 2, oldctx.end()));
+        auto t3 = std::chrono::high_resolution_clock::now();
+        int shiftable = 0;
+        for (const auto & slot : slots)
+        {
+            int covered = checked_coverage(plan_deletion_runs(slot, newctx, 64), slot, newctx);
+            shiftable += (covered > (int)newctx.size() * 45 / 100 ? 1 : 0);
+        }
+        auto t4 = std::chrono::high_resolution_clock::now();
+        double slots_ms = std::chrono::duration<double, std::milli>(t4 - t3).count();
+        double table_mb = (double)oldctx.size() * newctx.size() * sizeof(int) / (1024.0 * 1024.0);
+        if (table_mb <= 1024.0)
+        {
+            auto t5 = std::chrono::high_resolution_clock::now();
+            for (const auto & slot : slots)
+            {
+                legacy_lcs(slot, newctx);
+            }
+            auto t6 = std::chrono::high_resolution_clock::now();
+            double table_ms = std::chrono::duration<double, std::milli>(t6 - t5).count();
+            printf("           slot selection over %d saved contexts: m*n table %9.1f ms, automaton %7.1f ms, %d shiftable\n",
+                (int)slots.size(), table_ms, slots_ms, shiftable);
+        }
+        else
+        {
+            printf("           slot selection over %d saved contexts: m*n table skipped (%.0f MB per slot), automaton %7.1f ms, %d shiftable\n",
+                (int)slots.size(), table_mb, slots_ms, shiftable);
+        }
+    }
+    return (failures > 0 ? 1 : 0);
+}
@@ -0,0 +1,213 @@
+// Micro-benchmark for the sampler front end.
+// Compares the old per-token path (full vocab candidate list, bucket top-k, hash set repetition penalty)
+// against kcpp_sampler_workspace on random logits, then checks top-k on masked vocabs where only a few tokens stay finite.
+// No model needed.
+// Build with: make sampler_bench
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <unordered_set>
+#include <algorithm>
+#include <cmath>
+
+#include "llama.h"
+#include "sampler_workspace.h"
+
+//copy of the top-k used by gpttype_adapter before the workspace
+static void legacy_top_k(llama_token_data_array * cur_p, int32_t k) {
+    if (k <= 0) {
+        k = cur_p->size;
+    }
+
+    k = std::max(k, (int) 1); //min keep of 1
+    k = std::min(k, (int) cur_p->size);
+
+    // Sort scores in descending order
+    if (!cur_p->sorted) {
+        auto comp = [](const llama_token_data & a, const llama_token_data & b) {
+            return a.logit > b.logit;
+        };
+        if (k <= 128) {
+            std::partial_sort(cur_p->data, cur_p->data + k, cur_p->data + cur_p->size, comp);
+        } else {
+            constexpr int   nbuckets     = 128;
+            constexpr float bucket_low   = -10.0f;
+            constexpr float bucket_high  =  10.0f;
+            constexpr float bucket_scale = nbuckets/(bucket_high - bucket_low);
+            constexpr float bucket_inter = -bucket_low * bucket_scale;
+
+            std::vector<int> bucket_idx(cur_p->size);
+            std::vector<int> histo(nbuckets, 0);
+
+            for (int i = 0; i < (int)cur_p->size; ++i) {
+                const float val = cur_p->data[i].logit;
+                int ib = int(bucket_scale * val + bucket_inter); //nbuckets * (val - bucket_low) / (bucket_high - bucket_low);
+                ib = std::max(0, std::min(nbuckets-1, ib));
+                bucket_idx[i] = ib;
+                ++histo[ib];
+            }
+            int nhave = 0;
+            int ib = nbuckets - 1;
+            for ( ; ib >= 0; --ib) {
+                nhave += histo[ib];
+                if (nhave >= k) {
+                    break;
+                }
+            }
+            std::vector<llama_token_data> tmp_tokens(nhave);
+            auto * ptr = tmp_tokens.data();
+            std::vector<llama_token_data*> bucket_ptrs;
+            bucket_ptrs.reserve(nbuckets - ib);
+            for (int j = nbuckets - 1; j >= ib; --j) {
+                bucket_ptrs.push_back(ptr);
+                ptr += histo[j];
+            }
+            for (int i = 0; i < (int)cur_p->size; ++i) {
+                int j = bucket_idx[i];
+                if (j >= ib) {
+                    *bucket_ptrs[nbuckets-1-j]++ = cur_p->data[i];
+                }
+            }
+
+            ptr = tmp_tokens.data();
+            int ndone = 0;
+            for (int j = nbuckets-1; j > ib; --j) {
+                std::sort(ptr, ptr + histo[j], comp);
+                ptr += histo[j];
+                ndone += histo[j];
+            }
+            std::partial_sort(ptr, ptr + k - ndone, ptr + histo[ib], comp);
+
+            std::memcpy(cur_p->data, tmp_tokens.data(), k*sizeof(llama_token_data));
+
+        }
+        cur_p->sorted = true;
+    }
+    cur_p->size = k;
+}
+
+static void legacy_rep_pen(llama_token_data_array * candidates, const int32_t * last_tokens, int last_n_repeat, float rep_pen, float rep_pen_reduced)
+{
+    std::unordered_set<llama_token> tokens_near(last_tokens + last_n_repeat / 2, last_tokens + last_n_repeat);
+    std::unordered_set<llama_token> tokens_far(last_tokens, last_tokens + last_n_repeat / 2);
+    for (size_t i = 0; i < candidates->size; ++i) {
+        const bool token_in_near = tokens_near.find(candidates->data[i].id) != tokens_near.end();
+        const bool token_in_far = tokens_far.find(candidates->data[i].id) != tokens_far.end();
+        if (!token_in_near && !token_in_far) {
+            continue;
+        }
+        float penalty = (token_in_near?rep_pen:rep_pen_reduced);
+        candidates->data[i].logit = (candidates->data[i].logit <= 0 ? candidates->data[i].logit * penalty : candidates->data[i].logit / penalty);
+    }
+}
+
+static void workspace_rep_pen(kcpp_sampler_workspace & ws, llama_token_data_array * candidates, const int32_t * last_tokens, int last_n_repeat, float rep_pen, float rep_pen_reduced)
+{
+    ws.mark_history(last_tokens, last_n_repeat, last_n_repeat / 2);
+    for (size_t i = 0; i < candidates->size; ++i) {
+        const int seen = ws.history_class(candidates->data[i].id);
+        if (seen == 0) {
+            continue;
+        }
+        float penalty = (seen == 2 ? rep_pen : rep_pen_reduced);
+        candidates->data[i].logit = (candidates->data[i].logit <= 0 ? candidates->data[i].logit * penalty : candidates->data[i].logit / penalty);
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    const int vocabs[] = {32000, 151936, 262144};
+    const int topk = 3000;
+    const int steps = (argc > 1 ? atoi(argv[1]) : 200);
+    const int rep_range = 512;
+    std::mt19937 rng(1234);
+    std::normal_distribution<float> dist(0.0f, 3.0f);
+    kcpp_sampler_workspace ws;
+
+    for (int n_vocab : vocabs)
+    {
+        std::vector<std::vector<float>> logits(8, std::vector<float>(n_vocab));
+        for (auto & l : logits) {
+            for (auto & v : l) {
+                v = dist(rng);
+            }
+        }
+        std::vector<int32_t> history(rep_range);
+        for (auto & t : history) {
+            t = rng() % n_vocab;
+        }
+
+        double legacy_us = 0, ws_us = 0;
+        int mismatches = 0;
+        for (int s = 0; s < steps; ++s)
+        {
+            const float * src = logits[s % logits.size()].data();
+
+            auto t0 = std::chrono::high_resolution_clock::now();
+            std::vector<llama_token_data> candidates;
+            candidates.reserve(n_vocab);
+            for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+                candidates.emplace_back(llama_token_data{token_id, src[token_id], 0.0f});
+            }
+            llama_token_data_array a = { candidates.data(), candidates.size(), -1, false };
+            legacy_top_k(&a, topk);
+            legacy_rep_pen(&a, history.data(), rep_range, 1.1f, 1.05f);
+            auto t1 = std::chrono::high_resolution_clock::now();
+
+            ws.load(src, n_vocab);
+            llama_token_data_array b = ws.top_k(topk);
+            workspace_rep_pen(ws, &b, history.data(), rep_range, 1.1f, 1.05f);
+            auto t2 = std::chrono::high_resolution_clock::now();
+
+            legacy_us += std::chrono::duration<double, std::micro>(t1 - t0).count();
+            ws_us += std::chrono::duration<double, std::micro>(t2 - t1).count();
+            if (a.size != b.size || a.data[0].id != b.data[0].id || a.data[a.size-1].logit != b.data[b.size-1].logit) {
+                ++mismatches;
+            }
+        }
+        printf("vocab %7d: legacy %8.1f us/token, workspace %8.1f us/token, speedup %.2fx, mismatches %d\n",
+            n_vocab, legacy_us / steps, ws_us / steps, legacy_us / ws_us, mismatches);
+    }
+
+    //grammar style masks, everything -inf except a few allowed tokens that may share one logit
+    int mask_failures = 0;
+    const int mask_cases[][3] = { {32000, 1, 1}, {32000, 1, 40}, {151936, 3, 3}, {151936, 3, 10}, {32000, 5, 2} };
+    for (const auto & mc : mask_cases)
+    {
+        const int n_vocab = mc[0];
+        const int allowed = mc[1];
+        const int k = mc[2];
+        for (int equal = 0; equal < 2; ++equal)
+        {
+            std::vector<float> masked(n_vocab, -INFINITY);
+            std::vector<int> ids;
+            for (int a = 0; a < allowed; ++a)
+            {
+                const int id = 537 + a * 911;
+                masked[id] = (equal ? 1.5f : dist(rng));
+                ids.push_back(id);
+            }
+            ws.load(masked.data(), n_vocab);
+            llama_token_data_array b = ws.top_k(k);
+            const size_t want = std::min(allowed, k);
+            bool ok = (b.size == (size_t)std::min(k, n_vocab));
+            for (size_t i = 0; ok && i < b.size; ++i)
+            {
+                const bool is_allowed = std::find(ids.begin(), ids.end(), b.data[i].id) != ids.end();
+                ok = (i < want ? is_allowed && masked[b.data[i].id] == b.data[i].logit : !is_allowed)
+                    && (i == 0 || b.data[i - 1].logit >= b.data[i].logit);
+            }
+            if (!ok)
+            {
+                ++mask_failures;
+                printf("masked top-k failed: vocab %d allowed %d k %d equal %d, first id %d logit %f\n",
+                    n_vocab, allowed, k, equal, b.size ? b.data[0].id : -1, b.size ? b.data[0].logit : 0.0f);
+            }
+        }
+    }
+    printf("masked top-k: failures %d\n", mask_failures);
+    return mask_failures ? 1 : 0;
+}
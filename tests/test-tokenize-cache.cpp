@@ -0,0 +1,301 @@
+// Checks that kcpp_tokenize_cache gives the same tokens as tokenizing the whole prompt with common_tokenize.
+// Writes small byte level bpe vocabs with the llama3 and qwen2 pretokenizers and their chat special tokens,
+// then compares grown chat prompts, prompts edited in place and edits around special tokens, both with the
+// default reuse thresholds and with low ones so that most requests take the split path.
+// Build with: make tokenizecache_test
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <set>
+#include <random>
+
+#include "ggml.h"
+#include "gguf.h"
+#include "llama.h"
+#include "common/common.h"
+#include "tokenize_cache.h"
+
+static int failures = 0;
+
+//gpt2 byte level encoding of a raw byte, the form bpe vocabs store their tokens in
+static std::string byte_symbol(unsigned char b)
+{
+    unsigned int cp = b;
+    if (!((b >= 33 && b <= 126) || (b >= 161 && b <= 172) || (b >= 174)))
+    {
+        int n = 0;
+        for (int i = 0; i < b; ++i)
+        {
+            if (!((i >= 33 && i <= 126) || (i >= 161 && i <= 172) || (i >= 174)))
+            {
+                ++n;
+            }
+        }
+        cp = 256 + n;
+    }
+    std::string out;
+    if (cp < 0x80)
+    {
+        out += (char)cp;
+    }
+    else
+    {
+        out += (char)(0xC0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+    return out;
+}
+
+//vocab of all bytes, every prefix of the given words as a merge, and the special tokens
+static bool write_vocab(const char * path, const char * pre, const std::vector<std::string> & words, const std::vector<std::string> & specials)
+{
+    std::vector<std::string> tokens;
+    std::vector<int32_t> types;
+    std::vector<std::string> merges;
+    std::set<std::string> known;
+    for (int b = 0; b < 256; ++b)
+    {
+        tokens.push_back(byte_symbol((unsigned char)b));
+        types.push_back(1);
+        known.insert(tokens.back());
+    }
+    for (const auto & w : words)
+    {
+        std::string cur = byte_symbol((unsigned char)w[0]);
+        for (size_t i = 1; i < w.size(); ++i)
+        {
+            const std::string next = byte_symbol((unsigned char)w[i]);
+            if (known.insert(cur + next).second)
+            {
+                merges.push_back(cur + " " + next);
+                tokens.push_back(cur + next);
+                types.push_back(1);
+            }
+            cur += next;
+        }
+    }
+    for (const auto & s : specials)
+    {
+        tokens.push_back(s);
+        types.push_back(3);
+    }
+
+    gguf_context * g = gguf_init_empty();
+    gguf_set_val_str(g, "general.architecture", "llama");
+    gguf_set_val_u32(g, "llama.context_length", 4096);
+    gguf_set_val_u32(g, "llama.embedding_length", 64);
+    gguf_set_val_u32(g, "llama.block_count", 1);
+    gguf_set_val_u32(g, "llama.feed_forward_length", 128);
+    gguf_set_val_u32(g, "llama.attention.head_count", 4);
+    gguf_set_val_f32(g, "llama.attention.layer_norm_rms_epsilon", 1e-5f);
+    gguf_set_val_str(g, "tokenizer.ggml.model", "gpt2");
+    gguf_set_val_str(g, "tokenizer.ggml.pre", pre);
+    std::vector<const char *> tp, mp;
+    for (const auto & t : tokens)
+    {
+        tp.push_back(t.c_str());
+    }
+    for (const auto & m : merges)
+    {
+        mp.push_back(m.c_str());
+    }
+    gguf_set_arr_str(g, "tokenizer.ggml.tokens", tp.data(), tp.size());
+    gguf_set_arr_data(g, "tokenizer.ggml.token_type", GGUF_TYPE_INT32, types.data(), types.size());
+    gguf_set_arr_str(g, "tokenizer.ggml.merges", mp.data(), mp.size());
+    gguf_set_val_u32(g, "tokenizer.ggml.bos_token_id", 256 + merges.size());
+    gguf_set_val_u32(g, "tokenizer.ggml.eos_token_id", 256 + merges.size() + 1);
+    gguf_set_val_bool(g, "tokenizer.ggml.add_bos_token", false);
+    const bool ok = gguf_write_to_file(g, path, true);
+    gguf_free(g);
+    return ok;
+}
+
+struct tokenizer_case
+{
+    const char * name;
+    const char * pre;
+    std::vector<std::string> specials; //bos, eos, then the rest
+    std::string user_open, assistant_open, turn_close;
+};
+
+static std::string random_text(std::mt19937 & rng, const std::vector<std::string> & pool, size_t n_pieces)
+{
+    std::string s;
+    for (size_t i = 0; i < n_pieces; ++i)
+    {
+        s += pool[rng() % pool.size()];
+    }
+    return s;
+}
+
+//runs one cached tokenize and compares it with the full one, returns the bytes the cache tokenized
+static size_t check(kcpp_tokenize_cache & cache, const llama_vocab * vocab, const std::string & text, const char * what)
+{
+    size_t tokenized = 0;
+    const std::vector<int> cached = cache.tokenize(text,
+        [&](const std::string & s) { tokenized += s.size(); return common_tokenize(vocab, s, false, true); },
+        [&](int id) { return common_token_to_piece(vocab, id, true); });
+    const std::vector<int> full = common_tokenize(vocab, text, false, true);
+    if (cached != full)
+    {
+        size_t i = 0;
+        while (i < cached.size() && i < full.size() && cached[i] == full[i])
+        {
+            ++i;
+        }
+        printf("FAIL: %s, %zu bytes, tokens differ at %zu of %zu/%zu\n", what, text.size(), i, cached.size(), full.size());
+        ++failures;
+    }
+    return tokenized;
+}
+
+static void run_case(const tokenizer_case & tc, const std::vector<std::string> & words, const std::vector<std::string> & pool)
+{
+    const std::string path = std::string("tokenize-cache-test-") + tc.name + ".gguf";
+    if (!write_vocab(path.c_str(), tc.pre, words, tc.specials))
+    {
+        printf("FAIL: %s, could not write %s\n", tc.name, path.c_str());
+        ++failures;
+        return;
+    }
+    llama_model_params mp = llama_model_default_params();
+    mp.vocab_only = true;
+    llama_model * model = llama_model_load_from_file(path.c_str(), mp);
+    remove(path.c_str());
+    if (!model)
+    {
+        printf("FAIL: %s, vocab did not load\n", tc.name);
+        ++failures;
+        return;
+    }
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+    const int before = failures;
+
+    for (int low = 0; low < 2; ++low)
+    {
+        std::mt19937 rng(1234 + low);
+        auto make_cache = [&]()
+        {
+            kcpp_tokenize_cache c;
+            if (low)
+            {
+                c.min_reuse = 96;
+                c.margin = 24;
+            }
+            return c;
+        };
+
+        //grown: every request is the previous one plus a reply and a new user turn
+        {
+            kcpp_tokenize_cache cache = make_cache();
+            std::string history = tc.specials[0];
+            size_t total = 0, tokenized = 0;
+            for (int turn = 0; turn < 40; ++turn)
+            {
+                history += tc.user_open + random_text(rng, pool, 10 + rng() % 60) + tc.turn_close;
+                const std::string prompt = history + tc.assistant_open;
+                total += prompt.size();
+                tokenized += check(cache, vocab, prompt, "grown");
+                history = prompt + random_text(rng, pool, 10 + rng() % 80) + tc.turn_close;
+            }
+            if (tokenized * 2 > total)
+            {
+                printf("FAIL: %s grown prompts did not reuse tokens, %zu of %zu bytes tokenized\n", tc.name, tokenized, total);
+                ++failures;
+            }
+        }
+
+        //edited: small insertions, deletions and replacements, mostly near the end where the cache reuses the most
+        {
+            const std::vector<std::string> snippets = { " ", "  ", "\n", "\n\n", " \n", "\n ", "\t", "\r\n", "'", "'s", "s", "A", "1", "42", ".", "...", "!\n", "é", "日本" };
+            kcpp_tokenize_cache cache = make_cache();
+            std::string prompt = tc.specials[0] + tc.user_open + random_text(rng, pool, 500) + tc.turn_close + tc.assistant_open;
+            for (int i = 0; i < 200; ++i)
+            {
+                const size_t pos = (i % 4 == 0) ? rng() % prompt.size() : prompt.size() - 1 - rng() % std::min<size_t>(prompt.size(), 400);
+                const size_t del = (rng() % 3 == 0) ? std::min<size_t>(rng() % 4, prompt.size() - pos) : 0;
+                const std::string ins = (rng() % 3 != 0) ? snippets[rng() % snippets.size()] : std::string();
+                prompt = prompt.substr(0, pos) + ins + prompt.substr(pos + del);
+                check(cache, vocab, prompt, "edited");
+                if (i % 10 == 9)
+                {
+                    prompt += random_text(rng, pool, 20);
+                    check(cache, vocab, prompt, "edited then grown");
+                }
+            }
+        }
+
+        //special tokens: whole and partial special token text added and removed around the change
+        {
+            std::vector<std::string> snippets = { "<", "<|", "|>", ">\n", "\n<" };
+            for (const auto & s : tc.specials)
+            {
+                snippets.push_back(s);
+                snippets.push_back(s + "\n");
+                snippets.push_back("\n" + s);
+                snippets.push_back(s.substr(0, s.size() / 2));
+                snippets.push_back(s.substr(s.size() / 2));
+            }
+            kcpp_tokenize_cache cache = make_cache();
+            std::string prompt = tc.specials[0];
+            for (int i = 0; i < 8; ++i)
+            {
+                prompt += tc.user_open + random_text(rng, pool, 40) + tc.turn_close + tc.assistant_open + random_text(rng, pool, 40) + tc.turn_close;
+            }
+            for (int i = 0; i < 200; ++i)
+            {
+                const size_t pos = prompt.size() - 1 - rng() % std::min<size_t>(prompt.size(), 300);
+                const size_t del = (rng() % 2 == 0) ? std::min<size_t>(rng() % 12, prompt.size() - pos) : 0;
+                prompt = prompt.substr(0, pos) + snippets[rng() % snippets.size()] + prompt.substr(pos + del);
+                check(cache, vocab, prompt, "special");
+                if (i % 8 == 7)
+                {
+                    prompt += tc.user_open + random_text(rng, pool, 15) + tc.turn_close + tc.assistant_open;
+                    check(cache, vocab, prompt, "special then grown");
+                }
+            }
+        }
+    }
+
+    printf("%s: %s\n", tc.name, failures == before ? "ok" : "FAILED");
+    llama_model_free(model);
+}
+
+int main()
+{
+    llama_backend_init();
+    llama_log_set([](ggml_log_level level, const char * text, void *) { if (level >= GGML_LOG_LEVEL_ERROR) { fputs(text, stderr); } }, nullptr);
+
+    //merged tokens, so whitespace, punctuation and words combine the way real vocabs do
+    const std::vector<std::string> words = {
+        " the", " and", " you", " user", " assistant", "user", "assistant", "system", " of", " to", " is", "ing", "ed",
+        " don", "'t", "'s", "'ll", " it", "It", " I", "The", " story", " said", " was", " she", " he",
+        "\n\n", "\n\n\n", "\n\n\n\n", " \n", "  ", "    ", "        ", "\t\t", ".\n", ".\n\n", ",\n", "!\n\n", "?\n",
+        " (", ");", " {", " }", "\"", " \"", "...", " -", "**", " **", "123", "2024", "é", " é", "日本", "語",
+    };
+    //what prompts are made of: words, line breaks, code, numbers and non ascii text
+    const std::vector<std::string> pool = {
+        " the", " and", " you", " story", " said", " was", "The", " she", " he", " it", "It's", " don't", " we'll",
+        " of", " to", " is", " walking", " ended", ",", ".", "!", "?", "...", " -", " \"quoted\"", " (aside)",
+        "\n", "\n\n", "\n\n\n", " \n", "  \n", "\n ", "\n  ", "\r\n", "\t", "    ", "**bold**", " *italic*",
+        " 12", " 2024", "345678", " 3.14", " naïve", " café", " 日本語", " Привет", " 🙂",
+        "\n    if (x) {\n        return y;\n    }\n", "\n- item\n- item", "\n1. first\n2. second",
+    };
+
+    const std::vector<tokenizer_case> cases = {
+        { "llama3", "llama-bpe", { "<|begin_of_text|>", "<|eot_id|>", "<|start_header_id|>", "<|end_header_id|>" },
+            "<|start_header_id|>user<|end_header_id|>\n\n", "<|start_header_id|>assistant<|end_header_id|>\n\n", "<|eot_id|>" },
+        { "qwen2", "qwen2", { "<|endoftext|>", "<|im_end|>", "<|im_start|>" },
+            "<|im_start|>user\n", "<|im_start|>assistant\n", "<|im_end|>\n" },
+    };
+    for (const auto & tc : cases)
+    {
+        run_case(tc, words, pool);
+    }
+
+    llama_backend_free();
+    printf("%s, %d failures\n", failures ? "FAILED" : "ok", failures);
+    return failures ? 1 : 0;
+}